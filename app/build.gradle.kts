@@ -45,6 +45,12 @@ android {
         compose = true
     }
 
+    // GGUF 模型不压缩存放，才能用 AssetManager.openFd 拿到文件描述符，
+    // 并按 fd 长度校验 / 内核零拷贝复制到内部存储
+    androidResources {
+        noCompress += "gguf"
+    }
+
     externalNativeBuild {
         cmake {
             path = file("src/main/cpp/CMakeLists.txt")
@@ -0,0 +1,73 @@
+package com.example.haiyangapp.benchmark
+
+import android.os.Bundle
+import android.util.Log
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry
+import com.example.haiyangapp.inference.KvCacheType
+import com.example.haiyangapp.inference.ModelConfig
+import org.junit.Assert.assertTrue
+import org.junit.Test
+import org.junit.runner.RunWith
+import java.io.File
+
+/**
+ * 设备端基准测试入口，结果写入 getExternalFilesDir("benchmarks")/benchmark-<时间戳>.json
+ *
+ * 运行示例（参数均可省略，逗号分隔的列表覆盖 BenchmarkConfig 的默认值）：
+ *
+ *     adb shell am instrument -w \
+ *         -e class com.example.haiyangapp.benchmark.InferenceBenchmarkTest \
+ *         -e chatModel /data/local/tmp/qwen3.gguf -e embeddingModel /data/local/tmp/minilm.gguf \
+ *         -e promptLengths 128,512 -e threads 2,4,6 -e gpuLayers 0,-1 -e kvCacheTypes F16,Q8_0 \
+ *         com.example.haiyangapp.test/androidx.test.runner.AndroidJUnitRunner
+ *
+ * 未指定模型时使用应用内部存储中已复制的默认模型，找不到则跳过对应部分；
+ * 输出路径通过 instrumentation status 的 "benchmark_json" 字段报告，便于设备农场拉取
+ */
+@RunWith(AndroidJUnit4::class)
+class InferenceBenchmarkTest {
+
+    @Test
+    fun runBenchmark() {
+        val instrumentation = InstrumentationRegistry.getInstrumentation()
+        val context = instrumentation.targetContext
+        val args = InstrumentationRegistry.getArguments()
+
+        val chatModel = args.getString("chatModel")
+            ?: File(context.filesDir, "models/${ModelConfig().modelPath}").absolutePath
+        val embeddingModel = args.getString("embeddingModel")
+            ?: File(context.filesDir, "all-minilm-l6-v2-q8_0.gguf").absolutePath
+
+        val defaults = BenchmarkConfig()
+        val config = BenchmarkConfig(
+            promptLengths = args.intList("promptLengths") ?: defaults.promptLengths,
+            generationLengths = args.intList("generationLengths") ?: defaults.generationLengths,
+            threadCounts = args.intList("threads") ?: defaults.threadCounts,
+            gpuLayers = args.intList("gpuLayers") ?: defaults.gpuLayers,
+            kvCacheTypes = args.getString("kvCacheTypes")
+                ?.split(',')?.map { KvCacheType.valueOf(it.trim()) } ?: defaults.kvCacheTypes,
+            batchSizes = args.intList("batchSizes") ?: defaults.batchSizes,
+            repetitions = args.getString("repetitions")?.toInt() ?: defaults.repetitions,
+            embeddingBatchSizes = args.intList("embeddingBatchSizes") ?: defaults.embeddingBatchSizes,
+            vectorCounts = args.intList("vectorCounts") ?: defaults.vectorCounts
+        )
+
+        val result = InferenceBenchmark(context).run(
+            chatModelPath = chatModel.takeIf { File(it).canRead() },
+            embeddingModelPath = embeddingModel.takeIf { File(it).canRead() },
+            config = config
+        )
+
+        val outputDir = File(context.getExternalFilesDir(null), "benchmarks").apply { mkdirs() }
+        val output = File(outputDir, "benchmark-${System.currentTimeMillis()}.json")
+        output.writeText(result.toString(2))
+        Log.i("InferenceBenchmarkTest", "Benchmark results written to ${output.absolutePath}")
+
+        instrumentation.sendStatus(0, Bundle().apply { putString("benchmark_json", output.absolutePath) })
+        assertTrue(output.length() > 0)
+    }
+
+    private fun Bundle.intList(key: String): List<Int>? =
+        getString(key)?.split(',')?.map { it.trim().toInt() }
+}
@@ -1,9 +1,36 @@
 #include <jni.h>
 #include <string>
+#include <cstring>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <climits>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <android/log.h>
 #include <vector>
+#include <list>
+#include <unordered_map>
 #include "llama.h"
 #include "ggml.h"
+#include "ggml-cpu.h"
+#include "ggml-backend.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
 #define TAG "LlamaCpp-JNI"
 #define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, TAG, __VA_ARGS__)
@@ -11,728 +38,7477 @@
 #define LOGW(...) __android_log_print(ANDROID_LOG_WARN, TAG, __VA_ARGS__)
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
 
+// ============================================
+// 共享原生运行时（后端与线程池的引用计数）
+// ============================================
+
+// 按 (线程数, 轮询级别) 共享的 ggml 线程池
+struct shared_threadpool {
+    ggml_threadpool* pool;
+    int n_threads;
+    uint32_t poll;
+    int n_refs;
+};
+
+/**
+ * 所有模型句柄（聊天、嵌入、GPU 层数实测）共享的原生运行时
+ *
+ * llama 后端在第一个句柄创建时初始化，最后一个句柄释放时关闭，嵌入模型的空闲释放 / 重新加载
+ * 不再重复初始化，也不会在聊天模型仍在使用时关闭后端。聊天模型的预填充与嵌入模型共用同一个线程池，
+ * 两者在 CPU 上的计算由 compute_mutex 串行，线程总数不超过性能核数
+ */
+struct native_runtime {
+    std::mutex mutex;                            // 保护 n_refs 与 threadpools
+    int n_refs = 0;
+    std::vector<shared_threadpool> threadpools;
+    std::mutex compute_mutex;                    // 聊天请求与嵌入计算互斥
+};
+
+static native_runtime& get_runtime() {
+    static native_runtime runtime;
+    return runtime;
+}
+
+static void runtime_acquire() {
+    native_runtime& runtime = get_runtime();
+    std::lock_guard<std::mutex> lock(runtime.mutex);
+    if (runtime.n_refs++ == 0) {
+        llama_backend_init();
+        llama_numa_init(GGML_NUMA_STRATEGY_DISABLED);
+        LOGI("Native runtime initialized");
+    }
+}
+
+static void runtime_release() {
+    native_runtime& runtime = get_runtime();
+    std::lock_guard<std::mutex> lock(runtime.mutex);
+    if (runtime.n_refs <= 0) {
+        LOGW("Native runtime released more times than acquired");
+        return;
+    }
+    if (--runtime.n_refs == 0) {
+        llama_backend_free();
+        LOGI("Native runtime shut down");
+    }
+}
+
+// 已映射文件在 /proc/self/maps 中的标识（设备号 + inode）
+struct mapped_file_id {
+    dev_t dev = 0;
+    ino_t ino = 0;
+};
+
+// 投机解码用的草稿模型（如 Qwen3-0.6B），与主模型共享分词器
+struct draft_model_wrapper {
+    llama_model* model = nullptr;
+    llama_context* ctx = nullptr;
+    mapped_file_id model_file;
+    llama_sampler* smpl = nullptr;            // 草稿使用贪心采样
+    std::vector<llama_token> cached_tokens;   // 草稿上下文 KV 中已有的 token
+    std::vector<llama_token> target_tokens;   // 每步需要与主上下文对齐的 token（复用缓冲区）
+    int n_draft = 4;                          // 每步起草的 token 数，0 表示关闭投机解码
+
+    // 统计（自加载草稿模型起累计）
+    int64_t n_steps = 0;      // 主模型批量验证次数
+    int64_t n_drafted = 0;    // 起草 token 总数
+    int64_t n_accepted = 0;   // 被主模型接受的草稿 token 数
+};
+
+// 单次生成请求的性能统计（时间单位为微秒，由 ggml_time_us 单调计时）
+struct generation_stats {
+    int64_t t_start_us = 0;            // 请求开始时刻
+    int64_t t_first_token_us = -1;     // 首 token 延迟 (TTFT)：请求开始到第一个输出 token，-1 表示未产生
+    int64_t t_total_us = 0;            // 请求总耗时
+    int64_t t_tokenize_us = 0;         // 提示词分词
+    int64_t t_prefill_us = 0;          // 提示词预填充 (llama_decode)
+    int64_t t_decode_us = 0;           // 生成阶段 llama_decode（投机解码时为主模型批量验证）
+    int64_t t_draft_us = 0;            // 草稿模型对齐与起草
+    int64_t t_sample_us = 0;           // 采样
+    int64_t t_detokenize_us = 0;       // token 转文本
+    int64_t t_callback_us = 0;         // JNI 回调（onText / onPrefillProgress）
+
+    int n_prompt_tokens = 0;           // 提示词 token 数
+    int n_reused_tokens = 0;           // 从 KV 缓存复用的前缀 token 数
+    int n_prefill_tokens = 0;          // 实际预填充的 token 数
+    int n_generated_tokens = 0;        // 生成的 token 数
+
+    // llama_perf_context 报告的数值（毫秒），用于与我们自己的计时交叉核对
+    double perf_prompt_eval_ms = 0;
+    double perf_eval_ms = 0;
+    int perf_n_prompt_eval = 0;
+    int perf_n_eval = 0;
+
+    int governor_mode = 0;             // 请求结束时的调速模式 (governor_mode)
+    int governor_mode_changes = 0;     // 本次请求内调速模式的切换次数
+
+    int n_context_shifts = 0;          // 生成过程中上下文滑动次数
+    int n_discarded_tokens = 0;        // 因超出 n_ctx 被丢弃的 token 数（提示词截断 + 滑动）
+};
+
+// 预热状态（与 Kotlin WarmupState.ordinal 一致）
+enum warmup_state {
+    WARMUP_NOT_RUN = 0,
+    WARMUP_RUNNING = 1,
+    WARMUP_DONE = 2,
+    WARMUP_CANCELLED = 3,   // cancelWarmup 或主请求到来时提前结束
+    WARMUP_FAILED = 4
+};
+
+// 加载后预热的耗时统计（微秒）
+struct warmup_stats {
+    int state = WARMUP_NOT_RUN;
+    int64_t t_prefault_us = 0;      // 权重页预读
+    int64_t n_prefault_bytes = 0;   // 已预读的映射字节数
+    int64_t t_decode_us = 0;        // 预热解码（GPU 管线编译、线程池启动、首次分配计算缓冲区）
+    int64_t t_total_us = 0;
+};
+
+// 推理调速模式（与 Kotlin GovernorMode.ordinal 一致），数值越大越保守
+enum governor_mode {
+    GOVERNOR_NORMAL = 0,        // 配置的线程数与生成长度
+    GOVERNOR_REDUCED_THREADS,   // 解码线程数减半，降低功耗和发热
+    GOVERNOR_SHORT_ANSWERS,     // 在减少线程的基础上限制生成长度
+    GOVERNOR_DRAFT_ONLY,        // 只用草稿模型生成（需已加载草稿模型，否则停留在上一级）
+};
+
+/**
+ * 热 / 电量感知的推理调速器
+ *
+ * 输入：Kotlin 通过 PowerManager 推送的温控状态、温度余量和省电模式，以及原生层测得的单 token 解码延迟。
+ * 温控给出最低级别；延迟 EMA 比当前模式的基线慢 GOVERNOR_SLOWDOWN_RATIO 倍时再升一级，
+ * 保持一段时间后尝试逐级恢复，仍然变慢会再次升级。
+ */
+struct inference_governor {
+    std::atomic<bool> enabled{true};
+    std::atomic<int> thermal_status{0};         // PowerManager.THERMAL_STATUS_*
+    std::atomic<float> thermal_headroom{-1.0f}; // PowerManager.getThermalHeadroom，< 0 表示未知，>= 1 表示已开始降频
+    std::atomic<bool> power_save{false};
+
+    int mode = GOVERNOR_NORMAL;
+    int latency_level = GOVERNOR_NORMAL;  // 由解码延迟决定的级别
+    double ema_token_us = 0;              // 单 token 解码延迟 EMA
+    double baseline_token_us = 0;         // 本次请求、当前模式下观察到的最低 EMA
+    int n_samples = 0;                    // 本次请求、当前模式下的延迟样本数
+    int64_t last_change_us = 0;           // 最近一次升降级时刻
+};
+
+// 输出过滤的隐藏片段：open 与 close 之间的内容不输出（如 <think>…</think>），未闭合时隐藏到结尾
+struct hidden_span {
+    std::string open;
+    std::string close;
+};
+
+struct output_filter_config {
+    std::vector<std::string> stops = { "<|im_end|>" };
+    std::vector<hidden_span> spans = { { "<think>", "</think>" } };
+};
+
+// 采样链参数，参数相同的请求复用同一条采样链
+struct sampler_params {
+    float temperature = 0.0f;
+    float top_p = 0.0f;
+    int top_k = 0;
+
+    bool operator==(const sampler_params& other) const {
+        return temperature == other.temperature && top_p == other.top_p && top_k == other.top_k;
+    }
+};
+
+struct inference_session;
+
+// 提示词前缀快照：独立序列中保存的一段 KV（与序列 0 共享单元，直到序列 0 分歧）
+struct prompt_snapshot {
+    llama_seq_id seq_id = -1;
+    std::vector<llama_token> tokens;  // 快照覆盖的 token，空表示槽位空闲
+    bool pinned = false;              // 固定的系统提示词快照，不参与 LRU 淘汰
+    uint64_t last_used = 0;
+    int n_hits = 0;
+};
+
 // 存储模型和上下文的结构
 struct llama_context_wrapper {
     llama_model* model;
-    llama_context* ctx;
+    llama_context* ctx;  // trimMemory 释放后为 nullptr，下一个请求按 ctx_params 重建
+    llama_context_params ctx_params{};
+    mapped_file_id model_file;
     bool using_gpu;      // 是否正在使用 GPU
     int gpu_layers;      // GPU 层数
+    int n_batch;         // 预填充每批最多解码的 token 数
+    int kv_cache_type = -1;   // 创建上下文时请求的 KV 缓存 ggml_type，< 0 为默认 (F16)
+    int flash_attn = -1;      // 创建上下文时请求的 Flash Attention：-1 自动，0 关闭，1 开启
+
+    // 绑定在性能核上的 ggml 线程池：解码（带宽受限）与预填充（计算受限）分开设置线程数
+    ggml_threadpool* threadpool = nullptr;
+    ggml_threadpool* threadpool_batch = nullptr;
+    int n_threads = 0;
+    int n_threads_batch = 0;
+
+    // KV 缓存复用（跨轮次前缀匹配）
+    std::vector<llama_token> cached_tokens;  // 当前 KV 缓存中序列 0 已有的 token
+    int last_prompt_tokens = 0;              // 最近一次请求的提示词 token 数
+    int last_reused_tokens = 0;              // 最近一次请求复用的前缀 token 数
+
+    // 协作式取消：在解码步骤/预填充批次之间检查，并通过 abort 回调中断进行中的 llama_decode
+    // 请求在等锁前领取序号，拿到锁后按序号判断等锁期间是否已被取消，cancel_requested 只对持锁的请求生效
+    std::atomic<bool> cancel_requested{false};
+    std::mutex cancel_mutex;    // 保护 request_seq 与 cancel_seq
+    uint64_t request_seq = 0;   // 最近一个进入 main_request_scope 的请求序号
+    uint64_t cancel_seq = 0;    // 序号不超过它的请求（进行中和排队中）均已取消
+
+    // 投机解码草稿模型（可选）
+    draft_model_wrapper* draft = nullptr;
+
+    // 性能统计：stats 由生成线程在 ctx_mutex 下写入，请求结束时在 stats_mutex 下发布为 last_stats 供读取
+    generation_stats stats;
+    generation_stats last_stats;
+    std::mutex stats_mutex;
+
+    // 加载后预热：cancelWarmup 或主请求等待 ctx_mutex 时在两段之间停止
+    // warmup 由预热线程在 ctx_mutex 下写入，开始和结束时在 warmup_mutex 下发布为 last_warmup 供读取
+    std::atomic<bool> warmup_cancel{false};
+    warmup_stats warmup;
+    warmup_stats last_warmup;
+    std::mutex warmup_mutex;
+
+    // 热 / 电量感知调速器
+    inference_governor governor;
+
+    // 上下文滑动窗口：超出 n_ctx 时保留开头 n_keep 个 token，丢弃其后最早的部分（在 ctx_mutex 下读写）
+    bool context_shift = true;
+    int n_keep = -1;     // < 0 表示自动固定系统提示词
+
+    // 输出过滤的停止序列与隐藏片段
+    output_filter_config filter_config;
+
+    // 跨请求复用的采样链与缓冲区：参数不变时只 reset 采样链，缓冲区容量保留，解码循环中不再分配
+    llama_sampler* sampler = nullptr;
+    sampler_params sampler_config;
+    std::vector<llama_token> prompt_tokens;  // 当前请求的提示词 token
+    std::string output_text;                 // generate 的可见输出
+    std::vector<llama_token_data> candidates;  // 采样候选数组（n_vocab 个）
+
+    // 多会话并行：主对话在序列 0，后台会话在序列 1..n，共享同一份权重和统一 KV 缓存
+    int n_ctx_main = 0;                        // 序列 0 可用的上下文长度，0 表示整个 n_ctx
+    int session_ctx = 0;                       // 每个后台会话的上下文长度
+    std::vector<inference_session*> sessions;  // sessions[i] 使用序列 i + 1
+    llama_batch session_batch = {};            // 主请求与后台会话合批解码用的 batch
+    std::mutex ctx_mutex;                      // 串行化 ctx 上的解码：主请求、后台调度步、状态读写
+    std::atomic<int> main_waiting{0};          // 等待 ctx_mutex 的主请求数，后台调度步为其让路
+    std::atomic<bool> main_active{false};      // 主请求进行中：只有这时 abort 回调才会中断解码
+    std::mutex session_mutex;                  // 配合 session_cv 等待会话结束或上下文空闲
+    std::condition_variable session_cv;
+    std::atomic<int> n_session_runners{0};     // 正在 runSession 中等待的线程数
+
+    // 提示词前缀快照（序列 n_sessions + 1 起）：固定系统提示词 + 带知识块系统提示词的 LRU
+    std::vector<prompt_snapshot> snapshots;
+    std::vector<llama_token> pinned_prompt;    // pinSystemPrompt 指定的系统提示词，预填充经过时固定为快照
+    int snapshot_budget = 0;                   // 所有快照合计可占用的 token 数
+    uint64_t snapshot_clock = 0;
+
+    // LoRA 适配器：挂在同一份基础权重上，lora_adapters[i] 的缩放由请求各自指定，0 表示不启用
+    std::vector<llama_adapter_lora*> lora_adapters;
+    std::vector<float> lora_main;     // 主对话（序列 0）的缩放
+    std::vector<float> lora_applied;  // 上下文中当前生效的缩放
 };
 
+// llama_decode 内部的 abort 回调，返回 true 时中断当前计算
+static bool generation_abort_callback(void* data) {
+    auto* wrapper = static_cast<llama_context_wrapper*>(data);
+    return wrapper->main_active.load(std::memory_order_relaxed) &&
+           wrapper->cancel_requested.load(std::memory_order_relaxed);
+}
+
+// 序列 0（主对话）可用的上下文长度，其余部分留给后台会话
+static int main_context_size(const llama_context_wrapper* wrapper) {
+    return wrapper->n_ctx_main > 0 ? wrapper->n_ctx_main : (int) llama_n_ctx(wrapper->ctx);
+}
+
 // ============================================
-// GPU 能力检测
+// LoRA 适配器
 // ============================================
 
-// 检测 Vulkan GPU 是否可用
-static bool detect_vulkan_available() {
-#ifdef GGML_USE_VULKAN
-    // 尝试检测 Vulkan 后端
-    LOGI("Checking Vulkan availability...");
-
-    // ggml_backend_vulkan_device_count 返回可用的 Vulkan 设备数量
-    // 如果编译时没有启用 Vulkan，这个函数不存在，会在链接时失败
-    // 所以我们用一个简单的检查
-    return true;  // 如果编译时启用了 GGML_USE_VULKAN，就返回 true
-#else
-    LOGI("Vulkan backend not compiled in");
-    return false;
-#endif
+// 两组缩放是否等价，未列出的适配器视为 0
+static bool lora_equal(const std::vector<float>& a, const std::vector<float>& b) {
+    const size_t n = std::max(a.size(), b.size());
+    for (size_t i = 0; i < n; i++) {
+        if ((i < a.size() ? a[i] : 0.0f) != (i < b.size() ? b[i] : 0.0f)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * 把上下文中生效的适配器切换为 scales（调用方持有 ctx_mutex），组合不变时什么也不做
+ * 适配器是上下文级别的设置，同一个 batch 内的序列只能使用同一组缩放
+ */
+static void apply_lora(llama_context_wrapper* wrapper, const std::vector<float>& scales) {
+    if (wrapper->ctx == nullptr || lora_equal(wrapper->lora_applied, scales)) {
+        return;
+    }
+    llama_clear_adapter_lora(wrapper->ctx);
+    for (size_t i = 0; i < scales.size() && i < wrapper->lora_adapters.size(); i++) {
+        if (scales[i] != 0.0f && llama_set_adapter_lora(wrapper->ctx, wrapper->lora_adapters[i], scales[i]) != 0) {
+            LOGE("Failed to apply LoRA adapter %zu (scale %.2f)", i, scales[i]);
+        }
+    }
+    wrapper->lora_applied = scales;
 }
 
+/**
+ * 主请求（generate / generateStream / 基准测试）期间持有 ctx_mutex 和运行时的 compute_mutex
+ * 等锁期间后台调度步不再抢锁，结束后唤醒等待上下文的后台会话；期间上下文使用主对话的适配器
+ * 等锁期间收到的 cancelGeneration 在拿到锁后生效，不会被清除
+ */
+struct main_request_scope {
+    llama_context_wrapper* wrapper;
+    std::unique_lock<std::mutex> lock;
+    std::unique_lock<std::mutex> compute;
+    uint64_t seq = 0;
+
+    explicit main_request_scope(llama_context_wrapper* w)
+        : wrapper(w), lock(w->ctx_mutex, std::defer_lock), compute(get_runtime().compute_mutex, std::defer_lock) {
+        {
+            std::lock_guard<std::mutex> guard(wrapper->cancel_mutex);
+            seq = ++wrapper->request_seq;
+        }
+        wrapper->main_waiting++;
+        lock.lock();
+        compute.lock();
+        wrapper->main_waiting--;
+        {
+            std::lock_guard<std::mutex> guard(wrapper->cancel_mutex);
+            wrapper->cancel_requested.store(wrapper->cancel_seq >= seq);
+        }
+        wrapper->main_active.store(true);
+        apply_lora(wrapper, wrapper->lora_main);
+    }
+
+    ~main_request_scope() {
+        wrapper->main_active.store(false);
+        wrapper->session_cv.notify_all();
+    }
+};
+
 // ============================================
-// 模型初始化函数（原版 - CPU only）
+// 性能统计与 ATrace
 // ============================================
-extern "C" JNIEXPORT jlong JNICALL
-Java_com_example_haiyangapp_inference_LlamaCppJNI_initModel(
-    JNIEnv* env,
-    jobject /* this */,
-    jstring modelPath,
-    jint contextSize,
-    jint threads) {
 
-    const char *path = env->GetStringUTFChars(modelPath, nullptr);
-    LOGD("Initializing model from: %s", path);
-    LOGD("Context size: %d, Threads: %d", contextSize, threads);
+// ATrace_* 在 API 23 才加入 NDK，minSdk 为 21，只能运行时从 libandroid.so 查找；
+// 找不到或未在抓取 trace 时各阶段只计时、不打点
+struct atrace_api {
+    void (*begin_section)(const char*) = nullptr;
+    void (*end_section)() = nullptr;
+    bool (*is_enabled)() = nullptr;
+};
 
-    // 初始化 llama 后端
-    llama_backend_init();
-    llama_numa_init(GGML_NUMA_STRATEGY_DISABLED);
+static const atrace_api& get_atrace() {
+    static const atrace_api api = [] {
+        atrace_api a;
+        void* lib = dlopen("libandroid.so", RTLD_NOW | RTLD_LOCAL);
+        if (lib != nullptr) {
+            a.begin_section = reinterpret_cast<void (*)(const char*)>(dlsym(lib, "ATrace_beginSection"));
+            a.end_section = reinterpret_cast<void (*)()>(dlsym(lib, "ATrace_endSection"));
+            a.is_enabled = reinterpret_cast<bool (*)()>(dlsym(lib, "ATrace_isEnabled"));
+        }
+        if (a.begin_section == nullptr || a.end_section == nullptr || a.is_enabled == nullptr) {
+            a = atrace_api();
+        }
+        return a;
+    }();
+    return api;
+}
 
-    // 设置模型参数
-    llama_model_params model_params = llama_model_default_params();
-    model_params.n_gpu_layers = 0;  // CPU only 模式
+/**
+ * 作用域计时：析构时把耗时累加到 acc，Perfetto 抓取期间同时输出同名 trace section
+ */
+struct phase_timer {
+    int64_t* acc;
+    int64_t t_begin;
+    bool traced = false;
+
+    phase_timer(int64_t* acc, const char* name) : acc(acc), t_begin(ggml_time_us()) {
+        const atrace_api& atrace = get_atrace();
+        if (atrace.is_enabled != nullptr && atrace.is_enabled()) {
+            atrace.begin_section(name);
+            traced = true;
+        }
+    }
 
-    // 加载模型
-    llama_model* model = llama_load_model_from_file(path, model_params);
-    env->ReleaseStringUTFChars(modelPath, path);
+    ~phase_timer() {
+        *acc += ggml_time_us() - t_begin;
+        if (traced) {
+            get_atrace().end_section();
+        }
+    }
 
-    if (model == nullptr) {
-        LOGE("Failed to load model");
-        return 0;
+    phase_timer(const phase_timer&) = delete;
+    phase_timer& operator=(const phase_timer&) = delete;
+};
+
+// 开始一次生成请求：清零统计并重置 llama.cpp 内部的性能计数
+static void begin_generation_stats(llama_context_wrapper* wrapper) {
+    wrapper->stats = generation_stats();
+    wrapper->stats.t_start_us = ggml_time_us();
+    llama_perf_context_reset(wrapper->ctx);
+}
+
+// 结束一次生成请求：记录总耗时并合并 llama_perf_context 的数值
+static void finish_generation_stats(llama_context_wrapper* wrapper, int n_generated) {
+    generation_stats& stats = wrapper->stats;
+    stats.t_total_us = ggml_time_us() - stats.t_start_us;
+    stats.n_generated_tokens = n_generated;
+
+    const llama_perf_context_data perf = llama_perf_context(wrapper->ctx);
+    stats.perf_prompt_eval_ms = perf.t_p_eval_ms;
+    stats.perf_eval_ms = perf.t_eval_ms;
+    stats.perf_n_prompt_eval = perf.n_p_eval;
+    stats.perf_n_eval = perf.n_eval;
+    stats.governor_mode = wrapper->governor.mode;
+
+    const double prefill_tps = stats.t_prefill_us > 0 ? stats.n_prefill_tokens * 1e6 / stats.t_prefill_us : 0.0;
+    const double decode_tps = stats.t_total_us - stats.t_first_token_us > 0 && stats.t_first_token_us >= 0
+        ? (stats.n_generated_tokens - 1) * 1e6 / (stats.t_total_us - stats.t_first_token_us) : 0.0;
+    LOGD("Generation stats: ttft %.1f ms, prefill %d tok @ %.1f tok/s, decode %d tok @ %.1f tok/s, "
+         "sample %.1f ms, detokenize %.1f ms, callback %.1f ms, total %.1f ms",
+         stats.t_first_token_us / 1000.0, stats.n_prefill_tokens, prefill_tps,
+         stats.n_generated_tokens, decode_tps,
+         stats.t_sample_us / 1000.0, stats.t_detokenize_us / 1000.0, stats.t_callback_us / 1000.0,
+         stats.t_total_us / 1000.0);
+
+    std::lock_guard<std::mutex> lock(wrapper->stats_mutex);
+    wrapper->last_stats = stats;
+}
+
+// ============================================
+// 推理调速（温控 / 省电 / 解码延迟）
+// ============================================
+
+#define GOVERNOR_SLOWDOWN_RATIO 1.5          // 延迟 EMA 超过基线该倍数时升一级
+#define GOVERNOR_EMA_ALPHA 0.1
+#define GOVERNOR_MIN_SAMPLES 8               // 建立基线前至少需要的 token 数
+#define GOVERNOR_ESCALATE_HOLD_US 2000000    // 两次升级之间的最短间隔
+#define GOVERNOR_RECOVER_HOLD_US 15000000    // 升级后至少保持该时长才尝试恢复一级
+#define GOVERNOR_SHORT_MAX_TOKENS 256        // SHORT_ANSWERS 模式下的生成长度上限
+#define GOVERNOR_HEADROOM_MODERATE 0.85f     // 温度余量达到该值时减少线程
+#define GOVERNOR_HEADROOM_SEVERE 1.0f        // 温度余量达到该值（即将 / 已经降频）时限制生成长度
+
+// PowerManager.THERMAL_STATUS_*
+#define THERMAL_STATUS_LIGHT 1
+#define THERMAL_STATUS_MODERATE 2
+#define THERMAL_STATUS_SEVERE 3
+
+static const char* governor_mode_name(int mode) {
+    switch (mode) {
+        case GOVERNOR_REDUCED_THREADS: return "reduced-threads";
+        case GOVERNOR_SHORT_ANSWERS: return "short-answers";
+        case GOVERNOR_DRAFT_ONLY: return "draft-only";
+        default: return "normal";
     }
+}
 
-    // 设置上下文参数
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx = contextSize;
-    ctx_params.n_threads = threads;
-    ctx_params.n_threads_batch = threads;
+// 温控与省电模式要求的最低级别
+static int governor_thermal_level(const inference_governor& governor) {
+    int level = GOVERNOR_NORMAL;
+
+    const int status = governor.thermal_status.load();
+    if (status >= THERMAL_STATUS_SEVERE) {
+        level = GOVERNOR_DRAFT_ONLY;
+    } else if (status >= THERMAL_STATUS_MODERATE) {
+        level = GOVERNOR_SHORT_ANSWERS;
+    } else if (status >= THERMAL_STATUS_LIGHT) {
+        level = GOVERNOR_REDUCED_THREADS;
+    }
 
-    // 创建上下文
-    llama_context* ctx = llama_new_context_with_model(model, ctx_params);
-    if (ctx == nullptr) {
-        LOGE("Failed to create context");
-        llama_free_model(model);
-        return 0;
+    const float headroom = governor.thermal_headroom.load();
+    if (headroom >= GOVERNOR_HEADROOM_SEVERE) {
+        level = std::max(level, (int) GOVERNOR_SHORT_ANSWERS);
+    } else if (headroom >= GOVERNOR_HEADROOM_MODERATE) {
+        level = std::max(level, (int) GOVERNOR_REDUCED_THREADS);
     }
 
-    // 创建包装结构
-    llama_context_wrapper* wrapper = new llama_context_wrapper();
-    wrapper->model = model;
-    wrapper->ctx = ctx;
-    wrapper->using_gpu = false;
-    wrapper->gpu_layers = 0;
+    if (governor.power_save.load()) {
+        level = std::max(level, (int) GOVERNOR_REDUCED_THREADS);
+    }
+    return level;
+}
 
-    LOGD("Model initialized successfully (CPU only)!");
-    return reinterpret_cast<jlong>(wrapper);
+// 当前模式下的解码线程数
+static int governor_decode_threads(const llama_context_wrapper* wrapper) {
+    if (wrapper->governor.mode >= GOVERNOR_REDUCED_THREADS) {
+        return std::max(1, wrapper->n_threads / 2);
+    }
+    return wrapper->n_threads;
+}
+
+// 当前模式下的生成长度上限
+static int governor_max_tokens(const llama_context_wrapper* wrapper, int max_tokens) {
+    if (wrapper->governor.mode >= GOVERNOR_SHORT_ANSWERS) {
+        return std::min(max_tokens, GOVERNOR_SHORT_MAX_TOKENS);
+    }
+    return max_tokens;
+}
+
+/**
+ * 按温控级别和延迟级别重新确定模式，模式改变时调整解码线程数（线程池不重建，只减少参与计算的线程）
+ */
+static void governor_update(llama_context_wrapper* wrapper) {
+    inference_governor& governor = wrapper->governor;
+    const int64_t now = ggml_time_us();
+
+    int target = GOVERNOR_NORMAL;
+    if (governor.enabled.load()) {
+        // 降级保持足够久后尝试恢复一级
+        if (governor.latency_level > GOVERNOR_NORMAL && now - governor.last_change_us > GOVERNOR_RECOVER_HOLD_US) {
+            governor.latency_level--;
+            governor.last_change_us = now;
+        }
+        target = std::max(governor_thermal_level(governor), governor.latency_level);
+        if (target == GOVERNOR_DRAFT_ONLY && wrapper->draft == nullptr) {
+            target = GOVERNOR_SHORT_ANSWERS;
+        }
+    } else {
+        governor.latency_level = GOVERNOR_NORMAL;
+    }
+
+    if (target == governor.mode) {
+        return;
+    }
+
+    LOGI("Governor: %s -> %s (thermal status %d, headroom %.2f, power save %d, token latency %.1f ms)",
+         governor_mode_name(governor.mode), governor_mode_name(target),
+         governor.thermal_status.load(), governor.thermal_headroom.load(), governor.power_save.load(),
+         governor.ema_token_us / 1000.0);
+
+    governor.mode = target;
+    governor.last_change_us = now;
+    governor.ema_token_us = 0;
+    governor.baseline_token_us = 0;
+    governor.n_samples = 0;
+    wrapper->stats.governor_mode_changes++;
+
+    if (wrapper->ctx != nullptr && wrapper->n_threads > 0) {
+        llama_set_n_threads(wrapper->ctx, governor_decode_threads(wrapper), wrapper->n_threads_batch);
+    }
+}
+
+// 每次生成请求开始时调用：解码延迟随 n_past 增长，基线只在同一请求内比较，
+// 否则长对话后期会被误判为降频。latency_level 保留，按恢复间隔逐级回落
+static void governor_begin_request(llama_context_wrapper* wrapper) {
+    inference_governor& governor = wrapper->governor;
+    governor.ema_token_us = 0;
+    governor.baseline_token_us = 0;
+    governor.n_samples = 0;
+    governor_update(wrapper);
+}
+
+// 每得到一个生成 token 调用一次，token_us 为该 token 的解码耗时
+static void governor_on_token(llama_context_wrapper* wrapper, int64_t token_us) {
+    inference_governor& governor = wrapper->governor;
+    if (!governor.enabled.load()) {
+        return;
+    }
+
+    governor.ema_token_us = governor.n_samples == 0
+        ? (double) token_us
+        : GOVERNOR_EMA_ALPHA * token_us + (1.0 - GOVERNOR_EMA_ALPHA) * governor.ema_token_us;
+    if (++governor.n_samples < GOVERNOR_MIN_SAMPLES) {
+        return;
+    }
+
+    if (governor.baseline_token_us <= 0 || governor.ema_token_us < governor.baseline_token_us) {
+        governor.baseline_token_us = governor.ema_token_us;
+    }
+
+    const int64_t now = ggml_time_us();
+    if (governor.ema_token_us > governor.baseline_token_us * GOVERNOR_SLOWDOWN_RATIO &&
+        now - governor.last_change_us > GOVERNOR_ESCALATE_HOLD_US &&
+        governor.latency_level < GOVERNOR_DRAFT_ONLY) {
+        governor.latency_level = std::max(governor.latency_level, governor.mode) + 1;
+    }
+
+    // 温控状态可能在生成过程中由 Kotlin 更新，这里一并检查
+    governor_update(wrapper);
 }
 
 // ============================================
-// 模型初始化函数（GPU 支持版本，带静默回退）
+// KV 缓存前缀复用
 // ============================================
-extern "C" JNIEXPORT jlong JNICALL
-Java_com_example_haiyangapp_inference_LlamaCppJNI_initModelWithGpu(
-    JNIEnv* env,
-    jobject /* this */,
-    jstring modelPath,
-    jint contextSize,
-    jint threads,
-    jboolean useGpu,
-    jint gpuLayers) {
 
-    const char *path = env->GetStringUTFChars(modelPath, nullptr);
-    LOGI("Initializing model from: %s", path);
-    LOGI("Context size: %d, Threads: %d, UseGPU: %d, GPU Layers: %d",
-         contextSize, threads, useGpu, gpuLayers);
+static size_t common_prefix_length(const std::vector<llama_token>& a, const std::vector<llama_token>& b) {
+    size_t n = 0;
+    const size_t n_max = std::min(a.size(), b.size());
+    while (n < n_max && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
 
-    // 初始化 llama 后端
-    llama_backend_init();
-    llama_numa_init(GGML_NUMA_STRATEGY_DISABLED);
+// ChatML 的 <|im_end|>，词表中没有时返回 LLAMA_TOKEN_NULL
+static llama_token im_end_token(const llama_model* model) {
+    llama_token im_end = LLAMA_TOKEN_NULL;
+    if (llama_tokenize(llama_model_get_vocab(model), "<|im_end|>", 10, &im_end, 1, false, true) != 1) {
+        return LLAMA_TOKEN_NULL;
+    }
+    return im_end;
+}
 
-    // 设置模型参数
-    llama_model_params model_params = llama_model_default_params();
+// 开头 ChatML 系统提示词块的长度（到第一个 <|im_end|> 为止），在前 limit 个 token 内找不到返回 0
+static int system_block_length(const llama_model* model, const std::vector<llama_token>& tokens, int limit) {
+    const llama_token im_end = im_end_token(model);
+    limit = std::min(limit, (int) tokens.size());
+    for (int i = 0; i < limit && im_end != LLAMA_TOKEN_NULL; i++) {
+        if (tokens[i] == im_end) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
 
-    bool gpu_available = false;
-    int actual_gpu_layers = 0;
+// 自动保存的快照短于该长度时不值得占用一个序列
+#define PROMPT_SNAPSHOT_MIN_TOKENS 32
+// 快照比序列 0 现有前缀至少多复用该数量的 token 时才恢复，也是固定系统提示词快照的最短长度
+#define PROMPT_SNAPSHOT_MIN_GAIN 16
 
-    // 尝试使用 GPU
-    if (useGpu) {
-        gpu_available = detect_vulkan_available();
+/**
+ * 提示词前缀快照：切换对话、后台会话或不同知识块的请求覆盖序列 0 后，
+ * 系统提示词（及注入的知识块）不必重新预填充。
+ *
+ * 快照保存在序列 0 之后的独立序列中，保存和恢复都用 llama_memory_seq_cp：统一 KV 缓存下
+ * 只是给已有单元加上序列标记，不复制数据；序列 0 分歧后快照独占这些单元，合计不超过 snapshot_budget
+ */
+static void create_prompt_snapshots(llama_context_wrapper* wrapper, int n_slots, llama_seq_id first_seq, int budget) {
+    wrapper->snapshots.resize(n_slots);
+    for (int i = 0; i < n_slots; i++) {
+        wrapper->snapshots[i].seq_id = first_seq + i;
+    }
+    wrapper->snapshot_budget = budget;
+}
 
-        if (gpu_available) {
-            // gpuLayers = -1 表示全部层都用 GPU
-            actual_gpu_layers = (gpuLayers < 0) ? 99 : gpuLayers;
-            model_params.n_gpu_layers = actual_gpu_layers;
-            LOGI("GPU acceleration enabled, using %d layers on GPU", actual_gpu_layers);
-        } else {
-            LOGW("GPU requested but not available, falling back to CPU");
-            model_params.n_gpu_layers = 0;
+static void drop_prompt_snapshot(llama_context_wrapper* wrapper, prompt_snapshot& snap) {
+    if (!snap.tokens.empty()) {
+        llama_memory_seq_rm(llama_get_memory(wrapper->ctx), snap.seq_id, -1, -1);
+    }
+    snap.tokens.clear();
+    snap.pinned = false;
+    snap.n_hits = 0;
+}
+
+// 最久未用的非固定快照；occupied_only 为 false 时优先返回空闲槽位
+static prompt_snapshot* lru_prompt_snapshot(llama_context_wrapper* wrapper, const prompt_snapshot* exclude, bool occupied_only) {
+    prompt_snapshot* victim = nullptr;
+    for (prompt_snapshot& snap : wrapper->snapshots) {
+        if (&snap == exclude || snap.pinned) {
+            continue;
+        }
+        if (snap.tokens.empty()) {
+            if (!occupied_only) {
+                return &snap;
+            }
+            continue;
+        }
+        if (victim == nullptr || snap.last_used < victim->last_used) {
+            victim = &snap;
         }
-    } else {
-        model_params.n_gpu_layers = 0;
-        LOGI("GPU disabled by user, using CPU only");
     }
+    return victim;
+}
 
-    // 加载模型
-    llama_model* model = llama_load_model_from_file(path, model_params);
+/**
+ * 把序列 0 开头的 n_tokens 个 token 保存为快照：已有相同快照时只刷新使用时间，
+ * 否则占用空闲槽位或淘汰最久未用的非固定快照，合计超出 snapshot_budget 时继续淘汰
+ * 固定快照只保留一个，新的固定快照替换旧的
+ */
+static void store_prompt_snapshot(llama_context_wrapper* wrapper, int n_tokens, bool pinned) {
+    const std::vector<llama_token>& cached = wrapper->cached_tokens;
+    if (wrapper->snapshots.empty() || n_tokens <= 0 || n_tokens > wrapper->snapshot_budget ||
+        n_tokens > (int) cached.size()) {
+        return;
+    }
 
-    // 如果 GPU 加载失败，尝试回退到 CPU
-    if (model == nullptr && gpu_available && actual_gpu_layers > 0) {
-        LOGW("GPU model loading failed, attempting CPU fallback...");
-        model_params.n_gpu_layers = 0;
-        model = llama_load_model_from_file(path, model_params);
-        gpu_available = false;
-        actual_gpu_layers = 0;
+    prompt_snapshot* slot = nullptr;
+    for (prompt_snapshot& snap : wrapper->snapshots) {
+        const bool same = (int) snap.tokens.size() == n_tokens &&
+                          std::equal(snap.tokens.begin(), snap.tokens.end(), cached.begin());
+        if (same) {
+            slot = &snap;
+        } else if (pinned && snap.pinned) {
+            drop_prompt_snapshot(wrapper, snap);
+        }
+    }
+    if (slot != nullptr) {
+        slot->pinned = slot->pinned || pinned;
+        slot->last_used = ++wrapper->snapshot_clock;
+        return;
     }
 
-    env->ReleaseStringUTFChars(modelPath, path);
+    slot = lru_prompt_snapshot(wrapper, nullptr, false);
+    if (slot == nullptr) {
+        return;
+    }
+    drop_prompt_snapshot(wrapper, *slot);
 
-    if (model == nullptr) {
-        LOGE("Failed to load model (both GPU and CPU attempts failed)");
-        return 0;
+    int n_used = 0;
+    for (const prompt_snapshot& snap : wrapper->snapshots) {
+        n_used += (int) snap.tokens.size();
+    }
+    while (n_used + n_tokens > wrapper->snapshot_budget) {
+        prompt_snapshot* victim = lru_prompt_snapshot(wrapper, slot, true);
+        if (victim == nullptr) {
+            return;
+        }
+        n_used -= (int) victim->tokens.size();
+        drop_prompt_snapshot(wrapper, *victim);
     }
 
-    // 设置上下文参数
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx = contextSize;
-    ctx_params.n_threads = threads;
-    ctx_params.n_threads_batch = threads;
+    llama_memory_seq_cp(llama_get_memory(wrapper->ctx), 0, slot->seq_id, 0, (llama_pos) n_tokens);
+    slot->tokens.assign(cached.begin(), cached.begin() + n_tokens);
+    slot->pinned = pinned;
+    slot->last_used = ++wrapper->snapshot_clock;
+    LOGD("Prompt snapshot stored: %d tokens in sequence %d%s", n_tokens, slot->seq_id, pinned ? " (pinned)" : "");
+}
 
-    // 创建上下文
-    llama_context* ctx = llama_new_context_with_model(model, ctx_params);
-    if (ctx == nullptr) {
-        LOGE("Failed to create context");
-        llama_free_model(model);
-        return 0;
+/**
+ * 预填充成功后保存快照：系统提示词块（含注入的知识块）进入 LRU，
+ * 与 pinSystemPrompt 指定的系统提示词相同的前缀更新固定快照
+ */
+static void capture_prompt_snapshots(llama_context_wrapper* wrapper, const std::vector<llama_token>& tokens) {
+    if (wrapper->snapshots.empty()) {
+        return;
+    }
+
+    const int n_pinned = (int) common_prefix_length(wrapper->pinned_prompt, tokens);
+    if (n_pinned >= PROMPT_SNAPSHOT_MIN_GAIN) {
+        int n_current = 0;
+        for (const prompt_snapshot& snap : wrapper->snapshots) {
+            if (snap.pinned) {
+                n_current = (int) snap.tokens.size();
+            }
+        }
+        // 只在覆盖得更长时替换，避免带 / 不带知识块的请求交替时反复重建
+        if (n_pinned > n_current) {
+            store_prompt_snapshot(wrapper, n_pinned, true);
+        }
+    }
+
+    // 固定快照已覆盖的系统提示词块不再重复保存
+    const int n_system = system_block_length(wrapper->model, tokens, (int) tokens.size());
+    if (n_system >= PROMPT_SNAPSHOT_MIN_TOKENS && n_system > n_pinned) {
+        store_prompt_snapshot(wrapper, n_system, false);
+    }
+}
+
+/**
+ * 某个快照与新提示词的公共前缀比序列 0 现有的多出 PROMPT_SNAPSHOT_MIN_GAIN 以上时，
+ * 清空序列 0 并从该快照复制这段前缀，之后的前缀复用与预填充照常进行
+ */
+static void restore_prompt_snapshot(llama_context_wrapper* wrapper, const std::vector<llama_token>& tokens) {
+    const size_t n_cached = common_prefix_length(wrapper->cached_tokens, tokens);
+    prompt_snapshot* best = nullptr;
+    size_t n_best = n_cached + PROMPT_SNAPSHOT_MIN_GAIN - 1;
+    for (prompt_snapshot& snap : wrapper->snapshots) {
+        const size_t n = common_prefix_length(snap.tokens, tokens);
+        if (n > n_best) {
+            best = &snap;
+            n_best = n;
+        }
+    }
+    if (best == nullptr) {
+        return;
+    }
+
+    llama_memory_t mem = llama_get_memory(wrapper->ctx);
+    llama_memory_seq_rm(mem, 0, -1, -1);
+    llama_memory_seq_cp(mem, best->seq_id, 0, 0, (llama_pos) n_best);
+    wrapper->cached_tokens.assign(tokens.begin(), tokens.begin() + n_best);
+    best->last_used = ++wrapper->snapshot_clock;
+    best->n_hits++;
+    LOGD("Prompt snapshot restored: %zu tokens from sequence %d (sequence 0 matched %zu, hit #%d)",
+         n_best, best->seq_id, n_cached, best->n_hits);
+}
+
+/**
+ * llama_memory_seq_add 平移的是单元本身的位置，与序列 0 共享单元的快照会被一起移动：
+ * 滑动前丢弃延伸到 n_keep 之后的快照
+ */
+static void drop_prompt_snapshots_beyond(llama_context_wrapper* wrapper, int n_keep) {
+    for (prompt_snapshot& snap : wrapper->snapshots) {
+        if ((int) snap.tokens.size() > n_keep) {
+            drop_prompt_snapshot(wrapper, snap);
+        }
+    }
+}
+
+/**
+ * 将新提示词与 KV 缓存中已有的 token 做最长公共前缀匹配（快照匹配得更长时先从快照恢复），
+ * 只移除分歧的尾部，返回可以跳过解码的前缀长度。
+ *
+ * 至少保留最后一个提示词 token 重新解码，以便得到采样所需的 logits。
+ */
+static int reuse_cached_prefix(llama_context_wrapper* wrapper, const std::vector<llama_token>& tokens) {
+    restore_prompt_snapshot(wrapper, tokens);
+
+    size_t n_prefix = common_prefix_length(wrapper->cached_tokens, tokens);
+    if (n_prefix >= tokens.size()) {
+        n_prefix = tokens.empty() ? 0 : tokens.size() - 1;
+    }
+
+    llama_memory_t mem = llama_get_memory(wrapper->ctx);
+    if (n_prefix == 0) {
+        llama_memory_seq_rm(mem, 0, -1, -1);
+    } else if (!llama_memory_seq_rm(mem, 0, (llama_pos) n_prefix, -1)) {
+        // 部分删除失败时回退到清空整个序列 0，后台会话的序列不受影响
+        LOGW("Partial KV cache removal failed, clearing sequence 0");
+        llama_memory_seq_rm(mem, 0, -1, -1);
+        n_prefix = 0;
+    }
+
+    wrapper->cached_tokens.resize(n_prefix);
+    wrapper->last_prompt_tokens = (int) tokens.size();
+    wrapper->last_reused_tokens = (int) n_prefix;
+
+    LOGD("KV cache reuse: %zu / %zu prompt tokens", n_prefix, tokens.size());
+    return (int) n_prefix;
+}
+
+// 解码失败后序列 0 的 KV 状态不可信，清空并丢弃 token 记录
+static void invalidate_cached_prefix(llama_context_wrapper* wrapper) {
+    llama_memory_seq_rm(llama_get_memory(wrapper->ctx), 0, -1, -1);
+    wrapper->cached_tokens.clear();
+}
+
+// ============================================
+// 上下文滑动窗口（对话超出 n_ctx 时丢弃最早的轮次）
+// ============================================
+
+// 生成中滑动时一次丢弃可滑动部分（n_keep 之后）的比例，多丢一些以减少滑动次数
+#define CONTEXT_SHIFT_DISCARD_RATIO 0.5
+// 自动固定系统提示词时允许的最大长度（占 n_ctx 的比例），超过则只固定第一个 token
+#define CONTEXT_KEEP_MAX_RATIO 0.25
+// 截断提示词时至少为生成预留的 token 数（maxTokens 更小时按 maxTokens）
+#define CONTEXT_MIN_GENERATION_ROOM 256
+// 在新提示词中定位 KV 缓存滑动后内容时比较的 token 数
+#define CONTEXT_ALIGN_PROBE_TOKENS 32
+
+/**
+ * 需要固定在窗口开头的 token 数
+ * wrapper->n_keep >= 0 时直接使用；否则固定到第一个 <|im_end|>（ChatML 系统提示词结束处），
+ * 找不到或过长时只固定第一个 token (BOS)
+ */
+static int context_keep_tokens(const llama_context_wrapper* wrapper, const std::vector<llama_token>& tokens) {
+    const int n_tokens = (int) tokens.size();
+    if (wrapper->n_keep >= 0) {
+        return std::min(wrapper->n_keep, n_tokens);
+    }
+
+    const int limit = (int) (main_context_size(wrapper) * CONTEXT_KEEP_MAX_RATIO);
+    const int n_system = system_block_length(wrapper->model, tokens, limit);
+    return n_system > 0 ? n_system : std::min(1, n_tokens);
+}
+
+/**
+ * 丢弃序列 0 的 [n_keep, n_keep + n_discard)，并把其后的位置前移 n_discard，cached 同步删除这段 token
+ * KV 不支持位置平移时删除 n_keep 之后的全部内容，重新解码保留的尾部
+ */
+static bool shift_context(llama_context* ctx, std::vector<llama_token>& cached, int n_keep, int n_discard) {
+    const int n_past = (int) cached.size();
+    n_discard = std::min(n_discard, n_past - n_keep);
+    if (n_keep < 0 || n_discard <= 0) {
+        return false;
+    }
+
+    llama_memory_t mem = llama_get_memory(ctx);
+    if (llama_memory_can_shift(mem)) {
+        if (!llama_memory_seq_rm(mem, 0, n_keep, n_keep + n_discard)) {
+            return false;
+        }
+        llama_memory_seq_add(mem, 0, n_keep + n_discard, n_past, -n_discard);
+        cached.erase(cached.begin() + n_keep, cached.begin() + n_keep + n_discard);
+        return true;
+    }
+
+    std::vector<llama_token> tail(cached.begin() + n_keep + n_discard, cached.end());
+    if (!llama_memory_seq_rm(mem, 0, n_keep, -1)) {
+        return false;
+    }
+    cached.resize(n_keep);
+
+    const int n_batch = std::max(1, (int) llama_n_batch(ctx));
+    for (size_t i = 0; i < tail.size(); i += n_batch) {
+        const int n_eval = (int) std::min<size_t>(n_batch, tail.size() - i);
+        if (llama_decode(ctx, llama_batch_get_one(tail.data() + i, n_eval)) != 0) {
+            llama_memory_seq_rm(mem, 0, (llama_pos) cached.size(), -1);
+            return false;
+        }
+        cached.insert(cached.end(), tail.begin() + i, tail.begin() + i + n_eval);
+    }
+    return true;
+}
+
+/**
+ * 主上下文放不下接下来的 n_tokens 个 token 时滑动窗口，草稿上下文与主上下文前缀一致时同步滑动
+ * @return 空间足够或已滑动返回 true；关闭滑动或无法滑动返回 false
+ */
+static bool ensure_context_space(llama_context_wrapper* wrapper, int n_tokens) {
+    std::vector<llama_token>& cached = wrapper->cached_tokens;
+    const int n_ctx = main_context_size(wrapper);
+    const int n_past = (int) cached.size();
+    if (n_past + n_tokens <= n_ctx) {
+        return true;
+    }
+    if (!wrapper->context_shift) {
+        LOGE("Context full (%d + %d > %d) and context shift is disabled", n_past, n_tokens, n_ctx);
+        return false;
+    }
+
+    const int n_keep = context_keep_tokens(wrapper, cached);
+    const int n_discard = std::max(n_past + n_tokens - n_ctx,
+                                   (int) ((n_past - n_keep) * CONTEXT_SHIFT_DISCARD_RATIO));
+
+    // 草稿 KV 不同步滑动的话，下一次对齐会从 n_keep 起重新解码整个窗口
+    draft_model_wrapper* draft = wrapper->draft;
+    if (draft != nullptr && !draft->cached_tokens.empty()) {
+        const bool aligned = common_prefix_length(draft->cached_tokens, cached) >= (size_t) (n_keep + n_discard);
+        if (!aligned || !shift_context(draft->ctx, draft->cached_tokens, n_keep, n_discard)) {
+            llama_memory_clear(llama_get_memory(draft->ctx), true);
+            draft->cached_tokens.clear();
+        }
+    }
+
+    drop_prompt_snapshots_beyond(wrapper, n_keep);
+    if (!shift_context(wrapper->ctx, cached, n_keep, n_discard)) {
+        LOGE("Context shift failed (keep %d, discard %d of %d)", n_keep, n_discard, n_past);
+        return false;
+    }
+
+    wrapper->stats.n_context_shifts++;
+    wrapper->stats.n_discarded_tokens += n_discard;
+    LOGI("Context shift: kept %d pinned + %d recent tokens, discarded %d",
+         n_keep, (int) cached.size() - n_keep, n_discard);
+    return true;
+}
+
+/**
+ * 提示词加生成空间超出 n_ctx 时截断提示词：保留开头 n_keep 个 token，删除其后最早的部分
+ *
+ * 优先删除与 KV 缓存此前滑动掉的同一段：紧跟固定部分之后的缓存内容能在新提示词中找到时就删到该处，
+ * 提示词与缓存重新对齐，前缀复用后只需预填充新增的一轮。否则一次删除一半可滑动部分，
+ * 为之后几轮留出空间，让它们能继续按上面的方式对齐
+ * @return 删除的 token 数
+ */
+static int fit_prompt_to_context(llama_context_wrapper* wrapper, std::vector<llama_token>& tokens, int max_tokens) {
+    const int n_ctx = main_context_size(wrapper);
+    const int n_tokens = (int) tokens.size();
+    const int budget = n_ctx - std::min(std::max(max_tokens, 1), CONTEXT_MIN_GENERATION_ROOM);
+    if (!wrapper->context_shift || n_tokens <= budget) {
+        return 0;
+    }
+
+    const int n_keep = std::min(context_keep_tokens(wrapper, tokens), budget / 2);
+    const int n_required = n_tokens - budget;
+    int n_discard = 0;
+
+    const std::vector<llama_token>& cached = wrapper->cached_tokens;
+    if (common_prefix_length(cached, tokens) >= (size_t) n_keep &&
+        cached.size() >= (size_t) (n_keep + CONTEXT_ALIGN_PROBE_TOKENS)) {
+        const auto probe_begin = cached.begin() + n_keep;
+        const auto probe_end = probe_begin + CONTEXT_ALIGN_PROBE_TOKENS;
+        auto it = std::search(tokens.begin() + n_keep + n_required, tokens.end(), probe_begin, probe_end);
+        if (it != tokens.end()) {
+            n_discard = (int) (it - tokens.begin()) - n_keep;
+        }
+    }
+    if (n_discard == 0) {
+        n_discard = std::max(n_required, (int) ((n_tokens - n_keep) * CONTEXT_SHIFT_DISCARD_RATIO));
+        n_discard = std::min(n_discard, n_tokens - n_keep - 1);
+    }
+
+    tokens.erase(tokens.begin() + n_keep, tokens.begin() + n_keep + n_discard);
+    wrapper->stats.n_discarded_tokens += n_discard;
+    LOGI("Prompt of %d tokens exceeds context budget %d: kept %d pinned tokens, discarded %d",
+         n_tokens, budget, n_keep, n_discard);
+    return n_discard;
+}
+
+// ============================================
+// 采样链与分词（跨请求复用）
+// ============================================
+
+// 重复惩罚考虑的最近 token 数（提示词和已生成的 token）
+#define SAMPLER_PENALTY_LAST_N 256
+
+static llama_sampler* create_sampler_chain(const sampler_params& params) {
+    llama_sampler* smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+
+    // 添加重复惩罚
+    llama_sampler_chain_add(smpl, llama_sampler_init_penalties(
+        SAMPLER_PENALTY_LAST_N,  // penalty_last_n - 考虑更长的历史
+        1.15f,                   // penalty_repeat - 提高重复惩罚系数
+        0.1f,                    // penalty_freq - 添加频率惩罚
+        0.0f                     // penalty_present
+    ));
+
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(params.top_k));
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(params.top_p, 1));
+    llama_sampler_chain_add(smpl, llama_sampler_init_temp(params.temperature));
+    llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    return smpl;
+}
+
+/**
+ * 取得 slot 中可直接使用的采样链：参数与 current 相同时 llama_sampler_reset
+ * （清空惩罚历史，默认种子下重新取随机种子），否则释放后按新参数重建
+ */
+static llama_sampler* reuse_sampler(llama_sampler*& slot, sampler_params& current, const sampler_params& params) {
+    if (slot != nullptr && current == params) {
+        llama_sampler_reset(slot);
+        return slot;
+    }
+    if (slot != nullptr) {
+        llama_sampler_free(slot);
+    }
+    slot = create_sampler_chain(params);
+    current = params;
+    return slot;
+}
+
+// 把提示词末尾的 token 送入采样链，重复惩罚同样作用于提示词中已出现的内容
+static void accept_prompt_tokens(llama_sampler* smpl, const std::vector<llama_token>& tokens) {
+    const size_t n = std::min<size_t>(tokens.size(), SAMPLER_PENALTY_LAST_N);
+    for (size_t i = tokens.size() - n; i < tokens.size(); i++) {
+        llama_sampler_accept(smpl, tokens[i]);
+    }
+}
+
+/**
+ * 与 llama_sampler_sample 相同，但候选数组使用调用方复用的 cur，
+ * 避免每个 token 分配一次 n_vocab 大小的 llama_token_data 数组
+ */
+static llama_token sample_token(llama_sampler* smpl, llama_context* ctx, int32_t idx, std::vector<llama_token_data>& cur) {
+    const float* logits = llama_get_logits_ith(ctx, idx);
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+    if ((int) cur.size() < n_vocab) {
+        cur.resize(n_vocab);
+    }
+    for (int i = 0; i < n_vocab; i++) {
+        cur[i] = llama_token_data{ i, logits[i], 0.0f };
+    }
+
+    llama_token_data_array cur_p = { cur.data(), (size_t) n_vocab, -1, false };
+    llama_sampler_apply(smpl, &cur_p);
+    const llama_token token = cur_p.data[cur_p.selected].id;
+    llama_sampler_accept(smpl, token);
+    return token;
+}
+
+/**
+ * 两遍分词：先以 n_tokens_max = 0 取得精确的 token 数，再写入 out
+ * out 在请求之间复用，容量只增不减
+ * @return token 数，失败返回 -1
+ */
+static int tokenize_prompt(const llama_vocab* vocab, const char* text, std::vector<llama_token>& out) {
+    const int32_t len = (int32_t) strlen(text);
+    // 返回负数表示所需的 token 数，INT32_MIN 表示溢出
+    const int32_t n_required = llama_tokenize(vocab, text, len, nullptr, 0, true, true);
+    if (n_required == INT32_MIN || n_required == 0) {
+        out.clear();
+        return n_required == 0 ? 0 : -1;
+    }
+
+    out.resize(n_required < 0 ? -n_required : n_required);
+    const int32_t n_tokens = llama_tokenize(
+        vocab,
+        text,
+        len,
+        out.data(),
+        (int32_t) out.size(),
+        true,   // add_special - 添加BOS token
+        true    // parse_special - 解析ChatML特殊标记(<|im_start|>, <|im_end|>等)
+    );
+    if (n_tokens != (int32_t) out.size()) {
+        out.clear();
+        return -1;
+    }
+    return n_tokens;
+}
+
+// ============================================
+// 输出过滤（停止序列与隐藏片段）
+// ============================================
+
+/**
+ * 流式输出过滤器：逐段输入 token 文本，只输出用户可见的部分
+ *
+ * 只在 pending（可能是某个模式开头的尾部，长度不超过最长模式）上匹配，
+ * 每个 token 的开销与已生成长度无关。可见输出开头的空白（包括隐藏片段之后的换行）会被去掉。
+ */
+struct output_filter {
+    const output_filter_config& config;
+    std::string pending;      // 尚不能确定是否属于某个模式的尾部
+    int active_span = -1;     // 当前所在的隐藏片段，-1 表示可见区域
+    bool emitted = false;     // 是否已输出过非空白字符
+    size_t n_hidden = 0;      // 被隐藏的字节数
+
+    explicit output_filter(const output_filter_config& c) : config(c) {
+        pending.reserve(256);
+    }
+};
+
+// 把 text 计入可见输出或隐藏部分
+static void filter_emit(output_filter& f, const char* text, size_t len, std::string& visible) {
+    if (f.active_span >= 0) {
+        f.n_hidden += len;
+        return;
+    }
+    if (!f.emitted) {
+        while (len > 0 && (*text == ' ' || *text == '\n' || *text == '\r' || *text == '\t')) {
+            text++;
+            len--;
+        }
+        f.emitted = len > 0;
+    }
+    visible.append(text, len);
+}
+
+// s 的尾部与 pattern 开头重合的最大长度（不含完整匹配）
+static size_t partial_match_length(const std::string& s, const std::string& pattern) {
+    const size_t n_max = std::min(s.size(), pattern.size() - 1);
+    for (size_t n = n_max; n > 0; n--) {
+        if (s.compare(s.size() - n, n, pattern, 0, n) == 0) {
+            return n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * 输入一段 token 文本，可见部分追加到 visible
+ * @return 遇到停止序列时返回 false（停止序列本身及之后的内容不输出）
+ */
+static bool filter_feed(output_filter& f, const char* piece, size_t len, std::string& visible) {
+    f.pending.append(piece, len);
+
+    while (true) {
+        // 当前状态下需要匹配的模式：停止序列，以及隐藏片段的开始标记（可见区域）或当前片段的结束标记
+        size_t best_pos = std::string::npos;
+        size_t best_len = 0;
+        int best_kind = 0;   // 0 停止，1 进入片段，2 离开片段
+        int best_span = -1;
+
+        auto consider = [&](const std::string& pattern, int kind, int span) {
+            if (pattern.empty()) {
+                return;
+            }
+            const size_t pos = f.pending.find(pattern);
+            if (pos != std::string::npos && pos < best_pos) {
+                best_pos = pos;
+                best_len = pattern.size();
+                best_kind = kind;
+                best_span = span;
+            }
+        };
+        for (const std::string& stop : f.config.stops) {
+            consider(stop, 0, -1);
+        }
+        if (f.active_span < 0) {
+            for (size_t i = 0; i < f.config.spans.size(); i++) {
+                consider(f.config.spans[i].open, 1, (int) i);
+            }
+        } else {
+            consider(f.config.spans[f.active_span].close, 2, f.active_span);
+        }
+
+        if (best_pos == std::string::npos) {
+            break;
+        }
+
+        filter_emit(f, f.pending.data(), best_pos, visible);
+        f.pending.erase(0, best_pos + best_len);
+        if (best_kind == 0) {
+            f.pending.clear();
+            return false;
+        }
+        f.active_span = best_kind == 1 ? best_span : -1;
+    }
+
+    // 保留可能是某个模式开头的尾部，其余可以确定输出 / 隐藏
+    size_t hold = 0;
+    for (const std::string& stop : f.config.stops) {
+        hold = std::max(hold, partial_match_length(f.pending, stop));
+    }
+    if (f.active_span < 0) {
+        for (const hidden_span& span : f.config.spans) {
+            hold = std::max(hold, partial_match_length(f.pending, span.open));
+        }
+    } else {
+        hold = std::max(hold, partial_match_length(f.pending, f.config.spans[f.active_span].close));
+    }
+
+    filter_emit(f, f.pending.data(), f.pending.size() - hold, visible);
+    f.pending.erase(0, f.pending.size() - hold);
+    return true;
+}
+
+// 生成结束：可见区域中残留的不完整标记按普通文本输出，未闭合的隐藏片段丢弃
+static void filter_finish(output_filter& f, std::string& visible) {
+    filter_emit(f, f.pending.data(), f.pending.size(), visible);
+    f.pending.clear();
+    if (f.n_hidden > 0) {
+        LOGD("Output filter hid %zu bytes", f.n_hidden);
+    }
+}
+
+// 复用过滤器处理新的一段输出
+static void filter_reset(output_filter& f) {
+    f.pending.clear();
+    f.active_span = -1;
+    f.emitted = false;
+    f.n_hidden = 0;
+}
+
+// ============================================
+// 多会话并行序列（后台任务与主对话共享权重和 KV 缓存）
+// ============================================
+
+// runSession 拿不到上下文锁时等待其他线程推进的最长时间
+#define SESSION_POLL_MS 20
+
+enum session_state {
+    SESSION_FREE = 0,   // 槽位未分配
+    SESSION_IDLE,       // 已分配，等待提交
+    SESSION_PREFILL,    // 正在预填充提示词
+    SESSION_GENERATE,   // 正在逐 token 生成
+    SESSION_DONE,       // 已结束，结果等待 runSession 取走
+};
+
+/**
+ * 后台会话：占用共享上下文中的一个序列，每个调度步与主请求的解码合批推进
+ * 除 state / release_requested 外的字段只在持有 ctx_mutex 时访问
+ */
+struct inference_session {
+    llama_seq_id seq_id;
+    std::atomic<int> state{SESSION_FREE};
+    std::atomic<bool> release_requested{false};
+
+    llama_sampler* smpl = nullptr;              // 跨提交复用，参数不变时只 reset
+    sampler_params sampler_config;
+    std::vector<llama_token> prompt;
+    int n_past = 0;                             // 序列中已解码的 token 数
+    int max_tokens = 0;
+    int n_generated = 0;
+    llama_token next_token = LLAMA_TOKEN_NULL;  // 已采样、待解码的 token
+    std::vector<float> lora;                    // 适配器缩放，提交时未单独设置则沿用主对话的
+    bool lora_custom = false;                   // 是否通过 setLoraAdapter 单独设置过
+    int n_batched = 0;                          // 本步放入 batch 的 token 数
+    int32_t i_logits = -1;                      // 本步需要采样的 batch 下标，-1 表示不采样
+
+    output_filter filter;
+    std::string text;                           // 过滤后的可见输出
+
+    inference_session(llama_seq_id seq, const output_filter_config& config) : seq_id(seq), filter(config) {}
+};
+
+static void batch_push(llama_batch& batch, llama_token token, llama_pos pos, llama_seq_id seq_id, bool logits) {
+    const int i = batch.n_tokens++;
+    batch.token[i] = token;
+    batch.pos[i] = pos;
+    batch.n_seq_id[i] = 1;
+    batch.seq_id[i][0] = seq_id;
+    batch.logits[i] = logits;
+}
+
+// 分配 n_sessions 个会话槽位（序列 1..n_sessions）和合批用的 batch
+static void create_sessions(llama_context_wrapper* wrapper, int n_sessions, int session_ctx) {
+    wrapper->session_ctx = session_ctx;
+    for (int i = 0; i < n_sessions; i++) {
+        wrapper->sessions.push_back(new inference_session(i + 1, wrapper->filter_config));
+    }
+    wrapper->session_batch = llama_batch_init(std::max(1, wrapper->n_batch), 0, 1);
+}
+
+static void free_sessions(llama_context_wrapper* wrapper) {
+    if (wrapper->sessions.empty()) {
+        return;
+    }
+    for (inference_session* s : wrapper->sessions) {
+        if (s->smpl != nullptr) {
+            llama_sampler_free(s->smpl);
+        }
+        delete s;
+    }
+    wrapper->sessions.clear();
+    llama_batch_free(wrapper->session_batch);
+    wrapper->session_batch = {};
+}
+
+// 根据 JNI 传入的会话 ID（即 seq_id）查找槽位
+static inference_session* find_session(llama_context_wrapper* wrapper, jint session_id) {
+    if (session_id < 1 || session_id > (jint) wrapper->sessions.size()) {
+        return nullptr;
+    }
+    return wrapper->sessions[session_id - 1];
+}
+
+static bool sessions_pending(const llama_context_wrapper* wrapper) {
+    for (const inference_session* s : wrapper->sessions) {
+        const int state = s->state.load();
+        if ((state == SESSION_PREFILL || state == SESSION_GENERATE) && !s->release_requested.load()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void notify_sessions(llama_context_wrapper* wrapper) {
+    {
+        std::lock_guard<std::mutex> lock(wrapper->session_mutex);
+    }
+    wrapper->session_cv.notify_all();
+}
+
+// 结束会话：冲刷过滤器尾部并清空其序列，结果留给 runSession
+static void finish_session(llama_context_wrapper* wrapper, inference_session* s) {
+    filter_finish(s->filter, s->text);
+    llama_memory_seq_rm(llama_get_memory(wrapper->ctx), s->seq_id, -1, -1);
+    s->n_past = 0;
+    LOGD("Background session %d finished: %d tokens", s->seq_id, s->n_generated);
+    s->state.store(SESSION_DONE);
+    notify_sessions(wrapper);
+}
+
+// 回收已释放的会话槽位（调用方持有 ctx_mutex）
+static void reap_sessions(llama_context_wrapper* wrapper) {
+    for (inference_session* s : wrapper->sessions) {
+        if (!s->release_requested.load()) {
+            continue;
+        }
+        if (s->smpl != nullptr) {
+            llama_sampler_free(s->smpl);
+            s->smpl = nullptr;
+        }
+        if (wrapper->ctx != nullptr) {
+            llama_memory_seq_rm(llama_get_memory(wrapper->ctx), s->seq_id, -1, -1);
+        }
+        s->prompt.clear();
+        s->text.clear();
+        s->n_past = 0;
+        s->lora.clear();
+        s->lora_custom = false;
+        s->release_requested.store(false);
+        s->state.store(SESSION_FREE);
+    }
+}
+
+/**
+ * 把各后台会话的下一步放进 batch 的剩余预算（n_batch 减去已有 token）：
+ * 生成中的会话各 1 个 token，预填充中的会话分块填满剩下的位置。先排生成，长提示词不会拖慢已在生成的会话
+ * 只调度适配器缩放与上下文当前组合相同的会话，其余的等到组合切换后再推进
+ */
+static void schedule_sessions(llama_context_wrapper* wrapper, llama_batch& batch, int budget) {
+    for (inference_session* s : wrapper->sessions) {
+        if (budget <= 0) {
+            break;
+        }
+        if (s->state.load() != SESSION_GENERATE || s->release_requested.load() ||
+            !lora_equal(s->lora, wrapper->lora_applied)) {
+            continue;
+        }
+        batch_push(batch, s->next_token, s->n_past, s->seq_id, true);
+        s->n_batched = 1;
+        s->i_logits = batch.n_tokens - 1;
+        budget--;
+    }
+
+    for (inference_session* s : wrapper->sessions) {
+        if (budget <= 0) {
+            break;
+        }
+        if (s->state.load() != SESSION_PREFILL || s->release_requested.load() ||
+            !lora_equal(s->lora, wrapper->lora_applied)) {
+            continue;
+        }
+        const int n_prompt = (int) s->prompt.size();
+        const int n_eval = std::min(budget, n_prompt - s->n_past);
+        for (int i = 0; i < n_eval; i++) {
+            const int pos = s->n_past + i;
+            batch_push(batch, s->prompt[pos], pos, s->seq_id, pos == n_prompt - 1);
+        }
+        s->n_batched = n_eval;
+        s->i_logits = (s->n_past + n_eval == n_prompt) ? batch.n_tokens - 1 : -1;
+        budget -= n_eval;
+    }
+}
+
+// 采样会话的下一个 token，遇到结束符、停止序列、maxTokens 或会话上下文用尽时结束
+static void sample_session(llama_context_wrapper* wrapper, inference_session* s) {
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    const llama_token token = sample_token(s->smpl, wrapper->ctx, s->i_logits, wrapper->candidates);
+    if (llama_vocab_is_eog(vocab, token)) {
+        finish_session(wrapper, s);
+        return;
+    }
+
+    s->n_generated++;
+    char piece[256];
+    const int n_piece = llama_token_to_piece(vocab, token, piece, sizeof(piece), 0, false);
+    if (n_piece > 0 && !filter_feed(s->filter, piece, n_piece, s->text)) {
+        finish_session(wrapper, s);
+        return;
+    }
+    if (s->n_generated >= s->max_tokens || s->n_past >= wrapper->session_ctx) {
+        finish_session(wrapper, s);
+        return;
+    }
+    s->next_token = token;
+}
+
+/**
+ * 处理 batch 解码结果：成功时推进各会话并采样，失败时回滚本步写入的 KV
+ * @param fail 失败时直接结束参与本步的会话（单独解码也失败，不再重试）
+ */
+static void complete_sessions(llama_context_wrapper* wrapper, bool ok, bool fail) {
+    for (inference_session* s : wrapper->sessions) {
+        if (s->n_batched == 0) {
+            continue;
+        }
+        if (ok) {
+            s->n_past += s->n_batched;
+            if (s->state.load() == SESSION_PREFILL && s->n_past == (int) s->prompt.size()) {
+                s->state.store(SESSION_GENERATE);
+            }
+            if (s->i_logits >= 0) {
+                sample_session(wrapper, s);
+            }
+        } else {
+            llama_memory_seq_rm(llama_get_memory(wrapper->ctx), s->seq_id, s->n_past, -1);
+            if (fail) {
+                LOGE("Background session %d failed to decode", s->seq_id);
+                finish_session(wrapper, s);
+            }
+        }
+        s->n_batched = 0;
+        s->i_logits = -1;
+    }
+}
+
+/**
+ * 没有主请求时推进后台会话一步（调用方持有 ctx_mutex）
+ * @return 是否有会话参与了本步
+ */
+static bool step_sessions(llama_context_wrapper* wrapper) {
+    reap_sessions(wrapper);
+
+    // 优先沿用上下文当前的适配器组合，没有这样的会话时切换到第一个待推进会话的组合
+    const inference_session* next = nullptr;
+    for (const inference_session* s : wrapper->sessions) {
+        const int state = s->state.load();
+        if ((state != SESSION_PREFILL && state != SESSION_GENERATE) || s->release_requested.load()) {
+            continue;
+        }
+        if (lora_equal(s->lora, wrapper->lora_applied)) {
+            next = s;
+            break;
+        }
+        if (next == nullptr) {
+            next = s;
+        }
+    }
+    if (next == nullptr) {
+        return false;
+    }
+    apply_lora(wrapper, next->lora);
+
+    llama_batch& batch = wrapper->session_batch;
+    batch.n_tokens = 0;
+    schedule_sessions(wrapper, batch, wrapper->n_batch);
+    if (batch.n_tokens == 0) {
+        return false;
+    }
+
+    const int ret = llama_decode(wrapper->ctx, batch);
+    if (ret != 0) {
+        LOGE("Background session decode failed with code %d", ret);
+    }
+    complete_sessions(wrapper, ret == 0, true);
+    return true;
+}
+
+// ============================================
+// 解码（带取消检查）
+// ============================================
+
+enum decode_status {
+    DECODE_OK = 0,
+    DECODE_CANCELLED,   // 已请求取消，或 llama_decode 被 abort 回调中断
+    DECODE_FAILED,
+};
+
+/**
+ * 解码一段 token 并接到 cached 之后（cached 记录该上下文序列 0 中已有的 token）。
+ * 被中断的 llama_decode 可能已在 KV 中留下部分 ubatch，此时裁剪回 cached 的位置。
+ */
+static decode_status decode_into(
+    llama_context* ctx,
+    std::vector<llama_token>& cached,
+    const std::atomic<bool>& cancel_requested,
+    llama_token* tokens,
+    int n_tokens) {
+
+    if (cancel_requested.load()) {
+        return DECODE_CANCELLED;
+    }
+
+    int ret = llama_decode(ctx, llama_batch_get_one(tokens, n_tokens));
+    if (ret == 0) {
+        cached.insert(cached.end(), tokens, tokens + n_tokens);
+        return DECODE_OK;
+    }
+
+    if (ret == 2 || cancel_requested.load()) {
+        llama_memory_seq_rm(llama_get_memory(ctx), 0, (llama_pos) cached.size(), -1);
+        return DECODE_CANCELLED;
+    }
+
+    LOGE("llama_decode failed with code %d", ret);
+    return DECODE_FAILED;
+}
+
+/**
+ * 后台会话的下一步与主对话的 token 合成一个 batch 解码。主对话的 token 放在末尾，
+ * 只有最后一个输出 logits，采样时的 -1 下标仍指向主对话
+ * 合批失败时回滚后台会话的本步，再单独解码主对话的 token
+ */
+static decode_status decode_with_sessions(llama_context_wrapper* wrapper, llama_token* tokens, int n_tokens) {
+    if (wrapper->cancel_requested.load()) {
+        return DECODE_CANCELLED;
+    }
+
+    reap_sessions(wrapper);
+
+    std::vector<llama_token>& cached = wrapper->cached_tokens;
+    llama_batch& batch = wrapper->session_batch;
+    batch.n_tokens = 0;
+    schedule_sessions(wrapper, batch, wrapper->n_batch - n_tokens);
+    for (int i = 0; i < n_tokens; i++) {
+        batch_push(batch, tokens[i], (llama_pos) (cached.size() + i), 0, i == n_tokens - 1);
+    }
+
+    const int ret = llama_decode(wrapper->ctx, batch);
+    if (ret == 0) {
+        cached.insert(cached.end(), tokens, tokens + n_tokens);
+        complete_sessions(wrapper, true, false);
+        return DECODE_OK;
+    }
+
+    llama_memory_seq_rm(llama_get_memory(wrapper->ctx), 0, (llama_pos) cached.size(), -1);
+    complete_sessions(wrapper, false, false);
+    if (ret == 2 || wrapper->cancel_requested.load()) {
+        return DECODE_CANCELLED;
+    }
+
+    LOGW("Batched decode with background sessions failed with code %d, retrying alone", ret);
+    return decode_into(wrapper->ctx, cached, wrapper->cancel_requested, tokens, n_tokens);
+}
+
+static decode_status decode_tokens(llama_context_wrapper* wrapper, llama_token* tokens, int n_tokens) {
+    if (!ensure_context_space(wrapper, n_tokens)) {
+        return DECODE_FAILED;
+    }
+    if (n_tokens < wrapper->n_batch && sessions_pending(wrapper)) {
+        return decode_with_sessions(wrapper, tokens, n_tokens);
+    }
+    return decode_into(wrapper->ctx, wrapper->cached_tokens, wrapper->cancel_requested, tokens, n_tokens);
+}
+
+// ============================================
+// 分批预填充
+// ============================================
+
+// 预填充进度回调：(已处理 token 数, 提示词总 token 数)
+typedef std::function<void(int, int)> prefill_progress_fn;
+
+/**
+ * 从 n_past 开始按 n_batch 分批解码提示词，避免超长提示词（如注入 RAG 上下文后）
+ * 超出上下文的批大小或造成峰值内存过高。每批之间检查取消请求。
+ */
+static decode_status decode_prompt_chunked(
+    llama_context_wrapper* wrapper,
+    std::vector<llama_token>& tokens,
+    int n_past,
+    const prefill_progress_fn& on_progress) {
+
+    const int n_tokens = (int) tokens.size();
+    const int n_batch = std::max(1, wrapper->n_batch);
+    wrapper->stats.n_prefill_tokens = std::max(0, n_tokens - n_past);
+
+    for (int i = n_past; i < n_tokens; i += n_batch) {
+        const int n_eval = std::min(n_batch, n_tokens - i);
+
+        decode_status status;
+        {
+            phase_timer timer(&wrapper->stats.t_prefill_us, "llama:prefill");
+            status = decode_tokens(wrapper, tokens.data() + i, n_eval);
+        }
+        if (status != DECODE_OK) {
+            if (status == DECODE_FAILED) {
+                LOGE("Failed to decode prompt batch at %d (%d tokens)", i, n_eval);
+            }
+            return status;
+        }
+
+        if (on_progress) {
+            phase_timer timer(&wrapper->stats.t_callback_us, "llama:callback");
+            on_progress(i + n_eval, n_tokens);
+        }
+    }
+    return DECODE_OK;
+}
+
+// ============================================
+// JNI 字符串
+// ============================================
+
+/**
+ * 用标准 UTF-8 字节构造 Java String
+ * NewStringUTF 要求 modified UTF-8，4 字节字符（如 emoji）和被截断的多字节序列会被破坏
+ */
+static jstring new_string_utf8(JNIEnv* env, const std::string& text) {
+    jbyteArray bytes = env->NewByteArray((jsize) text.size());
+    if (bytes == nullptr) {
+        return nullptr;
+    }
+    env->SetByteArrayRegion(bytes, 0, (jsize) text.size(), reinterpret_cast<const jbyte*>(text.data()));
+
+    jclass string_class = env->FindClass("java/lang/String");
+    jmethodID ctor = env->GetMethodID(string_class, "<init>", "([BLjava/lang/String;)V");
+    jstring charset = env->NewStringUTF("UTF-8");
+    jstring result = (jstring) env->NewObject(string_class, ctor, bytes, charset);
+    env->DeleteLocalRef(charset);
+    env->DeleteLocalRef(bytes);
+    env->DeleteLocalRef(string_class);
+    return result;
+}
+
+// ============================================
+// 流式输出缓冲（与 Kotlin 共享的 direct ByteBuffer 环形缓冲区）
+// ============================================
+
+// 默认每累计该数量的 token 交付一次
+#define STREAM_DEFAULT_FLUSH_TOKENS 4
+// 默认距上次交付超过该时长（毫秒）时交付，避免慢速解码时界面长时间不更新
+#define STREAM_DEFAULT_FLUSH_INTERVAL_MS 50
+
+/**
+ * 返回 text 中以完整 UTF-8 码点结束的前缀长度，末尾不完整的多字节序列留到下一次交付
+ * （一个汉字可能被拆到两个 BPE token 中）
+ */
+static size_t utf8_complete_length(const char* text, size_t len) {
+    for (size_t back = 1; back <= 4 && back <= len; back++) {
+        const unsigned char c = (unsigned char) text[len - back];
+        if ((c & 0xC0) == 0x80) {
+            continue;  // 续字节，继续向前找起始字节
+        }
+        const size_t need = c < 0x80 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+        return back >= need ? len : len - back;
+    }
+    return len;  // 非法序列原样交付，由 Kotlin 解码时替换
+}
+
+/**
+ * 原生层写、Kotlin 读的环形缓冲区
+ *
+ * 每次交付把完整 UTF-8 码点复制到 [head, head + n)（超过容量时回绕到开头），
+ * 再同步回调 onText(head, n)；Kotlin 在回调内读完，之后该区域即可被覆盖
+ */
+struct stream_ring {
+    JNIEnv* env;
+    jobject callback;
+    jmethodID on_text;
+    uint8_t* data;
+    size_t capacity;
+    size_t head = 0;             // 下一次写入位置
+    std::string pending;         // 尚未交付的可见文本
+    int pending_tokens = 0;      // 自上次交付以来的 token 数
+    int flush_tokens;
+    int64_t flush_interval_us;
+    int64_t last_flush_us;
+    int64_t* t_callback_us;
+
+    stream_ring(JNIEnv* e, jobject cb, jmethodID method, uint8_t* buf, size_t cap,
+                int n_tokens, int interval_ms, int64_t* callback_timer)
+        : env(e), callback(cb), on_text(method), data(buf), capacity(cap),
+          flush_tokens(n_tokens > 0 ? n_tokens : STREAM_DEFAULT_FLUSH_TOKENS),
+          flush_interval_us((interval_ms >= 0 ? interval_ms : STREAM_DEFAULT_FLUSH_INTERVAL_MS) * 1000LL),
+          last_flush_us(ggml_time_us()), t_callback_us(callback_timer) {
+        pending.reserve(1024);
+    }
+};
+
+// 交付 pending 中的完整码点；final 为 true 时连同不完整的尾部一起交付
+static void stream_ring_flush(stream_ring& ring, bool final) {
+    size_t n_ready = final ? ring.pending.size() : utf8_complete_length(ring.pending.data(), ring.pending.size());
+    size_t offset = 0;
+
+    while (n_ready > 0) {
+        size_t n = std::min(n_ready, ring.capacity);
+        if (n < n_ready) {
+            n = utf8_complete_length(ring.pending.data() + offset, n);
+            if (n == 0) {
+                n = std::min(n_ready, ring.capacity);
+            }
+        }
+
+        const size_t first = std::min(n, ring.capacity - ring.head);
+        memcpy(ring.data + ring.head, ring.pending.data() + offset, first);
+        memcpy(ring.data, ring.pending.data() + offset + first, n - first);
+
+        {
+            phase_timer timer(ring.t_callback_us, "llama:callback");
+            ring.env->CallVoidMethod(ring.callback, ring.on_text, (jint) ring.head, (jint) n);
+        }
+        ring.head = (ring.head + n) % ring.capacity;
+        offset += n;
+        n_ready -= n;
+    }
+
+    ring.pending.erase(0, offset);
+    ring.pending_tokens = 0;
+    ring.last_flush_us = ggml_time_us();
+}
+
+// 每个 token 之后调用：累计到 N 个 token、超过 M 毫秒或接近缓冲区容量时交付
+static void stream_ring_on_token(stream_ring& ring) {
+    ring.pending_tokens++;
+    if (ring.pending.empty()) {
+        return;
+    }
+    if (ring.pending_tokens >= ring.flush_tokens ||
+        ggml_time_us() - ring.last_flush_us >= ring.flush_interval_us ||
+        ring.pending.size() >= ring.capacity / 2) {
+        stream_ring_flush(ring, false);
+    }
+}
+
+// ============================================
+// 生成循环（普通 / 投机解码）
+// ============================================
+
+// 每得到一个待输出的 token 调用一次，返回 false 时停止生成
+typedef std::function<bool(llama_token)> token_sink_fn;
+
+/**
+ * 让草稿上下文的 KV 与 target 对齐：复用公共前缀，解码其余部分
+ * 最后一个 token 始终重新解码，以便草稿上下文得到采样所需的 logits
+ */
+static decode_status align_draft_context(llama_context_wrapper* wrapper, std::vector<llama_token>& target) {
+    draft_model_wrapper* draft = wrapper->draft;
+
+    // 与主上下文相同的前缀复用逻辑，最后一个 token 始终重新解码以得到 logits
+    size_t n_prefix = common_prefix_length(draft->cached_tokens, target);
+    if (n_prefix >= target.size()) {
+        n_prefix = target.size() - 1;
+    }
+    llama_memory_t mem = llama_get_memory(draft->ctx);
+    if (n_prefix == 0 || !llama_memory_seq_rm(mem, 0, (llama_pos) n_prefix, -1)) {
+        llama_memory_clear(mem, true);
+        n_prefix = 0;
+    }
+    draft->cached_tokens.resize(n_prefix);
+
+    const int n_batch = std::max(1, (int) llama_n_batch(draft->ctx));
+    for (size_t i = n_prefix; i < target.size(); i += n_batch) {
+        const int n_eval = (int) std::min<size_t>(n_batch, target.size() - i);
+        decode_status status = decode_into(draft->ctx, draft->cached_tokens, wrapper->cancel_requested,
+                                           target.data() + i, n_eval);
+        if (status != DECODE_OK) {
+            return status;
+        }
+    }
+    return DECODE_OK;
+}
+
+/**
+ * 让草稿上下文与主上下文对齐（cached_tokens + id_last），再贪心起草最多 n_max 个 token
+ */
+static decode_status draft_next_tokens(
+    llama_context_wrapper* wrapper,
+    llama_token id_last,
+    int n_max,
+    std::vector<llama_token>& drafted) {
+
+    draft_model_wrapper* draft = wrapper->draft;
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+
+    std::vector<llama_token>& target = draft->target_tokens;
+    target.assign(wrapper->cached_tokens.begin(), wrapper->cached_tokens.end());
+    target.push_back(id_last);
+
+    decode_status status = align_draft_context(wrapper, target);
+    if (status != DECODE_OK) {
+        return status;
+    }
+
+    for (int k = 0; k < n_max; k++) {
+        llama_token token = sample_token(draft->smpl, draft->ctx, -1, wrapper->candidates);
+        drafted.push_back(token);
+
+        // 最后一个草稿 token 无需在草稿模型上解码
+        if (llama_vocab_is_eog(vocab, token) || k + 1 == n_max) {
+            break;
+        }
+
+        status = decode_into(draft->ctx, draft->cached_tokens, wrapper->cancel_requested, &token, 1);
+        if (status != DECODE_OK) {
+            return status;
+        }
+    }
+    return DECODE_OK;
+}
+
+/**
+ * 投机解码：草稿模型每步起草 N 个 token，主模型在一次批量 llama_decode 中验证。
+ *
+ * 主模型在每个位置按自己的采样器采样，与草稿一致则接受并继续，
+ * 第一个不一致的位置直接采用主模型的采样结果，因此输出分布与普通解码相同。
+ */
+static decode_status generate_tokens_speculative(
+    llama_context_wrapper* wrapper,
+    llama_sampler* smpl,
+    int max_tokens,
+    const token_sink_fn& on_token,
+    int* n_generated) {
+
+    draft_model_wrapper* draft = wrapper->draft;
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    llama_memory_t mem = llama_get_memory(wrapper->ctx);
+    const int n_ctx = main_context_size(wrapper);
+
+    const int n_draft = draft->n_draft;
+
+    llama_batch batch = llama_batch_init(n_draft + 1, 0, 1);
+    std::vector<llama_token> drafted;
+    drafted.reserve(n_draft);
+
+    generation_stats& stats = wrapper->stats;
+    decode_status status = DECODE_OK;
+    llama_token id_last;
+    {
+        phase_timer timer(&stats.t_sample_us, "llama:sample");
+        id_last = sample_token(smpl, wrapper->ctx, -1, wrapper->candidates);
+    }
+
+    while (true) {
+        max_tokens = governor_max_tokens(wrapper, max_tokens);
+
+        if (llama_vocab_is_eog(vocab, id_last)) {
+            LOGD("End of generation token received");
+            break;
+        }
+        if (!on_token(id_last)) {
+            break;
+        }
+        if (++(*n_generated) >= max_tokens) {
+            break;
+        }
+        const int64_t t_step_start = ggml_time_us();
+
+        // 窗口已满时先滑动，保证本步至少能验证 id_last（剩余空间不足时起草长度随之缩短）
+        if (!ensure_context_space(wrapper, 1)) {
+            status = DECODE_FAILED;
+            break;
+        }
+
+        // 1. 起草（不超过剩余生成长度和上下文容量）
+        const int n_past = (int) wrapper->cached_tokens.size();
+        const int n_draft_max = std::min({n_draft, max_tokens - *n_generated, n_ctx - n_past - 1});
+
+        drafted.clear();
+        if (n_draft_max > 0) {
+            {
+                phase_timer timer(&stats.t_draft_us, "llama:draft");
+                status = draft_next_tokens(wrapper, id_last, n_draft_max, drafted);
+            }
+            if (status == DECODE_CANCELLED) {
+                break;
+            }
+            if (status == DECODE_FAILED) {
+                // 草稿失败不影响主模型，本步退化为普通解码
+                LOGW("Draft decode failed, falling back to single-token step");
+                llama_memory_clear(llama_get_memory(draft->ctx), true);
+                draft->cached_tokens.clear();
+                drafted.clear();
+                status = DECODE_OK;
+            }
+        }
+
+        // 2. 主模型一次性验证 [id_last, d1 .. dN]
+        if (wrapper->cancel_requested.load()) {
+            status = DECODE_CANCELLED;
+            break;
+        }
+
+        batch.n_tokens = 0;
+        for (int i = 0; i <= (int) drafted.size(); i++) {
+            batch.token[i] = (i == 0) ? id_last : drafted[i - 1];
+            batch.pos[i] = n_past + i;
+            batch.n_seq_id[i] = 1;
+            batch.seq_id[i][0] = 0;
+            batch.logits[i] = true;
+            batch.n_tokens++;
+        }
+
+        int ret;
+        {
+            phase_timer timer(&stats.t_decode_us, "llama:decode");
+            ret = llama_decode(wrapper->ctx, batch);
+        }
+        if (ret != 0) {
+            llama_memory_seq_rm(mem, 0, n_past, -1);
+            status = (ret == 2 || wrapper->cancel_requested.load()) ? DECODE_CANCELLED : DECODE_FAILED;
+            break;
+        }
+        wrapper->cached_tokens.push_back(id_last);
+
+        // 3. 逐位置采样，接受与草稿一致的前缀
+        int n_accepted = 0;
+        bool stop = false;
+        for (int i = 0; i <= (int) drafted.size(); i++) {
+            llama_token token;
+            {
+                phase_timer timer(&stats.t_sample_us, "llama:sample");
+                token = sample_token(smpl, wrapper->ctx, i, wrapper->candidates);
+            }
+
+            if (i < (int) drafted.size() && token == drafted[i]) {
+                n_accepted++;
+                if (llama_vocab_is_eog(vocab, token)) {
+                    LOGD("End of generation token received");
+                    stop = true;
+                    break;
+                }
+                if (!on_token(token) || ++(*n_generated) >= max_tokens) {
+                    stop = true;
+                    break;
+                }
+                // 被接受的草稿 token 已在主模型 KV 中
+                wrapper->cached_tokens.push_back(token);
+                continue;
+            }
+
+            id_last = token;
+            break;
+        }
+
+        // 移除主模型 KV 中未被接受的草稿 token
+        llama_memory_seq_rm(mem, 0, (llama_pos) wrapper->cached_tokens.size(), -1);
+
+        draft->n_steps++;
+        draft->n_drafted += (int64_t) drafted.size();
+        draft->n_accepted += n_accepted;
+
+        // 调速器按每个产出 token 的平均耗时判断是否降频
+        governor_on_token(wrapper, (ggml_time_us() - t_step_start) / (n_accepted + 1));
+
+        if (stop) {
+            break;
+        }
+    }
+
+    llama_batch_free(batch);
+
+    if (draft->n_drafted > 0) {
+        LOGD("Speculative decoding: accepted %lld / %lld drafted tokens in %lld steps",
+             (long long) draft->n_accepted, (long long) draft->n_drafted, (long long) draft->n_steps);
+    }
+    return status;
+}
+
+/**
+ * 只用草稿模型生成（调速器 DRAFT_ONLY 模式）
+ *
+ * 草稿上下文先与主上下文中的提示词对齐，之后每步只在草稿模型上解码；
+ * 主模型 KV 中只保留提示词，下一轮请求会按前缀复用重新预填充这段回答
+ */
+static decode_status generate_tokens_draft_only(
+    llama_context_wrapper* wrapper,
+    llama_sampler* smpl,
+    int max_tokens,
+    const token_sink_fn& on_token,
+    int* n_generated) {
+
+    draft_model_wrapper* draft = wrapper->draft;
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    generation_stats& stats = wrapper->stats;
+
+    decode_status status;
+    {
+        phase_timer timer(&stats.t_draft_us, "llama:draft");
+        status = align_draft_context(wrapper, wrapper->cached_tokens);
+    }
+
+    while (status == DECODE_OK && *n_generated < governor_max_tokens(wrapper, max_tokens)) {
+        llama_token token;
+        {
+            phase_timer timer(&stats.t_sample_us, "llama:sample");
+            token = sample_token(smpl, draft->ctx, -1, wrapper->candidates);
+        }
+        if (llama_vocab_is_eog(vocab, token)) {
+            LOGD("End of generation token received");
+            break;
+        }
+        if (!on_token(token)) {
+            break;
+        }
+
+        if (draft->cached_tokens.size() + 1 > llama_n_ctx(draft->ctx)) {
+            const int n_keep = context_keep_tokens(wrapper, draft->cached_tokens);
+            const int n_discard = (int) ((draft->cached_tokens.size() - n_keep) * CONTEXT_SHIFT_DISCARD_RATIO);
+            if (!wrapper->context_shift || !shift_context(draft->ctx, draft->cached_tokens, n_keep, n_discard)) {
+                status = DECODE_FAILED;
+                break;
+            }
+            stats.n_context_shifts++;
+            stats.n_discarded_tokens += n_discard;
+        }
+
+        const int64_t t_decode_start = ggml_time_us();
+        {
+            phase_timer timer(&stats.t_decode_us, "llama:decode");
+            status = decode_into(draft->ctx, draft->cached_tokens, wrapper->cancel_requested, &token, 1);
+        }
+        if (status != DECODE_OK) {
+            break;
+        }
+        governor_on_token(wrapper, ggml_time_us() - t_decode_start);
+        (*n_generated)++;
+    }
+
+    if (status == DECODE_FAILED) {
+        // 草稿上下文失败不影响主模型 KV
+        llama_memory_clear(llama_get_memory(draft->ctx), true);
+        draft->cached_tokens.clear();
+    }
+    return status;
+}
+
+/**
+ * 提示词预填充完成后的生成循环。已加载草稿模型且 n_draft > 0 时使用投机解码。
+ */
+static decode_status generate_tokens(
+    llama_context_wrapper* wrapper,
+    llama_sampler* smpl,
+    int max_tokens,
+    const token_sink_fn& on_token,
+    int* n_generated) {
+
+    *n_generated = 0;
+
+    // 第一个输出 token 交给调用方时记录首 token 延迟
+    generation_stats& stats = wrapper->stats;
+    const token_sink_fn emit = [&stats, &on_token](llama_token token) -> bool {
+        if (stats.t_first_token_us < 0) {
+            stats.t_first_token_us = ggml_time_us() - stats.t_start_us;
+        }
+        return on_token(token);
+    };
+
+    governor_begin_request(wrapper);
+    if (wrapper->governor.mode == GOVERNOR_DRAFT_ONLY && wrapper->draft != nullptr) {
+        return generate_tokens_draft_only(wrapper, smpl, max_tokens, emit, n_generated);
+    }
+    if (wrapper->draft != nullptr && wrapper->draft->n_draft > 0) {
+        return generate_tokens_speculative(wrapper, smpl, max_tokens, emit, n_generated);
+    }
+
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    decode_status status = DECODE_OK;
+
+    while (*n_generated < governor_max_tokens(wrapper, max_tokens)) {
+        // 采样下一个token
+        llama_token new_token;
+        {
+            phase_timer timer(&stats.t_sample_us, "llama:sample");
+            new_token = sample_token(smpl, wrapper->ctx, -1, wrapper->candidates);
+        }
+
+        // 检查是否是结束符(EOS/EOG/EOT)
+        if (llama_vocab_is_eog(vocab, new_token)) {
+            LOGD("End of generation token received");
+            break;
+        }
+
+        if (!emit(new_token)) {
+            break;
+        }
+
+        // 准备下一次解码（同时检查取消请求）
+        const int64_t t_decode_start = ggml_time_us();
+        {
+            phase_timer timer(&stats.t_decode_us, "llama:decode");
+            status = decode_tokens(wrapper, &new_token, 1);
+        }
+        if (status != DECODE_OK) {
+            break;
+        }
+        governor_on_token(wrapper, ggml_time_us() - t_decode_start);
+
+        (*n_generated)++;
+    }
+    return status;
+}
+
+// ============================================
+// 草稿模型辅助函数
+// ============================================
+
+// 草稿与主模型词表大小允许的最大差异（与 llama.cpp speculative 示例一致）
+#define DRAFT_VOCAB_MAX_SIZE_DIFFERENCE 128
+// 从该 token ID 开始逐个比较文本，跳过开头的特殊标记
+#define DRAFT_VOCAB_CHECK_START_TOKEN_ID 5
+
+// 检查草稿模型能否与主模型共享 token 序列
+static bool is_draft_vocab_compatible(const llama_model* target, const llama_model* draft) {
+    const llama_vocab* vocab_tgt = llama_model_get_vocab(target);
+    const llama_vocab* vocab_dft = llama_model_get_vocab(draft);
+
+    if (llama_vocab_bos(vocab_tgt) != llama_vocab_bos(vocab_dft) ||
+        llama_vocab_eos(vocab_tgt) != llama_vocab_eos(vocab_dft)) {
+        LOGW("Draft vocab special tokens differ from target");
+        return false;
+    }
+
+    const int n_vocab_tgt = llama_vocab_n_tokens(vocab_tgt);
+    const int n_vocab_dft = llama_vocab_n_tokens(vocab_dft);
+    if (std::abs(n_vocab_tgt - n_vocab_dft) > DRAFT_VOCAB_MAX_SIZE_DIFFERENCE) {
+        LOGW("Draft vocab size differs too much: target %d, draft %d", n_vocab_tgt, n_vocab_dft);
+        return false;
+    }
+
+    for (int i = DRAFT_VOCAB_CHECK_START_TOKEN_ID; i < std::min(n_vocab_tgt, n_vocab_dft); i++) {
+        const char* text_tgt = llama_vocab_get_text(vocab_tgt, i);
+        const char* text_dft = llama_vocab_get_text(vocab_dft, i);
+        if (std::strcmp(text_tgt, text_dft) != 0) {
+            LOGW("Draft vocab token %d differs from target", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void free_draft_model(llama_context_wrapper* wrapper) {
+    draft_model_wrapper* draft = wrapper->draft;
+    if (draft == nullptr) {
+        return;
+    }
+
+    if (draft->smpl) {
+        llama_sampler_free(draft->smpl);
+    }
+    if (draft->ctx) {
+        llama_free(draft->ctx);
+    }
+    if (draft->model) {
+        llama_free_model(draft->model);
+    }
+
+    delete draft;
+    wrapper->draft = nullptr;
+}
+
+// ============================================
+// GPU 能力检测
+// ============================================
+
+// 可用于 llama_model_params.n_gpu_layers 的 GPU 显存预算占可用显存的比例，其余留给 KV 缓存和计算缓冲区
+#define GPU_MEMORY_BUDGET_FRACTION 0.8
+// n_gpu_layers 取该值表示全部层（含输出层）都放到 GPU
+#define GPU_LAYERS_ALL 999
+
+struct gpu_device_info {
+    std::string name;         // ggml 设备名（如 Vulkan0）
+    std::string description;  // 设备描述（GPU 型号 / 驱动报告的名称）
+    size_t memory_free = 0;
+    size_t memory_total = 0;
+};
+
+// 通过 ggml 后端注册表枚举 GPU 设备（Vulkan 后端未编译或驱动不可用时为空）
+static std::vector<gpu_device_info> enumerate_gpu_devices() {
+    std::vector<gpu_device_info> devices;
+    const size_t n_devices = ggml_backend_dev_count();
+    for (size_t i = 0; i < n_devices; i++) {
+        ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+        const enum ggml_backend_dev_type type = ggml_backend_dev_type(dev);
+        if (type != GGML_BACKEND_DEVICE_TYPE_GPU && type != GGML_BACKEND_DEVICE_TYPE_IGPU) {
+            continue;
+        }
+
+        gpu_device_info info;
+        const char* name = ggml_backend_dev_name(dev);
+        const char* description = ggml_backend_dev_description(dev);
+        info.name = name ? name : "";
+        info.description = description ? description : "";
+        ggml_backend_dev_memory(dev, &info.memory_free, &info.memory_total);
+        devices.push_back(info);
+    }
+    return devices;
+}
+
+// 检测是否有可用的 GPU 设备（实际枚举 ggml 注册的设备，而不是只看编译开关）
+static bool detect_vulkan_available() {
+    const std::vector<gpu_device_info> devices = enumerate_gpu_devices();
+    if (devices.empty()) {
+        LOGI("No GPU device registered in ggml (Vulkan backend missing or driver unavailable)");
+        return false;
+    }
+    for (const gpu_device_info& dev : devices) {
+        LOGI("GPU device %s: %s, %zu / %zu MB free",
+             dev.name.c_str(), dev.description.c_str(),
+             dev.memory_free / (1024 * 1024), dev.memory_total / (1024 * 1024));
+    }
+    return true;
+}
+
+/**
+ * 按 GPU 显存预算估算最多能放到 GPU 的层数
+ *
+ * 只读取 GGUF 元数据（vocab_only）得到层数，按文件大小平均到每层（输出层按一层计）。
+ * @param n_layers_out 输出模型总层数（含输出层），读取失败时为 0
+ * @return 可放到 GPU 的层数，全部放得下时为 GPU_LAYERS_ALL
+ */
+static int gpu_layers_for_budget(const char* path, int* n_layers_out) {
+    *n_layers_out = 0;
+
+    struct stat st;
+    if (stat(path, &st) != 0 || st.st_size <= 0) {
+        return 0;
+    }
+
+    llama_model_params params = llama_model_default_params();
+    params.vocab_only = true;
+    params.n_gpu_layers = 0;
+    llama_model* meta = llama_load_model_from_file(path, params);
+    if (meta == nullptr) {
+        return 0;
+    }
+    const int n_layers = llama_model_n_layer(meta) + 1;
+    llama_free_model(meta);
+    *n_layers_out = n_layers;
+
+    size_t memory_free = 0;
+    for (const gpu_device_info& dev : enumerate_gpu_devices()) {
+        memory_free += dev.memory_free;
+    }
+
+    const double budget = (double) memory_free * GPU_MEMORY_BUDGET_FRACTION;
+    const double bytes_per_layer = (double) st.st_size / n_layers;
+    const int fit = (int) (budget / bytes_per_layer);
+    LOGI("GPU memory budget %.0f MB, ~%.1f MB per layer: %d of %d layers fit",
+         budget / (1024 * 1024), bytes_per_layer / (1024 * 1024), std::min(fit, n_layers), n_layers);
+    return fit >= n_layers ? GPU_LAYERS_ALL : std::max(fit, 0);
+}
+
+// ============================================
+// KV 缓存量化与 Flash Attention
+// ============================================
+
+/**
+ * 设置上下文的 KV 缓存元素类型与 Flash Attention
+ *
+ * llama.cpp 的量化 V 缓存只能配合 Flash Attention 使用：KV 量化且 Flash Attention 为自动时强制开启，
+ * 显式关闭时 V 缓存退回 F16（K 缓存仍量化）
+ * @param kv_type KV 缓存 ggml_type（F16 = 1, Q8_0 = 8, Q4_0 = 2），< 0 表示默认 (F16)
+ * @param flash_attn -1 自动，0 关闭，1 开启
+ */
+static void apply_kv_cache_options(llama_context_params& params, int kv_type, int flash_attn) {
+    if (flash_attn >= 0) {
+        params.flash_attn_type = flash_attn > 0 ? LLAMA_FLASH_ATTN_TYPE_ENABLED : LLAMA_FLASH_ATTN_TYPE_DISABLED;
+    }
+    if (kv_type < 0 || kv_type == GGML_TYPE_F16) {
+        return;
+    }
+
+    params.type_k = (ggml_type) kv_type;
+    params.type_v = (ggml_type) kv_type;
+    if (flash_attn == 0) {
+        LOGW("Quantized V cache requires flash attention, keeping V cache in F16");
+        params.type_v = GGML_TYPE_F16;
+    } else {
+        params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+    }
+}
+
+/**
+ * 每层 K / V 的向量宽度 (head_dim × n_head_kv)
+ * 优先读取 GGUF 中的 <arch>.attention.key_length / value_length（如 Qwen3 的 head_dim 不等于 n_embd / n_head）
+ */
+static int64_t kv_embd_size(const llama_model* model, const char* key_suffix) {
+    const int32_t n_head = std::max(llama_model_n_head(model), 1);
+    const int32_t n_head_kv = llama_model_n_head_kv(model);
+    int64_t head_dim = llama_model_n_embd(model) / n_head;
+
+    char arch[64];
+    if (llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch)) > 0) {
+        char key[128];
+        char value[32];
+        snprintf(key, sizeof(key), "%s.attention.%s", arch, key_suffix);
+        if (llama_model_meta_val_str(model, key, value, sizeof(value)) > 0) {
+            head_dim = std::max(atoll(value), 1LL);
+        }
+    }
+    return head_dim * n_head_kv;
+}
+
+/**
+ * 按上下文大小和实际 KV 类型估算 KV 缓存占用（字节）
+ */
+static int64_t estimate_kv_cache_bytes(const llama_model* model, uint32_t n_ctx,
+                                       ggml_type type_k, ggml_type type_v) {
+    const int64_t n_layer = llama_model_n_layer(model);
+    const int64_t k_row = (int64_t) ggml_row_size(type_k, kv_embd_size(model, "key_length"));
+    const int64_t v_row = (int64_t) ggml_row_size(type_v, kv_embd_size(model, "value_length"));
+    return n_layer * (int64_t) n_ctx * (k_row + v_row);
+}
+
+// ============================================
+// CPU 拓扑与线程池（大小核感知）
+// ============================================
+
+// 自动选择时解码线程数上限：解码受内存带宽限制，更多线程只会增加屏障等待
+#define DECODE_MAX_AUTO_THREADS 4
+// 解码线程池在两次计算之间自旋等待的轮询强度（ggml 默认值），预填充线程池不自旋
+#define DECODE_THREADPOOL_POLL 50
+
+struct cpu_topology {
+    std::vector<int> max_freq_khz;       // 各核心最高频率，读取失败为 0
+    std::vector<int> performance_cores;  // 最低频簇以外的核心；各核频率一致或无法读取时为全部核心
+};
+
+/**
+ * 从 /sys/devices/system/cpu/cpuN/cpufreq 读取核心最高频率，区分大小核
+ * 小核参与 ggml 线程池时，每个屏障都要等最慢的线程，整体反而变慢
+ */
+static const cpu_topology& get_cpu_topology() {
+    static const cpu_topology topology = [] {
+        cpu_topology t;
+        const long n_cpus = std::min<long>(sysconf(_SC_NPROCESSORS_CONF), GGML_MAX_N_THREADS);
+        for (long i = 0; i < n_cpus; i++) {
+            char path[96];
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%ld/cpufreq/cpuinfo_max_freq", i);
+            int freq = 0;
+            FILE* f = fopen(path, "r");
+            if (f != nullptr) {
+                if (fscanf(f, "%d", &freq) != 1) {
+                    freq = 0;
+                }
+                fclose(f);
+            }
+            t.max_freq_khz.push_back(freq);
+        }
+
+        int min_freq = INT_MAX;
+        int max_freq = 0;
+        for (int freq : t.max_freq_khz) {
+            if (freq > 0) {
+                min_freq = std::min(min_freq, freq);
+                max_freq = std::max(max_freq, freq);
+            }
+        }
+        for (int i = 0; i < (int) t.max_freq_khz.size(); i++) {
+            if (max_freq == 0 || min_freq == max_freq || t.max_freq_khz[i] > min_freq) {
+                t.performance_cores.push_back(i);
+            }
+        }
+        if (t.performance_cores.empty()) {
+            t.performance_cores.push_back(0);
+        }
+
+        LOGI("CPU topology: %zu cores, %zu performance cores (max freq %d kHz, min %d kHz)",
+             t.max_freq_khz.size(), t.performance_cores.size(), max_freq, max_freq > 0 ? min_freq : 0);
+        return t;
+    }();
+    return topology;
+}
+
+static int default_decode_threads() {
+    return std::max(1, std::min((int) get_cpu_topology().performance_cores.size(), DECODE_MAX_AUTO_THREADS));
+}
+
+static int default_batch_threads() {
+    return std::max(1, (int) get_cpu_topology().performance_cores.size());
+}
+
+// 创建 cpumask 只包含性能核的线程池（不严格绑核，线程可在性能核之间迁移）
+static ggml_threadpool* create_performance_threadpool(int n_threads, uint32_t poll) {
+    ggml_threadpool_params params = ggml_threadpool_params_default(n_threads);
+    for (int cpu : get_cpu_topology().performance_cores) {
+        params.cpumask[cpu] = true;
+    }
+    params.strict_cpu = false;
+    params.poll = poll;
+
+    ggml_threadpool* threadpool = ggml_threadpool_new(&params);
+    if (threadpool == nullptr) {
+        LOGW("Failed to create threadpool with %d threads", n_threads);
+    }
+    return threadpool;
+}
+
+// 取得运行时中线程数与轮询级别相同的线程池，没有时新建；失败返回 nullptr
+static ggml_threadpool* runtime_acquire_threadpool(int n_threads, uint32_t poll) {
+    native_runtime& runtime = get_runtime();
+    std::lock_guard<std::mutex> lock(runtime.mutex);
+    for (shared_threadpool& entry : runtime.threadpools) {
+        if (entry.n_threads == n_threads && entry.poll == poll) {
+            entry.n_refs++;
+            return entry.pool;
+        }
+    }
+
+    ggml_threadpool* pool = create_performance_threadpool(n_threads, poll);
+    if (pool != nullptr) {
+        runtime.threadpools.push_back({ pool, n_threads, poll, 1 });
+    }
+    return pool;
+}
+
+static void runtime_release_threadpool(ggml_threadpool* pool) {
+    if (pool == nullptr) {
+        return;
+    }
+    native_runtime& runtime = get_runtime();
+    std::lock_guard<std::mutex> lock(runtime.mutex);
+    for (auto it = runtime.threadpools.begin(); it != runtime.threadpools.end(); ++it) {
+        if (it->pool == pool) {
+            if (--it->n_refs == 0) {
+                ggml_threadpool_free(pool);
+                runtime.threadpools.erase(it);
+            }
+            return;
+        }
+    }
+}
+
+static void attach_threadpools(llama_context_wrapper* wrapper, llama_context* ctx) {
+    if (wrapper->threadpool != nullptr) {
+        llama_attach_threadpool(ctx, wrapper->threadpool, wrapper->threadpool_batch);
+    }
+    llama_set_n_threads(ctx, governor_decode_threads(wrapper), wrapper->n_threads_batch);
+}
+
+static void free_threadpools(llama_context_wrapper* wrapper) {
+    if (wrapper->ctx) {
+        llama_detach_threadpool(wrapper->ctx);
+    }
+    if (wrapper->draft && wrapper->draft->ctx) {
+        llama_detach_threadpool(wrapper->draft->ctx);
+    }
+    runtime_release_threadpool(wrapper->threadpool_batch);
+    runtime_release_threadpool(wrapper->threadpool);
+    wrapper->threadpool = nullptr;
+    wrapper->threadpool_batch = nullptr;
+}
+
+/**
+ * 设置解码 / 预填充线程数（<= 0 表示按性能核数自动选择），重建线程池并挂到主模型和草稿模型上下文
+ * 线程池创建失败时退回 llama.cpp 自带的线程调度，只设置线程数
+ */
+static void apply_thread_counts(llama_context_wrapper* wrapper, int n_threads, int n_threads_batch) {
+    if (n_threads <= 0) {
+        n_threads = default_decode_threads();
+    }
+    if (n_threads_batch <= 0) {
+        n_threads_batch = default_batch_threads();
+    }
+
+    free_threadpools(wrapper);
+
+    wrapper->n_threads = n_threads;
+    wrapper->n_threads_batch = n_threads_batch;
+    // 预填充线程池与嵌入模型共享（同为 n_threads_batch、不轮询）
+    wrapper->threadpool = runtime_acquire_threadpool(n_threads, DECODE_THREADPOOL_POLL);
+    if (wrapper->threadpool != nullptr) {
+        wrapper->threadpool_batch = n_threads_batch == n_threads
+            ? runtime_acquire_threadpool(n_threads, DECODE_THREADPOOL_POLL)
+            : runtime_acquire_threadpool(n_threads_batch, 0);
+        if (wrapper->threadpool_batch == nullptr) {
+            runtime_release_threadpool(wrapper->threadpool);
+            wrapper->threadpool = nullptr;
+        }
+    }
+
+    if (wrapper->ctx) {
+        attach_threadpools(wrapper, wrapper->ctx);
+    }
+    if (wrapper->draft && wrapper->draft->ctx) {
+        attach_threadpools(wrapper, wrapper->draft->ctx);
+    }
+
+    LOGI("Threads: decode %d, prefill %d (%s)", n_threads, n_threads_batch,
+         wrapper->threadpool ? "shared pools on performance cores" : "default scheduling");
+}
+
+// ============================================
+// 内存压力响应（onTrimMemory）
+// ============================================
+
+#define TRIM_LEVEL_MODERATE 1   // 释放上下文（KV 缓存、计算缓冲区）、提示词快照和采样缓冲区，保留权重
+#define TRIM_LEVEL_SEVERE 2     // 另外把已映射的权重页交还内核
+
+static mapped_file_id file_id_of(const char* path) {
+    mapped_file_id id;
+    struct stat st;
+    if (path != nullptr && stat(path, &st) == 0) {
+        id.dev = st.st_dev;
+        id.ino = st.st_ino;
+    }
+    return id;
+}
+
+// 进程当前的常驻内存（/proc/self/statm 第二列），读取失败返回 0
+static int64_t resident_bytes() {
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f == nullptr) {
+        return 0;
+    }
+    long long n_size = 0;
+    long long n_resident = 0;
+    const int n_read = fscanf(f, "%lld %lld", &n_size, &n_resident);
+    fclose(f);
+    return n_read == 2 ? (int64_t) n_resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+// 文件映射中的一段地址区间
+struct mapped_region {
+    uintptr_t start = 0;
+    size_t size = 0;
+};
+
+/**
+ * 从 /proc/self/maps 找出映射了该文件的只读区域（llama.cpp 卸载到 GPU 的部分在加载后已解除映射）。
+ * 可写映射可能有私有修改，不返回
+ */
+static std::vector<mapped_region> file_mappings(const mapped_file_id& id) {
+    std::vector<mapped_region> regions;
+    if (id.ino == 0) {
+        return regions;
+    }
+    FILE* f = fopen("/proc/self/maps", "r");
+    if (f == nullptr) {
+        return regions;
+    }
+
+    char line[512];
+    bool line_start = true;
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        // 超长行（路径很长）的后续片段不是新的映射
+        const bool parse = line_start;
+        line_start = strchr(line, '\n') != nullptr;
+        if (!parse) {
+            continue;
+        }
+
+        unsigned long start = 0;
+        unsigned long end = 0;
+        char perms[5] = {};
+        unsigned int dev_major = 0;
+        unsigned int dev_minor = 0;
+        unsigned long inode = 0;
+        if (sscanf(line, "%lx-%lx %4s %*s %x:%x %lu", &start, &end, perms, &dev_major, &dev_minor, &inode) != 6) {
+            continue;
+        }
+        if ((ino_t) inode != id.ino || dev_major != major(id.dev) || dev_minor != minor(id.dev) || perms[1] == 'w') {
+            continue;
+        }
+        regions.push_back({ (uintptr_t) start, (size_t) (end - start) });
+    }
+    fclose(f);
+    return regions;
+}
+
+/**
+ * 对映射了该文件的只读区域 madvise(MADV_DONTNEED)：文件页可随时从磁盘重新读入，
+ * 之后解码时按需缺页换回，不需要重新加载模型
+ * @return 处理的映射字节数
+ */
+static size_t release_mapped_file_pages(const mapped_file_id& id) {
+    size_t n_advised = 0;
+    for (const mapped_region& region : file_mappings(id)) {
+        if (madvise(reinterpret_cast<void*>(region.start), region.size, MADV_DONTNEED) == 0) {
+            n_advised += region.size;
+        } else {
+            LOGW("madvise failed for %zx+%zu: %s", (size_t) region.start, region.size, strerror(errno));
+        }
+    }
+    return n_advised;
+}
+
+/**
+ * 释放主上下文（调用方持有 ctx_mutex，且没有进行中的后台会话）
+ * 序列 0 的 KV 和快照随之失效；固定的系统提示词、适配器和线程池保留，重建后照常生效
+ */
+static void release_context(llama_context_wrapper* wrapper) {
+    if (wrapper->ctx == nullptr) {
+        return;
+    }
+    llama_detach_threadpool(wrapper->ctx);
+    llama_free(wrapper->ctx);
+    wrapper->ctx = nullptr;
+
+    std::vector<llama_token>().swap(wrapper->cached_tokens);
+    std::vector<llama_token>().swap(wrapper->prompt_tokens);
+    std::vector<llama_token_data>().swap(wrapper->candidates);
+    std::string().swap(wrapper->output_text);
+    for (prompt_snapshot& snap : wrapper->snapshots) {
+        std::vector<llama_token>().swap(snap.tokens);
+        snap.pinned = false;
+        snap.n_hits = 0;
+    }
+    wrapper->lora_applied.clear();
+}
+
+/**
+ * 上下文已被 trimMemory 释放时按创建时的参数重建（调用方持有 ctx_mutex），并恢复主对话的适配器
+ * @return 上下文可用返回 true
+ */
+static bool ensure_context(llama_context_wrapper* wrapper) {
+    if (wrapper->ctx != nullptr) {
+        return true;
+    }
+
+    const int64_t t_start = ggml_time_us();
+    llama_context* ctx = llama_new_context_with_model(wrapper->model, wrapper->ctx_params);
+    if (ctx == nullptr) {
+        LOGE("Failed to recreate context after memory trim");
+        return false;
+    }
+
+    wrapper->ctx = ctx;
+    llama_set_abort_callback(ctx, generation_abort_callback, wrapper);
+    attach_threadpools(wrapper, ctx);
+    apply_lora(wrapper, wrapper->lora_main);
+    wrapper->cached_tokens.reserve(main_context_size(wrapper));
+    wrapper->candidates.resize(llama_vocab_n_tokens(llama_model_get_vocab(wrapper->model)));
+    LOGI("Context recreated after memory trim in %.1f ms", (ggml_time_us() - t_start) / 1000.0);
+    return true;
+}
+
+// ============================================
+// 模型初始化函数（原版 - CPU only）
+// ============================================
+extern "C" JNIEXPORT jlong JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_initModel(
+    JNIEnv* env,
+    jobject /* this */,
+    jstring modelPath,
+    jint contextSize,
+    jint threads) {
+
+    const char *path = env->GetStringUTFChars(modelPath, nullptr);
+    LOGD("Initializing model from: %s", path);
+    LOGD("Context size: %d, Threads: %d", contextSize, threads);
+
+    // 初始化 llama 后端（与其他句柄共享，释放最后一个句柄时关闭）
+    runtime_acquire();
+
+    // 设置模型参数
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = 0;  // CPU only 模式
+
+    // 加载模型
+    llama_model* model = llama_load_model_from_file(path, model_params);
+    const mapped_file_id model_file = file_id_of(path);
+    env->ReleaseStringUTFChars(modelPath, path);
+
+    if (model == nullptr) {
+        LOGE("Failed to load model");
+        runtime_release();
+        return 0;
+    }
+
+    // 设置上下文参数
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = contextSize;
+    ctx_params.n_threads = threads;
+    ctx_params.n_threads_batch = threads;
+    ctx_params.no_perf = false;  // 保留 llama_perf_context 计数，供生成统计使用
+
+    // 创建上下文
+    llama_context* ctx = llama_new_context_with_model(model, ctx_params);
+    if (ctx == nullptr) {
+        LOGE("Failed to create context");
+        llama_free_model(model);
+        runtime_release();
+        return 0;
+    }
+
+    // 创建包装结构
+    llama_context_wrapper* wrapper = new llama_context_wrapper();
+    wrapper->model = model;
+    wrapper->ctx = ctx;
+    wrapper->ctx_params = ctx_params;
+    wrapper->model_file = model_file;
+    wrapper->using_gpu = false;
+    wrapper->gpu_layers = 0;
+    wrapper->n_batch = (int) llama_n_batch(ctx);
+    llama_set_abort_callback(ctx, generation_abort_callback, wrapper);
+
+    LOGD("Model initialized successfully (CPU only)!");
+    return reinterpret_cast<jlong>(wrapper);
+}
+
+// ============================================
+// 模型初始化函数（GPU 支持版本，带静默回退）
+// ============================================
+extern "C" JNIEXPORT jlong JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_initModelWithGpu(
+    JNIEnv* env,
+    jobject /* this */,
+    jstring modelPath,
+    jint contextSize,
+    jint threads,
+    jint batchThreads,
+    jboolean useGpu,
+    jint gpuLayers,
+    jint batchSize,
+    jint kvCacheType,
+    jint flashAttention,
+    jint parallelSessions,
+    jint sessionContextSize,
+    jint promptCacheSlots,
+    jint promptCacheTokens) {
+
+    const char *path = env->GetStringUTFChars(modelPath, nullptr);
+    LOGI("Initializing model from: %s", path);
+    LOGI("Context size: %d, Threads: %d / %d, UseGPU: %d, GPU Layers: %d, Batch size: %d, "
+         "KV type: %d, Flash attention: %d, Background sessions: %d x %d, Prompt snapshots: %d (%d tokens)",
+         contextSize, threads, batchThreads, useGpu, gpuLayers, batchSize, kvCacheType, flashAttention,
+         parallelSessions, sessionContextSize, promptCacheSlots, promptCacheTokens);
+
+    // 初始化 llama 后端（与其他句柄共享，释放最后一个句柄时关闭）
+    runtime_acquire();
+
+    // 设置模型参数
+    llama_model_params model_params = llama_model_default_params();
+
+    bool gpu_available = false;
+    int actual_gpu_layers = 0;
+
+    // 尝试使用 GPU
+    if (useGpu) {
+        gpu_available = detect_vulkan_available();
+
+        if (gpu_available) {
+            // gpuLayers = -1 表示在显存预算内尽量多放
+            int n_layers = 0;
+            actual_gpu_layers = (gpuLayers < 0) ? gpu_layers_for_budget(path, &n_layers) : gpuLayers;
+            gpu_available = actual_gpu_layers > 0;
+            model_params.n_gpu_layers = actual_gpu_layers;
+            LOGI("GPU acceleration enabled, using %d layers on GPU", actual_gpu_layers);
+        } else {
+            LOGW("GPU requested but not available, falling back to CPU");
+            model_params.n_gpu_layers = 0;
+        }
+    } else {
+        model_params.n_gpu_layers = 0;
+        LOGI("GPU disabled by user, using CPU only");
+    }
+
+    // 加载模型
+    llama_model* model = llama_load_model_from_file(path, model_params);
+
+    // 如果 GPU 加载失败，尝试回退到 CPU
+    if (model == nullptr && gpu_available && actual_gpu_layers > 0) {
+        LOGW("GPU model loading failed, attempting CPU fallback...");
+        model_params.n_gpu_layers = 0;
+        model = llama_load_model_from_file(path, model_params);
+        gpu_available = false;
+        actual_gpu_layers = 0;
+    }
+
+    if (model == nullptr) {
+        env->ReleaseStringUTFChars(modelPath, path);
+        LOGE("Failed to load model (both GPU and CPU attempts failed)");
+        runtime_release();
+        return 0;
+    }
+
+    // 设置上下文参数：后台会话和提示词快照各占一个序列，统一 KV 缓存让序列 0 使用 contextSize、
+    // 每个会话使用 sessionContextSize，快照合计使用 promptCacheTokens
+    const int n_sessions = (parallelSessions > 0 && sessionContextSize > 0) ? parallelSessions : 0;
+    const int n_snapshots = (promptCacheSlots > 0 && promptCacheTokens > 0) ? promptCacheSlots : 0;
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = contextSize + n_sessions * sessionContextSize + (n_snapshots > 0 ? promptCacheTokens : 0);
+    if (n_sessions > 0 || n_snapshots > 0) {
+        ctx_params.n_seq_max = 1 + n_sessions + n_snapshots;
+        ctx_params.kv_unified = true;
+    }
+    ctx_params.n_threads = threads > 0 ? threads : default_decode_threads();
+    ctx_params.n_threads_batch = batchThreads > 0 ? batchThreads : default_batch_threads();
+    if (batchSize > 0) {
+        // n_ubatch 不能超过 n_batch
+        ctx_params.n_batch = batchSize;
+        ctx_params.n_ubatch = std::min<uint32_t>(ctx_params.n_ubatch, batchSize);
+    }
+    apply_kv_cache_options(ctx_params, kvCacheType, flashAttention);
+    ctx_params.no_perf = false;  // 保留 llama_perf_context 计数，供生成统计使用
+
+    // 创建上下文（GPU 显存不足时通常在这里失败，而不是加载模型时）
+    llama_context* ctx = llama_new_context_with_model(model, ctx_params);
+    if (ctx == nullptr && gpu_available && actual_gpu_layers > 0) {
+        LOGW("GPU context creation failed, reloading model on CPU...");
+        llama_free_model(model);
+        model_params.n_gpu_layers = 0;
+        model = llama_load_model_from_file(path, model_params);
+        gpu_available = false;
+        actual_gpu_layers = 0;
+        if (model != nullptr) {
+            ctx = llama_new_context_with_model(model, ctx_params);
+        }
+    }
+
+    const mapped_file_id model_file = file_id_of(path);
+    env->ReleaseStringUTFChars(modelPath, path);
+
+    if (ctx == nullptr) {
+        LOGE("Failed to create context");
+        if (model != nullptr) {
+            llama_free_model(model);
+        }
+        runtime_release();
+        return 0;
+    }
+
+    // 创建包装结构
+    llama_context_wrapper* wrapper = new llama_context_wrapper();
+    wrapper->model = model;
+    wrapper->ctx = ctx;
+    wrapper->ctx_params = ctx_params;
+    wrapper->model_file = model_file;
+    wrapper->using_gpu = gpu_available && (actual_gpu_layers > 0);
+    wrapper->gpu_layers = actual_gpu_layers;
+    wrapper->n_batch = (int) llama_n_batch(ctx);
+    wrapper->kv_cache_type = kvCacheType;
+    wrapper->flash_attn = flashAttention;
+    wrapper->n_ctx_main = contextSize;
+    wrapper->cached_tokens.reserve(contextSize);
+    wrapper->candidates.resize(llama_vocab_n_tokens(llama_model_get_vocab(model)));
+    if (n_sessions > 0) {
+        create_sessions(wrapper, n_sessions, sessionContextSize);
+    }
+    if (n_snapshots > 0) {
+        create_prompt_snapshots(wrapper, n_snapshots, 1 + n_sessions, promptCacheTokens);
+    }
+    llama_set_abort_callback(ctx, generation_abort_callback, wrapper);
+    apply_thread_counts(wrapper, threads, batchThreads);
+    LOGI("KV cache: %.1f MB for %u tokens",
+         estimate_kv_cache_bytes(model, llama_n_ctx(ctx), ctx_params.type_k, ctx_params.type_v) / (1024.0 * 1024.0),
+         llama_n_ctx(ctx));
+
+    if (wrapper->using_gpu) {
+        LOGI("Model initialized successfully with GPU acceleration (%d layers)!", actual_gpu_layers);
+    } else {
+        LOGI("Model initialized successfully (CPU only, GPU fallback or disabled)");
+    }
+
+    return reinterpret_cast<jlong>(wrapper);
+}
+
+// ============================================
+// 获取当前推理模式信息
+// ============================================
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_isUsingGpu(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    if (modelHandle == 0) {
+        return JNI_FALSE;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    return wrapper->using_gpu ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getGpuLayers(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    if (modelHandle == 0) {
+        return 0;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    return wrapper->gpu_layers;
+}
+
+/**
+ * 主模型内存占用
+ * @return [模型权重字节, KV 缓存字节（估算）, K 缓存 ggml_type, V 缓存 ggml_type, Flash Attention 请求值, n_ctx]
+ */
+extern "C" JNIEXPORT jlongArray JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getMemoryUsage(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    if (modelHandle == 0) {
+        return nullptr;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+
+    // 按创建上下文时的同一规则还原实际的 K / V 类型
+    llama_context_params params = llama_context_default_params();
+    apply_kv_cache_options(params, wrapper->kv_cache_type, wrapper->flash_attn);
+    const uint32_t n_ctx = wrapper->ctx != nullptr ? llama_n_ctx(wrapper->ctx) : 0;  // trimMemory 释放后为 0
+
+    const jlong values[6] = {
+        (jlong) llama_model_size(wrapper->model),
+        (jlong) estimate_kv_cache_bytes(wrapper->model, n_ctx, params.type_k, params.type_v),
+        (jlong) params.type_k,
+        (jlong) params.type_v,
+        (jlong) params.flash_attn_type,
+        (jlong) n_ctx
+    };
+    jlongArray result = env->NewLongArray(6);
+    if (result != nullptr) {
+        env->SetLongArrayRegion(result, 0, 6, values);
+    }
+    return result;
+}
+
+/**
+ * 响应系统内存压力，只在没有主请求和进行中的后台会话时执行，不释放模型权重
+ *
+ * TRIM_LEVEL_MODERATE：释放上下文（KV 缓存、计算缓冲区）、提示词快照和采样缓冲区，
+ *   下一个请求重建上下文，会话 KV 可从 saveSessionState 保存的文件恢复
+ * TRIM_LEVEL_SEVERE：另外对映射的模型文件（含草稿模型）madvise(MADV_DONTNEED)，
+ *   常驻的权重页交还内核，之后按需从文件重新读入
+ *
+ * @param level TRIM_LEVEL_*
+ * @return [上下文释放的字节数, 权重页释放的字节数]，按进程常驻内存的变化计算（GPU 显存不计入）；
+ *         上下文忙时返回 null
+ */
+extern "C" JNIEXPORT jlongArray JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_trimMemory(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jint level) {
+
+    if (modelHandle == 0 || level < TRIM_LEVEL_MODERATE) {
+        return nullptr;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    std::unique_lock<std::mutex> lock(wrapper->ctx_mutex, std::try_to_lock);
+    if (!lock.owns_lock() || wrapper->main_waiting.load() > 0 || sessions_pending(wrapper)) {
+        LOGW("Memory trim skipped: context is busy");
+        return nullptr;
+    }
+    reap_sessions(wrapper);
+
+    const int64_t rss_before = resident_bytes();
+    release_context(wrapper);
+    const int64_t rss_context = resident_bytes();
+
+    int64_t weight_bytes = 0;
+    if (level >= TRIM_LEVEL_SEVERE) {
+        size_t n_advised = release_mapped_file_pages(wrapper->model_file);
+        if (wrapper->draft != nullptr) {
+            n_advised += release_mapped_file_pages(wrapper->draft->model_file);
+        }
+        weight_bytes = std::max<int64_t>(0, rss_context - resident_bytes());
+        LOGI("Memory trim: advised %.1f MB of mapped weights", n_advised / (1024.0 * 1024.0));
+    }
+
+    const int64_t context_bytes = std::max<int64_t>(0, rss_before - rss_context);
+    LOGI("Memory trim level %d: context %.1f MB, weight pages %.1f MB", level,
+         context_bytes / (1024.0 * 1024.0), weight_bytes / (1024.0 * 1024.0));
+
+    const jlong values[2] = { (jlong) context_bytes, (jlong) weight_bytes };
+    jlongArray result = env->NewLongArray(2);
+    if (result != nullptr) {
+        env->SetLongArrayRegion(result, 0, 2, values);
+    }
+    return result;
+}
+
+/**
+ * 进程当前的常驻内存字节数，用于统计 Kotlin 侧释放（如卸载嵌入模型）的效果
+ */
+extern "C" JNIEXPORT jlong JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getResidentMemoryBytes(
+    JNIEnv* env,
+    jobject /* this */) {
+    return (jlong) resident_bytes();
+}
+
+// ============================================
+// 模型预热（降低冷启动的首 token 延迟）
+// ============================================
+
+#define WARMUP_PREFAULT_CHUNK (16 * 1024 * 1024)  // 每段预读的字节数，段之间检查取消并报告进度
+#define WARMUP_STAGE_PREFAULT 0                   // 与 Kotlin WarmupCallback.onProgress 的 stage 一致
+#define WARMUP_STAGE_DECODE 1
+
+// getWarmupStats 返回数组的长度（顺序与 Kotlin WarmupStats.fromArray 一致）
+#define WARMUP_STATS_FIELDS 5
+
+// 把预热线程的 warmup 复制为 last_warmup，getWarmupStats 只读取后者
+static void publish_warmup_stats(llama_context_wrapper* wrapper) {
+    std::lock_guard<std::mutex> lock(wrapper->warmup_mutex);
+    wrapper->last_warmup = wrapper->warmup;
+}
+
+// 预热为可选工作：显式取消或有主请求在等 ctx_mutex 时让路，剩余开销由该请求自己承担
+static bool warmup_interrupted(const llama_context_wrapper* wrapper) {
+    return wrapper->warmup_cancel.load() || wrapper->main_waiting.load() > 0;
+}
+
+/**
+ * 逐页读一个字节，让缺页发生在预热而不是首次解码中（之前的 MADV_WILLNEED 已让内核批量预读）
+ */
+static void touch_pages(const mapped_region& region) {
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    const volatile uint8_t* p = reinterpret_cast<const volatile uint8_t*>(region.start);
+    uint8_t sink = 0;
+    for (size_t off = 0; off < region.size; off += page) {
+        sink ^= p[off];
+    }
+    (void) sink;
+}
+
+/**
+ * 用最小的输入各解码一次：多 token 批次走预填充的矩阵乘，单 token 走解码的矩阵向量乘，
+ * 两条路径的 GPU 管线和计算图分别在首次使用时编译 / 分配。结束后清空序列 0（调用方持有 ctx_mutex 和 compute_mutex）
+ */
+static decode_status warmup_decode(llama_context_wrapper* wrapper) {
+    // 已有请求或恢复的会话用过上下文，说明已经是热的
+    if (!wrapper->cached_tokens.empty()) {
+        return DECODE_OK;
+    }
+
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    std::vector<llama_token> tokens;
+    const llama_token bos = llama_vocab_bos(vocab);
+    const llama_token eos = llama_vocab_eos(vocab);
+    if (bos != LLAMA_TOKEN_NULL) {
+        tokens.push_back(bos);
+    }
+    if (eos != LLAMA_TOKEN_NULL) {
+        tokens.push_back(eos);
+    }
+    while (tokens.size() < 2) {
+        tokens.push_back(0);
+    }
+
+    apply_lora(wrapper, wrapper->lora_main);
+    decode_status status = decode_into(wrapper->ctx, wrapper->cached_tokens, wrapper->warmup_cancel,
+                                       tokens.data(), (int) tokens.size());
+    if (status == DECODE_OK) {
+        status = decode_into(wrapper->ctx, wrapper->cached_tokens, wrapper->warmup_cancel, tokens.data(), 1);
+    }
+    llama_synchronize(wrapper->ctx);
+    invalidate_cached_prefix(wrapper);
+
+    draft_model_wrapper* draft = wrapper->draft;
+    if (status == DECODE_OK && draft != nullptr && draft->ctx != nullptr && draft->cached_tokens.empty()) {
+        status = decode_into(draft->ctx, draft->cached_tokens, wrapper->warmup_cancel, tokens.data(), 1);
+        llama_synchronize(draft->ctx);
+        llama_memory_seq_rm(llama_get_memory(draft->ctx), 0, -1, -1);
+        draft->cached_tokens.clear();
+    }
+    return status;
+}
+
+/**
+ * 加载后预热主模型（阻塞，由 Kotlin 在后台线程调用）：
+ * 1. 预读映射的权重文件（含草稿模型），避免首次解码时逐页缺页
+ * 2. 极小的预填充 + 解码，触发 GPU 管线编译、线程池启动和计算缓冲区分配
+ * 两段之间及预读的每一段之后检查 cancelWarmup 和主请求，被打断时尽快释放 ctx_mutex
+ *
+ * @param callback 可为 null；WarmupCallback.onProgress(stage, done, total)
+ * @return 完整完成返回 true，耗时通过 getWarmupStats 读取
+ */
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_warmupModel(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jobject callback) {
+
+    if (modelHandle == 0) {
+        return JNI_FALSE;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+
+    jmethodID onProgressMethod = nullptr;
+    if (callback != nullptr) {
+        onProgressMethod = env->GetMethodID(env->GetObjectClass(callback), "onProgress", "(IJJ)V");
+        if (onProgressMethod == nullptr) {
+            env->ExceptionClear();
+        }
+    }
+    auto report = [&](int stage, int64_t done, int64_t total) {
+        if (onProgressMethod != nullptr) {
+            env->CallVoidMethod(callback, onProgressMethod, (jint) stage, (jlong) done, (jlong) total);
+        }
+    };
+
+    // 等锁前清除取消标记：等锁期间收到的 cancelWarmup 仍然生效
+    wrapper->warmup_cancel.store(false);
+    std::unique_lock<std::mutex> lock(wrapper->ctx_mutex);
+    warmup_stats& stats = wrapper->warmup;
+    stats = warmup_stats();
+    stats.state = WARMUP_RUNNING;
+    publish_warmup_stats(wrapper);
+    const int64_t t_start = ggml_time_us();
+
+    std::vector<mapped_region> regions = file_mappings(wrapper->model_file);
+    if (wrapper->draft != nullptr) {
+        const std::vector<mapped_region> draft_regions = file_mappings(wrapper->draft->model_file);
+        regions.insert(regions.end(), draft_regions.begin(), draft_regions.end());
+    }
+    int64_t n_total = 0;
+    for (const mapped_region& region : regions) {
+        n_total += (int64_t) region.size;
+    }
+
+    report(WARMUP_STAGE_PREFAULT, 0, n_total);
+    for (const mapped_region& region : regions) {
+        for (size_t off = 0; off < region.size && !warmup_interrupted(wrapper); off += WARMUP_PREFAULT_CHUNK) {
+            const mapped_region chunk = { region.start + off, std::min<size_t>(WARMUP_PREFAULT_CHUNK, region.size - off) };
+            madvise(reinterpret_cast<void*>(chunk.start), chunk.size, MADV_WILLNEED);
+            touch_pages(chunk);
+            stats.n_prefault_bytes += (int64_t) chunk.size;
+            report(WARMUP_STAGE_PREFAULT, stats.n_prefault_bytes, n_total);
+        }
+    }
+    stats.t_prefault_us = ggml_time_us() - t_start;
+
+    decode_status status = DECODE_CANCELLED;
+    if (!warmup_interrupted(wrapper)) {
+        report(WARMUP_STAGE_DECODE, 0, 1);
+        const int64_t t_decode = ggml_time_us();
+        {
+            std::lock_guard<std::mutex> compute(get_runtime().compute_mutex);
+            status = ensure_context(wrapper) ? warmup_decode(wrapper) : DECODE_FAILED;
+        }
+        stats.t_decode_us = ggml_time_us() - t_decode;
+        report(WARMUP_STAGE_DECODE, 1, 1);
+    }
+
+    stats.t_total_us = ggml_time_us() - t_start;
+    stats.state = status == DECODE_OK ? WARMUP_DONE : status == DECODE_CANCELLED ? WARMUP_CANCELLED : WARMUP_FAILED;
+    LOGI("Warmup %s in %.1f ms: prefaulted %.1f MB in %.1f ms, decode %.1f ms",
+         stats.state == WARMUP_DONE ? "done" : stats.state == WARMUP_CANCELLED ? "cancelled" : "failed",
+         stats.t_total_us / 1000.0, stats.n_prefault_bytes / (1024.0 * 1024.0),
+         stats.t_prefault_us / 1000.0, stats.t_decode_us / 1000.0);
+    publish_warmup_stats(wrapper);
+    return stats.state == WARMUP_DONE ? JNI_TRUE : JNI_FALSE;
+}
+
+/**
+ * 请求停止进行中的预热（可在任意线程调用）
+ */
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_cancelWarmup(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    if (modelHandle != 0) {
+        reinterpret_cast<llama_context_wrapper*>(modelHandle)->warmup_cancel.store(true);
+    }
+}
+
+/**
+ * 最近一次预热的统计：[状态, 预读耗时, 预读字节, 预热解码耗时, 总耗时]，时间为微秒
+ * 预热进行中调用时状态为 RUNNING、其余为 0，可在任意线程调用
+ */
+extern "C" JNIEXPORT jlongArray JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getWarmupStats(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    jlong values[WARMUP_STATS_FIELDS] = {0};
+    if (modelHandle != 0) {
+        llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+        warmup_stats stats;
+        {
+            std::lock_guard<std::mutex> lock(wrapper->warmup_mutex);
+            stats = wrapper->last_warmup;
+        }
+        values[0] = stats.state;
+        values[1] = stats.t_prefault_us;
+        values[2] = stats.n_prefault_bytes;
+        values[3] = stats.t_decode_us;
+        values[4] = stats.t_total_us;
+    }
+
+    jlongArray result = env->NewLongArray(WARMUP_STATS_FIELDS);
+    if (result != nullptr) {
+        env->SetLongArrayRegion(result, 0, WARMUP_STATS_FIELDS, values);
+    }
+    return result;
+}
+
+// ============================================
+// GPU 设备枚举与层数实测
+// ============================================
+
+// 实测时先解码的预热 token 数（包含 GPU 管线编译等一次性开销，不计时）
+#define GPU_CALIBRATION_WARMUP_TOKENS 2
+
+/**
+ * 枚举 ggml 注册的 GPU 设备
+ * @return 每个设备一项："名称\t描述\t可用显存字节\t总显存字节"
+ */
+extern "C" JNIEXPORT jobjectArray JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getGpuDevices(
+    JNIEnv* env,
+    jobject /* this */) {
+
+    const std::vector<gpu_device_info> devices = enumerate_gpu_devices();
+    jclass string_class = env->FindClass("java/lang/String");
+    jobjectArray result = env->NewObjectArray((jsize) devices.size(), string_class, nullptr);
+    if (result == nullptr) {
+        return nullptr;
+    }
+
+    for (size_t i = 0; i < devices.size(); i++) {
+        const gpu_device_info& dev = devices[i];
+        const std::string line = dev.name + "\t" + dev.description + "\t" +
+            std::to_string(dev.memory_free) + "\t" + std::to_string(dev.memory_total);
+        jstring item = env->NewStringUTF(line.c_str());
+        env->SetObjectArrayElement(result, (jsize) i, item);
+        env->DeleteLocalRef(item);
+    }
+    return result;
+}
+
+/**
+ * 以 n_gpu_layers 个 GPU 层加载模型并创建与正式使用相同大小的上下文，测量单 token 解码耗时
+ * @return 每 token 平均微秒数；加载或创建上下文失败返回 -1
+ */
+static int64_t measure_gpu_layers(const char* path, int n_gpu_layers, int context_size,
+                                  int batch_size, int n_gen) {
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = n_gpu_layers;
+    llama_model* model = llama_load_model_from_file(path, model_params);
+    if (model == nullptr) {
+        return -1;
+    }
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = context_size;
+    ctx_params.n_threads = default_decode_threads();
+    ctx_params.n_threads_batch = default_batch_threads();
+    if (batch_size > 0) {
+        ctx_params.n_batch = batch_size;
+        ctx_params.n_ubatch = std::min<uint32_t>(ctx_params.n_ubatch, batch_size);
+    }
+    llama_context* ctx = llama_new_context_with_model(model, ctx_params);
+    if (ctx == nullptr) {
+        llama_free_model(model);
+        return -1;
+    }
+
+    // 解码耗时与 token 内容无关，固定使用同一个 token
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+    llama_token token = (llama_token) (llama_vocab_n_tokens(vocab) / 2);
+
+    int64_t elapsed_us = -1;
+    bool ok = true;
+    int64_t t_start_us = 0;
+    for (int i = 0; i < GPU_CALIBRATION_WARMUP_TOKENS + n_gen && ok; i++) {
+        if (i == GPU_CALIBRATION_WARMUP_TOKENS) {
+            t_start_us = ggml_time_us();
+        }
+        ok = llama_decode(ctx, llama_batch_get_one(&token, 1)) == 0;
+    }
+    if (ok) {
+        elapsed_us = (ggml_time_us() - t_start_us) / std::max(n_gen, 1);
+    }
+
+    llama_free(ctx);
+    llama_free_model(model);
+    return elapsed_us;
+}
+
+/**
+ * 实测不同 GPU 层数下的解码速度，供 Kotlin 按设备缓存最快的层数
+ *
+ * 候选为 0 层（纯 CPU）以及显存预算内最大层数的 1/4、1/2、3/4 和全部，从少到多依次测量；
+ * 某个层数创建上下文失败（显存不足）后不再测更多层。
+ * @param nGen 每个候选计时的解码 token 数
+ * @return [层数 0, 每 token 微秒 0, 层数 1, ...]，失败的候选耗时为 -1；没有 GPU 设备时返回 null
+ */
+extern "C" JNIEXPORT jlongArray JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_calibrateGpuLayers(
+    JNIEnv* env,
+    jobject /* this */,
+    jstring modelPath,
+    jint contextSize,
+    jint batchSize,
+    jint nGen) {
+
+    // 实测期间持有运行时，聊天模型尚未加载时后端也不会在两次候选之间关闭
+    runtime_acquire();
+    if (!detect_vulkan_available()) {
+        runtime_release();
+        return nullptr;
+    }
+
+    const char* path = env->GetStringUTFChars(modelPath, nullptr);
+    int n_layers = 0;
+    const int budget = gpu_layers_for_budget(path, &n_layers);
+    const int max_layers = std::min(budget, n_layers);
+
+    std::vector<int> candidates = { 0 };
+    for (int quarter = 1; quarter <= 4; quarter++) {
+        const int layers = quarter == 4 && budget == GPU_LAYERS_ALL ? GPU_LAYERS_ALL : max_layers * quarter / 4;
+        if (layers > candidates.back()) {
+            candidates.push_back(layers);
+        }
+    }
+
+    std::vector<jlong> results;
+    bool exhausted = false;
+    for (int layers : candidates) {
+        const int64_t us = exhausted ? -1 : measure_gpu_layers(path, layers, contextSize, batchSize, nGen);
+        LOGI("GPU calibration: %d layers -> %lld us/token", layers, (long long) us);
+        exhausted = exhausted || (us < 0 && layers > 0);
+        results.push_back(layers);
+        results.push_back(us);
+    }
+    env->ReleaseStringUTFChars(modelPath, path);
+    runtime_release();
+
+    jlongArray result = env->NewLongArray((jsize) results.size());
+    if (result != nullptr) {
+        env->SetLongArrayRegion(result, 0, (jsize) results.size(), results.data());
+    }
+    return result;
+}
+
+// ============================================
+// 线程数设置
+// ============================================
+
+/**
+ * 获取性能核（非最低频簇）的 CPU 编号
+ */
+extern "C" JNIEXPORT jintArray JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getPerformanceCores(
+    JNIEnv* env,
+    jobject /* this */) {
+
+    const std::vector<int>& cores = get_cpu_topology().performance_cores;
+    jintArray result = env->NewIntArray((jsize) cores.size());
+    if (result != nullptr) {
+        std::vector<jint> values(cores.begin(), cores.end());
+        env->SetIntArrayRegion(result, 0, (jsize) values.size(), values.data());
+    }
+    return result;
+}
+
+/**
+ * 设置解码 / 预填充线程数，<= 0 表示按性能核数自动选择；等待进行中的生成结束后再替换线程池
+ */
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_setThreadCounts(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jint threads,
+    jint batchThreads) {
+
+    if (modelHandle == 0) {
+        return;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    main_request_scope scope(wrapper);
+    apply_thread_counts(wrapper, threads, batchThreads);
+}
+
+/**
+ * 获取当前线程数 [解码, 预填充]
+ */
+extern "C" JNIEXPORT jintArray JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getThreadCounts(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    jint values[2] = {0, 0};
+    if (modelHandle != 0) {
+        llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+        values[0] = wrapper->n_threads;
+        values[1] = wrapper->n_threads_batch;
+    }
+
+    jintArray result = env->NewIntArray(2);
+    if (result != nullptr) {
+        env->SetIntArrayRegion(result, 0, 2, values);
+    }
+    return result;
+}
+
+// ============================================
+// KV 缓存复用统计
+// ============================================
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getLastPromptTokenCount(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    if (modelHandle == 0) {
+        return 0;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    return wrapper->last_prompt_tokens;
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getLastReusedTokenCount(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    if (modelHandle == 0) {
+        return 0;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    return wrapper->last_reused_tokens;
+}
+
+// ============================================
+// 生成性能统计
+// ============================================
+
+// getLastGenerationStats 返回数组的长度（顺序与 Kotlin GenerationStats.fromArray 一致）
+#define GENERATION_STATS_FIELDS 22
+
+/**
+ * 获取最近一次已结束的 generate / generateStream 的性能统计（生成进行中调用返回上一次的结果）
+ * 时间均为微秒：[TTFT, 总耗时, 分词, 预填充, 生成解码, 起草, 采样, 转文本, 回调,
+ *               提示词 token 数, 复用 token 数, 预填充 token 数, 生成 token 数,
+ *               perf 预填充耗时, perf 生成耗时, perf 预填充 token 数, perf 生成 token 数, 请求开始时刻,
+ *               调速模式, 调速模式切换次数, 上下文滑动次数, 丢弃 token 数]
+ */
+extern "C" JNIEXPORT jlongArray JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getLastGenerationStats(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    jlong values[GENERATION_STATS_FIELDS] = {0};
+    if (modelHandle != 0) {
+        llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+        generation_stats stats;
+        {
+            std::lock_guard<std::mutex> lock(wrapper->stats_mutex);
+            stats = wrapper->last_stats;
+        }
+        values[0] = stats.t_first_token_us;
+        values[1] = stats.t_total_us;
+        values[2] = stats.t_tokenize_us;
+        values[3] = stats.t_prefill_us;
+        values[4] = stats.t_decode_us;
+        values[5] = stats.t_draft_us;
+        values[6] = stats.t_sample_us;
+        values[7] = stats.t_detokenize_us;
+        values[8] = stats.t_callback_us;
+        values[9] = stats.n_prompt_tokens;
+        values[10] = stats.n_reused_tokens;
+        values[11] = stats.n_prefill_tokens;
+        values[12] = stats.n_generated_tokens;
+        values[13] = (jlong) (stats.perf_prompt_eval_ms * 1000.0);
+        values[14] = (jlong) (stats.perf_eval_ms * 1000.0);
+        values[15] = stats.perf_n_prompt_eval;
+        values[16] = stats.perf_n_eval;
+        values[17] = stats.t_start_us;
+        values[18] = stats.governor_mode;
+        values[19] = stats.governor_mode_changes;
+        values[20] = stats.n_context_shifts;
+        values[21] = stats.n_discarded_tokens;
+    } else {
+        values[0] = -1;
+    }
+
+    jlongArray result = env->NewLongArray(GENERATION_STATS_FIELDS);
+    if (result != nullptr) {
+        env->SetLongArrayRegion(result, 0, GENERATION_STATS_FIELDS, values);
+    }
+    return result;
+}
+
+// ============================================
+// 推理调速
+// ============================================
+
+/**
+ * 更新设备温控状态（由 Kotlin 在温控回调和每次生成前调用，可与生成并发）
+ * @param thermalStatus PowerManager.THERMAL_STATUS_*，API 29 以下传 0
+ * @param thermalHeadroom PowerManager.getThermalHeadroom，未知时传负数
+ * @param powerSave 是否处于省电模式
+ */
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_setDeviceThermalState(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jint thermalStatus,
+    jfloat thermalHeadroom,
+    jboolean powerSave) {
+
+    if (modelHandle == 0) {
+        return;
+    }
+
+    inference_governor& governor = reinterpret_cast<llama_context_wrapper*>(modelHandle)->governor;
+    governor.thermal_status.store(thermalStatus);
+    governor.thermal_headroom.store(thermalHeadroom);
+    governor.power_save.store(powerSave == JNI_TRUE);
+}
+
+/**
+ * 启用 / 关闭调速器，关闭后下一次生成回到 NORMAL 模式
+ */
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_setGovernorEnabled(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jboolean enabled) {
+
+    if (modelHandle == 0) {
+        return;
+    }
+
+    reinterpret_cast<llama_context_wrapper*>(modelHandle)->governor.enabled.store(enabled == JNI_TRUE);
+}
+
+// ============================================
+// 上下文滑动窗口设置
+// ============================================
+
+/**
+ * 设置超出上下文时的滑动窗口
+ * @param enabled 关闭后超出 n_ctx 的请求直接失败（旧行为）
+ * @param keepTokens 固定在窗口开头的 token 数，< 0 表示自动固定系统提示词（到第一个 <|im_end|>）
+ */
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_setContextShift(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jboolean enabled,
+    jint keepTokens) {
+
+    if (modelHandle == 0) {
+        return;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    std::lock_guard<std::mutex> lock(wrapper->ctx_mutex);
+    wrapper->context_shift = enabled == JNI_TRUE;
+    wrapper->n_keep = keepTokens;
+}
+
+// ============================================
+// 输出过滤设置
+// ============================================
+
+// 读取 Java String[]，null 视为空列表
+static std::vector<std::string> jstring_array_to_vector(JNIEnv* env, jobjectArray array) {
+    std::vector<std::string> values;
+    const jsize n = array != nullptr ? env->GetArrayLength(array) : 0;
+    for (jsize i = 0; i < n; i++) {
+        jstring item = (jstring) env->GetObjectArrayElement(array, i);
+        const char* chars = item != nullptr ? env->GetStringUTFChars(item, nullptr) : nullptr;
+        values.emplace_back(chars != nullptr ? chars : "");
+        if (chars != nullptr) {
+            env->ReleaseStringUTFChars(item, chars);
+        }
+        env->DeleteLocalRef(item);
+    }
+    return values;
+}
+
+/**
+ * 设置输出过滤规则（对之后的 generate / generateStream 和后台会话调度步生效）
+ * 主请求和后台会话的过滤器引用 filter_config，在 ctx_mutex 下替换：会等待进行中的解码结束
+ * @param stopSequences 停止序列，生成文本出现任一序列即停止，序列本身不输出
+ * @param hiddenOpen 隐藏片段开始标记，与 hiddenClose 一一对应
+ * @param hiddenClose 隐藏片段结束标记
+ */
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_setOutputFilter(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jobjectArray stopSequences,
+    jobjectArray hiddenOpen,
+    jobjectArray hiddenClose) {
+
+    if (modelHandle == 0) {
+        return;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    output_filter_config config;
+    config.stops = jstring_array_to_vector(env, stopSequences);
+    config.spans.clear();
+
+    const std::vector<std::string> open = jstring_array_to_vector(env, hiddenOpen);
+    const std::vector<std::string> close = jstring_array_to_vector(env, hiddenClose);
+    for (size_t i = 0; i < std::min(open.size(), close.size()); i++) {
+        if (!open[i].empty()) {
+            config.spans.push_back({ open[i], close[i] });
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(wrapper->ctx_mutex);
+        wrapper->filter_config = config;
+    }
+    LOGD("Output filter: %zu stop sequences, %zu hidden spans", config.stops.size(), config.spans.size());
+}
+
+// ============================================
+// 取消正在进行的生成
+// ============================================
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_cancelGeneration(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    if (modelHandle == 0) {
+        return;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    {
+        std::lock_guard<std::mutex> guard(wrapper->cancel_mutex);
+        wrapper->cancel_seq = wrapper->request_seq;
+        wrapper->cancel_requested.store(true);
+    }
+    LOGI("Generation cancel requested");
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_generate(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jstring prompt,
+    jint maxTokens,
+    jfloat temperature,
+    jfloat topP,
+    jint topK) {
+
+    if (modelHandle == 0) {
+        LOGE("Model handle is null");
+        return env->NewStringUTF("");
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    main_request_scope scope(wrapper);
+    if (!ensure_context(wrapper)) {
+        return env->NewStringUTF("");
+    }
+    begin_generation_stats(wrapper);
+    const char *promptStr = env->GetStringUTFChars(prompt, nullptr);
+    LOGD("Generating text for prompt (length: %zu)", strlen(promptStr));
+
+    // Tokenize prompt（写入复用的缓冲区）
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    std::vector<llama_token>& tokens = wrapper->prompt_tokens;
+
+    int n_tokens;
+    {
+        phase_timer timer(&wrapper->stats.t_tokenize_us, "llama:tokenize");
+        n_tokens = tokenize_prompt(vocab, promptStr, tokens);
+    }
+
+    env->ReleaseStringUTFChars(prompt, promptStr);
+
+    if (n_tokens <= 0) {
+        LOGE("Failed to tokenize prompt");
+        return env->NewStringUTF("");
+    }
+
+    LOGD("Prompt tokenized: %d tokens", n_tokens);
+
+    // 参数不变时复用上一次的采样链
+    llama_sampler* smpl = reuse_sampler(wrapper->sampler, wrapper->sampler_config,
+                                        sampler_params{ temperature, topP, topK });
+
+    // 超出上下文时丢弃最早的轮次，再复用 KV 缓存中与上一轮相同的前缀，只解码新增部分
+    fit_prompt_to_context(wrapper, tokens, maxTokens);
+    int n_past = reuse_cached_prefix(wrapper, tokens);
+    wrapper->stats.n_prompt_tokens = (int) tokens.size();
+    wrapper->stats.n_reused_tokens = n_past;
+
+    // 分批评估提示词
+    decode_status status = decode_prompt_chunked(wrapper, tokens, n_past, nullptr);
+    if (status != DECODE_OK) {
+        if (status == DECODE_CANCELLED) {
+            LOGI("Generation cancelled during prefill");
+        } else {
+            LOGE("Failed to decode prompt");
+            invalidate_cached_prefix(wrapper);
+        }
+        finish_generation_stats(wrapper, 0);
+        return env->NewStringUTF("");
+    }
+    capture_prompt_snapshots(wrapper, tokens);
+    accept_prompt_tokens(smpl, tokens);
+
+    // 生成tokens（经输出过滤：遇到停止序列即停止，隐藏片段不计入结果）
+    std::string& result = wrapper->output_text;
+    result.clear();
+    output_filter filter(wrapper->filter_config);
+    auto on_token = [&](llama_token token) -> bool {
+        // 将token转换为文本
+        char piece[256];
+        int n_piece;
+        {
+            phase_timer timer(&wrapper->stats.t_detokenize_us, "llama:detokenize");
+            n_piece = llama_token_to_piece(vocab, token, piece, sizeof(piece), 0, false);
+        }
+        if (n_piece > 0 && !filter_feed(filter, piece, n_piece, result)) {
+            LOGD("Stop sequence found in generated text, stopping");
+            return false;
+        }
+        return true;
+    };
+
+    int n_generated = 0;
+    status = generate_tokens(wrapper, smpl, maxTokens, on_token, &n_generated);
+    filter_finish(filter, result);
+    if (status == DECODE_CANCELLED) {
+        LOGI("Generation cancelled after %d tokens", n_generated);
+    } else if (status == DECODE_FAILED) {
+        LOGE("Failed to decode token");
+        invalidate_cached_prefix(wrapper);
+    }
+
+    finish_generation_stats(wrapper, n_generated);
+
+    LOGD("Generation completed: %d tokens generated", n_generated);
+    return new_string_utf8(env, result);
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_freeModel(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    if (modelHandle == 0) {
+        LOGW("Attempting to free null model handle");
+        return;
+    }
+
+    LOGD("Freeing model");
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+
+    // 让仍在 runSession 中等待的线程返回、进行中的预热尽快结束，再等进行中的解码结束
+    wrapper->warmup_cancel.store(true);
+    for (inference_session* s : wrapper->sessions) {
+        s->release_requested.store(true);
+    }
+    {
+        std::unique_lock<std::mutex> lock(wrapper->session_mutex);
+        wrapper->session_cv.notify_all();
+        wrapper->session_cv.wait(lock, [wrapper] { return wrapper->n_session_runners.load() == 0; });
+    }
+    {
+        std::lock_guard<std::mutex> lock(wrapper->ctx_mutex);
+        free_sessions(wrapper);
+    }
+
+    free_threadpools(wrapper);
+    free_draft_model(wrapper);
+
+    if (wrapper->sampler) {
+        llama_sampler_free(wrapper->sampler);
+    }
+    if (wrapper->ctx) {
+        llama_free(wrapper->ctx);
+    }
+    for (llama_adapter_lora* adapter : wrapper->lora_adapters) {
+        llama_adapter_lora_free(adapter);
+    }
+    if (wrapper->model) {
+        llama_free_model(wrapper->model);
+    }
+
+    delete wrapper;
+    runtime_release();
+
+    LOGD("Model freed successfully");
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_generateStream(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jstring prompt,
+    jint maxTokens,
+    jfloat temperature,
+    jfloat topP,
+    jint topK,
+    jobject buffer,
+    jint flushTokens,
+    jint flushIntervalMs,
+    jobject callback) {
+
+    if (modelHandle == 0) {
+        LOGE("Model handle is null");
+        return;
+    }
+
+    uint8_t* ring_data = static_cast<uint8_t*>(env->GetDirectBufferAddress(buffer));
+    const jlong ring_capacity = env->GetDirectBufferCapacity(buffer);
+    if (ring_data == nullptr || ring_capacity < 4) {
+        LOGE("Stream buffer must be a direct ByteBuffer of at least 4 bytes");
+        return;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    main_request_scope scope(wrapper);
+    if (!ensure_context(wrapper)) {
+        jmethodID onErrorMethod = env->GetMethodID(env->GetObjectClass(callback), "onError", "(Ljava/lang/String;)V");
+        if (onErrorMethod != nullptr) {
+            env->CallVoidMethod(callback, onErrorMethod, env->NewStringUTF("Failed to recreate context"));
+        }
+        return;
+    }
+    begin_generation_stats(wrapper);
+    const char *promptStr = env->GetStringUTFChars(prompt, nullptr);
+    LOGD("Generating text (stream) for prompt (length: %zu)", strlen(promptStr));
+
+    // 获取回调方法
+    jclass callbackClass = env->GetObjectClass(callback);
+    jmethodID onTextMethod = env->GetMethodID(callbackClass, "onText", "(II)V");
+    jmethodID onCompleteMethod = env->GetMethodID(callbackClass, "onComplete", "()V");
+    jmethodID onErrorMethod = env->GetMethodID(callbackClass, "onError", "(Ljava/lang/String;)V");
+
+    if (onTextMethod == nullptr || onCompleteMethod == nullptr || onErrorMethod == nullptr) {
+        LOGE("Failed to get callback methods");
+        env->ReleaseStringUTFChars(prompt, promptStr);
+        return;
+    }
+
+    // 预填充进度回调为可选方法
+    jmethodID onPrefillProgressMethod = env->GetMethodID(callbackClass, "onPrefillProgress", "(II)V");
+    if (onPrefillProgressMethod == nullptr) {
+        env->ExceptionClear();
+    }
+
+    // Tokenize prompt（写入复用的缓冲区）
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    std::vector<llama_token>& tokens = wrapper->prompt_tokens;
+
+    int n_tokens;
+    {
+        phase_timer timer(&wrapper->stats.t_tokenize_us, "llama:tokenize");
+        n_tokens = tokenize_prompt(vocab, promptStr, tokens);
+    }
+
+    env->ReleaseStringUTFChars(prompt, promptStr);
+
+    if (n_tokens <= 0) {
+        LOGE("Failed to tokenize prompt");
+        jstring errorMsg = env->NewStringUTF("Failed to tokenize prompt");
+        env->CallVoidMethod(callback, onErrorMethod, errorMsg);
+        return;
+    }
+
+    LOGD("Prompt tokenized: %d tokens", n_tokens);
+
+    // 参数不变时复用上一次的采样链
+    llama_sampler* smpl = reuse_sampler(wrapper->sampler, wrapper->sampler_config,
+                                        sampler_params{ temperature, topP, topK });
+
+    // 超出上下文时丢弃最早的轮次，再复用 KV 缓存中与上一轮相同的前缀，只解码新增部分
+    fit_prompt_to_context(wrapper, tokens, maxTokens);
+    int n_past = reuse_cached_prefix(wrapper, tokens);
+    wrapper->stats.n_prompt_tokens = (int) tokens.size();
+    wrapper->stats.n_reused_tokens = n_past;
+
+    // 分批评估提示词，并通过回调报告预填充进度
+    prefill_progress_fn on_progress = nullptr;
+    if (onPrefillProgressMethod != nullptr) {
+        on_progress = [env, callback, onPrefillProgressMethod](int processed, int total) {
+            env->CallVoidMethod(callback, onPrefillProgressMethod, processed, total);
+        };
+    }
+
+    decode_status status = decode_prompt_chunked(wrapper, tokens, n_past, on_progress);
+    if (status == DECODE_CANCELLED) {
+        LOGI("Stream generation cancelled during prefill");
+        finish_generation_stats(wrapper, 0);
+        env->CallVoidMethod(callback, onCompleteMethod);
+        return;
+    }
+    if (status == DECODE_FAILED) {
+        LOGE("Failed to decode prompt");
+        invalidate_cached_prefix(wrapper);
+        finish_generation_stats(wrapper, 0);
+        jstring errorMsg = env->NewStringUTF("Failed to decode prompt");
+        env->CallVoidMethod(callback, onErrorMethod, errorMsg);
+        return;
+    }
+    capture_prompt_snapshots(wrapper, tokens);
+    accept_prompt_tokens(smpl, tokens);
+
+    // 生成tokens：经输出过滤后只把可见文本写入共享缓冲区，按 token 数 / 时间间隔批量交付，
+    // 隐藏片段（如思考内容）不跨 JNI
+    output_filter filter(wrapper->filter_config);
+    stream_ring ring(env, callback, onTextMethod, ring_data, (size_t) ring_capacity,
+                     flushTokens, flushIntervalMs, &wrapper->stats.t_callback_us);
+    auto on_token = [&](llama_token token) -> bool {
+        // 将token转换为文本
+        char piece[256];
+        int n_piece;
+        {
+            phase_timer timer(&wrapper->stats.t_detokenize_us, "llama:detokenize");
+            n_piece = llama_token_to_piece(vocab, token, piece, sizeof(piece), 0, false);
+        }
+        if (n_piece > 0 && !filter_feed(filter, piece, n_piece, ring.pending)) {
+            LOGD("Stop sequence found in generated text, stopping");
+            return false;
+        }
+        stream_ring_on_token(ring);
+        return true;
+    };
+
+    int n_generated = 0;
+    status = generate_tokens(wrapper, smpl, maxTokens, on_token, &n_generated);
+    filter_finish(filter, ring.pending);
+    stream_ring_flush(ring, true);
+    if (status == DECODE_CANCELLED) {
+        LOGI("Stream generation cancelled after %d tokens", n_generated);
+    } else if (status == DECODE_FAILED) {
+        LOGE("Failed to decode token");
+        invalidate_cached_prefix(wrapper);
+    }
+
+    finish_generation_stats(wrapper, n_generated);
+
+    LOGD("Stream generation completed: %d tokens generated", n_generated);
+    env->CallVoidMethod(callback, onCompleteMethod);
+}
+
+// ============================================
+// 会话 KV 状态持久化（按对话保存 / 恢复序列 0）
+// ============================================
+
+/**
+ * 获取 KV 缓存中序列 0 已有的 token 数
+ */
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getCachedTokenCount(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    if (modelHandle == 0) {
+        return 0;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    return (jint) wrapper->cached_tokens.size();
+}
+
+/**
+ * 将序列 0 的 KV 状态连同其 token 列表写入文件
+ * @param path 会话状态文件路径
+ * @return 写入的字节数，0 表示失败或缓存为空
+ */
+extern "C" JNIEXPORT jlong JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_saveSessionState(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jstring path) {
+
+    if (modelHandle == 0) {
+        LOGE("Invalid model handle");
+        return 0;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    std::lock_guard<std::mutex> lock(wrapper->ctx_mutex);
+    if (wrapper->cached_tokens.empty()) {
+        return 0;
+    }
+
+    const int64_t t_start = ggml_time_us();
+    const char* path_str = env->GetStringUTFChars(path, nullptr);
+    const size_t n_bytes = llama_state_seq_save_file(
+        wrapper->ctx, path_str, 0, wrapper->cached_tokens.data(), wrapper->cached_tokens.size());
+
+    if (n_bytes == 0) {
+        LOGE("Failed to save session state to %s", path_str);
+    } else {
+        LOGI("Session state saved: %zu tokens, %zu bytes in %.1f ms",
+             wrapper->cached_tokens.size(), n_bytes, (ggml_time_us() - t_start) / 1000.0);
+    }
+    env->ReleaseStringUTFChars(path, path_str);
+    return (jlong) n_bytes;
+}
+
+/**
+ * 从文件恢复序列 0 的 KV 状态和 token 列表，替换当前缓存
+ * 之后的请求会与恢复的 token 做前缀匹配，只需预填充新增部分
+ * @param path 会话状态文件路径
+ * @return 恢复的 token 数，失败返回 -1（此时缓存被清空）
+ */
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_loadSessionState(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jstring path) {
+
+    if (modelHandle == 0) {
+        LOGE("Invalid model handle");
+        return -1;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    std::lock_guard<std::mutex> lock(wrapper->ctx_mutex);
+    if (!ensure_context(wrapper)) {
+        return -1;
+    }
+    const int64_t t_start = ggml_time_us();
+
+    // 先清空，保证序列 0 只包含恢复的状态
+    invalidate_cached_prefix(wrapper);
+
+    std::vector<llama_token> tokens(main_context_size(wrapper));
+    size_t n_tokens = 0;
+    const char* path_str = env->GetStringUTFChars(path, nullptr);
+    const size_t n_bytes = llama_state_seq_load_file(
+        wrapper->ctx, path_str, 0, tokens.data(), tokens.size(), &n_tokens);
+
+    if (n_bytes == 0) {
+        LOGE("Failed to load session state from %s", path_str);
+        env->ReleaseStringUTFChars(path, path_str);
+        invalidate_cached_prefix(wrapper);
+        return -1;
+    }
+
+    tokens.resize(n_tokens);
+    wrapper->cached_tokens.swap(tokens);
+    LOGI("Session state restored: %zu tokens, %zu bytes in %.1f ms",
+         n_tokens, n_bytes, (ggml_time_us() - t_start) / 1000.0);
+    env->ReleaseStringUTFChars(path, path_str);
+    return (jint) n_tokens;
+}
+
+/**
+ * 指定需要固定的系统提示词：之后预填充经过这段前缀时保存为固定快照，不参与 LRU 淘汰，
+ * 切换对话或注入不同知识块后只需预填充知识块和用户问题。不会立即解码，也不改动序列 0
+ * @param prompt 格式化后的 ChatML 系统提示词块，null 表示取消固定
+ * @return 系统提示词的 token 数；未启用提示词快照或分词失败返回 -1
+ */
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_pinSystemPrompt(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jstring prompt) {
+
+    if (modelHandle == 0) {
+        return -1;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    std::lock_guard<std::mutex> lock(wrapper->ctx_mutex);
+    if (wrapper->snapshots.empty()) {
+        return -1;
+    }
+
+    std::vector<llama_token> tokens;
+    if (prompt != nullptr) {
+        const char* prompt_str = env->GetStringUTFChars(prompt, nullptr);
+        const int n_tokens = tokenize_prompt(llama_model_get_vocab(wrapper->model), prompt_str, tokens);
+        env->ReleaseStringUTFChars(prompt, prompt_str);
+        if (n_tokens < 0) {
+            return -1;
+        }
+    }
+    if (tokens == wrapper->pinned_prompt) {
+        return (jint) tokens.size();
+    }
+
+    // 固定的内容变了：旧的固定快照回到 LRU，由之后的请求自然淘汰
+    for (prompt_snapshot& snap : wrapper->snapshots) {
+        snap.pinned = false;
+    }
+    wrapper->pinned_prompt.swap(tokens);
+    LOGD("Pinned system prompt: %zu tokens", wrapper->pinned_prompt.size());
+    return (jint) wrapper->pinned_prompt.size();
+}
+
+// ============================================
+// LoRA 适配器（一份基础权重，按对话 / 会话挂载微调）
+// ============================================
+
+/**
+ * 加载 LoRA 适配器并挂在已加载的基础模型上，只占用适配器本身的内存，加载后默认不启用
+ * 适配器必须基于同一个基础模型训练
+ * @param path 适配器 GGUF 路径
+ * @return 适配器编号（>= 0），失败返回 -1
+ */
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_loadLoraAdapter(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jstring path) {
+
+    if (modelHandle == 0) {
+        return -1;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    std::lock_guard<std::mutex> lock(wrapper->ctx_mutex);
+
+    const char* path_str = env->GetStringUTFChars(path, nullptr);
+    const int64_t t_start = ggml_time_us();
+    llama_adapter_lora* adapter = llama_adapter_lora_init(wrapper->model, path_str);
+    if (adapter == nullptr) {
+        LOGE("Failed to load LoRA adapter from %s", path_str);
+        env->ReleaseStringUTFChars(path, path_str);
+        return -1;
+    }
+
+    wrapper->lora_adapters.push_back(adapter);
+    const int id = (int) wrapper->lora_adapters.size() - 1;
+    LOGI("LoRA adapter %d loaded from %s in %.1f ms", id, path_str, (ggml_time_us() - t_start) / 1000.0);
+    env->ReleaseStringUTFChars(path, path_str);
+    return id;
+}
+
+/**
+ * 设置主对话或某个后台会话使用的适配器缩放
+ *
+ * 主对话的组合改变后序列 0 的 KV 缓存和提示词快照是按旧权重算出的，一并清空；
+ * 后台会话只能在未运行时设置，未设置的会话提交时沿用主对话的组合
+ *
+ * @param sessionId 0 表示主对话，>= 1 为后台会话 ID
+ * @param adapterId loadLoraAdapter 返回的编号
+ * @param scale 缩放，0 表示停用
+ * @return 参数无效或会话正在运行时返回 false
+ */
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_setLoraAdapter(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jint sessionId,
+    jint adapterId,
+    jfloat scale) {
+
+    if (modelHandle == 0) {
+        return JNI_FALSE;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    std::lock_guard<std::mutex> lock(wrapper->ctx_mutex);
+    if (adapterId < 0 || adapterId >= (jint) wrapper->lora_adapters.size()) {
+        LOGE("Invalid LoRA adapter %d", adapterId);
+        return JNI_FALSE;
+    }
+
+    if (sessionId == 0) {
+        std::vector<float> scales = wrapper->lora_main;
+        scales.resize(wrapper->lora_adapters.size(), 0.0f);
+        scales[adapterId] = scale;
+        if (lora_equal(scales, wrapper->lora_main)) {
+            return JNI_TRUE;
+        }
+        {
+            std::lock_guard<std::mutex> session_lock(wrapper->session_mutex);
+            wrapper->lora_main.swap(scales);
+        }
+        if (wrapper->ctx != nullptr) {
+            invalidate_cached_prefix(wrapper);
+            for (prompt_snapshot& snap : wrapper->snapshots) {
+                drop_prompt_snapshot(wrapper, snap);
+            }
+        }
+        LOGI("Main conversation LoRA adapter %d scale set to %.2f", adapterId, scale);
+        return JNI_TRUE;
+    }
+
+    inference_session* s = find_session(wrapper, sessionId);
+    const int state = s != nullptr ? s->state.load() : SESSION_FREE;
+    if (s == nullptr || state == SESSION_PREFILL || state == SESSION_GENERATE) {
+        LOGE("Background session %d is not available for LoRA changes", sessionId);
+        return JNI_FALSE;
+    }
+    if (!s->lora_custom) {
+        s->lora = wrapper->lora_main;
+        s->lora_custom = true;
+    }
+    s->lora.resize(wrapper->lora_adapters.size(), 0.0f);
+    s->lora[adapterId] = scale;
+    return JNI_TRUE;
+}
+
+// ============================================
+// 后台会话（与主对话并行的生成任务，如自动标题、摘要）
+// ============================================
+
+/**
+ * 分配一个空闲的后台会话
+ * @return 会话 ID（即其 seq_id，>= 1）；未启用后台会话或没有空闲槽位时返回 -1
+ */
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_createSession(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    if (modelHandle == 0) {
+        return -1;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        for (inference_session* s : wrapper->sessions) {
+            int expected = SESSION_FREE;
+            if (s->state.compare_exchange_strong(expected, SESSION_IDLE)) {
+                return s->seq_id;
+            }
+        }
+        // 已释放但尚未回收的槽位：上下文空闲时就地回收后再找一次
+        if (attempt > 0 || wrapper->main_waiting.load() > 0 || !wrapper->ctx_mutex.try_lock()) {
+            break;
+        }
+        reap_sessions(wrapper);
+        wrapper->ctx_mutex.unlock();
+    }
+    LOGW("No free background session (%zu in use)", wrapper->sessions.size());
+    return -1;
+}
+
+/**
+ * 向空闲会话（新建或上次结果已被 runSession 取走）提交生成请求，提示词格式与 generate 相同
+ * 采样链与 generate 一致，输出经过同样的停止序列 / 隐藏片段过滤
+ * @return 会话不可用或提示词放不进会话上下文时返回 false
+ */
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_submitSession(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jint sessionId,
+    jstring prompt,
+    jint maxTokens,
+    jfloat temperature,
+    jfloat topP,
+    jint topK) {
+
+    if (modelHandle == 0) {
+        return JNI_FALSE;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    inference_session* s = find_session(wrapper, sessionId);
+    if (s == nullptr || s->state.load() != SESSION_IDLE || s->release_requested.load()) {
+        LOGE("Background session %d is not idle", sessionId);
+        return JNI_FALSE;
+    }
+
+    // 会话处于空闲状态时调度步不会访问它，这里可以不持有 ctx_mutex
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    const char* promptStr = env->GetStringUTFChars(prompt, nullptr);
+    const int n_tokens = tokenize_prompt(vocab, promptStr, s->prompt);
+    env->ReleaseStringUTFChars(prompt, promptStr);
+
+    if (n_tokens <= 0 || n_tokens >= wrapper->session_ctx) {
+        LOGE("Background prompt of %d tokens does not fit session context %d", n_tokens, wrapper->session_ctx);
+        s->prompt.clear();
+        return JNI_FALSE;
+    }
+
+    llama_sampler* smpl = reuse_sampler(s->smpl, s->sampler_config, sampler_params{ temperature, topP, topK });
+    accept_prompt_tokens(smpl, s->prompt);
+
+    if (!s->lora_custom) {
+        std::lock_guard<std::mutex> lock(wrapper->session_mutex);
+        s->lora = wrapper->lora_main;
+    }
+    s->n_past = 0;
+    s->max_tokens = std::max(1, (int) maxTokens);
+    s->n_generated = 0;
+    s->text.clear();
+    filter_reset(s->filter);
+    s->state.store(SESSION_PREFILL);
+
+    LOGD("Background session %d submitted: %d prompt tokens", s->seq_id, n_tokens);
+    return JNI_TRUE;
+}
+
+/**
+ * 阻塞直到会话生成结束。主请求进行中时会话随其每个解码步合批推进，
+ * 上下文空闲时由调用线程执行调度步，同时推进所有后台会话
+ * @return 过滤后的生成文本；会话未提交或被 releaseSession / freeModel 放弃时返回 null
+ */
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_runSession(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jint sessionId) {
+
+    if (modelHandle == 0) {
+        return nullptr;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    inference_session* s = find_session(wrapper, sessionId);
+    if (s == nullptr) {
+        return nullptr;
+    }
+
+    wrapper->n_session_runners++;
+    bool done = false;
+    while (!s->release_requested.load()) {
+        const int state = s->state.load();
+        if (state == SESSION_DONE) {
+            done = true;
+            break;
+        }
+        if (state != SESSION_PREFILL && state != SESSION_GENERATE) {
+            break;
+        }
+
+        // 主请求在等锁时让路，避免后台任务拖慢前台对话
+        if (wrapper->main_waiting.load() == 0 && wrapper->ctx_mutex.try_lock()) {
+            if (!ensure_context(wrapper)) {
+                wrapper->ctx_mutex.unlock();
+                break;
+            }
+            {
+                std::lock_guard<std::mutex> compute(get_runtime().compute_mutex);
+                step_sessions(wrapper);
+            }
+            wrapper->ctx_mutex.unlock();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(wrapper->session_mutex);
+        wrapper->session_cv.wait_for(lock, std::chrono::milliseconds(SESSION_POLL_MS), [s] {
+            return s->state.load() == SESSION_DONE || s->release_requested.load();
+        });
+    }
+
+    std::string text;
+    if (done) {
+        text.swap(s->text);
+        s->state.store(SESSION_IDLE);
+    }
+    wrapper->n_session_runners--;
+    notify_sessions(wrapper);
+
+    return done ? new_string_utf8(env, text) : nullptr;
+}
+
+/**
+ * 释放会话，进行中的生成被放弃；槽位与其 KV 在上下文空闲时回收
+ */
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_releaseSession(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jint sessionId) {
+
+    if (modelHandle == 0) {
+        return;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    inference_session* s = find_session(wrapper, sessionId);
+    if (s == nullptr || s->state.load() == SESSION_FREE) {
+        return;
+    }
+
+    s->release_requested.store(true);
+    notify_sessions(wrapper);
+    if (wrapper->main_waiting.load() == 0 && wrapper->ctx_mutex.try_lock()) {
+        reap_sessions(wrapper);
+        wrapper->ctx_mutex.unlock();
+    }
+}
+
+// ============================================
+// 投机解码草稿模型
+// ============================================
+
+/**
+ * 为主模型加载投机解码草稿模型
+ * @param modelHandle 主模型句柄
+ * @param draftModelPath 草稿模型路径 (如 Qwen3-0.6B-Q8_0.gguf)
+ * @param contextSize 草稿上下文大小（应与主模型一致）
+ * @param threads CPU 线程数
+ * @param draftLength 每步起草的 token 数
+ * @return 是否加载成功
+ */
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_initDraftModel(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jstring draftModelPath,
+    jint contextSize,
+    jint threads,
+    jint draftLength) {
+
+    if (modelHandle == 0) {
+        LOGE("Model handle is null");
+        return JNI_FALSE;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+
+    // 加载在锁外进行（耗时较长），替换 wrapper->draft 时再与生成路径互斥
+    const char *path = env->GetStringUTFChars(draftModelPath, nullptr);
+    LOGI("Initializing draft model from: %s (draft length: %d)", path, draftLength);
+
+    // 草稿模型与主模型使用相同的 GPU 层配置
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = wrapper->gpu_layers;
+
+    llama_model* model = llama_load_model_from_file(path, model_params);
+    const mapped_file_id model_file = file_id_of(path);
+    env->ReleaseStringUTFChars(draftModelPath, path);
+
+    if (model == nullptr) {
+        LOGE("Failed to load draft model");
+        return JNI_FALSE;
+    }
+
+    if (!is_draft_vocab_compatible(wrapper->model, model)) {
+        LOGE("Draft model vocab is incompatible with target model");
+        llama_free_model(model);
+        return JNI_FALSE;
+    }
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = contextSize;
+    ctx_params.n_batch = wrapper->n_batch;
+    ctx_params.n_ubatch = std::min<uint32_t>(ctx_params.n_ubatch, wrapper->n_batch);
+    ctx_params.n_threads = threads > 0 ? threads : wrapper->n_threads;
+    ctx_params.n_threads_batch = threads > 0 ? threads : wrapper->n_threads_batch;
+
+    llama_context* ctx = llama_new_context_with_model(model, ctx_params);
+    if (ctx == nullptr) {
+        LOGE("Failed to create draft context");
+        llama_free_model(model);
+        return JNI_FALSE;
+    }
+    llama_set_abort_callback(ctx, generation_abort_callback, wrapper);
+
+    llama_sampler* smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+
+    draft_model_wrapper* draft = new draft_model_wrapper();
+    draft->model = model;
+    draft->model_file = model_file;
+    draft->ctx = ctx;
+    draft->smpl = smpl;
+    draft->n_draft = std::max(0, (int) draftLength);
+
+    main_request_scope scope(wrapper);
+    if (threads <= 0) {
+        // 未指定线程数时与主模型共用性能核线程池（两者从不同时计算）
+        attach_threadpools(wrapper, ctx);
+    }
+    free_draft_model(wrapper);
+    wrapper->draft = draft;
+
+    LOGI("Draft model initialized successfully");
+    return JNI_TRUE;
+}
+
+/**
+ * 设置每步起草的 token 数，0 表示暂时关闭投机解码（不释放草稿模型）
+ */
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_setDraftLength(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jint draftLength) {
+
+    if (modelHandle == 0) {
+        return;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    std::lock_guard<std::mutex> lock(wrapper->ctx_mutex);
+    if (wrapper->draft != nullptr) {
+        wrapper->draft->n_draft = std::max(0, (int) draftLength);
+    }
+}
+
+/**
+ * 获取投机解码统计
+ * @return [起草长度, 验证步数, 起草 token 数, 接受 token 数]，未加载草稿模型时全为 0
+ */
+extern "C" JNIEXPORT jlongArray JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getSpeculativeStats(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    jlong stats[4] = {0, 0, 0, 0};
+
+    if (modelHandle != 0) {
+        llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+        std::lock_guard<std::mutex> lock(wrapper->ctx_mutex);
+        if (wrapper->draft != nullptr) {
+            stats[0] = wrapper->draft->n_draft;
+            stats[1] = wrapper->draft->n_steps;
+            stats[2] = wrapper->draft->n_drafted;
+            stats[3] = wrapper->draft->n_accepted;
+        }
+    }
+
+    jlongArray result = env->NewLongArray(4);
+    if (result != nullptr) {
+        env->SetLongArrayRegion(result, 0, 4, stats);
+    }
+    return result;
+}
+
+/**
+ * 释放草稿模型，之后生成回到普通解码
+ */
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_freeDraftModel(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    if (modelHandle == 0) {
+        return;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    main_request_scope scope(wrapper);
+    free_draft_model(wrapper);
+    LOGD("Draft model freed");
+}
+
+// ============================================
+// 基准测试（与用户请求走相同的分批预填充 / 解码路径）
+// ============================================
+
+// 基准测试提示词使用固定种子的随机 token，保证各设备、各轮之间输入一致
+#define BENCHMARK_PROMPT_SEED 1234u
+
+/**
+ * 以新的线程数 / 批大小 / KV 缓存类型重建主模型上下文，模型权重不重新加载
+ * 新上下文创建失败时保留原上下文
+ * @param kvCacheType KV 缓存的 ggml_type（F16 = 1, Q8_0 = 8, Q4_0 = 2），< 0 表示默认 (F16)
+ * @return 是否重建成功
+ */
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_benchmarkResetContext(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jint contextSize,
+    jint threads,
+    jint batchSize,
+    jint kvCacheType) {
+
+    if (modelHandle == 0) {
+        return JNI_FALSE;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    std::lock_guard<std::mutex> lock(wrapper->ctx_mutex);
+    if (!wrapper->sessions.empty()) {
+        LOGE("Cannot rebuild a context that hosts background sessions");
+        return JNI_FALSE;
+    }
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = contextSize;
+    ctx_params.n_threads = threads;
+    ctx_params.n_threads_batch = threads;
+    if (batchSize > 0) {
+        ctx_params.n_batch = batchSize;
+        ctx_params.n_ubatch = std::min<uint32_t>(ctx_params.n_ubatch, batchSize);
+    }
+    apply_kv_cache_options(ctx_params, kvCacheType, wrapper->flash_attn);
+    ctx_params.no_perf = false;
+
+    llama_context* ctx = llama_new_context_with_model(wrapper->model, ctx_params);
+    if (ctx == nullptr) {
+        LOGE("Failed to create benchmark context (threads=%d, batch=%d, kv type=%d)",
+             threads, batchSize, kvCacheType);
+        return JNI_FALSE;
+    }
+
+    free_threadpools(wrapper);
+    llama_free(wrapper->ctx);
+    wrapper->ctx = ctx;
+    wrapper->ctx_params = ctx_params;
+    wrapper->n_batch = (int) llama_n_batch(ctx);
+    wrapper->kv_cache_type = kvCacheType;
+    wrapper->n_ctx_main = contextSize;
+    wrapper->cached_tokens.clear();
+    wrapper->snapshots.clear();  // 新上下文只有序列 0，快照随旧上下文一起释放
+    wrapper->lora_applied.clear();  // 新上下文未挂载适配器，下一个主请求重新应用
+    llama_set_abort_callback(ctx, generation_abort_callback, wrapper);
+    apply_thread_counts(wrapper, threads, threads);
+    return JNI_TRUE;
+}
+
+/**
+ * 预填充 nPrompt 个 token 后生成 nGen 个 token，重复 repetitions 轮
+ *
+ * 预填充走 decode_prompt_chunked，生成使用与 generate 相同的采样链和逐 token 解码，
+ * 但忽略结束符以保证每轮生成长度一致。每轮开始前清空 KV 缓存，测试前先做一次预热解码。
+ *
+ * @return [轮次 0 预填充耗时, 轮次 0 生成耗时, 轮次 1 ...]（微秒）；失败或被取消返回 null
+ */
+extern "C" JNIEXPORT jlongArray JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_benchmarkGeneration(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jint nPrompt,
+    jint nGen,
+    jint repetitions) {
+
+    if (modelHandle == 0 || repetitions <= 0 || nPrompt + nGen <= 0) {
+        return nullptr;
+    }
+
+    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    main_request_scope scope(wrapper);
+    if (!ensure_context(wrapper)) {
+        return nullptr;
+    }
+
+    if (nPrompt + nGen > main_context_size(wrapper)) {
+        LOGE("Benchmark needs %d tokens but context is %d", nPrompt + nGen, main_context_size(wrapper));
+        return nullptr;
+    }
+
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    std::vector<llama_token> prompt(std::max(1, (int) nPrompt));
+    uint32_t rng = BENCHMARK_PROMPT_SEED;
+    for (llama_token& token : prompt) {
+        rng = rng * 1664525u + 1013904223u;
+        token = (llama_token) (rng % (uint32_t) n_vocab);
+    }
+
+    // 预热：首次解码包含权重换页、GPU 管线编译等一次性开销
+    invalidate_cached_prefix(wrapper);
+    if (decode_tokens(wrapper, prompt.data(), 1) != DECODE_OK) {
+        LOGE("Benchmark warmup decode failed");
+        invalidate_cached_prefix(wrapper);
+        return nullptr;
+    }
+
+    std::vector<jlong> timings;
+    timings.reserve(repetitions * 2);
+    decode_status status = DECODE_OK;
+
+    for (int rep = 0; rep < repetitions && status == DECODE_OK; rep++) {
+        invalidate_cached_prefix(wrapper);
+        begin_generation_stats(wrapper);
+
+        // 与 generate 相同的采样链（同样跨轮次复用）
+        llama_sampler* smpl = reuse_sampler(wrapper->sampler, wrapper->sampler_config,
+                                            sampler_params{ 0.7f, 0.9f, 40 });
+
+        if (nPrompt > 0) {
+            status = decode_prompt_chunked(wrapper, prompt, 0, nullptr);
+            accept_prompt_tokens(smpl, prompt);
+        } else {
+            status = decode_tokens(wrapper, prompt.data(), 1);
+        }
+
+        generation_stats& stats = wrapper->stats;
+        for (int i = 0; i < nGen && status == DECODE_OK; i++) {
+            llama_token token;
+            {
+                phase_timer timer(&stats.t_sample_us, "llama:sample");
+                token = sample_token(smpl, wrapper->ctx, -1, wrapper->candidates);
+            }
+            if (stats.t_first_token_us < 0) {
+                stats.t_first_token_us = ggml_time_us() - stats.t_start_us;
+            }
+            phase_timer timer(&stats.t_decode_us, "llama:decode");
+            status = decode_tokens(wrapper, &token, 1);
+        }
+
+        finish_generation_stats(wrapper, nGen);
+
+        // 生成耗时按墙钟计（含采样），与用户感知的吞吐一致
+        timings.push_back(stats.t_prefill_us);
+        timings.push_back(stats.t_decode_us + stats.t_sample_us);
+    }
+
+    invalidate_cached_prefix(wrapper);
+
+    if (status != DECODE_OK) {
+        LOGE("Benchmark aborted (%s)", status == DECODE_CANCELLED ? "cancelled" : "decode failed");
+        return nullptr;
+    }
+
+    jlongArray result = env->NewLongArray((jsize) timings.size());
+    if (result != nullptr) {
+        env->SetLongArrayRegion(result, 0, (jsize) timings.size(), timings.data());
+    }
+    return result;
+}
+
+/**
+ * llama.cpp / ggml 编译与运行时特性（NEON、DOTPROD、I8MM、Vulkan 等），写入基准测试结果
+ */
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getSystemInfo(
+    JNIEnv* env,
+    jobject /* this */) {
+    return env->NewStringUTF(llama_print_system_info());
+}
+
+// ============================================
+// 嵌入结果缓存（按 token 序列哈希的 LRU，可持久化）
+// ============================================
+
+// 默认内存上限，按每条向量的字节数折算为条目数
+#define EMBEDDING_CACHE_DEFAULT_BYTES (8 * 1024 * 1024)
+// 每个条目在向量之外的估算开销（哈希表节点、LRU 链表节点）
+#define EMBEDDING_CACHE_ENTRY_OVERHEAD 64
+#define EMBEDDING_CACHE_MAGIC 0x43454648u   // "HFEC"
+#define EMBEDDING_CACHE_VERSION 1
+
+struct embedding_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_embd;
+    uint32_t reserved;
+    uint64_t model_id;   // 模型描述与参数量的哈希，换模型后旧缓存作废
+    uint64_t n_entries;
+};
+
+struct embedding_cache_entry {
+    std::vector<float> embd;                // 已归一化的嵌入
+    std::list<uint64_t>::iterator lru_pos;
+};
+
+/**
+ * 嵌入模型句柄内的结果缓存，键为截断后 token 序列的 64 位 FNV-1a 哈希
+ * 重复的查询和重新导入时内容未变的知识块直接返回缓存结果，不再 llama_decode
+ */
+struct embedding_cache {
+    std::mutex mutex;
+    size_t max_entries = 0;                 // 0 表示关闭缓存
+    std::list<uint64_t> lru;                // 最近使用的在前
+    std::unordered_map<uint64_t, embedding_cache_entry> entries;
+    int64_t n_hits = 0;
+    int64_t n_misses = 0;
+    std::string path;                       // 持久化文件，空表示只在内存中
+    bool dirty = false;
+};
+
+static uint64_t fnv1a_64(const void* data, size_t len, uint64_t hash = 0xcbf29ce484222325ull) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static uint64_t embedding_cache_key(const llama_token* tokens, size_t n_tokens) {
+    return fnv1a_64(tokens, n_tokens * sizeof(llama_token));
+}
+
+static uint64_t embedding_model_id(const llama_model* model) {
+    char desc[256] = {};
+    llama_model_desc(model, desc, sizeof(desc));
+    const uint64_t n_params = llama_model_n_params(model);
+    return fnv1a_64(&n_params, sizeof(n_params), fnv1a_64(desc, strlen(desc)));
+}
+
+static void embedding_cache_set_limit(embedding_cache& cache, int64_t max_bytes, int n_embd) {
+    const size_t entry_bytes = (size_t) n_embd * sizeof(float) + EMBEDDING_CACHE_ENTRY_OVERHEAD;
+    cache.max_entries = max_bytes > 0 ? (size_t) max_bytes / entry_bytes : 0;
+    while (cache.entries.size() > cache.max_entries) {
+        cache.entries.erase(cache.lru.back());
+        cache.lru.pop_back();
+    }
+}
+
+// 命中时把向量写入 out 并移到 LRU 头部
+static bool embedding_cache_get(embedding_cache& cache, uint64_t key, float* out) {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if (cache.max_entries == 0) {
+        return false;
+    }
+    auto it = cache.entries.find(key);
+    if (it == cache.entries.end()) {
+        cache.n_misses++;
+        return false;
+    }
+    cache.lru.splice(cache.lru.begin(), cache.lru, it->second.lru_pos);
+    std::copy(it->second.embd.begin(), it->second.embd.end(), out);
+    cache.n_hits++;
+    return true;
+}
+
+static void embedding_cache_put_locked(embedding_cache& cache, uint64_t key, const float* embd, int n_embd) {
+    if (cache.max_entries == 0 || cache.entries.count(key) > 0) {
+        return;
+    }
+    if (cache.entries.size() >= cache.max_entries) {
+        cache.entries.erase(cache.lru.back());
+        cache.lru.pop_back();
+    }
+    cache.lru.push_front(key);
+    embedding_cache_entry& entry = cache.entries[key];
+    entry.embd.assign(embd, embd + n_embd);
+    entry.lru_pos = cache.lru.begin();
+    cache.dirty = true;
+}
+
+static void embedding_cache_put(embedding_cache& cache, uint64_t key, const float* embd, int n_embd) {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    embedding_cache_put_locked(cache, key, embd, n_embd);
+}
+
+// 写入 cache.path（临时文件 + rename），按最久未用到最近使用的顺序保存，读取时恢复同样的 LRU 顺序
+static bool embedding_cache_save(embedding_cache& cache, int n_embd, uint64_t model_id) {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if (cache.path.empty() || !cache.dirty) {
+        return true;
+    }
+
+    const std::string tmp_path = cache.path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        LOGE("Failed to write %s: %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    embedding_cache_header header = {};
+    header.magic = EMBEDDING_CACHE_MAGIC;
+    header.version = EMBEDDING_CACHE_VERSION;
+    header.n_embd = (uint32_t) n_embd;
+    header.model_id = model_id;
+    header.n_entries = cache.entries.size();
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (auto it = cache.lru.rbegin(); ok && it != cache.lru.rend(); ++it) {
+        const std::vector<float>& embd = cache.entries[*it].embd;
+        ok = fwrite(&*it, sizeof(uint64_t), 1, file) == 1 &&
+             fwrite(embd.data(), sizeof(float), embd.size(), file) == embd.size();
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), cache.path.c_str()) != 0) {
+        LOGE("Failed to save embedding cache %s", cache.path.c_str());
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    cache.dirty = false;
+    LOGI("Embedding cache saved: %zu entries", cache.entries.size());
+    return true;
+}
+
+// 读取 cache.path，维度或模型不匹配时忽略；超过上限的部分只保留最近使用的条目
+// 返回读取的条目数
+static size_t embedding_cache_load(embedding_cache& cache, int n_embd, uint64_t model_id) {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    FILE* file = fopen(cache.path.c_str(), "rb");
+    if (!file) {
+        return 0;
+    }
+
+    embedding_cache_header header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+              header.magic == EMBEDDING_CACHE_MAGIC && header.version == EMBEDDING_CACHE_VERSION &&
+              header.n_embd == (uint32_t) n_embd && header.model_id == model_id;
+    if (!ok) {
+        fclose(file);
+        LOGW("Ignoring embedding cache %s (model or format changed)", cache.path.c_str());
+        return 0;
+    }
+
+    std::vector<float> embd(n_embd);
+    size_t n_loaded = 0;
+    for (uint64_t i = 0; i < header.n_entries; i++) {
+        uint64_t key;
+        if (fread(&key, sizeof(key), 1, file) != 1 ||
+            fread(embd.data(), sizeof(float), embd.size(), file) != embd.size()) {
+            LOGW("Embedding cache %s is truncated after %zu entries", cache.path.c_str(), n_loaded);
+            break;
+        }
+        // 文件按从旧到新排列，依次插入头部后最新的在前；超出上限时淘汰最旧的
+        embedding_cache_put_locked(cache, key, embd.data(), n_embd);
+        n_loaded++;
+    }
+    fclose(file);
+
+    cache.dirty = false;
+    LOGI("Embedding cache loaded: %zu entries", cache.entries.size());
+    return n_loaded;
+}
+
+// ============================================
+// 嵌入模型相关函数 (用于知识库 RAG)
+// ============================================
+
+// 批量嵌入：单次 llama_decode 最多打包的序列数和 token 数
+#define EMBEDDING_MAX_SEQUENCES 16
+#define EMBEDDING_BATCH_TOKENS 2048
+
+// 嵌入模型上下文包装
+struct embedding_context_wrapper {
+    llama_model* model;
+    llama_context* ctx;
+    int n_embd;     // 嵌入维度
+    int n_seq_ctx;  // 单条文本最多使用的 token 数（即 contextSize）
+    int n_batch;    // 单次解码打包的 token 上限
+    int n_seq_max;  // 单次解码打包的序列上限
+    ggml_threadpool* threadpool = nullptr;  // 与聊天模型预填充共享的线程池
+    embedding_cache cache;
+    uint64_t model_id = 0;                  // 校验持久化缓存是否属于当前模型
+    std::vector<llama_token> special_prefix;  // 分词时自动加在文本前后的特殊 token（如 [CLS] / [SEP]）
+    std::vector<llama_token> special_suffix;
+};
+
+// L2 归一化后写入 out
+static void normalize_embedding(const float* embd, float* out, int n_embd) {
+    float norm = 0.0f;
+    for (int i = 0; i < n_embd; i++) {
+        norm += embd[i] * embd[i];
+    }
+    norm = sqrtf(norm);
+    const float scale = norm > 0 ? 1.0f / norm : 1.0f;
+    for (int i = 0; i < n_embd; i++) {
+        out[i] = embd[i] * scale;
+    }
+}
+
+// 对嵌入模型词表分词，先计数再精确分配
+static std::vector<llama_token> tokenize_for_embedding(const llama_vocab* vocab, const char* text, int text_len) {
+    int n_tokens = -llama_tokenize(vocab, text, text_len, nullptr, 0, true, true);
+    std::vector<llama_token> tokens(std::max(0, n_tokens));
+    if (n_tokens > 0) {
+        n_tokens = llama_tokenize(vocab, text, text_len, tokens.data(), (int) tokens.size(), true, true);
+        tokens.resize(std::max(0, n_tokens));
+    }
+    return tokens;
+}
+
+// 用探测文本对比带 / 不带特殊 token 的分词结果，得到自动添加的前缀和后缀，
+// 原生分块按片段分词（不带特殊 token）后再补上，与整段分词的结果一致
+static void detect_special_tokens(const llama_vocab* vocab,
+                                  std::vector<llama_token>& prefix,
+                                  std::vector<llama_token>& suffix) {
+    const char* probe = "a";
+    llama_token plain[16];
+    llama_token special[32];
+    const int n_plain = llama_tokenize(vocab, probe, 1, plain, 16, false, false);
+    const int n_special = llama_tokenize(vocab, probe, 1, special, 32, true, false);
+    prefix.clear();
+    suffix.clear();
+    if (n_plain <= 0 || n_special < n_plain) {
+        return;
+    }
+    for (int start = 0; start + n_plain <= n_special; start++) {
+        if (std::equal(plain, plain + n_plain, special + start)) {
+            prefix.assign(special, special + start);
+            suffix.assign(special + start + n_plain, special + n_special);
+            return;
+        }
+    }
+}
+
+/**
+ * 初始化嵌入模型
+ * @param modelPath 嵌入模型路径 (如 all-MiniLM-L6-v2.gguf)
+ * @param contextSize 上下文大小 (嵌入模型一般用 512)
+ * @param threads CPU 线程数
+ * @return 模型句柄
+ */
+extern "C" JNIEXPORT jlong JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_initEmbeddingModel(
+    JNIEnv* env,
+    jobject /* this */,
+    jstring modelPath,
+    jint contextSize,
+    jint threads) {
+
+    const char *path = env->GetStringUTFChars(modelPath, nullptr);
+    LOGI("Initializing embedding model from: %s", path);
+
+    // 初始化后端（与聊天模型共享，空闲释放后重新加载不会重复初始化）
+    runtime_acquire();
+
+    // 模型参数 - 嵌入模型使用 CPU
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = 0;  // CPU only for embedding
+
+    // 加载模型
+    llama_model* model = llama_load_model_from_file(path, model_params);
+    env->ReleaseStringUTFChars(modelPath, path);
+
+    if (model == nullptr) {
+        LOGE("Failed to load embedding model");
+        runtime_release();
+        return 0;
+    }
+
+    // 上下文参数 - 启用嵌入模式
+    // 多序列打包：非因果模型要求整批放进一个 ubatch，所以 n_ubatch = n_batch；
+    // 使用统一 KV，保证每个序列都能用满 contextSize
+    const int n_batch = std::max((int) contextSize, EMBEDDING_BATCH_TOKENS);
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = n_batch;
+    ctx_params.n_batch = n_batch;
+    ctx_params.n_ubatch = n_batch;
+    ctx_params.n_seq_max = EMBEDDING_MAX_SEQUENCES;
+    ctx_params.kv_unified = true;
+    const int n_threads = threads > 0 ? threads : default_batch_threads();
+    ctx_params.n_threads = n_threads;
+    ctx_params.n_threads_batch = n_threads;
+    ctx_params.embeddings = true;  // 启用嵌入模式
+
+    // 创建上下文
+    llama_context* ctx = llama_new_context_with_model(model, ctx_params);
+    if (ctx == nullptr) {
+        LOGE("Failed to create embedding context");
+        llama_free_model(model);
+        runtime_release();
+        return 0;
+    }
+
+    // 与聊天模型的预填充共用性能核上的线程池（线程数相同时为同一个），计算由 compute_mutex 串行
+    ggml_threadpool* threadpool = runtime_acquire_threadpool(n_threads, 0);
+    if (threadpool != nullptr) {
+        llama_attach_threadpool(ctx, threadpool, threadpool);
+    }
+
+    // 获取嵌入维度
+    int n_embd = llama_n_embd(model);
+    LOGI("Embedding model initialized, dimension: %d", n_embd);
+
+    // 创建包装
+    embedding_context_wrapper* wrapper = new embedding_context_wrapper();
+    wrapper->model = model;
+    wrapper->ctx = ctx;
+    wrapper->n_embd = n_embd;
+    wrapper->n_seq_ctx = contextSize;
+    wrapper->n_batch = (int) llama_n_batch(ctx);
+    wrapper->n_seq_max = (int) llama_n_seq_max(ctx);
+    wrapper->threadpool = threadpool;
+    wrapper->model_id = embedding_model_id(model);
+    detect_special_tokens(llama_model_get_vocab(model), wrapper->special_prefix, wrapper->special_suffix);
+    embedding_cache_set_limit(wrapper->cache, EMBEDDING_CACHE_DEFAULT_BYTES, n_embd);
+
+    return reinterpret_cast<jlong>(wrapper);
+}
+
+/**
+ * 获取嵌入维度
+ */
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getEmbeddingDimension(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    if (modelHandle == 0) {
+        return 0;
+    }
+
+    embedding_context_wrapper* wrapper = reinterpret_cast<embedding_context_wrapper*>(modelHandle);
+    return wrapper->n_embd;
+}
+
+/**
+ * 获取单条文本的嵌入向量
+ * @param modelHandle 嵌入模型句柄
+ * @param text 输入文本
+ * @return 嵌入向量 (FloatArray)
+ */
+extern "C" JNIEXPORT jfloatArray JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getEmbedding(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jstring text) {
+
+    if (modelHandle == 0) {
+        LOGE("Embedding model handle is null");
+        return nullptr;
+    }
+
+    embedding_context_wrapper* wrapper = reinterpret_cast<embedding_context_wrapper*>(modelHandle);
+    const char* textStr = env->GetStringUTFChars(text, nullptr);
+
+    // Tokenize，超出单条序列上限的部分截断（与 getEmbeddingsBatch 一致）
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    std::vector<llama_token> tokens = tokenize_for_embedding(vocab, textStr, (int) strlen(textStr));
+    env->ReleaseStringUTFChars(text, textStr);
+
+    if (tokens.empty()) {
+        LOGE("Failed to tokenize text for embedding");
+        return nullptr;
+    }
+
+    const int n_seq_tokens_max = std::min(wrapper->n_seq_ctx, wrapper->n_batch);
+    if ((int) tokens.size() > n_seq_tokens_max) {
+        LOGW("Embedding text truncated from %zu to %d tokens", tokens.size(), n_seq_tokens_max);
+        tokens.resize(n_seq_tokens_max);
+    }
+    const int n_tokens = (int) tokens.size();
+    LOGD("Embedding: tokenized %d tokens", n_tokens);
+
+    // 缓存命中时直接返回，不占用 compute_mutex
+    std::vector<float> normalized(wrapper->n_embd);
+    const uint64_t cache_key = embedding_cache_key(tokens.data(), tokens.size());
+    if (embedding_cache_get(wrapper->cache, cache_key, normalized.data())) {
+        jfloatArray cached = env->NewFloatArray(wrapper->n_embd);
+        if (cached != nullptr) {
+            env->SetFloatArrayRegion(cached, 0, wrapper->n_embd, normalized.data());
+        }
+        return cached;
+    }
+
+    // 与聊天请求共享线程池，计算期间持有 compute_mutex
+    std::lock_guard<std::mutex> compute(get_runtime().compute_mutex);
+
+    // 清空 KV 缓存
+    llama_memory_t mem = llama_get_memory(wrapper->ctx);
+    llama_memory_clear(mem, true);
+
+    // 创建批次并解码
+    llama_batch batch = llama_batch_get_one(tokens.data(), n_tokens);
+
+    if (llama_decode(wrapper->ctx, batch) != 0) {
+        LOGE("Failed to decode for embedding");
+        return nullptr;
+    }
+
+    // 获取嵌入向量 (使用序列0的嵌入)
+    const float* embd = llama_get_embeddings_seq(wrapper->ctx, 0);
+    if (embd == nullptr) {
+        // 尝试获取整体嵌入
+        embd = llama_get_embeddings(wrapper->ctx);
+    }
+
+    if (embd == nullptr) {
+        LOGE("Failed to get embeddings");
+        return nullptr;
+    }
+
+    // 创建 Java float 数组
+    jfloatArray result = env->NewFloatArray(wrapper->n_embd);
+    if (result == nullptr) {
+        LOGE("Failed to create float array");
+        return nullptr;
+    }
+
+    // 归一化嵌入向量 (L2 normalization)
+    normalize_embedding(embd, normalized.data(), wrapper->n_embd);
+    embedding_cache_put(wrapper->cache, cache_key, normalized.data(), wrapper->n_embd);
+
+    env->SetFloatArrayRegion(result, 0, wrapper->n_embd, normalized.data());
+
+    LOGD("Embedding computed successfully, dimension: %d", wrapper->n_embd);
+    return result;
+}
+
+/**
+ * 将 batch 中已打包的序列一次解码，并把每个序列的池化嵌入归一化写入 out
+ * @param out_rows 每个序列在 out 中对应的行号
+ * @param cache_keys 每个序列的缓存键，解码成功后结果写入缓存
+ */
+static bool decode_embedding_batch(
+    embedding_context_wrapper* wrapper,
+    llama_batch& batch,
+    const std::vector<int>& out_rows,
+    const std::vector<uint64_t>& cache_keys,
+    float* out) {
+
+    // 与聊天请求共享线程池，按批持有 compute_mutex，聊天请求可以在两批之间插入
+    std::lock_guard<std::mutex> compute(get_runtime().compute_mutex);
+
+    // 嵌入模型通常没有 KV 缓存，有的话每批都需要清空
+    llama_memory_t mem = llama_get_memory(wrapper->ctx);
+    if (mem != nullptr) {
+        llama_memory_clear(mem, true);
+    }
+
+    if (llama_decode(wrapper->ctx, batch) != 0) {
+        LOGE("Failed to decode embedding batch (%d sequences, %d tokens)",
+             (int) out_rows.size(), batch.n_tokens);
+        return false;
+    }
+
+    for (size_t s = 0; s < out_rows.size(); s++) {
+        const float* embd = llama_get_embeddings_seq(wrapper->ctx, (llama_seq_id) s);
+        if (embd == nullptr) {
+            LOGW("Missing pooled embedding for sequence %zu", s);
+            continue;
+        }
+        float* row = out + (size_t) out_rows[s] * wrapper->n_embd;
+        normalize_embedding(embd, row, wrapper->n_embd);
+        embedding_cache_put(wrapper->cache, cache_keys[s], row, wrapper->n_embd);
+    }
+    return true;
+}
+
+/**
+ * 把多条 token 序列打包解码，结果按序号写入 out（n_sequences * n_embd）
+ *
+ * 多条序列以不同 seq_id 打包进同一个 llama_batch（不超过 n_batch 个 token、n_seq_max 个序列），
+ * 一次 llama_decode 后按序列读取池化结果；命中嵌入缓存的序列直接复制结果，不参与打包。
+ * 调用方需保证每条序列不超过 min(contextSize, n_batch) 个 token。
+ *
+ * @return 失败的序列数（空序列也算失败），对应行保持原值
+ */
+static int embed_token_sequences(
+    embedding_context_wrapper* wrapper,
+    const std::vector<std::vector<llama_token>>& sequences,
+    float* out,
+    int* n_cached_out) {
+
+    const int n_embd = wrapper->n_embd;
+    llama_batch batch = llama_batch_init(wrapper->n_batch, 0, 1);
+    std::vector<int> batch_rows;
+    std::vector<uint64_t> batch_keys;
+    batch_rows.reserve(wrapper->n_seq_max);
+    batch_keys.reserve(wrapper->n_seq_max);
+    int n_failed = 0;
+    int n_cached = 0;
+
+    for (size_t t = 0; t < sequences.size(); t++) {
+        const std::vector<llama_token>& tokens = sequences[t];
+        if (tokens.empty()) {
+            n_failed++;
+            continue;
+        }
+
+        const uint64_t cache_key = embedding_cache_key(tokens.data(), tokens.size());
+        if (embedding_cache_get(wrapper->cache, cache_key, out + t * n_embd)) {
+            n_cached++;
+            continue;
+        }
+
+        // 放不下时先解码已打包的序列
+        if (batch.n_tokens + (int) tokens.size() > wrapper->n_batch ||
+            (int) batch_rows.size() >= wrapper->n_seq_max) {
+            if (!decode_embedding_batch(wrapper, batch, batch_rows, batch_keys, out)) {
+                n_failed += (int) batch_rows.size();
+            }
+            batch.n_tokens = 0;
+            batch_rows.clear();
+            batch_keys.clear();
+        }
+
+        const llama_seq_id seq_id = (llama_seq_id) batch_rows.size();
+        for (size_t i = 0; i < tokens.size(); i++) {
+            const int idx = batch.n_tokens++;
+            batch.token[idx] = tokens[i];
+            batch.pos[idx] = (llama_pos) i;
+            batch.n_seq_id[idx] = 1;
+            batch.seq_id[idx][0] = seq_id;
+            batch.logits[idx] = true;
+        }
+        batch_rows.push_back((int) t);
+        batch_keys.push_back(cache_key);
+    }
+
+    if (!batch_rows.empty()) {
+        if (!decode_embedding_batch(wrapper, batch, batch_rows, batch_keys, out)) {
+            n_failed += (int) batch_rows.size();
+        }
+    }
+    llama_batch_free(batch);
+
+    if (n_cached_out != nullptr) {
+        *n_cached_out = n_cached;
+    }
+    return n_failed;
+}
+
+/**
+ * 批量获取多条文本的嵌入向量
+ *
+ * 逐条分词后交给 embed_token_sequences 打包解码。超过 contextSize 的文本会被截断。
+ *
+ * @param modelHandle 嵌入模型句柄
+ * @param texts 输入文本数组
+ * @return 扁平的归一化嵌入 (texts.size * dimension)，失败的文本对应全零行
+ */
+extern "C" JNIEXPORT jfloatArray JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getEmbeddingsBatch(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jobjectArray texts) {
+
+    if (modelHandle == 0) {
+        LOGE("Embedding model handle is null");
+        return nullptr;
+    }
+
+    embedding_context_wrapper* wrapper = reinterpret_cast<embedding_context_wrapper*>(modelHandle);
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    const int n_texts = env->GetArrayLength(texts);
+    const int n_embd = wrapper->n_embd;
+    const int n_seq_tokens_max = std::min(wrapper->n_seq_ctx, wrapper->n_batch);
+
+    std::vector<std::vector<llama_token>> sequences(n_texts);
+    for (int t = 0; t < n_texts; t++) {
+        jstring text = (jstring) env->GetObjectArrayElement(texts, t);
+        const char* textStr = env->GetStringUTFChars(text, nullptr);
+        sequences[t] = tokenize_for_embedding(vocab, textStr, (int) strlen(textStr));
+        env->ReleaseStringUTFChars(text, textStr);
+        env->DeleteLocalRef(text);
+
+        if ((int) sequences[t].size() > n_seq_tokens_max) {
+            LOGW("Embedding text %d truncated from %zu to %d tokens", t, sequences[t].size(), n_seq_tokens_max);
+            sequences[t].resize(n_seq_tokens_max);
+        }
+    }
+
+    std::vector<float> output((size_t) n_texts * n_embd, 0.0f);
+    int n_cached = 0;
+    const int n_failed = embed_token_sequences(wrapper, sequences, output.data(), &n_cached);
+
+    jfloatArray result = env->NewFloatArray((jsize) output.size());
+    if (result == nullptr) {
+        LOGE("Failed to create float array");
+        return nullptr;
+    }
+    env->SetFloatArrayRegion(result, 0, (jsize) output.size(), output.data());
+
+    LOGD("Batch embedding computed: %d texts, %d cached, %d failed", n_texts, n_cached, n_failed);
+    return result;
+}
+
+// ============================================
+// 按 token 分块并嵌入（知识库导入）
+// ============================================
+
+// 分块边界的优先级：句末标点 > 分句标点 > 直接按 token 切
+enum chunk_split_level {
+    CHUNK_SPLIT_SENTENCE = 0,
+    CHUNK_SPLIT_CLAUSE = 1,
+    CHUNK_SPLIT_TOKEN = 2,
+};
+
+// 文本片段：字节区间 [begin, end) 与其在 tokens 中的区间 [tok_begin, tok_end)
+struct text_segment {
+    int begin;
+    int end;
+    int tok_begin;
+    int tok_end;
+    int u16_begin = 0;  // 对应 Java 字符串中的 UTF-16 下标
+    int u16_end = 0;
+};
+
+static bool is_ascii_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// 若 i 处是 level 级的分隔符，返回其字节长度（片段在分隔符之后结束），否则返回 0
+static int chunk_delimiter_len(const char* text, int i, int end, chunk_split_level level) {
+    const unsigned char c = (unsigned char) text[i];
+    if (c < 0x80) {
+        if (level == CHUNK_SPLIT_SENTENCE) {
+            if (c == '\n') {
+                return 1;
+            }
+            // 英文句号后需跟空白或结尾，避免切开 3.14、e.g 之类
+            if ((c == '.' || c == '!' || c == '?') && (i + 1 >= end || is_ascii_space(text[i + 1]))) {
+                return 1;
+            }
+        } else if ((c == ',' || c == ';' || c == ':') && (i + 1 >= end || is_ascii_space(text[i + 1]))) {
+            return 1;
+        }
+        return 0;
+    }
+    if (i + 3 > end) {
+        return 0;
+    }
+    const unsigned char c1 = (unsigned char) text[i + 1];
+    const unsigned char c2 = (unsigned char) text[i + 2];
+    if (level == CHUNK_SPLIT_SENTENCE) {
+        if ((c == 0xE3 && c1 == 0x80 && c2 == 0x82) ||   // 。
+            (c == 0xEF && c1 == 0xBC && c2 == 0x81) ||   // ！
+            (c == 0xEF && c1 == 0xBC && c2 == 0x9F) ||   // ？
+            (c == 0xE2 && c1 == 0x80 && c2 == 0xA6)) {   // …
+            return 3;
+        }
+    } else {
+        if ((c == 0xEF && c1 == 0xBC && c2 == 0x8C) ||   // ，
+            (c == 0xEF && c1 == 0xBC && c2 == 0x9B) ||   // ；
+            (c == 0xEF && c1 == 0xBC && c2 == 0x9A) ||   // ：
+            (c == 0xE3 && c1 == 0x80 && c2 == 0x81)) {   // 、
+            return 3;
+        }
+    }
+    return 0;
+}
+
+static bool is_utf8_continuation(char c) {
+    return ((unsigned char) c & 0xC0) == 0x80;
+}
+
+/**
+ * 把 [begin, end) 切成不超过 max_tokens 的片段，片段的 token 依次追加到 tokens
+ * 先按 level 级标点切分并逐段分词，放不下的段落降一级再切；
+ * 到 CHUNK_SPLIT_TOKEN 级时直接按 token 切，片段字节边界按 token 比例估算（落在 UTF-8 字符起点）
+ */
+static void append_text_segments(
+    const llama_vocab* vocab,
+    const char* text,
+    int begin,
+    int end,
+    int max_tokens,
+    chunk_split_level level,
+    std::vector<text_segment>& segments,
+    std::vector<llama_token>& tokens) {
+
+    if (level == CHUNK_SPLIT_TOKEN) {
+        const int tok_base = (int) tokens.size();
+        int n_tokens = -llama_tokenize(vocab, text + begin, end - begin, nullptr, 0, false, true);
+        if (n_tokens <= 0) {
+            return;
+        }
+        tokens.resize(tok_base + n_tokens);
+        n_tokens = llama_tokenize(vocab, text + begin, end - begin, tokens.data() + tok_base, n_tokens, false, true);
+        tokens.resize(tok_base + std::max(0, n_tokens));
+
+        int piece_begin = begin;
+        for (int t = 0; t < n_tokens; t += max_tokens) {
+            const int t_end = std::min(n_tokens, t + max_tokens);
+            int piece_end = t_end == n_tokens
+                ? end
+                : begin + (int) ((int64_t) (end - begin) * t_end / n_tokens);
+            while (piece_end < end && is_utf8_continuation(text[piece_end])) {
+                piece_end++;
+            }
+            segments.push_back({piece_begin, piece_end, tok_base + t, tok_base + t_end});
+            piece_begin = piece_end;
+        }
+        return;
+    }
+
+    int piece_begin = begin;
+    for (int i = begin; i < end; ) {
+        const int delim = chunk_delimiter_len(text, i, end, level);
+        i += delim > 0 ? delim : 1;
+        if (delim == 0 && i < end) {
+            continue;
+        }
+
+        // 片段为 [piece_begin, i)，全是空白时并入下一段
+        bool blank = true;
+        for (int j = piece_begin; j < i && blank; j++) {
+            blank = is_ascii_space(text[j]);
+        }
+        if (blank) {
+            if (i < end) {
+                continue;
+            }
+            break;
+        }
+
+        const int tok_base = (int) tokens.size();
+        const int n_need = -llama_tokenize(vocab, text + piece_begin, i - piece_begin, nullptr, 0, false, true);
+        if (n_need > max_tokens) {
+            append_text_segments(vocab, text, piece_begin, i, max_tokens,
+                                 (chunk_split_level) (level + 1), segments, tokens);
+        } else if (n_need > 0) {
+            tokens.resize(tok_base + n_need);
+            const int n = llama_tokenize(vocab, text + piece_begin, i - piece_begin,
+                                         tokens.data() + tok_base, n_need, false, true);
+            tokens.resize(tok_base + std::max(0, n));
+            if (n > 0) {
+                segments.push_back({piece_begin, i, tok_base, tok_base + n});
+            }
+        }
+        piece_begin = i;
+    }
+}
+
+/**
+ * 按 token 分块并批量嵌入
+ *
+ * 用嵌入模型的词表把文档按句切分、逐句分词（每个字节只分词一次），再把相邻句子贪心装进
+ * 不超过 maxTokens 的块，块之间按整句保留不超过 overlapTokens 的重叠；单句超长时按分句标点、
+ * 最后按 token 切开。块的 token 直接送入与 getEmbeddingsBatch 相同的多序列批量解码，
+ * 每块都尽量用满嵌入模型的上下文，也不会超出。
+ *
+ * @param modelHandle 嵌入模型句柄
+ * @param text 文档全文
+ * @param maxTokens 每块的 token 上限（含特殊 token），<= 0 或超过上下文时取嵌入上下文大小
+ * @param overlapTokens 相邻块的重叠 token 上限
+ * @return ChunkEmbeddings（块在 text 中的 UTF-16 区间、token 数与扁平嵌入），失败返回 null
+ */
+extern "C" JNIEXPORT jobject JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_chunkAndEmbed(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jstring text,
+    jint maxTokens,
+    jint overlapTokens) {
+
+    if (modelHandle == 0) {
+        LOGE("Embedding model handle is null");
+        return nullptr;
+    }
+
+    embedding_context_wrapper* wrapper = reinterpret_cast<embedding_context_wrapper*>(modelHandle);
+    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    const int n_specials = (int) (wrapper->special_prefix.size() + wrapper->special_suffix.size());
+    const int n_seq_tokens_max = std::min(wrapper->n_seq_ctx, wrapper->n_batch);
+    const int max_chunk_tokens = maxTokens > 0 ? std::min((int) maxTokens, n_seq_tokens_max) : n_seq_tokens_max;
+    const int max_content = max_chunk_tokens - n_specials;
+    if (max_content <= 0) {
+        LOGE("chunkAndEmbed: maxTokens %d leaves no room for content", (int) maxTokens);
+        return nullptr;
+    }
+    const int overlap = std::max(0, std::min((int) overlapTokens, max_content / 2));
+
+    // 分句并分词
+    const char* textStr = env->GetStringUTFChars(text, nullptr);
+    const int text_len = (int) strlen(textStr);
+    std::vector<text_segment> segments;
+    std::vector<llama_token> tokens;
+    tokens.reserve(text_len / 2 + 16);
+    append_text_segments(vocab, textStr, 0, text_len, max_content, CHUNK_SPLIT_SENTENCE, segments, tokens);
+
+    // 字节偏移换算为 UTF-16 下标：JNI 的 modified UTF-8 中每个非续字节对应一个 UTF-16 单元
+    int u16 = 0;
+    int pos = 0;
+    for (text_segment& seg : segments) {
+        for (; pos < seg.begin; pos++) {
+            u16 += is_utf8_continuation(textStr[pos]) ? 0 : 1;
+        }
+        seg.u16_begin = u16;
+        for (; pos < seg.end; pos++) {
+            u16 += is_utf8_continuation(textStr[pos]) ? 0 : 1;
+        }
+        seg.u16_end = u16;
+    }
+    env->ReleaseStringUTFChars(text, textStr);
+
+    if (segments.empty()) {
+        LOGW("chunkAndEmbed: no tokens in text");
+    }
+
+    // 贪心装块：[first, last] 的片段不超过 max_content 个 token
+    auto seg_tokens = [&](size_t s) { return segments[s].tok_end - segments[s].tok_begin; };
+    std::vector<std::vector<llama_token>> sequences;
+    std::vector<jint> spans;
+    for (size_t first = 0; first < segments.size(); ) {
+        size_t last = first;
+        int n_content = seg_tokens(first);
+        while (last + 1 < segments.size() && n_content + seg_tokens(last + 1) <= max_content) {
+            n_content += seg_tokens(++last);
+        }
+
+        std::vector<llama_token> seq;
+        seq.reserve(n_content + n_specials);
+        seq.insert(seq.end(), wrapper->special_prefix.begin(), wrapper->special_prefix.end());
+        seq.insert(seq.end(), tokens.begin() + segments[first].tok_begin, tokens.begin() + segments[last].tok_end);
+        seq.insert(seq.end(), wrapper->special_suffix.begin(), wrapper->special_suffix.end());
+        sequences.push_back(std::move(seq));
+        spans.push_back(segments[first].u16_begin);
+        spans.push_back(segments[last].u16_end);
+        spans.push_back(n_content + n_specials);
+
+        if (last + 1 >= segments.size()) {
+            break;
+        }
+
+        // 下一块从末尾若干整句开始重叠，且至少前进一个片段、能放下紧接着的新片段
+        size_t next = last + 1;
+        int n_overlap = 0;
+        while (next - 1 > first && n_overlap + seg_tokens(next - 1) <= overlap) {
+            n_overlap += seg_tokens(--next);
+        }
+        while (next <= last && n_overlap + seg_tokens(last + 1) > max_content) {
+            n_overlap -= seg_tokens(next++);
+        }
+        first = next;
+    }
+
+    const int n_chunks = (int) sequences.size();
+    std::vector<float> output((size_t) n_chunks * wrapper->n_embd, 0.0f);
+    int n_cached = 0;
+    const int n_failed = embed_token_sequences(wrapper, sequences, output.data(), &n_cached);
+    LOGI("chunkAndEmbed: %zu tokens -> %d chunks (%d cached, %d failed)",
+         tokens.size(), n_chunks, n_cached, n_failed);
+
+    jintArray span_array = env->NewIntArray((jsize) spans.size());
+    jfloatArray embd_array = env->NewFloatArray((jsize) output.size());
+    if (span_array == nullptr || embd_array == nullptr) {
+        LOGE("Failed to allocate chunk result arrays");
+        return nullptr;
+    }
+    env->SetIntArrayRegion(span_array, 0, (jsize) spans.size(), spans.data());
+    env->SetFloatArrayRegion(embd_array, 0, (jsize) output.size(), output.data());
+
+    jclass result_class = env->FindClass("com/example/haiyangapp/inference/ChunkEmbeddings");
+    if (result_class == nullptr) {
+        LOGE("ChunkEmbeddings class not found");
+        return nullptr;
+    }
+    jmethodID ctor = env->GetMethodID(result_class, "<init>", "([I[FI)V");
+    if (ctor == nullptr) {
+        LOGE("ChunkEmbeddings constructor not found");
+        return nullptr;
+    }
+    return env->NewObject(result_class, ctor, span_array, embd_array, (jint) wrapper->n_embd);
+}
+
+/**
+ * 配置嵌入缓存
+ * @param path 持久化文件路径，为 null 时只缓存在内存中；非空时立即读取已有条目，释放模型时写回
+ * @param maxBytes 内存上限（字节），<= 0 关闭缓存
+ * @return 从文件读取的条目数，失败返回 -1
+ */
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_setEmbeddingCache(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle,
+    jstring path,
+    jlong maxBytes) {
+
+    if (modelHandle == 0) {
+        LOGE("Embedding model handle is null");
+        return -1;
+    }
+
+    embedding_context_wrapper* wrapper = reinterpret_cast<embedding_context_wrapper*>(modelHandle);
+    embedding_cache& cache = wrapper->cache;
+
+    // 切换文件前先把当前内容写回旧路径
+    embedding_cache_save(cache, wrapper->n_embd, wrapper->model_id);
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        embedding_cache_set_limit(cache, maxBytes, wrapper->n_embd);
+        cache.path.clear();
+        if (path != nullptr) {
+            const char* pathStr = env->GetStringUTFChars(path, nullptr);
+            cache.path = pathStr;
+            env->ReleaseStringUTFChars(path, pathStr);
+        }
+    }
+
+    if (cache.path.empty() || cache.max_entries == 0) {
+        return 0;
+    }
+    return (jint) embedding_cache_load(cache, wrapper->n_embd, wrapper->model_id);
+}
+
+/**
+ * 获取嵌入缓存统计
+ * @return [命中次数, 未命中次数, 条目数, 占用字节数]，句柄无效返回 null
+ */
+extern "C" JNIEXPORT jlongArray JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_getEmbeddingCacheStats(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    if (modelHandle == 0) {
+        return nullptr;
+    }
+
+    embedding_context_wrapper* wrapper = reinterpret_cast<embedding_context_wrapper*>(modelHandle);
+    embedding_cache& cache = wrapper->cache;
+
+    jlong stats[4];
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        const size_t entry_bytes = (size_t) wrapper->n_embd * sizeof(float) + EMBEDDING_CACHE_ENTRY_OVERHEAD;
+        stats[0] = cache.n_hits;
+        stats[1] = cache.n_misses;
+        stats[2] = (jlong) cache.entries.size();
+        stats[3] = (jlong) (cache.entries.size() * entry_bytes);
+    }
+
+    jlongArray result = env->NewLongArray(4);
+    if (result != nullptr) {
+        env->SetLongArrayRegion(result, 0, 4, stats);
+    }
+    return result;
+}
+
+/**
+ * 释放嵌入模型
+ */
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_freeEmbeddingModel(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong modelHandle) {
+
+    if (modelHandle == 0) {
+        LOGW("Attempting to free null embedding model handle");
+        return;
+    }
+
+    LOGD("Freeing embedding model");
+    embedding_context_wrapper* wrapper = reinterpret_cast<embedding_context_wrapper*>(modelHandle);
+    embedding_cache_save(wrapper->cache, wrapper->n_embd, wrapper->model_id);
+
+    if (wrapper->ctx) {
+        llama_detach_threadpool(wrapper->ctx);
+        llama_free(wrapper->ctx);
+    }
+    runtime_release_threadpool(wrapper->threadpool);
+    if (wrapper->model) {
+        llama_free_model(wrapper->model);
+    }
+
+    delete wrapper;
+    runtime_release();
+    LOGD("Embedding model freed successfully");
+}
+
+// ============================================
+// 知识库向量存储 (内存映射文件，替代 Room BLOB + Kotlin 端逐条扫描)
+// ============================================
+
+// 文件布局：64 字节文件头 + 定长行；每行 = 32 字节行头 (chunkId / docId / flags) + stride 个 float
+// 只追加写入，删除文档时打墓碑，由 compact 重写文件回收空间
+#define VECTOR_STORE_MAGIC 0x53565948u    // "HYVS"
+#define VECTOR_STORE_VERSION 1
+#define VECTOR_STORE_ROW_ALIGN 4           // 每行 float 数补齐到 4 的倍数，便于 NEON 整块加载
+#define VECTOR_STORE_GROW_ROWS 1024        // 文件按该行数成块扩展
+#define VECTOR_STORE_ROW_DELETED 0x1u
+
+struct vector_store_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t dim;          // 向量维度（与嵌入模型一致）
+    uint32_t stride;       // 每行 float 数
+    uint64_t n_rows;       // 已写入行数（含墓碑）
+    uint64_t n_deleted;    // 墓碑行数
+    uint8_t reserved[32];
+};
+static_assert(sizeof(vector_store_header) == 64, "vector store header must be 64 bytes");
+
+struct vector_store_row {
+    int64_t chunk_id;      // Room 中的知识块 ID
+    int64_t doc_id;        // 所属文档 ID（用于过滤和墓碑）
+    uint32_t flags;
+    uint32_t reserved[3];
+};
+static_assert(sizeof(vector_store_row) == 32, "vector store row header must be 32 bytes");
+
+// 量化模式（与 Kotlin VectorQuantization.ordinal 一致）
+enum vector_quant_mode {
+    VECTOR_QUANT_NONE = 0,     // 直接扫描 float 向量
+    VECTOR_QUANT_INT8 = 1,     // 每向量一个 scale 的 int8，int32 累加点积
+    VECTOR_QUANT_BINARY = 2,   // 1 bit 符号量化，popcount 汉明距离
+};
+
+#define VECTOR_QUANT_INT8_ALIGN 16    // int8 行长度补齐到 16，便于 NEON 整块加载
+
+// 量化扫描用的内存镜像，首次量化检索时从映射文件构建；
+// 粗排只访问这些紧凑数组，float 行只在精排候选时才被读入页缓存
+struct vector_store_codes {
+    bool meta_ready = false;
+    std::vector<int64_t> doc_ids;     // 行号 -> 文档 ID
+    std::vector<uint8_t> deleted;     // 行号 -> 是否为墓碑
+
+    bool q8_ready = false;
+    int q8_stride = 0;
+    std::vector<int8_t> q8;           // n_rows * q8_stride
+    std::vector<float> q8_scale;      // 每行反量化 scale
+
+    bool bits_ready = false;
+    int n_words = 0;
+    std::vector<uint64_t> bits;       // n_rows * n_words 个符号位
+};
+
+// IVF-flat 近似最近邻索引：球面 k-means 聚类中心 + 每簇行号倒排表，
+// 持久化在向量文件旁的 <path>.ivf 中（中心 + 行号 -> 簇号）
+#define VECTOR_IVF_MAGIC 0x56495948u        // "HYIV"
+#define VECTOR_IVF_VERSION 1
+#define VECTOR_IVF_MIN_TRAIN_ROWS 2048      // 存活行数达到该值才训练，之前一律精确扫描
+#define VECTOR_IVF_RETRAIN_GROWTH 4         // 存活行数增长到训练时的该倍数后重新训练
+#define VECTOR_IVF_MIN_LISTS 16
+#define VECTOR_IVF_MAX_LISTS 1024
+#define VECTOR_IVF_SAMPLES_PER_LIST 32      // 训练采样数 = 簇数 * 该值
+#define VECTOR_IVF_TRAIN_ITERATIONS 6
+
+struct vector_ivf_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t dim;
+    uint32_t stride;
+    uint32_t n_lists;
+    uint32_t reserved;
+    uint64_t n_assigned;    // 已分配簇号的行数
+    uint64_t trained_rows;  // 训练时的存活行数
+};
+
+struct vector_store_ivf {
+    bool trained = false;
+    int n_lists = 0;
+    size_t trained_rows = 0;
+    size_t saved_rows = 0;                      // 已持久化的分配行数
+    std::vector<float> centroids;               // n_lists * stride，已归一化
+    std::vector<uint32_t> assign;               // 行号 -> 簇号
+    std::vector<std::vector<uint32_t>> lists;   // 簇号 -> 行号
+};
+
+// BM25 倒排索引：分词结果以 64 位哈希作为词项，倒排表按行号记录词频，
+// 持久化在向量文件旁的 <path>.bm25 中（每行词数 + 倒排表），行号与向量文件一致
+#define VECTOR_TEXT_MAGIC 0x4d425948u       // "HYBM"
+#define VECTOR_TEXT_VERSION 1
+#define VECTOR_TEXT_UNINDEXED 0xFFFFFFFFu   // 该行尚未建立文本索引（旧数据或未传文本）
+#define VECTOR_BM25_K1 1.2f
+#define VECTOR_BM25_B 0.75f
+
+struct vector_text_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t n_rows;     // doc_len 的行数
+    uint64_t n_terms;    // 倒排表个数
+};
+
+struct vector_text_posting {
+    uint32_t row;
+    uint32_t tf;
+};
+
+struct vector_store_text {
+    std::unordered_map<uint64_t, std::vector<vector_text_posting>> postings;
+    std::vector<uint32_t> doc_len;   // 行号 -> 词数，VECTOR_TEXT_UNINDEXED 表示未建立
+    size_t n_docs = 0;               // 已建立索引的存活行数
+    uint64_t total_len = 0;          // 这些行的词数之和
+    bool dirty = false;
+};
+
+// 打开的向量存储；行向量均已 L2 归一化，点积即余弦相似度
+struct vector_index {
+    std::string path;
+    int fd = -1;
+    uint8_t* map = nullptr;   // 整个文件的共享映射
+    size_t map_size = 0;
+    int dim = 0;
+    int stride = 0;
+    size_t row_bytes = 0;     // 行头 + 向量
+    vector_store_codes codes;
+    vector_store_ivf ivf;
+    vector_store_text text;
+    std::mutex mutex;
+};
+
+// 点积内核：aarch64 用 FMA，armv7 用 vmla，其余平台标量（编译器可自动向量化）
+static float dot_f32(const float* a, const float* b, int n) {
+    int i = 0;
+#if defined(__aarch64__)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    float32x4_t acc2 = vdupq_n_f32(0.0f);
+    float32x4_t acc3 = vdupq_n_f32(0.0f);
+    for (; i + 16 <= n; i += 16) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i),      vld1q_f32(b + i));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4),  vld1q_f32(b + i + 4));
+        acc2 = vfmaq_f32(acc2, vld1q_f32(a + i + 8),  vld1q_f32(b + i + 8));
+        acc3 = vfmaq_f32(acc3, vld1q_f32(a + i + 12), vld1q_f32(b + i + 12));
+    }
+    for (; i + 4 <= n; i += 4) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    float sum = vaddvq_f32(vaddq_f32(vaddq_f32(acc0, acc1), vaddq_f32(acc2, acc3)));
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(a + i),     vld1q_f32(b + i));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    for (; i + 4 <= n; i += 4) {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    float32x4_t acc = vaddq_f32(acc0, acc1);
+    float32x2_t half = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    float sum = vget_lane_f32(vpadd_f32(half, half), 0);
+#else
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+    float sum = (s0 + s1) + (s2 + s3);
+#endif
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+// int8 点积内核：支持 dotprod 时用 sdot，否则 vmull + 成对累加；n 需为 16 的倍数才走 SIMD
+static int32_t dot_i8(const int8_t* a, const int8_t* b, int n) {
+    int i = 0;
+    int32_t sum = 0;
+#if defined(__aarch64__) && defined(__ARM_FEATURE_DOTPROD)
+    int32x4_t acc = vdupq_n_s32(0);
+    for (; i + 16 <= n; i += 16) {
+        acc = vdotq_s32(acc, vld1q_s8(a + i), vld1q_s8(b + i));
+    }
+    sum = vaddvq_s32(acc);
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    int32x4_t acc = vdupq_n_s32(0);
+    for (; i + 16 <= n; i += 16) {
+        const int8x16_t va = vld1q_s8(a + i);
+        const int8x16_t vb = vld1q_s8(b + i);
+        acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+        acc = vpadalq_s16(acc, vmull_s8(vget_high_s8(va), vget_high_s8(vb)));
+    }
+#if defined(__aarch64__)
+    sum = vaddvq_s32(acc);
+#else
+    const int32x2_t half = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+    sum = vget_lane_s32(vpadd_s32(half, half), 0);
+#endif
+#endif
+    for (; i < n; i++) {
+        sum += (int32_t) a[i] * (int32_t) b[i];
+    }
+    return sum;
+}
+
+// 汉明距离（aarch64 上 popcount 编译为 cnt 指令）
+static int hamming_distance(const uint64_t* a, const uint64_t* b, int n_words) {
+    int dist = 0;
+    for (int i = 0; i < n_words; i++) {
+        dist += __builtin_popcountll(a[i] ^ b[i]);
+    }
+    return dist;
+}
+
+// 对称 int8 量化：scale = max|x| / 127
+static void quantize_int8(const float* x, int dim, int q_stride, int8_t* out, float* scale) {
+    float max_abs = 0.0f;
+    for (int i = 0; i < dim; i++) {
+        max_abs = std::max(max_abs, std::fabs(x[i]));
+    }
+    const float s = max_abs > 0 ? max_abs / 127.0f : 1.0f;
+    const float inv = 1.0f / s;
+    for (int i = 0; i < dim; i++) {
+        out[i] = (int8_t) std::max(-127.0f, std::min(127.0f, roundf(x[i] * inv)));
+    }
+    std::fill(out + dim, out + q_stride, (int8_t) 0);
+    *scale = s;
+}
+
+// 1 bit 符号量化：x >= 0 记为 1
+static void quantize_binary(const float* x, int dim, uint64_t* out, int n_words) {
+    std::fill(out, out + n_words, (uint64_t) 0);
+    for (int i = 0; i < dim; i++) {
+        if (x[i] >= 0.0f) {
+            out[i / 64] |= (uint64_t) 1 << (i % 64);
+        }
+    }
+}
+
+// 维护大小为 k 的最小堆，堆顶为当前第 k 名
+typedef std::pair<float, size_t> scored_row;
+
+static void topk_push(std::vector<scored_row>& heap, size_t k, float score, size_t row) {
+    if (heap.size() < k) {
+        heap.emplace_back(score, row);
+        std::push_heap(heap.begin(), heap.end(), std::greater<scored_row>());
+    } else if (score > heap.front().first) {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<scored_row>());
+        heap.back() = scored_row(score, row);
+        std::push_heap(heap.begin(), heap.end(), std::greater<scored_row>());
+    }
+}
+
+static vector_store_header* store_header(vector_index* store) {
+    return reinterpret_cast<vector_store_header*>(store->map);
+}
+
+static vector_store_row* store_row(vector_index* store, size_t row) {
+    return reinterpret_cast<vector_store_row*>(store->map + sizeof(vector_store_header) + row * store->row_bytes);
+}
+
+static float* store_row_vector(vector_store_row* row) {
+    return reinterpret_cast<float*>(row + 1);
+}
+
+static size_t store_capacity(vector_index* store) {
+    return (store->map_size - sizeof(vector_store_header)) / store->row_bytes;
+}
+
+static size_t store_file_size(vector_index* store, size_t n_rows) {
+    return sizeof(vector_store_header) + n_rows * store->row_bytes;
+}
+
+// 重新映射整个文件
+static bool vector_store_map(vector_index* store, size_t file_size) {
+    if (store->map) {
+        munmap(store->map, store->map_size);
+        store->map = nullptr;
+        store->map_size = 0;
+    }
+    void* map = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+    if (map == MAP_FAILED) {
+        LOGE("Failed to mmap vector store (%zu bytes): %s", file_size, strerror(errno));
+        return false;
+    }
+    store->map = static_cast<uint8_t*>(map);
+    store->map_size = file_size;
+    return true;
+}
+
+// 为 [first_row, n_rows) 追加内存镜像（仅对已构建的部分），调用方需持有 store->mutex
+static void vector_store_append_codes(vector_index* store, size_t first_row) {
+    vector_store_codes& codes = store->codes;
+    if (!codes.meta_ready) {
+        return;
+    }
+    const size_t n_rows = store_header(store)->n_rows;
+    for (size_t row = first_row; row < n_rows; row++) {
+        vector_store_row* entry = store_row(store, row);
+        const float* vec = store_row_vector(entry);
+        codes.doc_ids.push_back(entry->doc_id);
+        codes.deleted.push_back((entry->flags & VECTOR_STORE_ROW_DELETED) ? 1 : 0);
+        if (codes.q8_ready) {
+            codes.q8.resize((row + 1) * codes.q8_stride);
+            codes.q8_scale.resize(row + 1);
+            quantize_int8(vec, store->dim, codes.q8_stride, codes.q8.data() + row * codes.q8_stride,
+                          &codes.q8_scale[row]);
+        }
+        if (codes.bits_ready) {
+            codes.bits.resize((row + 1) * codes.n_words);
+            quantize_binary(vec, store->dim, codes.bits.data() + row * codes.n_words, codes.n_words);
+        }
+    }
+}
+
+// 确保给定量化模式的内存镜像已构建，调用方需持有 store->mutex
+static void vector_store_ensure_codes(vector_index* store, int mode) {
+    vector_store_codes& codes = store->codes;
+    const size_t n_rows = store_header(store)->n_rows;
+    const bool need_q8 = mode == VECTOR_QUANT_INT8 && !codes.q8_ready;
+    const bool need_bits = mode == VECTOR_QUANT_BINARY && !codes.bits_ready;
+    if (codes.meta_ready && !need_q8 && !need_bits) {
+        return;
+    }
+
+    if (need_q8) {
+        codes.q8_stride = (store->dim + VECTOR_QUANT_INT8_ALIGN - 1) / VECTOR_QUANT_INT8_ALIGN * VECTOR_QUANT_INT8_ALIGN;
+        codes.q8.resize(n_rows * codes.q8_stride);
+        codes.q8_scale.resize(n_rows);
+    }
+    if (need_bits) {
+        codes.n_words = (store->dim + 63) / 64;
+        codes.bits.resize(n_rows * codes.n_words);
+    }
+    if (!codes.meta_ready) {
+        codes.doc_ids.resize(n_rows);
+        codes.deleted.resize(n_rows);
     }
 
-    // 创建包装结构
-    llama_context_wrapper* wrapper = new llama_context_wrapper();
-    wrapper->model = model;
-    wrapper->ctx = ctx;
-    wrapper->using_gpu = gpu_available && (actual_gpu_layers > 0);
-    wrapper->gpu_layers = actual_gpu_layers;
-
-    if (wrapper->using_gpu) {
-        LOGI("Model initialized successfully with GPU acceleration (%d layers)!", actual_gpu_layers);
-    } else {
-        LOGI("Model initialized successfully (CPU only, GPU fallback or disabled)");
+    for (size_t row = 0; row < n_rows; row++) {
+        vector_store_row* entry = store_row(store, row);
+        const float* vec = store_row_vector(entry);
+        if (!codes.meta_ready) {
+            codes.doc_ids[row] = entry->doc_id;
+            codes.deleted[row] = (entry->flags & VECTOR_STORE_ROW_DELETED) ? 1 : 0;
+        }
+        if (need_q8) {
+            quantize_int8(vec, store->dim, codes.q8_stride, codes.q8.data() + row * codes.q8_stride,
+                          &codes.q8_scale[row]);
+        }
+        if (need_bits) {
+            quantize_binary(vec, store->dim, codes.bits.data() + row * codes.n_words, codes.n_words);
+        }
     }
 
-    return reinterpret_cast<jlong>(wrapper);
+    codes.meta_ready = true;
+    codes.q8_ready = codes.q8_ready || need_q8;
+    codes.bits_ready = codes.bits_ready || need_bits;
+    LOGI("Vector store codes built for %zu rows (int8: %d, binary: %d)", n_rows, codes.q8_ready, codes.bits_ready);
 }
 
-// ============================================
-// 获取当前推理模式信息
-// ============================================
-extern "C" JNIEXPORT jboolean JNICALL
-Java_com_example_haiyangapp_inference_LlamaCppJNI_isUsingGpu(
-    JNIEnv* env,
-    jobject /* this */,
-    jlong modelHandle) {
+// 与向量最相近的聚类中心
+static int ivf_nearest(const vector_index* store, const float* vec) {
+    const vector_store_ivf& ivf = store->ivf;
+    int best = 0;
+    float best_score = -INFINITY;
+    for (int c = 0; c < ivf.n_lists; c++) {
+        const float score = dot_f32(vec, ivf.centroids.data() + (size_t) c * store->stride, store->stride);
+        if (score > best_score) {
+            best_score = score;
+            best = c;
+        }
+    }
+    return best;
+}
 
-    if (modelHandle == 0) {
-        return JNI_FALSE;
+// 为 [first_row, n_rows) 分配簇号，调用方需持有 store->mutex
+static void ivf_assign_from(vector_index* store, size_t first_row) {
+    vector_store_ivf& ivf = store->ivf;
+    const size_t n_rows = store_header(store)->n_rows;
+    ivf.assign.resize(n_rows);
+    for (size_t row = first_row; row < n_rows; row++) {
+        const int list = ivf_nearest(store, store_row_vector(store_row(store, row)));
+        ivf.assign[row] = (uint32_t) list;
+        ivf.lists[list].push_back((uint32_t) row);
     }
+}
 
-    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
-    return wrapper->using_gpu ? JNI_TRUE : JNI_FALSE;
+// 按分配结果重建倒排表
+static void ivf_rebuild_lists(vector_store_ivf& ivf) {
+    ivf.lists.assign(ivf.n_lists, std::vector<uint32_t>());
+    for (size_t row = 0; row < ivf.assign.size(); row++) {
+        ivf.lists[ivf.assign[row]].push_back((uint32_t) row);
+    }
 }
 
-extern "C" JNIEXPORT jint JNICALL
-Java_com_example_haiyangapp_inference_LlamaCppJNI_getGpuLayers(
-    JNIEnv* env,
-    jobject /* this */,
-    jlong modelHandle) {
+// 写入 <path>.ivf（临时文件 + rename），调用方需持有 store->mutex
+static bool ivf_save(vector_index* store) {
+    vector_store_ivf& ivf = store->ivf;
+    if (!ivf.trained) {
+        return false;
+    }
 
-    if (modelHandle == 0) {
-        return 0;
+    const std::string path = store->path + ".ivf";
+    const std::string tmp_path = path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        LOGE("Failed to write %s: %s", tmp_path.c_str(), strerror(errno));
+        return false;
     }
 
-    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
-    return wrapper->gpu_layers;
-}
+    vector_ivf_header header = {};
+    header.magic = VECTOR_IVF_MAGIC;
+    header.version = VECTOR_IVF_VERSION;
+    header.dim = (uint32_t) store->dim;
+    header.stride = (uint32_t) store->stride;
+    header.n_lists = (uint32_t) ivf.n_lists;
+    header.n_assigned = ivf.assign.size();
+    header.trained_rows = ivf.trained_rows;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(ivf.centroids.data(), sizeof(float), ivf.centroids.size(), file) == ivf.centroids.size() &&
+              fwrite(ivf.assign.data(), sizeof(uint32_t), ivf.assign.size(), file) == ivf.assign.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        LOGE("Failed to save IVF index %s", path.c_str());
+        unlink(tmp_path.c_str());
+        return false;
+    }
 
-extern "C" JNIEXPORT jstring JNICALL
-Java_com_example_haiyangapp_inference_LlamaCppJNI_generate(
-    JNIEnv* env,
-    jobject /* this */,
-    jlong modelHandle,
-    jstring prompt,
-    jint maxTokens,
-    jfloat temperature,
-    jfloat topP,
-    jint topK) {
+    ivf.saved_rows = ivf.assign.size();
+    LOGD("IVF index saved: %d lists, %zu rows", ivf.n_lists, ivf.saved_rows);
+    return true;
+}
 
-    if (modelHandle == 0) {
-        LOGE("Model handle is null");
-        return env->NewStringUTF("");
+// 读取 <path>.ivf 并为之后追加的行补分配簇号；文件缺失或不匹配时保持未训练
+static void ivf_load(vector_index* store) {
+    const std::string path = store->path + ".ivf";
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return;
     }
 
-    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
-    const char *promptStr = env->GetStringUTFChars(prompt, nullptr);
-    LOGD("Generating text for prompt (length: %zu)", strlen(promptStr));
+    vector_ivf_header header;
+    vector_store_ivf& ivf = store->ivf;
+    const size_t n_rows = store_header(store)->n_rows;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+              header.magic == VECTOR_IVF_MAGIC && header.version == VECTOR_IVF_VERSION &&
+              header.dim == (uint32_t) store->dim && header.stride == (uint32_t) store->stride &&
+              header.n_lists > 0 && header.n_lists <= VECTOR_IVF_MAX_LISTS && header.n_assigned <= n_rows;
+    if (ok) {
+        ivf.n_lists = (int) header.n_lists;
+        ivf.centroids.resize((size_t) ivf.n_lists * store->stride);
+        ivf.assign.resize(header.n_assigned);
+        ok = fread(ivf.centroids.data(), sizeof(float), ivf.centroids.size(), file) == ivf.centroids.size() &&
+             fread(ivf.assign.data(), sizeof(uint32_t), ivf.assign.size(), file) == ivf.assign.size();
+        for (size_t row = 0; ok && row < ivf.assign.size(); row++) {
+            ok = ivf.assign[row] < header.n_lists;
+        }
+    }
+    fclose(file);
 
-    // Tokenize prompt
-    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    if (!ok) {
+        LOGW("Ignoring invalid IVF index %s", path.c_str());
+        store->ivf = vector_store_ivf();
+        return;
+    }
 
-    // 预分配足够的空间
-    std::vector<llama_token> tokens;
-    tokens.resize(strlen(promptStr) + 256);
+    ivf.trained = true;
+    ivf.trained_rows = header.trained_rows;
+    ivf.saved_rows = header.n_assigned;
+    ivf_rebuild_lists(ivf);
+    ivf_assign_from(store, header.n_assigned);
+    LOGI("IVF index loaded: %d lists, %llu rows (+%zu new)",
+         ivf.n_lists, (unsigned long long) header.n_assigned, n_rows - (size_t) header.n_assigned);
+}
 
-    int n_tokens = llama_tokenize(
-        vocab,
-        promptStr,
-        strlen(promptStr),
-        tokens.data(),
-        tokens.size(),
-        true,   // add_special - 添加BOS token
-        true    // parse_special - 解析ChatML特殊标记(<|im_start|>, <|im_end|>等)
-    );
+// 在存活行上训练球面 k-means 并为所有行分配簇号，调用方需持有 store->mutex
+static void ivf_train(vector_index* store, size_t n_live) {
+    const int64_t t_start = ggml_time_us();
+    vector_store_ivf& ivf = store->ivf;
+    const size_t n_rows = store_header(store)->n_rows;
+    const int stride = store->stride;
+    const int n_lists = std::max(VECTOR_IVF_MIN_LISTS,
+                                 std::min(VECTOR_IVF_MAX_LISTS, (int) std::sqrt((double) n_live)));
+
+    // 均匀采样存活行
+    const size_t n_target = (size_t) n_lists * VECTOR_IVF_SAMPLES_PER_LIST;
+    const size_t step = std::max<size_t>(1, n_live / n_target);
+    std::vector<size_t> samples;
+    samples.reserve(std::min(n_live, n_target + 1));
+    size_t live_index = 0;
+    for (size_t row = 0; row < n_rows; row++) {
+        if (store_row(store, row)->flags & VECTOR_STORE_ROW_DELETED) {
+            continue;
+        }
+        if (live_index++ % step == 0) {
+            samples.push_back(row);
+        }
+    }
 
-    env->ReleaseStringUTFChars(prompt, promptStr);
+    // 用等间隔样本初始化中心
+    ivf.n_lists = n_lists;
+    ivf.centroids.assign((size_t) n_lists * stride, 0.0f);
+    for (int c = 0; c < n_lists; c++) {
+        const float* vec = store_row_vector(store_row(store, samples[(size_t) c * samples.size() / n_lists]));
+        std::copy(vec, vec + stride, ivf.centroids.begin() + (size_t) c * stride);
+    }
 
-    if (n_tokens < 0) {
-        LOGE("Failed to tokenize prompt");
-        return env->NewStringUTF("");
+    std::vector<float> sums((size_t) n_lists * stride);
+    std::vector<int> counts(n_lists);
+    for (int iter = 0; iter < VECTOR_IVF_TRAIN_ITERATIONS; iter++) {
+        std::fill(sums.begin(), sums.end(), 0.0f);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t row : samples) {
+            const float* vec = store_row_vector(store_row(store, row));
+            const int c = ivf_nearest(store, vec);
+            float* sum = sums.data() + (size_t) c * stride;
+            for (int i = 0; i < stride; i++) {
+                sum[i] += vec[i];
+            }
+            counts[c]++;
+        }
+        // 新中心 = 簇内向量和的归一化；空簇保留原中心
+        for (int c = 0; c < n_lists; c++) {
+            if (counts[c] > 0) {
+                normalize_embedding(sums.data() + (size_t) c * stride,
+                                    ivf.centroids.data() + (size_t) c * stride, stride);
+            }
+        }
     }
 
-    tokens.resize(n_tokens);
+    ivf.trained = true;
+    ivf.trained_rows = n_live;
+    ivf.assign.clear();
+    ivf.lists.assign(n_lists, std::vector<uint32_t>());
+    ivf_assign_from(store, 0);
+    ivf_save(store);
 
-    LOGD("Prompt tokenized: %d tokens", n_tokens);
+    LOGI("IVF index trained: %d lists from %zu samples over %zu rows in %.1f ms",
+         n_lists, samples.size(), n_rows, (ggml_time_us() - t_start) / 1000.0);
+}
 
-    // 准备采样参数
-    auto sparams = llama_sampler_chain_default_params();
-    llama_sampler* smpl = llama_sampler_chain_init(sparams);
+// 追加后维护 IVF：已训练则为新行分配簇号，存活行数足够或增长过多时（重新）训练
+static void ivf_on_append(vector_index* store, size_t first_row) {
+    const vector_store_header* header = store_header(store);
+    const size_t n_live = header->n_rows - header->n_deleted;
+    vector_store_ivf& ivf = store->ivf;
+
+    if (n_live >= VECTOR_IVF_MIN_TRAIN_ROWS &&
+        (!ivf.trained || n_live >= ivf.trained_rows * VECTOR_IVF_RETRAIN_GROWTH)) {
+        ivf_train(store, n_live);
+    } else if (ivf.trained) {
+        ivf_assign_from(store, first_row);
+    }
+}
 
-    // 添加重复惩罚
-    llama_sampler_chain_add(smpl, llama_sampler_init_penalties(
-        256,     // penalty_last_n - 增加到256,考虑更长的历史
-        1.15f,   // penalty_repeat - 提高重复惩罚系数
-        0.1f,    // penalty_freq - 添加频率惩罚
-        0.0f     // penalty_present
-    ));
+// 解码一个 UTF-8 码点，返回字节数（非法字节按 1 字节处理）
+static int utf8_decode(const unsigned char* s, int len, uint32_t* cp) {
+    const unsigned char c = s[0];
+    if (c < 0x80 || len < 2) {
+        *cp = c;
+        return 1;
+    }
+    if ((c & 0xE0) == 0xC0) {
+        *cp = ((c & 0x1Fu) << 6) | (s[1] & 0x3Fu);
+        return 2;
+    }
+    if ((c & 0xF0) == 0xE0 && len >= 3) {
+        *cp = ((c & 0x0Fu) << 12) | ((s[1] & 0x3Fu) << 6) | (s[2] & 0x3Fu);
+        return 3;
+    }
+    if ((c & 0xF8) == 0xF0 && len >= 4) {
+        *cp = ((c & 0x07u) << 18) | ((s[1] & 0x3Fu) << 12) | ((s[2] & 0x3Fu) << 6) | (s[3] & 0x3Fu);
+        return 4;
+    }
+    *cp = c;
+    return 1;
+}
 
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(topK));
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(topP, 1));
-    llama_sampler_chain_add(smpl, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+// 中日韩文字（汉字、假名、谚文）按字切分后组成二元词
+static bool is_cjk_codepoint(uint32_t cp) {
+    return (cp >= 0x3040 && cp <= 0x30FF) || (cp >= 0x3400 && cp <= 0x4DBF) ||
+           (cp >= 0x4E00 && cp <= 0x9FFF) || (cp >= 0xAC00 && cp <= 0xD7AF) ||
+           (cp >= 0xF900 && cp <= 0xFAFF);
+}
 
-    // 清空内存缓存,避免上次对话影响本次生成
-    llama_memory_t mem = llama_get_memory(wrapper->ctx);
-    llama_memory_clear(mem, true);
+static bool is_word_codepoint(uint32_t cp) {
+    return (cp >= '0' && cp <= '9') || (cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z') ||
+           cp == '_' || (cp >= 0xC0 && cp <= 0x24F);
+}
 
-    // 创建批次
-    llama_batch batch = llama_batch_get_one(tokens.data(), n_tokens);
+/**
+ * 检索用分词：拉丁字母 / 数字连续段转小写作为一个词（型号、编号整体保留），
+ * 中日韩连续段取相邻二元组（单字成段时取单字），词项以 FNV-1a 哈希表示
+ */
+static void lexical_terms(const char* text, int len, std::vector<uint64_t>& terms) {
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(text);
+    std::string word;
+    int cjk_prev = -1;       // 上一个汉字的起始字节
+    int cjk_prev_len = 0;
+    bool cjk_paired = false; // 上一个汉字是否已组成二元词
+
+    auto flush_word = [&]() {
+        if (word.size() >= 2 || (word.size() == 1 && word[0] >= '0' && word[0] <= '9')) {
+            terms.push_back(fnv1a_64(word.data(), word.size()));
+        }
+        word.clear();
+    };
+    auto flush_cjk = [&]() {
+        if (cjk_prev >= 0 && !cjk_paired) {
+            terms.push_back(fnv1a_64(s + cjk_prev, cjk_prev_len));
+        }
+        cjk_prev = -1;
+        cjk_paired = false;
+    };
+
+    for (int i = 0; i < len; ) {
+        uint32_t cp;
+        const int n = utf8_decode(s + i, len - i, &cp);
+        if (is_cjk_codepoint(cp)) {
+            flush_word();
+            if (cjk_prev >= 0) {
+                terms.push_back(fnv1a_64(s + cjk_prev, cjk_prev_len + n));
+                cjk_paired = true;
+            } else {
+                cjk_paired = false;
+            }
+            cjk_prev = i;
+            cjk_prev_len = n;
+        } else if (is_word_codepoint(cp)) {
+            flush_cjk();
+            if (n == 1) {
+                word.push_back((char) tolower(s[i]));
+            } else {
+                word.append(text + i, n);
+            }
+        } else {
+            flush_word();
+            flush_cjk();
+        }
+        i += n;
+    }
+    flush_word();
+    flush_cjk();
+}
 
-    // 评估提示词
-    if (llama_decode(wrapper->ctx, batch) != 0) {
-        LOGE("Failed to decode prompt");
-        llama_sampler_free(smpl);
-        return env->NewStringUTF("");
+// 为 row 建立文本索引，调用方需持有 store->mutex
+static void text_index_row(vector_index* store, size_t row, const char* text, int len) {
+    vector_store_text& index = store->text;
+    if (index.doc_len.size() <= row) {
+        index.doc_len.resize(row + 1, VECTOR_TEXT_UNINDEXED);
+    }
+    if (index.doc_len[row] != VECTOR_TEXT_UNINDEXED) {
+        return;
     }
 
-    // 生成tokens
-    std::string result;
-    int n_generated = 0;
+    std::vector<uint64_t> terms;
+    lexical_terms(text, len, terms);
+    std::sort(terms.begin(), terms.end());
+    for (size_t i = 0; i < terms.size(); ) {
+        size_t j = i;
+        while (j < terms.size() && terms[j] == terms[i]) {
+            j++;
+        }
+        index.postings[terms[i]].push_back({(uint32_t) row, (uint32_t) (j - i)});
+        i = j;
+    }
 
-    while (n_generated < maxTokens) {
-        // 采样下一个token
-        llama_token new_token = llama_sampler_sample(smpl, wrapper->ctx, -1);
+    index.doc_len[row] = (uint32_t) terms.size();
+    if (!(store_row(store, row)->flags & VECTOR_STORE_ROW_DELETED)) {
+        index.n_docs++;
+        index.total_len += terms.size();
+    }
+    index.dirty = true;
+}
 
-        // 检查是否是结束符(EOS/EOG/EOT)
-        if (llama_vocab_is_eog(vocab, new_token)) {
-            LOGD("End of generation token received");
-            break;
+// 行被打墓碑后从 BM25 统计中扣除（倒排表在压缩时清理），调用方需持有 store->mutex
+static void text_on_delete(vector_index* store, size_t row) {
+    vector_store_text& index = store->text;
+    if (row < index.doc_len.size() && index.doc_len[row] != VECTOR_TEXT_UNINDEXED && index.n_docs > 0) {
+        index.n_docs--;
+        index.total_len -= index.doc_len[row];
+    }
+}
+
+// 按存活行重新计算文档数和总词数
+static void text_recount(vector_index* store) {
+    vector_store_text& index = store->text;
+    index.n_docs = 0;
+    index.total_len = 0;
+    for (size_t row = 0; row < index.doc_len.size(); row++) {
+        if (index.doc_len[row] != VECTOR_TEXT_UNINDEXED &&
+            !(store_row(store, row)->flags & VECTOR_STORE_ROW_DELETED)) {
+            index.n_docs++;
+            index.total_len += index.doc_len[row];
         }
+    }
+}
 
-        // 将token转换为文本
-        char piece[256];
-        int n_piece = llama_token_to_piece(vocab, new_token, piece, sizeof(piece), 0, false);
-        if (n_piece > 0) {
-            result.append(piece, n_piece);
-
-            // 额外检查: 如果生成的文本包含<|im_end|>标记,停止生成
-            if (result.find("<|im_end|>") != std::string::npos) {
-                LOGD("Found <|im_end|> in generated text, stopping");
-                // 移除<|im_end|>标记
-                size_t pos = result.find("<|im_end|>");
-                result = result.substr(0, pos);
+// 写入 <path>.bm25（临时文件 + rename），调用方需持有 store->mutex
+static bool text_save(vector_index* store) {
+    vector_store_text& index = store->text;
+    const std::string path = store->path + ".bm25";
+    const std::string tmp_path = path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        LOGE("Failed to write %s: %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    vector_text_header header = {};
+    header.magic = VECTOR_TEXT_MAGIC;
+    header.version = VECTOR_TEXT_VERSION;
+    header.n_rows = index.doc_len.size();
+    header.n_terms = index.postings.size();
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(index.doc_len.data(), sizeof(uint32_t), index.doc_len.size(), file) == index.doc_len.size();
+    for (auto it = index.postings.begin(); ok && it != index.postings.end(); ++it) {
+        const uint32_t n = (uint32_t) it->second.size();
+        ok = fwrite(&it->first, sizeof(uint64_t), 1, file) == 1 &&
+             fwrite(&n, sizeof(uint32_t), 1, file) == 1 &&
+             fwrite(it->second.data(), sizeof(vector_text_posting), n, file) == n;
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        LOGE("Failed to save BM25 index %s", path.c_str());
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    index.dirty = false;
+    LOGD("BM25 index saved: %zu rows, %zu terms", index.doc_len.size(), index.postings.size());
+    return true;
+}
+
+// 读取 <path>.bm25；缺失或与向量文件不一致时所有行视为未建立索引，由上层补建
+static void text_load(vector_index* store) {
+    vector_store_text& index = store->text;
+    const size_t n_rows = store_header(store)->n_rows;
+    const std::string path = store->path + ".bm25";
+
+    FILE* file = fopen(path.c_str(), "rb");
+    bool ok = file != nullptr;
+    vector_text_header header;
+    if (ok) {
+        ok = fread(&header, sizeof(header), 1, file) == 1 &&
+             header.magic == VECTOR_TEXT_MAGIC && header.version == VECTOR_TEXT_VERSION &&
+             header.n_rows <= n_rows;
+    }
+    if (ok) {
+        index.doc_len.resize(header.n_rows);
+        ok = fread(index.doc_len.data(), sizeof(uint32_t), index.doc_len.size(), file) == index.doc_len.size();
+        for (uint64_t t = 0; ok && t < header.n_terms; t++) {
+            uint64_t term;
+            uint32_t n;
+            ok = fread(&term, sizeof(term), 1, file) == 1 && fread(&n, sizeof(n), 1, file) == 1;
+            if (!ok) {
                 break;
             }
+            std::vector<vector_text_posting>& list = index.postings[term];
+            list.resize(n);
+            ok = fread(list.data(), sizeof(vector_text_posting), n, file) == n;
+            for (uint32_t i = 0; ok && i < n; i++) {
+                ok = list[i].row < header.n_rows;
+            }
         }
+    }
+    if (file) {
+        fclose(file);
+    }
 
-        // 准备下一次解码
-        batch = llama_batch_get_one(&new_token, 1);
-        if (llama_decode(wrapper->ctx, batch) != 0) {
-            LOGE("Failed to decode token");
-            break;
+    if (!ok) {
+        if (file) {
+            LOGW("Ignoring invalid BM25 index %s", path.c_str());
         }
-
-        n_generated++;
+        index = vector_store_text();
     }
+    index.doc_len.resize(n_rows, VECTOR_TEXT_UNINDEXED);
+    text_recount(store);
+    LOGI("BM25 index loaded: %zu indexed rows, %zu terms", index.n_docs, index.postings.size());
+}
 
-    llama_sampler_free(smpl);
-
-    LOGD("Generation completed: %d tokens generated", n_generated);
-    return env->NewStringUTF(result.c_str());
+// 压缩后按新行号重写倒排表，old_to_new 中 UINT32_MAX 表示该行被回收
+static void text_remap(vector_index* store, const std::vector<uint32_t>& old_to_new, size_t n_new_rows) {
+    vector_store_text& index = store->text;
+    std::vector<uint32_t> doc_len(n_new_rows, VECTOR_TEXT_UNINDEXED);
+    for (size_t row = 0; row < index.doc_len.size() && row < old_to_new.size(); row++) {
+        if (old_to_new[row] != UINT32_MAX) {
+            doc_len[old_to_new[row]] = index.doc_len[row];
+        }
+    }
+    index.doc_len.swap(doc_len);
+
+    for (auto it = index.postings.begin(); it != index.postings.end(); ) {
+        std::vector<vector_text_posting>& list = it->second;
+        size_t n_kept = 0;
+        for (const vector_text_posting& posting : list) {
+            if (posting.row < old_to_new.size() && old_to_new[posting.row] != UINT32_MAX) {
+                list[n_kept++] = {old_to_new[posting.row], posting.tf};
+            }
+        }
+        list.resize(n_kept);
+        it = list.empty() ? index.postings.erase(it) : std::next(it);
+    }
+    index.dirty = true;
 }
 
-extern "C" JNIEXPORT void JNICALL
-Java_com_example_haiyangapp_inference_LlamaCppJNI_freeModel(
-    JNIEnv* env,
-    jobject /* this */,
-    jlong modelHandle) {
+/**
+ * BM25 检索，返回按分数降序的 (分数, 行号)，调用方需持有 store->mutex
+ * @param filter 已排序的文档 ID 过滤集合，为空指针时不过滤
+ */
+static std::vector<scored_row> text_search(vector_index* store, const char* query, int query_len,
+                                           size_t k, const std::vector<jlong>* filter) {
+    std::vector<scored_row> heap;
+    const vector_store_text& index = store->text;
+    if (index.n_docs == 0 || k == 0) {
+        return heap;
+    }
 
-    if (modelHandle == 0) {
-        LOGW("Attempting to free null model handle");
-        return;
+    std::vector<uint64_t> terms;
+    lexical_terms(query, query_len, terms);
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+
+    const float n_docs = (float) index.n_docs;
+    const float avg_len = std::max(1.0f, (float) index.total_len / n_docs);
+    std::unordered_map<uint32_t, float> scores;
+    for (uint64_t term : terms) {
+        auto it = index.postings.find(term);
+        if (it == index.postings.end()) {
+            continue;
+        }
+        const float df = (float) it->second.size();
+        const float idf = logf(1.0f + (n_docs - df + 0.5f) / (df + 0.5f));
+        for (const vector_text_posting& posting : it->second) {
+            const float tf = (float) posting.tf;
+            const float norm = VECTOR_BM25_K1 * (1.0f - VECTOR_BM25_B +
+                                                 VECTOR_BM25_B * (float) index.doc_len[posting.row] / avg_len);
+            scores[posting.row] += idf * tf * (VECTOR_BM25_K1 + 1.0f) / (tf + norm);
+        }
     }
 
-    LOGD("Freeing model");
-    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
+    heap.reserve(k);
+    for (const auto& entry : scores) {
+        const vector_store_row* row = store_row(store, entry.first);
+        if ((row->flags & VECTOR_STORE_ROW_DELETED) ||
+            (filter && !std::binary_search(filter->begin(), filter->end(), (jlong) row->doc_id))) {
+            continue;
+        }
+        if (entry.second > 0.0f) {
+            topk_push(heap, k, entry.second, entry.first);
+        }
+    }
+    std::sort_heap(heap.begin(), heap.end(), std::greater<scored_row>());
+    return heap;
+}
 
-    if (wrapper->ctx) {
-        llama_free(wrapper->ctx);
+// 扩展文件到至少 n_rows 行并重新映射，调用方需持有 store->mutex
+static bool vector_store_reserve(vector_index* store, size_t n_rows) {
+    const size_t capacity = store_capacity(store);
+    if (n_rows <= capacity) {
+        return true;
     }
-    if (wrapper->model) {
-        llama_free_model(wrapper->model);
+    size_t new_capacity = std::max<size_t>(capacity * 2, VECTOR_STORE_GROW_ROWS);
+    while (new_capacity < n_rows) {
+        new_capacity *= 2;
     }
-
-    delete wrapper;
-    llama_backend_free();
-
-    LOGD("Model freed successfully");
+    const size_t new_size = store_file_size(store, new_capacity);
+    if (ftruncate(store->fd, (off_t) new_size) != 0) {
+        LOGE("Failed to grow vector store to %zu bytes: %s", new_size, strerror(errno));
+        return false;
+    }
+    return vector_store_map(store, new_size);
 }
 
-extern "C" JNIEXPORT void JNICALL
-Java_com_example_haiyangapp_inference_LlamaCppJNI_generateStream(
-    JNIEnv* env,
-    jobject /* this */,
-    jlong modelHandle,
-    jstring prompt,
-    jint maxTokens,
-    jfloat temperature,
-    jfloat topP,
-    jint topK,
-    jobject callback) {
+static void vector_store_close(vector_index* store) {
+    if (store->ivf.trained && store->ivf.assign.size() != store->ivf.saved_rows) {
+        ivf_save(store);
+    }
+    if (store->text.dirty) {
+        text_save(store);
+    }
+    if (store->map) {
+        msync(store->map, store->map_size, MS_SYNC);
+        munmap(store->map, store->map_size);
+    }
+    if (store->fd >= 0) {
+        close(store->fd);
+    }
+    delete store;
+}
 
-    if (modelHandle == 0) {
-        LOGE("Model handle is null");
-        return;
+// 打开（或创建）向量文件；dim <= 0 时只打开已有文件并使用其维度
+static vector_index* vector_store_open(const char* path, int dim) {
+    const int fd = open(path, dim > 0 ? (O_RDWR | O_CREAT | O_CLOEXEC) : (O_RDWR | O_CLOEXEC), 0600);
+    if (fd < 0) {
+        if (dim > 0) {
+            LOGE("Failed to open vector store %s: %s", path, strerror(errno));
+        }
+        return nullptr;
     }
 
-    llama_context_wrapper* wrapper = reinterpret_cast<llama_context_wrapper*>(modelHandle);
-    const char *promptStr = env->GetStringUTFChars(prompt, nullptr);
-    LOGD("Generating text (stream) for prompt (length: %zu)", strlen(promptStr));
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        LOGE("Failed to stat vector store %s: %s", path, strerror(errno));
+        close(fd);
+        return nullptr;
+    }
 
-    // 获取回调方法
-    jclass callbackClass = env->GetObjectClass(callback);
-    jmethodID onTokenMethod = env->GetMethodID(callbackClass, "onToken", "(Ljava/lang/String;)V");
-    jmethodID onCompleteMethod = env->GetMethodID(callbackClass, "onComplete", "()V");
-    jmethodID onErrorMethod = env->GetMethodID(callbackClass, "onError", "(Ljava/lang/String;)V");
+    vector_index* store = new vector_index();
+    store->path = path;
+    store->fd = fd;
 
-    if (onTokenMethod == nullptr || onCompleteMethod == nullptr || onErrorMethod == nullptr) {
-        LOGE("Failed to get callback methods");
-        env->ReleaseStringUTFChars(prompt, promptStr);
-        return;
+    if ((size_t) st.st_size < sizeof(vector_store_header)) {
+        if (dim <= 0) {
+            vector_store_close(store);
+            return nullptr;
+        }
+        // 新文件：预分配一块并写入文件头
+        store->dim = dim;
+        store->stride = (dim + VECTOR_STORE_ROW_ALIGN - 1) / VECTOR_STORE_ROW_ALIGN * VECTOR_STORE_ROW_ALIGN;
+        store->row_bytes = sizeof(vector_store_row) + sizeof(float) * store->stride;
+        const size_t size = store_file_size(store, VECTOR_STORE_GROW_ROWS);
+        if (ftruncate(fd, (off_t) size) != 0 || !vector_store_map(store, size)) {
+            LOGE("Failed to initialize vector store %s", path);
+            vector_store_close(store);
+            return nullptr;
+        }
+        vector_store_header* header = store_header(store);
+        memset(header, 0, sizeof(*header));
+        header->magic = VECTOR_STORE_MAGIC;
+        header->version = VECTOR_STORE_VERSION;
+        header->dim = (uint32_t) store->dim;
+        header->stride = (uint32_t) store->stride;
+        unlink((store->path + ".ivf").c_str());
+        unlink((store->path + ".bm25").c_str());
+        LOGI("Vector store created: %s, dimension: %d", path, dim);
+        return store;
     }
 
-    // Tokenize prompt
-    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    // 已有文件：直接映射，无需反序列化
+    if (!vector_store_map(store, (size_t) st.st_size)) {
+        vector_store_close(store);
+        return nullptr;
+    }
+    const vector_store_header* header = store_header(store);
+    if (header->magic != VECTOR_STORE_MAGIC || header->version != VECTOR_STORE_VERSION ||
+        (dim > 0 && header->dim != (uint32_t) dim) || header->stride < header->dim) {
+        LOGE("Vector store %s header mismatch (magic=%08x, version=%u, dim=%u, expected dim=%d)",
+             path, header->magic, header->version, header->dim, dim);
+        vector_store_close(store);
+        return nullptr;
+    }
+    store->dim = (int) header->dim;
+    store->stride = (int) header->stride;
+    store->row_bytes = sizeof(vector_store_row) + sizeof(float) * store->stride;
+    if (header->n_rows > store_capacity(store) || header->n_deleted > header->n_rows) {
+        LOGE("Vector store %s is truncated (%llu rows)", path, (unsigned long long) header->n_rows);
+        vector_store_close(store);
+        return nullptr;
+    }
 
-    std::vector<llama_token> tokens;
-    tokens.resize(strlen(promptStr) + 256);
+    LOGI("Vector store mapped: %s, dimension: %d, rows: %llu, deleted: %llu",
+         path, store->dim, (unsigned long long) header->n_rows, (unsigned long long) header->n_deleted);
+    ivf_load(store);
+    text_load(store);
+    return store;
+}
 
-    int n_tokens = llama_tokenize(
-        vocab,
-        promptStr,
-        strlen(promptStr),
-        tokens.data(),
-        tokens.size(),
-        true,
-        true
-    );
+// 把存活行重写到临时文件后原子替换，返回回收的行数，失败返回 -1；调用方需持有 store->mutex
+static int vector_store_compact(vector_index* store) {
+    const vector_store_header* header = store_header(store);
+    const size_t n_rows = header->n_rows;
+    const size_t n_live = n_rows - header->n_deleted;
+    if (header->n_deleted == 0) {
+        return 0;
+    }
 
-    env->ReleaseStringUTFChars(prompt, promptStr);
+    const std::string tmp_path = store->path + ".compact";
+    const int tmp_fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (tmp_fd < 0) {
+        LOGE("Failed to create %s: %s", tmp_path.c_str(), strerror(errno));
+        return -1;
+    }
 
-    if (n_tokens < 0) {
-        LOGE("Failed to tokenize prompt");
-        jstring errorMsg = env->NewStringUTF("Failed to tokenize prompt");
-        env->CallVoidMethod(callback, onErrorMethod, errorMsg);
-        return;
+    const size_t size = store_file_size(store, std::max<size_t>(n_live, VECTOR_STORE_GROW_ROWS));
+    void* tmp_map = MAP_FAILED;
+    if (ftruncate(tmp_fd, (off_t) size) == 0) {
+        tmp_map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, tmp_fd, 0);
+    }
+    if (tmp_map == MAP_FAILED) {
+        LOGE("Failed to prepare compacted vector store: %s", strerror(errno));
+        close(tmp_fd);
+        unlink(tmp_path.c_str());
+        return -1;
     }
 
-    tokens.resize(n_tokens);
-    LOGD("Prompt tokenized: %d tokens", n_tokens);
+    uint8_t* dst = static_cast<uint8_t*>(tmp_map);
+    size_t n_written = 0;
+    std::vector<uint32_t> old_to_new(n_rows, UINT32_MAX);
+    for (size_t row = 0; row < n_rows; row++) {
+        const vector_store_row* src = store_row(store, row);
+        if (src->flags & VECTOR_STORE_ROW_DELETED) {
+            continue;
+        }
+        memcpy(dst + sizeof(vector_store_header) + n_written * store->row_bytes, src, store->row_bytes);
+        old_to_new[row] = (uint32_t) n_written;
+        n_written++;
+    }
+    vector_store_header* new_header = reinterpret_cast<vector_store_header*>(dst);
+    memcpy(new_header, header, sizeof(*new_header));
+    new_header->n_rows = n_written;
+    new_header->n_deleted = 0;
+
+    const bool synced = msync(tmp_map, size, MS_SYNC) == 0;
+    munmap(tmp_map, size);
+
+    // .ivf / .bm25 按旧行号记录，先删除再替换：中途被杀时重新打开视为缺失，
+    // IVF 在下次追加时重新训练，BM25 由上层按 vectorIndexMissingText 补建
+    unlink((store->path + ".ivf").c_str());
+    unlink((store->path + ".bm25").c_str());
+    if (!synced || rename(tmp_path.c_str(), store->path.c_str()) != 0) {
+        LOGE("Failed to replace vector store with compacted file: %s", strerror(errno));
+        close(tmp_fd);
+        unlink(tmp_path.c_str());
+        return -1;
+    }
 
-    // 准备采样参数
-    auto sparams = llama_sampler_chain_default_params();
-    llama_sampler* smpl = llama_sampler_chain_init(sparams);
+    // 切换到新文件
+    munmap(store->map, store->map_size);
+    store->map = nullptr;
+    store->map_size = 0;
+    close(store->fd);
+    store->fd = tmp_fd;
+    if (!vector_store_map(store, size)) {
+        return -1;
+    }
 
-    llama_sampler_chain_add(smpl, llama_sampler_init_penalties(
-        256, 1.15f, 0.1f, 0.0f
-    ));
+    // 行号已变化：量化镜像在下次量化检索时重建，IVF 沿用聚类中心重新分配
+    store->codes = vector_store_codes();
+    if (store->ivf.trained) {
+        store->ivf.assign.clear();
+        store->ivf.lists.assign(store->ivf.n_lists, std::vector<uint32_t>());
+        ivf_assign_from(store, 0);
+        ivf_save(store);
+    }
+    text_remap(store, old_to_new, n_written);
+    text_save(store);
 
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(topK));
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(topP, 1));
-    llama_sampler_chain_add(smpl, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    const int reclaimed = (int) (n_rows - n_written);
+    LOGI("Vector store compacted: %zu live rows, %d rows reclaimed", n_written, reclaimed);
+    return reclaimed;
+}
 
-    // 清空内存缓存
-    llama_memory_t mem = llama_get_memory(wrapper->ctx);
-    llama_memory_clear(mem, true);
+/**
+ * 打开（或创建）内存映射向量存储
+ * @param path 向量文件路径
+ * @param dimension 向量维度（与嵌入模型一致）；<= 0 表示只打开已有文件
+ * @return 存储句柄，0 表示失败（文件不存在或与维度不匹配）
+ */
+extern "C" JNIEXPORT jlong JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_openVectorIndex(
+    JNIEnv* env,
+    jobject /* this */,
+    jstring path,
+    jint dimension) {
 
-    // 创建批次
-    llama_batch batch = llama_batch_get_one(tokens.data(), n_tokens);
+    const char* path_str = env->GetStringUTFChars(path, nullptr);
+    vector_index* store = vector_store_open(path_str, dimension);
+    env->ReleaseStringUTFChars(path, path_str);
+    return reinterpret_cast<jlong>(store);
+}
 
-    // 评估提示词
-    if (llama_decode(wrapper->ctx, batch) != 0) {
-        LOGE("Failed to decode prompt");
-        llama_sampler_free(smpl);
-        jstring errorMsg = env->NewStringUTF("Failed to decode prompt");
-        env->CallVoidMethod(callback, onErrorMethod, errorMsg);
-        return;
+/**
+ * 向存储追加向量
+ * @param chunkIds 知识块 ID
+ * @param documentIds 对应的文档 ID
+ * @param vectors 扁平向量数组 (chunkIds.size * dimension)
+ * @param texts 知识块文本，用于增量更新 BM25 倒排索引；为 null 时这些行留待 vectorIndexSetText 补建
+ * @return 成功追加的行数，失败返回 -1
+ */
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_vectorIndexAdd(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong indexHandle,
+    jlongArray chunkIds,
+    jlongArray documentIds,
+    jfloatArray vectors,
+    jobjectArray texts) {
+
+    if (indexHandle == 0) {
+        LOGE("Invalid vector index handle");
+        return -1;
     }
 
-    // 生成tokens
-    std::string result;
-    int n_generated = 0;
+    vector_index* store = reinterpret_cast<vector_index*>(indexHandle);
+    const jsize n = env->GetArrayLength(chunkIds);
+    if (n == 0) {
+        return 0;
+    }
+    if (env->GetArrayLength(documentIds) != n ||
+        env->GetArrayLength(vectors) != (jsize) ((int64_t) n * store->dim) ||
+        (texts != nullptr && env->GetArrayLength(texts) != n)) {
+        LOGE("Vector index add: size mismatch (n=%d, dim=%d)", n, store->dim);
+        return -1;
+    }
 
-    while (n_generated < maxTokens) {
-        // 采样下一个token
-        llama_token new_token = llama_sampler_sample(smpl, wrapper->ctx, -1);
+    std::lock_guard<std::mutex> lock(store->mutex);
+    const size_t first_row = store_header(store)->n_rows;
+    if (!vector_store_reserve(store, first_row + n)) {
+        return -1;
+    }
 
-        // 检查是否是结束符
-        if (llama_vocab_is_eog(vocab, new_token)) {
-            LOGD("End of generation token received");
-            break;
-        }
+    jlong* ids = env->GetLongArrayElements(chunkIds, nullptr);
+    jlong* docs = env->GetLongArrayElements(documentIds, nullptr);
+    jfloat* data = env->GetFloatArrayElements(vectors, nullptr);
+
+    for (jsize i = 0; i < n; i++) {
+        vector_store_row* row = store_row(store, first_row + i);
+        memset(row, 0, sizeof(*row));
+        row->chunk_id = ids[i];
+        row->doc_id = docs[i];
+        float* vec = store_row_vector(row);
+        normalize_embedding(data + (size_t) i * store->dim, vec, store->dim);
+        std::fill(vec + store->dim, vec + store->stride, 0.0f);
+    }
 
-        // 将token转换为文本
-        char piece[256];
-        int n_piece = llama_token_to_piece(vocab, new_token, piece, sizeof(piece), 0, false);
-        if (n_piece > 0) {
-            std::string tokenStr(piece, n_piece);
-            result.append(tokenStr);
-
-            // 检查<|im_end|>标记
-            if (result.find("<|im_end|>") != std::string::npos) {
-                LOGD("Found <|im_end|> in generated text, stopping");
-                break;
+    env->ReleaseFloatArrayElements(vectors, data, JNI_ABORT);
+    env->ReleaseLongArrayElements(documentIds, docs, JNI_ABORT);
+    env->ReleaseLongArrayElements(chunkIds, ids, JNI_ABORT);
+
+    // 行写完后再提交行数
+    store_header(store)->n_rows = first_row + n;
+    vector_store_append_codes(store, first_row);
+    ivf_on_append(store, first_row);
+
+    store->text.doc_len.resize(first_row + n, VECTOR_TEXT_UNINDEXED);
+    if (texts != nullptr) {
+        for (jsize i = 0; i < n; i++) {
+            jstring text = (jstring) env->GetObjectArrayElement(texts, i);
+            if (text == nullptr) {
+                continue;
             }
-
-            // 流式回调：发送每个token
-            jstring tokenJStr = env->NewStringUTF(tokenStr.c_str());
-            env->CallVoidMethod(callback, onTokenMethod, tokenJStr);
-            env->DeleteLocalRef(tokenJStr);
+            const char* text_str = env->GetStringUTFChars(text, nullptr);
+            text_index_row(store, first_row + i, text_str, (int) strlen(text_str));
+            env->ReleaseStringUTFChars(text, text_str);
+            env->DeleteLocalRef(text);
         }
+    }
+    msync(store->map, store->map_size, MS_ASYNC);
 
-        // 准备下一次解码
-        batch = llama_batch_get_one(&new_token, 1);
-        if (llama_decode(wrapper->ctx, batch) != 0) {
-            LOGE("Failed to decode token");
-            break;
-        }
+    LOGD("Vector index: appended %d rows, total %zu", n, first_row + n);
+    return n;
+}
+
+/**
+ * 为某个文档的全部向量打墓碑
+ * @return 标记删除的行数
+ */
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_vectorIndexRemoveDocument(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong indexHandle,
+    jlong documentId) {
 
-        n_generated++;
+    if (indexHandle == 0) {
+        return 0;
     }
 
-    llama_sampler_free(smpl);
+    vector_index* store = reinterpret_cast<vector_index*>(indexHandle);
+    std::lock_guard<std::mutex> lock(store->mutex);
+
+    vector_store_header* header = store_header(store);
+    int removed = 0;
+    for (size_t row = 0; row < header->n_rows; row++) {
+        vector_store_row* entry = store_row(store, row);
+        if (entry->doc_id == documentId && !(entry->flags & VECTOR_STORE_ROW_DELETED)) {
+            entry->flags |= VECTOR_STORE_ROW_DELETED;
+            if (store->codes.meta_ready) {
+                store->codes.deleted[row] = 1;
+            }
+            text_on_delete(store, row);
+            removed++;
+        }
+    }
+    if (removed > 0) {
+        header->n_deleted += removed;
+        msync(store->map, store->map_size, MS_ASYNC);
+    }
 
-    LOGD("Stream generation completed: %d tokens generated", n_generated);
-    env->CallVoidMethod(callback, onCompleteMethod);
+    LOGD("Vector index: tombstoned %d rows of document %lld", removed, (long long) documentId);
+    return removed;
 }
 
-// ============================================
-// 嵌入模型相关函数 (用于知识库 RAG)
-// ============================================
+/**
+ * 获取存活（未删除）的向量数
+ */
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_vectorIndexSize(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong indexHandle) {
 
-// 嵌入模型上下文包装
-struct embedding_context_wrapper {
-    llama_model* model;
-    llama_context* ctx;
-    int n_embd;  // 嵌入维度
-};
+    if (indexHandle == 0) {
+        return 0;
+    }
+
+    vector_index* store = reinterpret_cast<vector_index*>(indexHandle);
+    std::lock_guard<std::mutex> lock(store->mutex);
+    const vector_store_header* header = store_header(store);
+    return (jint) (header->n_rows - header->n_deleted);
+}
 
 /**
- * 初始化嵌入模型
- * @param modelPath 嵌入模型路径 (如 all-MiniLM-L6-v2.gguf)
- * @param contextSize 上下文大小 (嵌入模型一般用 512)
- * @param threads CPU 线程数
- * @return 模型句柄
+ * 获取墓碑行数（用于决定何时压缩）
  */
-extern "C" JNIEXPORT jlong JNICALL
-Java_com_example_haiyangapp_inference_LlamaCppJNI_initEmbeddingModel(
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_vectorIndexDeletedCount(
     JNIEnv* env,
     jobject /* this */,
-    jstring modelPath,
-    jint contextSize,
-    jint threads) {
-
-    const char *path = env->GetStringUTFChars(modelPath, nullptr);
-    LOGI("Initializing embedding model from: %s", path);
+    jlong indexHandle) {
 
-    // 初始化后端 (如果尚未初始化)
-    static bool backend_initialized = false;
-    if (!backend_initialized) {
-        llama_backend_init();
-        llama_numa_init(GGML_NUMA_STRATEGY_DISABLED);
-        backend_initialized = true;
+    if (indexHandle == 0) {
+        return 0;
     }
 
-    // 模型参数 - 嵌入模型使用 CPU
-    llama_model_params model_params = llama_model_default_params();
-    model_params.n_gpu_layers = 0;  // CPU only for embedding
+    vector_index* store = reinterpret_cast<vector_index*>(indexHandle);
+    std::lock_guard<std::mutex> lock(store->mutex);
+    return (jint) store_header(store)->n_deleted;
+}
 
-    // 加载模型
-    llama_model* model = llama_load_model_from_file(path, model_params);
-    env->ReleaseStringUTFChars(modelPath, path);
+/**
+ * 压缩向量文件，丢弃墓碑行
+ * @return 回收的行数，失败返回 -1
+ */
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_vectorIndexCompact(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong indexHandle) {
 
-    if (model == nullptr) {
-        LOGE("Failed to load embedding model");
-        return 0;
+    if (indexHandle == 0) {
+        return -1;
     }
 
-    // 上下文参数 - 启用嵌入模式
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx = contextSize;
-    ctx_params.n_threads = threads;
-    ctx_params.n_threads_batch = threads;
-    ctx_params.embeddings = true;  // 启用嵌入模式
+    vector_index* store = reinterpret_cast<vector_index*>(indexHandle);
+    std::lock_guard<std::mutex> lock(store->mutex);
+    return vector_store_compact(store);
+}
 
-    // 创建上下文
-    llama_context* ctx = llama_new_context_with_model(model, ctx_params);
-    if (ctx == nullptr) {
-        LOGE("Failed to create embedding context");
-        llama_free_model(model);
-        return 0;
+/**
+ * 向量 Top-K 检索，返回按分数降序的 (相似度, 行号)，调用方需持有 store->mutex
+ * @param q 补齐到 stride 的归一化查询向量
+ * @param filter 已排序的文档 ID 过滤集合，为空指针时不过滤
+ */
+static std::vector<scored_row> vector_search_rows(
+    vector_index* store,
+    const float* q,
+    size_t k,
+    float minScore,
+    const std::vector<jlong>* filter,
+    int quantization,
+    int rescoreCandidates,
+    int nprobe) {
+
+    std::vector<scored_row> heap;
+    heap.reserve(k);
+    const size_t n_rows = store_header(store)->n_rows;
+    const bool use_ivf = nprobe > 0 && store->ivf.trained;
+    const bool exact = quantization == VECTOR_QUANT_NONE;
+
+    // 量化或 IVF 检索使用内存镜像中的文档 ID 和墓碑标记，避免逐行读取映射文件
+    if (!exact || use_ivf) {
+        vector_store_ensure_codes(store, quantization);
+    }
+    const vector_store_codes& codes = store->codes;
+
+    // 量化查询向量
+    std::vector<int8_t> q8;
+    float q8_scale = 1.0f;
+    std::vector<uint64_t> q_bits;
+    if (quantization == VECTOR_QUANT_INT8) {
+        q8.resize(codes.q8_stride);
+        quantize_int8(q, store->dim, codes.q8_stride, q8.data(), &q8_scale);
+    } else if (quantization == VECTOR_QUANT_BINARY) {
+        q_bits.resize(codes.n_words);
+        quantize_binary(q, store->dim, q_bits.data(), codes.n_words);
     }
 
-    // 获取嵌入维度
-    int n_embd = llama_n_embd(model);
-    LOGI("Embedding model initialized, dimension: %d", n_embd);
+    // 第一遍：精确模式直接得到结果，量化模式得到粗排候选
+    const size_t n_first = exact ? (size_t) k : (size_t) std::max<int>(k, rescoreCandidates);
+    std::vector<scored_row> first;
+    first.reserve(n_first);
+
+    auto visit = [&](size_t row) {
+        bool deleted;
+        int64_t doc_id;
+        if (codes.meta_ready) {
+            deleted = codes.deleted[row] != 0;
+            doc_id = codes.doc_ids[row];
+        } else {
+            const vector_store_row* entry = store_row(store, row);
+            deleted = (entry->flags & VECTOR_STORE_ROW_DELETED) != 0;
+            doc_id = entry->doc_id;
+        }
+        if (deleted || (filter && !std::binary_search(filter->begin(), filter->end(), (jlong) doc_id))) {
+            return;
+        }
 
-    // 创建包装
-    embedding_context_wrapper* wrapper = new embedding_context_wrapper();
-    wrapper->model = model;
-    wrapper->ctx = ctx;
-    wrapper->n_embd = n_embd;
+        float score;
+        if (quantization == VECTOR_QUANT_INT8) {
+            score = q8_scale * codes.q8_scale[row] *
+                    (float) dot_i8(q8.data(), codes.q8.data() + row * codes.q8_stride, codes.q8_stride);
+        } else if (quantization == VECTOR_QUANT_BINARY) {
+            score = -(float) hamming_distance(q_bits.data(), codes.bits.data() + row * codes.n_words,
+                                              codes.n_words);
+        } else {
+            score = dot_f32(q, store_row_vector(store_row(store, row)), store->stride);
+            if (score < minScore) {
+                return;
+            }
+        }
+        topk_push(first, n_first, score, row);
+    };
+
+    if (use_ivf) {
+        // 选出与查询最近的 nprobe 个簇
+        const vector_store_ivf& ivf = store->ivf;
+        std::vector<scored_row> probes;
+        const size_t n_probe = (size_t) std::min(nprobe, ivf.n_lists);
+        probes.reserve(n_probe);
+        for (int c = 0; c < ivf.n_lists; c++) {
+            topk_push(probes, n_probe, dot_f32(q, ivf.centroids.data() + (size_t) c * store->stride,
+                                               store->stride), (size_t) c);
+        }
+        for (const scored_row& probe : probes) {
+            for (uint32_t row : ivf.lists[probe.second]) {
+                visit(row);
+            }
+        }
+        // 过滤集合较小时探测到的簇里可能没有足够的目标文档，退回精确扫描
+        if (filter && first.size() < (size_t) k) {
+            first.clear();
+            for (size_t row = 0; row < n_rows; row++) {
+                visit(row);
+            }
+        }
+    } else {
+        for (size_t row = 0; row < n_rows; row++) {
+            visit(row);
+        }
+    }
 
-    return reinterpret_cast<jlong>(wrapper);
+    if (exact) {
+        heap.swap(first);
+    } else {
+        // 精排：候选行读取 float 向量计算精确相似度
+        for (const scored_row& candidate : first) {
+            const float score = dot_f32(q, store_row_vector(store_row(store, candidate.second)),
+                                        store->stride);
+            if (score >= minScore) {
+                topk_push(heap, k, score, candidate.second);
+            }
+        }
+    }
+
+    // 对最小堆做 sort_heap 得到按分数降序的结果
+    std::sort_heap(heap.begin(), heap.end(), std::greater<scored_row>());
+    return heap;
 }
 
 /**
- * 获取嵌入维度
+ * Top-K 相似度检索
+ * 量化模式下先用 int8 点积或汉明距离粗排出 rescoreCandidates 个候选，再用 float 向量精排；
+ * 已训练 IVF 且 nprobe > 0 时只扫描与查询最近的 nprobe 个簇
+ * @param query 查询向量
+ * @param topK 返回的最大结果数
+ * @param minScore 最低相似度阈值（作用于精确余弦相似度）
+ * @param documentIds 可选的文档 ID 过滤集合，null 表示检索全部
+ * @param quantization 量化模式 (0=float, 1=int8, 2=binary)
+ * @param rescoreCandidates 量化粗排保留的候选数（不少于 topK）
+ * @param nprobe IVF 探测的簇数，<= 0 表示精确扫描
+ * @param outChunkIds 输出：知识块 ID（长度至少为 topK）
+ * @param outScores 输出：相似度（长度至少为 topK）
+ * @return 实际结果数（按相似度降序写入输出数组），失败返回 -1
  */
 extern "C" JNIEXPORT jint JNICALL
-Java_com_example_haiyangapp_inference_LlamaCppJNI_getEmbeddingDimension(
+Java_com_example_haiyangapp_inference_LlamaCppJNI_vectorIndexSearch(
     JNIEnv* env,
     jobject /* this */,
-    jlong modelHandle) {
+    jlong indexHandle,
+    jfloatArray query,
+    jint topK,
+    jfloat minScore,
+    jlongArray documentIds,
+    jint quantization,
+    jint rescoreCandidates,
+    jint nprobe,
+    jlongArray outChunkIds,
+    jfloatArray outScores) {
+
+    if (indexHandle == 0) {
+        LOGE("Invalid vector index handle");
+        return -1;
+    }
 
-    if (modelHandle == 0) {
+    vector_index* store = reinterpret_cast<vector_index*>(indexHandle);
+    if (env->GetArrayLength(query) != store->dim) {
+        LOGE("Vector index search: query dimension %d != %d", env->GetArrayLength(query), store->dim);
+        return -1;
+    }
+    if (quantization < VECTOR_QUANT_NONE || quantization > VECTOR_QUANT_BINARY) {
+        LOGE("Vector index search: unknown quantization mode %d", quantization);
+        return -1;
+    }
+
+    const int k = std::min<int>(topK, std::min(env->GetArrayLength(outChunkIds), env->GetArrayLength(outScores)));
+    if (k <= 0) {
         return 0;
     }
 
-    embedding_context_wrapper* wrapper = reinterpret_cast<embedding_context_wrapper*>(modelHandle);
-    return wrapper->n_embd;
+    // 补齐后的归一化查询向量
+    std::vector<float> q(store->stride, 0.0f);
+    jfloat* query_data = env->GetFloatArrayElements(query, nullptr);
+    normalize_embedding(query_data, q.data(), store->dim);
+    env->ReleaseFloatArrayElements(query, query_data, JNI_ABORT);
+
+    // 文档过滤集合（排序后二分查找）
+    std::vector<jlong> filter;
+    const bool use_filter = documentIds != nullptr;
+    if (use_filter) {
+        const jsize n_filter = env->GetArrayLength(documentIds);
+        filter.resize(n_filter);
+        env->GetLongArrayRegion(documentIds, 0, n_filter, filter.data());
+        std::sort(filter.begin(), filter.end());
+    }
+
+    std::vector<jlong> ids;
+    std::vector<jfloat> scores;
+    ids.reserve(k);
+    scores.reserve(k);
+
+    {
+        std::lock_guard<std::mutex> lock(store->mutex);
+        const std::vector<scored_row> heap = vector_search_rows(
+            store, q.data(), (size_t) k, minScore, use_filter ? &filter : nullptr,
+            quantization, rescoreCandidates, nprobe);
+        for (const scored_row& entry : heap) {
+            ids.push_back((jlong) store_row(store, entry.second)->chunk_id);
+            scores.push_back(entry.first);
+        }
+    }
+
+    const int n_results = (int) ids.size();
+    env->SetLongArrayRegion(outChunkIds, 0, n_results, ids.data());
+    env->SetFloatArrayRegion(outScores, 0, n_results, scores.data());
+    return n_results;
 }
 
 /**
- * 获取单条文本的嵌入向量
- * @param modelHandle 嵌入模型句柄
- * @param text 输入文本
- * @return 嵌入向量 (FloatArray)
+ * 混合检索：向量 Top-N 与 BM25 Top-N 用倒数排名融合 (RRF) 合并，一次调用完成
+ * 每条结果的融合分数为 Σ 1 / (rrfK + 排名)，再除以两路都排第一时的分数归一化到 (0, 1]；
+ * 只命中关键词（如型号、人名）而向量相似度不足 minScore 的知识块也能进入结果
+ * @param queryText 原始查询文本（与写入时相同的中日韩二元 / 拉丁词分词）
+ * @param candidates 每一路保留的候选数（不少于 topK）
+ * @param rrfK RRF 平滑常数（常用 60）
+ * @param outScores 输出：归一化融合分数
+ * 其余参数与 vectorIndexSearch 相同
+ * @return 实际结果数（按融合分数降序写入输出数组），失败返回 -1
  */
-extern "C" JNIEXPORT jfloatArray JNICALL
-Java_com_example_haiyangapp_inference_LlamaCppJNI_getEmbedding(
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_vectorIndexHybridSearch(
     JNIEnv* env,
     jobject /* this */,
-    jlong modelHandle,
-    jstring text) {
-
-    if (modelHandle == 0) {
-        LOGE("Embedding model handle is null");
-        return nullptr;
+    jlong indexHandle,
+    jfloatArray query,
+    jstring queryText,
+    jint topK,
+    jfloat minScore,
+    jlongArray documentIds,
+    jint quantization,
+    jint rescoreCandidates,
+    jint nprobe,
+    jint candidates,
+    jint rrfK,
+    jlongArray outChunkIds,
+    jfloatArray outScores) {
+
+    if (indexHandle == 0) {
+        LOGE("Invalid vector index handle");
+        return -1;
     }
 
-    embedding_context_wrapper* wrapper = reinterpret_cast<embedding_context_wrapper*>(modelHandle);
-    const char* textStr = env->GetStringUTFChars(text, nullptr);
-
-    // Tokenize
-    const llama_vocab* vocab = llama_model_get_vocab(wrapper->model);
+    vector_index* store = reinterpret_cast<vector_index*>(indexHandle);
+    if (env->GetArrayLength(query) != store->dim) {
+        LOGE("Vector index hybrid search: query dimension %d != %d", env->GetArrayLength(query), store->dim);
+        return -1;
+    }
+    if (quantization < VECTOR_QUANT_NONE || quantization > VECTOR_QUANT_BINARY) {
+        LOGE("Vector index hybrid search: unknown quantization mode %d", quantization);
+        return -1;
+    }
 
-    std::vector<llama_token> tokens;
-    tokens.resize(strlen(textStr) + 256);
+    const int k = std::min<int>(topK, std::min(env->GetArrayLength(outChunkIds), env->GetArrayLength(outScores)));
+    if (k <= 0) {
+        return 0;
+    }
+    const size_t n_candidates = (size_t) std::max<int>(k, candidates);
+    const float rrf_k = (float) std::max(1, (int) rrfK);
+
+    std::vector<float> q(store->stride, 0.0f);
+    jfloat* query_data = env->GetFloatArrayElements(query, nullptr);
+    normalize_embedding(query_data, q.data(), store->dim);
+    env->ReleaseFloatArrayElements(query, query_data, JNI_ABORT);
+
+    std::vector<jlong> filter;
+    const bool use_filter = documentIds != nullptr;
+    if (use_filter) {
+        const jsize n_filter = env->GetArrayLength(documentIds);
+        filter.resize(n_filter);
+        env->GetLongArrayRegion(documentIds, 0, n_filter, filter.data());
+        std::sort(filter.begin(), filter.end());
+    }
 
-    int n_tokens = llama_tokenize(
-        vocab,
-        textStr,
-        strlen(textStr),
-        tokens.data(),
-        tokens.size(),
-        true,   // add_special
-        true    // parse_special
-    );
+    const char* text_str = queryText != nullptr ? env->GetStringUTFChars(queryText, nullptr) : nullptr;
+
+    std::vector<jlong> ids;
+    std::vector<jfloat> scores;
+    ids.reserve(k);
+    scores.reserve(k);
+    size_t n_vector = 0;
+    size_t n_lexical = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(store->mutex);
+        const std::vector<scored_row> vector_hits = vector_search_rows(
+            store, q.data(), n_candidates, minScore, use_filter ? &filter : nullptr,
+            quantization, rescoreCandidates, nprobe);
+        const std::vector<scored_row> lexical_hits = text_str != nullptr
+            ? text_search(store, text_str, (int) strlen(text_str), n_candidates, use_filter ? &filter : nullptr)
+            : std::vector<scored_row>();
+        n_vector = vector_hits.size();
+        n_lexical = lexical_hits.size();
+
+        // 按行号累加两路的 RRF 分数
+        std::unordered_map<size_t, float> fused;
+        for (size_t rank = 0; rank < vector_hits.size(); rank++) {
+            fused[vector_hits[rank].second] += 1.0f / (rrf_k + (float) (rank + 1));
+        }
+        for (size_t rank = 0; rank < lexical_hits.size(); rank++) {
+            fused[lexical_hits[rank].second] += 1.0f / (rrf_k + (float) (rank + 1));
+        }
 
-    env->ReleaseStringUTFChars(text, textStr);
+        std::vector<scored_row> heap;
+        heap.reserve(k);
+        for (const auto& entry : fused) {
+            topk_push(heap, (size_t) k, entry.second, entry.first);
+        }
+        std::sort_heap(heap.begin(), heap.end(), std::greater<scored_row>());
 
-    if (n_tokens < 0) {
-        LOGE("Failed to tokenize text for embedding");
-        return nullptr;
+        const float max_score = 2.0f / (rrf_k + 1.0f);
+        for (const scored_row& entry : heap) {
+            ids.push_back((jlong) store_row(store, entry.second)->chunk_id);
+            scores.push_back(entry.first / max_score);
+        }
     }
 
-    tokens.resize(n_tokens);
-    LOGD("Embedding: tokenized %d tokens", n_tokens);
+    if (text_str != nullptr) {
+        env->ReleaseStringUTFChars(queryText, text_str);
+    }
 
-    // 清空 KV 缓存
-    llama_memory_t mem = llama_get_memory(wrapper->ctx);
-    llama_memory_clear(mem, true);
+    const int n_results = (int) ids.size();
+    env->SetLongArrayRegion(outChunkIds, 0, n_results, ids.data());
+    env->SetFloatArrayRegion(outScores, 0, n_results, scores.data());
+    LOGD("Hybrid search: %zu vector + %zu BM25 candidates -> %d results", n_vector, n_lexical, n_results);
+    return n_results;
+}
 
-    // 创建批次并解码
-    llama_batch batch = llama_batch_get_one(tokens.data(), n_tokens);
+/**
+ * 列出尚未建立 BM25 文本索引的存活知识块（旧版本写入或导入时未带文本）
+ * @param maxCount 最多返回的个数
+ * @return 知识块 ID 数组
+ */
+extern "C" JNIEXPORT jlongArray JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_vectorIndexMissingText(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong indexHandle,
+    jint maxCount) {
 
-    if (llama_decode(wrapper->ctx, batch) != 0) {
-        LOGE("Failed to decode for embedding");
+    if (indexHandle == 0) {
         return nullptr;
     }
 
-    // 获取嵌入向量 (使用序列0的嵌入)
-    const float* embd = llama_get_embeddings_seq(wrapper->ctx, 0);
-    if (embd == nullptr) {
-        // 尝试获取整体嵌入
-        embd = llama_get_embeddings(wrapper->ctx);
+    vector_index* store = reinterpret_cast<vector_index*>(indexHandle);
+    std::vector<jlong> ids;
+    {
+        std::lock_guard<std::mutex> lock(store->mutex);
+        const size_t n_rows = store_header(store)->n_rows;
+        for (size_t row = 0; row < n_rows && (int) ids.size() < maxCount; row++) {
+            const vector_store_row* entry = store_row(store, row);
+            if (!(entry->flags & VECTOR_STORE_ROW_DELETED) &&
+                (row >= store->text.doc_len.size() || store->text.doc_len[row] == VECTOR_TEXT_UNINDEXED)) {
+                ids.push_back((jlong) entry->chunk_id);
+            }
+        }
     }
 
-    if (embd == nullptr) {
-        LOGE("Failed to get embeddings");
-        return nullptr;
+    jlongArray result = env->NewLongArray((jsize) ids.size());
+    if (result != nullptr) {
+        env->SetLongArrayRegion(result, 0, (jsize) ids.size(), ids.data());
     }
+    return result;
+}
 
-    // 创建 Java float 数组
-    jfloatArray result = env->NewFloatArray(wrapper->n_embd);
-    if (result == nullptr) {
-        LOGE("Failed to create float array");
-        return nullptr;
+/**
+ * 为已有知识块补建 BM25 文本索引
+ * @param chunkIds 知识块 ID
+ * @param texts 与 chunkIds 一一对应的文本
+ * @return 建立索引的行数，失败返回 -1
+ */
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_haiyangapp_inference_LlamaCppJNI_vectorIndexSetText(
+    JNIEnv* env,
+    jobject /* this */,
+    jlong indexHandle,
+    jlongArray chunkIds,
+    jobjectArray texts) {
+
+    if (indexHandle == 0) {
+        return -1;
     }
 
-    // 归一化嵌入向量 (L2 normalization)
-    std::vector<float> normalized(wrapper->n_embd);
-    float norm = 0.0f;
-    for (int i = 0; i < wrapper->n_embd; i++) {
-        norm += embd[i] * embd[i];
+    vector_index* store = reinterpret_cast<vector_index*>(indexHandle);
+    const jsize n = env->GetArrayLength(chunkIds);
+    if (env->GetArrayLength(texts) != n) {
+        LOGE("Vector index set text: size mismatch");
+        return -1;
     }
-    norm = sqrtf(norm);
-    if (norm > 0) {
-        for (int i = 0; i < wrapper->n_embd; i++) {
-            normalized[i] = embd[i] / norm;
+
+    std::vector<jlong> ids(n);
+    env->GetLongArrayRegion(chunkIds, 0, n, ids.data());
+    std::unordered_map<int64_t, jsize> wanted;
+    for (jsize i = 0; i < n; i++) {
+        wanted[ids[i]] = i;
+    }
+
+    std::lock_guard<std::mutex> lock(store->mutex);
+    const size_t n_rows = store_header(store)->n_rows;
+    store->text.doc_len.resize(n_rows, VECTOR_TEXT_UNINDEXED);
+    int n_indexed = 0;
+    for (size_t row = 0; row < n_rows; row++) {
+        const vector_store_row* entry = store_row(store, row);
+        auto it = wanted.find(entry->chunk_id);
+        if (it == wanted.end() || (entry->flags & VECTOR_STORE_ROW_DELETED) ||
+            store->text.doc_len[row] != VECTOR_TEXT_UNINDEXED) {
+            continue;
         }
-    } else {
-        for (int i = 0; i < wrapper->n_embd; i++) {
-            normalized[i] = embd[i];
+        jstring text = (jstring) env->GetObjectArrayElement(texts, it->second);
+        if (text == nullptr) {
+            continue;
         }
+        const char* text_str = env->GetStringUTFChars(text, nullptr);
+        text_index_row(store, row, text_str, (int) strlen(text_str));
+        env->ReleaseStringUTFChars(text, text_str);
+        env->DeleteLocalRef(text);
+        n_indexed++;
     }
 
-    env->SetFloatArrayRegion(result, 0, wrapper->n_embd, normalized.data());
-
-    LOGD("Embedding computed successfully, dimension: %d", wrapper->n_embd);
-    return result;
+    LOGD("BM25 index: backfilled %d rows", n_indexed);
+    return n_indexed;
 }
 
 /**
- * 释放嵌入模型
+ * 关闭向量存储（同步落盘并解除映射）
  */
 extern "C" JNIEXPORT void JNICALL
-Java_com_example_haiyangapp_inference_LlamaCppJNI_freeEmbeddingModel(
+Java_com_example_haiyangapp_inference_LlamaCppJNI_freeVectorIndex(
     JNIEnv* env,
     jobject /* this */,
-    jlong modelHandle) {
+    jlong indexHandle) {
 
-    if (modelHandle == 0) {
-        LOGW("Attempting to free null embedding model handle");
+    if (indexHandle == 0) {
+        LOGW("Attempting to free null vector index handle");
         return;
     }
 
-    LOGD("Freeing embedding model");
-    embedding_context_wrapper* wrapper = reinterpret_cast<embedding_context_wrapper*>(modelHandle);
-
-    if (wrapper->ctx) {
-        llama_free(wrapper->ctx);
-    }
-    if (wrapper->model) {
-        llama_free_model(wrapper->model);
-    }
-
-    delete wrapper;
-    LOGD("Embedding model freed successfully");
+    vector_store_close(reinterpret_cast<vector_index*>(indexHandle));
+    LOGD("Vector index closed");
 }
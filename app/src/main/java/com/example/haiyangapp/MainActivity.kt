@@ -10,6 +10,7 @@ import androidx.compose.runtime.*
 import androidx.compose.ui.Alignment
 import androidx.compose.ui.Modifier
 import androidx.compose.ui.unit.dp
+import androidx.lifecycle.lifecycleScope
 import androidx.lifecycle.viewmodel.compose.viewModel
 import androidx.navigation.compose.rememberNavController
 import com.example.haiyangapp.repository.RepositoryFactory
@@ -19,8 +20,12 @@ import com.example.haiyangapp.viewmodel.ChatViewModel
 import com.example.haiyangapp.ui.ChatViewModelFactory
 import com.example.haiyangapp.viewmodel.ConversationViewModel
 import com.example.haiyangapp.viewmodel.ConversationViewModelFactory
+import com.example.haiyangapp.viewmodel.KnowledgeViewModel
+import com.example.haiyangapp.inference.MemoryTrimLevel
+import com.example.haiyangapp.inference.MemoryTrimResult
 import com.example.haiyangapp.inference.ModelLoadingState
 import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.launch
 import kotlinx.coroutines.withContext
 import android.util.Log
 
@@ -33,8 +38,10 @@ class MainActivity : ComponentActivity() {
         super.onCreate(savedInstanceState)
         enableEdgeToEdge()
 
-        // 立即启动后台模型加载（非阻塞）
-        RepositoryFactory.startBackgroundModelLoading(applicationContext)
+        // 立即启动后台模型加载（非阻塞），模型预热期间同时加载嵌入模型
+        RepositoryFactory.startBackgroundModelLoading(applicationContext) {
+            KnowledgeViewModel.getEmbeddingManager(applicationContext).initialize()
+        }
 
         setContent {
             MaterialTheme {
@@ -55,6 +62,21 @@ class MainActivity : ComponentActivity() {
         }
     }
 
+    override fun onTrimMemory(level: Int) {
+        super.onTrimMemory(level)
+        val trimLevel = MemoryTrimLevel.fromTrimMemory(level) ?: return
+
+        // 释放 KV 缓存与计算缓冲区，严重时再回收权重页并卸载嵌入模型，下次使用时自动恢复
+        lifecycleScope.launch(Dispatchers.IO) {
+            val embeddingBytes =
+                if (trimLevel == MemoryTrimLevel.SEVERE) KnowledgeViewModel.trimEmbeddingModel() else 0L
+            val result = (RepositoryFactory.trimMemory(trimLevel) ?: MemoryTrimResult(0, 0))
+                .copy(embeddingBytes = embeddingBytes)
+            Log.i(TAG, "onTrimMemory($level): freed ${result.totalBytes / (1024 * 1024)} MB " +
+                "(context ${result.contextBytes}, weights ${result.weightBytes}, embedding ${result.embeddingBytes})")
+        }
+    }
+
     override fun onDestroy() {
         super.onDestroy()
         // 释放资源
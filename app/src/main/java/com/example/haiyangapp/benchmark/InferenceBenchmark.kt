@@ -0,0 +1,449 @@
+package com.example.haiyangapp.benchmark
+
+import android.app.ActivityManager
+import android.content.Context
+import android.os.Build
+import android.util.Log
+import com.example.haiyangapp.inference.EmbeddingCacheStats
+import com.example.haiyangapp.inference.GpuDevice
+import com.example.haiyangapp.inference.KvCacheType
+import com.example.haiyangapp.inference.LlamaCppJNI
+import com.example.haiyangapp.inference.MemoryUsage
+import com.example.haiyangapp.inference.WarmupStats
+import com.example.haiyangapp.knowledge.VectorQuantization
+import org.json.JSONArray
+import org.json.JSONObject
+import java.io.File
+import java.text.SimpleDateFormat
+import java.util.Date
+import java.util.Locale
+import java.util.Random
+import java.util.TimeZone
+import kotlin.math.sqrt
+
+/**
+ * 基准测试参数
+ *
+ * 对话模型按 gpuLayers 分组加载（每组只加载一次权重），
+ * 组内对 线程数 × 批大小 × KV 缓存类型 重建上下文，再扫描 提示词长度 × 生成长度
+ */
+data class BenchmarkConfig(
+    val promptLengths: List<Int> = listOf(128, 512),
+    val generationLengths: List<Int> = listOf(32, 128),
+    val threadCounts: List<Int> = listOf(2, 4),
+    val gpuLayers: List<Int> = listOf(0, -1),
+    val kvCacheTypes: List<KvCacheType> = listOf(KvCacheType.F16, KvCacheType.Q8_0),
+    val batchSizes: List<Int> = listOf(128, 512),
+    val repetitions: Int = 3,
+    val contextSize: Int = 2048,
+
+    /** 嵌入测试的文本条数，以及批量接口每次提交的条数 */
+    val embeddingTexts: Int = 64,
+    val embeddingBatchSizes: List<Int> = listOf(8, 16, 64),
+    val embeddingThreads: Int = 4,
+
+    /** 向量索引测试的规模、维度和查询次数 */
+    val vectorCounts: List<Int> = listOf(1_000, 10_000, 100_000),
+    val vectorDimension: Int = 384,
+    val vectorQueries: Int = 200,
+    val vectorTopK: Int = 10,
+    val vectorNprobe: List<Int> = listOf(0, 16)
+)
+
+/**
+ * 设备端基准测试
+ *
+ * 全部通过 LlamaCppJNI 调用，与用户实际使用的预填充 / 解码 / 嵌入 / 检索路径一致，
+ * 结果为带设备与 SoC 信息的 JSON，便于在设备农场上长期跟踪
+ */
+class InferenceBenchmark(private val context: Context) {
+
+    companion object {
+        private const val TAG = "InferenceBenchmark"
+
+        /** 结果 JSON 格式版本，字段变化时递增 */
+        const val SCHEMA_VERSION = 2
+
+        private const val VECTOR_ADD_BATCH = 1000
+        private const val RANDOM_SEED = 42L
+    }
+
+    /**
+     * 运行全部测试，模型路径为 null 时跳过对应部分
+     */
+    fun run(chatModelPath: String?, embeddingModelPath: String?, config: BenchmarkConfig): JSONObject {
+        val result = JSONObject()
+            .put("schema_version", SCHEMA_VERSION)
+            .put("timestamp", isoTimestamp())
+            .put("device", deviceInfo())
+            .put("system_info", LlamaCppJNI.getSystemInfo())
+
+        chatModelPath?.let {
+            result.put("chat_model", File(it).name)
+            result.put("chat", runChatBenchmark(it, config))
+        }
+        embeddingModelPath?.let {
+            result.put("embedding_model", File(it).name)
+            result.put("embedding", runEmbeddingBenchmark(it, config))
+        }
+        result.put("vector_index", runVectorIndexBenchmark(config))
+        return result
+    }
+
+    /**
+     * 对话模型：预填充 / 生成吞吐
+     */
+    fun runChatBenchmark(modelPath: String, config: BenchmarkConfig): JSONArray {
+        val results = JSONArray()
+
+        for (gpuLayers in config.gpuLayers) {
+            val handle = LlamaCppJNI.initModelWithGpu(
+                modelPath = modelPath,
+                contextSize = config.contextSize,
+                threads = config.threadCounts.first(),
+                batchThreads = config.threadCounts.first(),
+                useGpu = gpuLayers != 0,
+                gpuLayers = gpuLayers,
+                batchSize = config.batchSizes.first(),
+                kvCacheType = config.kvCacheTypes.first().ggmlType,
+                flashAttention = -1,
+                parallelSessions = 0,  // benchmarkResetContext 只能重建单序列上下文
+                sessionContextSize = 0,
+                promptCacheSlots = 0,
+                promptCacheTokens = 0
+            )
+            if (handle == 0L) {
+                results.put(JSONObject().put("gpu_layers", gpuLayers).put("error", "model load failed"))
+                continue
+            }
+
+            try {
+                val usingGpu = LlamaCppJNI.isUsingGpu(handle)
+                val actualGpuLayers = LlamaCppJNI.getGpuLayers(handle)
+                if (gpuLayers != 0 && !usingGpu) {
+                    // GPU 不可用时已静默回退到 CPU，与 gpuLayers = 0 的结果重复
+                    Log.w(TAG, "GPU unavailable, skipping gpuLayers=$gpuLayers")
+                    results.put(JSONObject().put("gpu_layers", gpuLayers).put("error", "gpu unavailable"))
+                    continue
+                }
+
+                // 冷启动开销：与应用加载后的预热相同，在第一组测量之前执行
+                LlamaCppJNI.warmupModel(handle, null)
+                val warmup = WarmupStats.fromArray(LlamaCppJNI.getWarmupStats(handle))
+
+                for (threads in config.threadCounts) {
+                    for (batchSize in config.batchSizes) {
+                        for (kvType in config.kvCacheTypes) {
+                            val base = JSONObject()
+                                .put("gpu_layers", actualGpuLayers)
+                                .put("using_gpu", usingGpu)
+                                .put("threads", threads)
+                                .put("batch_size", batchSize)
+                                .put("kv_cache_type", kvType.name)
+                                .put("warmup_prefault_ms", warmup.prefaultUs / 1000.0)
+                                .put("warmup_prefault_mb", warmup.prefaultBytes / (1024 * 1024))
+                                .put("warmup_decode_ms", warmup.decodeUs / 1000.0)
+
+                            if (!LlamaCppJNI.benchmarkResetContext(
+                                    handle, config.contextSize, threads, batchSize, kvType.ggmlType
+                                )) {
+                                results.put(JSONObject(base.toString()).put("error", "context creation failed"))
+                                continue
+                            }
+                            LlamaCppJNI.getMemoryUsage(handle)?.let(MemoryUsage::fromArray)?.let {
+                                base.put("model_mb", it.modelBytes / (1024 * 1024))
+                                    .put("kv_cache_mb", it.kvCacheBytes / (1024 * 1024))
+                                    .put("kv_value_type", it.valueType?.name)
+                            }
+
+                            for (promptLength in config.promptLengths) {
+                                for (generationLength in config.generationLengths) {
+                                    results.put(
+                                        measureGeneration(
+                                            handle, JSONObject(base.toString()),
+                                            promptLength, generationLength, config.repetitions
+                                        )
+                                    )
+                                }
+                            }
+                        }
+                    }
+                }
+            } finally {
+                LlamaCppJNI.freeModel(handle)
+            }
+        }
+        return results
+    }
+
+    private fun measureGeneration(
+        handle: Long,
+        entry: JSONObject,
+        promptLength: Int,
+        generationLength: Int,
+        repetitions: Int
+    ): JSONObject {
+        entry.put("n_prompt", promptLength).put("n_gen", generationLength)
+
+        val timings = LlamaCppJNI.benchmarkGeneration(handle, promptLength, generationLength, repetitions)
+            ?: return entry.put("error", "benchmark failed")
+
+        val prefillUs = LongArray(repetitions) { timings[it * 2] }
+        val decodeUs = LongArray(repetitions) { timings[it * 2 + 1] }
+
+        if (promptLength > 0) {
+            putThroughput(entry, "prefill", prefillUs.map { tokensPerSecond(promptLength, it) })
+        }
+        if (generationLength > 0) {
+            putThroughput(entry, "decode", decodeUs.map { tokensPerSecond(generationLength, it) })
+        }
+        entry.put("prefill_us", JSONArray(prefillUs.toList()))
+        entry.put("decode_us", JSONArray(decodeUs.toList()))
+
+        Log.i(TAG, "Chat benchmark: $entry")
+        return entry
+    }
+
+    /**
+     * 嵌入模型：逐条 getEmbedding 与批量 getEmbeddingsBatch 的吞吐对比
+     */
+    fun runEmbeddingBenchmark(modelPath: String, config: BenchmarkConfig): JSONObject {
+        val result = JSONObject()
+        val handle = LlamaCppJNI.initEmbeddingModel(modelPath, 512, config.embeddingThreads)
+        if (handle == 0L) {
+            return result.put("error", "model load failed")
+        }
+
+        try {
+            // 加载时默认启用的嵌入缓存会让逐条测试之后的批量测试全部命中、不再解码，测试期间关闭
+            LlamaCppJNI.setEmbeddingCache(handle, null, 0)
+
+            result.put("dimension", LlamaCppJNI.getEmbeddingDimension(handle))
+            result.put("threads", config.embeddingThreads)
+            result.put("n_texts", config.embeddingTexts)
+            result.put("cache_enabled", false)
+
+            val texts = syntheticTexts(config.embeddingTexts)
+
+            // 预热
+            LlamaCppJNI.getEmbedding(handle, texts.first())
+
+            val singleNs = measureNanos {
+                texts.forEach { LlamaCppJNI.getEmbedding(handle, it) }
+            }
+            result.put("single", embeddingEntry(1, texts.size, singleNs))
+
+            val batched = JSONArray()
+            for (batchSize in config.embeddingBatchSizes) {
+                val batchNs = measureNanos {
+                    texts.chunked(batchSize).forEach {
+                        LlamaCppJNI.getEmbeddingsBatch(handle, it.toTypedArray())
+                    }
+                }
+                batched.put(embeddingEntry(batchSize, texts.size, batchNs))
+            }
+            result.put("batched", batched)
+            LlamaCppJNI.getEmbeddingCacheStats(handle)?.let {
+                result.put("cache_hits", EmbeddingCacheStats.fromArray(it).hits)
+            }
+        } finally {
+            LlamaCppJNI.freeEmbeddingModel(handle)
+        }
+
+        Log.i(TAG, "Embedding benchmark: $result")
+        return result
+    }
+
+    private fun embeddingEntry(batchSize: Int, count: Int, nanos: Long): JSONObject = JSONObject()
+        .put("batch_size", batchSize)
+        .put("texts_per_second", count * 1e9 / nanos)
+        .put("ms_per_text", nanos / 1e6 / count)
+
+    /**
+     * 向量索引：不同规模下各量化模式 / nprobe 的查询延迟
+     */
+    fun runVectorIndexBenchmark(config: BenchmarkConfig): JSONArray {
+        val results = JSONArray()
+        val dim = config.vectorDimension
+        val random = Random(RANDOM_SEED)
+        val queries = Array(config.vectorQueries) { randomVectors(random, 1, dim) }
+        val outIds = LongArray(config.vectorTopK)
+        val outScores = FloatArray(config.vectorTopK)
+
+        for (count in config.vectorCounts) {
+            val file = File(context.cacheDir, "benchmark_vectors_$count.bin")
+            deleteVectorFiles(file)
+
+            val handle = LlamaCppJNI.openVectorIndex(file.absolutePath, dim)
+            if (handle == 0L) {
+                results.put(JSONObject().put("n_vectors", count).put("error", "open failed"))
+                continue
+            }
+
+            try {
+                val buildNs = measureNanos {
+                    var added = 0
+                    while (added < count) {
+                        val n = minOf(VECTOR_ADD_BATCH, count - added)
+                        val ids = LongArray(n) { (added + it).toLong() }
+                        val docs = LongArray(n) { ((added + it) / 32).toLong() }
+                        LlamaCppJNI.vectorIndexAdd(handle, ids, docs, randomVectors(random, n, dim), null)
+                        added += n
+                    }
+                }
+
+                for (quantization in VectorQuantization.values()) {
+                    for (nprobe in config.vectorNprobe) {
+                        // 预热：首次量化检索会构建内存镜像
+                        LlamaCppJNI.vectorIndexSearch(
+                            handle, queries[0], config.vectorTopK, 0f, null,
+                            quantization.ordinal, config.vectorTopK * 4, nprobe, outIds, outScores
+                        )
+
+                        val latencies = queries.map { query ->
+                            measureNanos {
+                                LlamaCppJNI.vectorIndexSearch(
+                                    handle, query, config.vectorTopK, 0f, null,
+                                    quantization.ordinal, config.vectorTopK * 4, nprobe, outIds, outScores
+                                )
+                            } / 1000.0
+                        }.sorted()
+
+                        val entry = JSONObject()
+                            .put("n_vectors", count)
+                            .put("dimension", dim)
+                            .put("build_ms", buildNs / 1e6)
+                            .put("quantization", quantization.name)
+                            .put("nprobe", nprobe)
+                            .put("top_k", config.vectorTopK)
+                            .put("latency_us_mean", latencies.average())
+                            .put("latency_us_p50", percentile(latencies, 0.50))
+                            .put("latency_us_p95", percentile(latencies, 0.95))
+                        Log.i(TAG, "Vector benchmark: $entry")
+                        results.put(entry)
+                    }
+                }
+            } finally {
+                LlamaCppJNI.freeVectorIndex(handle)
+                deleteVectorFiles(file)
+            }
+        }
+        return results
+    }
+
+    /**
+     * 设备与 SoC 信息
+     */
+    fun deviceInfo(): JSONObject {
+        val info = JSONObject()
+            .put("manufacturer", Build.MANUFACTURER)
+            .put("model", Build.MODEL)
+            .put("device", Build.DEVICE)
+            .put("board", Build.BOARD)
+            .put("hardware", Build.HARDWARE)
+            .put("sdk_int", Build.VERSION.SDK_INT)
+            .put("release", Build.VERSION.RELEASE)
+            .put("abis", JSONArray(Build.SUPPORTED_ABIS.toList()))
+            .put("cpu_cores", Runtime.getRuntime().availableProcessors())
+
+        if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.S) {
+            info.put("soc_manufacturer", Build.SOC_MANUFACTURER)
+            info.put("soc_model", Build.SOC_MODEL)
+        }
+
+        // 各核心最高频率 (kHz)，用于区分大小核
+        val maxFreqs = JSONArray()
+        for (cpu in 0 until Runtime.getRuntime().availableProcessors()) {
+            val freq = File("/sys/devices/system/cpu/cpu$cpu/cpufreq/cpuinfo_max_freq")
+            maxFreqs.put(runCatching { freq.readText().trim().toLong() }.getOrDefault(0L))
+        }
+        info.put("cpu_max_freq_khz", maxFreqs)
+
+        val activityManager = context.getSystemService(Context.ACTIVITY_SERVICE) as ActivityManager
+        val memoryInfo = ActivityManager.MemoryInfo()
+        activityManager.getMemoryInfo(memoryInfo)
+        info.put("total_mem_mb", memoryInfo.totalMem / (1024 * 1024))
+
+        val gpus = JSONArray()
+        LlamaCppJNI.getGpuDevices().map(GpuDevice::parse).forEach {
+            gpus.put(JSONObject()
+                .put("name", it.name)
+                .put("description", it.description)
+                .put("memory_free_mb", it.memoryFree / (1024 * 1024))
+                .put("memory_total_mb", it.memoryTotal / (1024 * 1024)))
+        }
+        info.put("gpu_devices", gpus)
+
+        return info
+    }
+
+    private fun tokensPerSecond(tokens: Int, micros: Long): Double =
+        if (micros > 0) tokens * 1_000_000.0 / micros else 0.0
+
+    private fun putThroughput(entry: JSONObject, prefix: String, samples: List<Double>) {
+        val mean = samples.average()
+        val variance = if (samples.size > 1) {
+            samples.sumOf { (it - mean) * (it - mean) } / (samples.size - 1)
+        } else {
+            0.0
+        }
+        entry.put("${prefix}_tps_avg", mean)
+        entry.put("${prefix}_tps_stddev", sqrt(variance))
+    }
+
+    private fun percentile(sorted: List<Double>, p: Double): Double {
+        if (sorted.isEmpty()) return 0.0
+        val index = ((sorted.size - 1) * p).toInt()
+        return sorted[index]
+    }
+
+    private inline fun measureNanos(block: () -> Unit): Long {
+        val start = System.nanoTime()
+        block()
+        return System.nanoTime() - start
+    }
+
+    /** 随机单位向量（扁平数组） */
+    private fun randomVectors(random: Random, count: Int, dim: Int): FloatArray {
+        val vectors = FloatArray(count * dim)
+        for (i in 0 until count) {
+            var norm = 0.0
+            for (d in 0 until dim) {
+                val v = random.nextGaussian().toFloat()
+                vectors[i * dim + d] = v
+                norm += v * v
+            }
+            val scale = (1.0 / sqrt(norm)).toFloat()
+            for (d in 0 until dim) {
+                vectors[i * dim + d] *= scale
+            }
+        }
+        return vectors
+    }
+
+    /** 长短不一的中英文混合文本，接近知识库分块的实际长度分布 */
+    private fun syntheticTexts(count: Int): List<String> {
+        val sentences = listOf(
+            "海洋环境监测需要长期、连续的数据采集。",
+            "Ocean temperature profiles are collected by Argo floats every ten days.",
+            "赤潮的发生与水体富营养化、温度和光照条件密切相关。",
+            "Coastal erosion is accelerated by storm surges and sea level rise.",
+            "珊瑚礁生态系统对海水酸化非常敏感。"
+        )
+        return List(count) { i ->
+            val repeats = 1 + i % 8
+            (0 until repeats).joinToString(" ") { sentences[(i + it) % sentences.size] }
+        }
+    }
+
+    private fun deleteVectorFiles(file: File) {
+        file.delete()
+        File(file.absolutePath + ".ivf").delete()
+    }
+
+    private fun isoTimestamp(): String {
+        val format = SimpleDateFormat("yyyy-MM-dd'T'HH:mm:ss'Z'", Locale.US)
+        format.timeZone = TimeZone.getTimeZone("UTC")
+        return format.format(Date())
+    }
+}
@@ -96,9 +96,10 @@ interface KnowledgeDao {
 
     /**
      * 批量插入知识块
+     * @return 新插入知识块的 ID（与参数顺序一致）
      */
     @Insert
-    suspend fun insertChunks(chunks: List<KnowledgeChunkEntity>)
+    suspend fun insertChunks(chunks: List<KnowledgeChunkEntity>): List<Long>
 
     /**
      * 插入单个知识块
@@ -124,6 +125,18 @@ interface KnowledgeDao {
     @Query("SELECT * FROM knowledge_chunks")
     suspend fun getAllChunks(): List<KnowledgeChunkEntity>
 
+    /**
+     * 获取仍以 BLOB 存储向量的知识块（旧版本数据，用于导入内存映射向量文件）
+     */
+    @Query("SELECT id, documentId, embedding FROM knowledge_chunks WHERE length(embedding) > 0")
+    suspend fun getLegacyChunkEmbeddings(): List<ChunkEmbedding>
+
+    /**
+     * 清空已导入向量文件的 BLOB
+     */
+    @Query("UPDATE knowledge_chunks SET embedding = X'' WHERE length(embedding) > 0")
+    suspend fun clearLegacyChunkEmbeddings()
+
     /**
      * 获取指定文档集合的所有知识块
      */
@@ -175,6 +188,24 @@ interface KnowledgeDao {
     suspend fun getChunksWithDocumentTitles(chunkIds: List<Long>): List<ChunkWithDocumentTitle>
 }
 
+/**
+ * 知识块向量投影
+ */
+data class ChunkEmbedding(
+    val id: Long,
+    val documentId: Long,
+    val embedding: ByteArray
+) {
+    override fun equals(other: Any?): Boolean {
+        if (this === other) return true
+        if (javaClass != other?.javaClass) return false
+        other as ChunkEmbedding
+        return id == other.id
+    }
+
+    override fun hashCode(): Int = id.hashCode()
+}
+
 /**
  * 知识块与文档标题的联合结果
  */
@@ -37,6 +37,9 @@ data class KnowledgeChunkEntity(
     /**
      * 向量嵌入 (Float32数组序列化为ByteArray)
      * 使用 all-MiniLM-L6-v2 模型，维度为 384
+     *
+     * 向量现由原生内存映射向量文件保存（见 VectorSearch），新写入的知识块此处为空数组；
+     * 旧版本写入的 BLOB 会在首次打开向量文件时导入并清空
      */
     val embedding: ByteArray,
 
@@ -31,10 +31,11 @@ interface InferenceRepository {
     suspend fun initialize(): Result<Unit>
 
     /**
-     * 在后台启动初始化（非阻塞）
+     * 在后台启动初始化（非阻塞），加载成功后按 ModelConfig.warmupOnLoad 预热模型
      * 可通过 loadingState 监听加载进度
+     * @param alongsideWarmup 模型就绪后与预热并行执行的初始化（如加载嵌入模型）
      */
-    fun startBackgroundInitialization()
+    fun startBackgroundInitialization(alongsideWarmup: suspend () -> Unit = {})
 
     /**
      * 发送消息并获取AI回复（流式）
@@ -56,6 +57,56 @@ interface InferenceRepository {
         conversationHistory: List<Pair<String, String>>
     ): Result<String>
 
+    /**
+     * 在后台会话中生成回复（非流式），用于自动标题、摘要等任务，可与正在进行的聊天同时运行
+     * @param conversationHistory 对话历史 (role, content)
+     * @param maxTokens 最大生成 token 数
+     * @return Result封装的完整回复
+     */
+    suspend fun sendBackgroundMessage(
+        conversationHistory: List<Pair<String, String>>,
+        maxTokens: Int
+    ): Result<String>
+
+    /**
+     * 取消当前正在进行的推理
+     * 原生层会在下一个解码步骤前停止，已生成的部分内容照常返回
+     */
+    fun cancelGeneration()
+
+    /**
+     * 设置当前对话，切换对话时会保存上一个对话的 KV 缓存并恢复目标对话的缓存
+     * @param conversationId 对话 ID，null 表示不关联任何对话
+     */
+    fun setActiveConversation(conversationId: Long?)
+
+    /**
+     * 固定系统提示词的 KV 快照，之后注入不同知识块的请求只需预填充知识块和用户问题（需 ModelConfig.promptCacheSlots > 0）
+     * @param systemContent 原始系统提示词（不含注入的知识块）
+     */
+    fun pinSystemPrompt(systemContent: String)
+
+    /**
+     * 响应系统内存压力，释放上下文（SEVERE 时还回收权重页），下次请求时自动重建
+     * @return 释放的内存，模型未加载或正在推理时返回 null
+     */
+    suspend fun trimMemory(level: MemoryTrimLevel): MemoryTrimResult?
+
+    /**
+     * 删除对话已保存的 KV 缓存
+     */
+    fun deleteConversationState(conversationId: Long)
+
+    /**
+     * 获取最近一次生成请求的性能统计，尚未生成时返回 null
+     */
+    fun getLastGenerationStats(): GenerationStats?
+
+    /**
+     * 获取加载后预热的统计（冷启动开销），尚未预热时返回 null
+     */
+    fun getWarmupStats(): WarmupStats?
+
     /**
      * 检查推理引擎是否已就绪
      */
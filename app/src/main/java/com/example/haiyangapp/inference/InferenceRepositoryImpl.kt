@@ -45,7 +45,7 @@ class InferenceRepositoryImpl(
         return result
     }
 
-    override fun startBackgroundInitialization() {
+    override fun startBackgroundInitialization(alongsideWarmup: suspend () -> Unit) {
         if (_loadingState.value == ModelLoadingState.Loading ||
             _loadingState.value == ModelLoadingState.Ready) {
             Log.d(TAG, "Model already loading or loaded, skipping...")
@@ -54,7 +54,13 @@ class InferenceRepositoryImpl(
 
         Log.d(TAG, "Starting background model initialization...")
         scope.launch {
-            initialize()
+            if (initialize().isFailure) return@launch
+
+            // 预热主要在等 I/O 和 GPU，与嵌入模型加载重叠
+            launch { alongsideWarmup() }
+            if (config.warmupOnLoad) {
+                llamaCppInference.warmup()
+            }
         }
     }
 
@@ -120,6 +126,45 @@ class InferenceRepositoryImpl(
         }
     }
 
+    override suspend fun sendBackgroundMessage(
+        conversationHistory: List<Pair<String, String>>,
+        maxTokens: Int
+    ): Result<String> {
+        if (!llamaCppInference.isLoaded()) {
+            return Result.failure(Exception("Inference engine not initialized"))
+        }
+        val prompt = llamaCppInference.buildPrompt(conversationHistory, enableThinking = false)
+        return llamaCppInference.inferInBackground(prompt, maxTokens)
+    }
+
+    override fun cancelGeneration() {
+        llamaCppInference.cancelGeneration()
+    }
+
+    override fun setActiveConversation(conversationId: Long?) {
+        llamaCppInference.setActiveConversation(conversationId)
+    }
+
+    override fun pinSystemPrompt(systemContent: String) {
+        llamaCppInference.pinSystemPrompt(systemContent)
+    }
+
+    override suspend fun trimMemory(level: MemoryTrimLevel): MemoryTrimResult? = withContext(Dispatchers.IO) {
+        llamaCppInference.trimMemory(level)
+    }
+
+    override fun deleteConversationState(conversationId: Long) {
+        llamaCppInference.deleteConversationState(conversationId)
+    }
+
+    override fun getLastGenerationStats(): GenerationStats? {
+        return llamaCppInference.lastGenerationStats.value
+    }
+
+    override fun getWarmupStats(): WarmupStats? {
+        return llamaCppInference.warmupStats.value
+    }
+
     override fun isReady(): Boolean {
         return llamaCppInference.isLoaded()
     }
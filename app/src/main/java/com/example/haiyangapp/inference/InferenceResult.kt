@@ -1,5 +1,7 @@
 package com.example.haiyangapp.inference
 
+import android.content.ComponentCallbacks2
+
 /**
  * 推理结果封装
  */
@@ -24,3 +26,359 @@ sealed class InferenceResult {
      */
     data class Streaming(val partialText: String, val isDone: Boolean = false) : InferenceResult()
 }
+
+/**
+ * 投机解码统计（自加载草稿模型起累计）
+ * @param draftLength 当前每步起草的 token 数
+ * @param steps 主模型批量验证次数
+ * @param draftedTokens 起草的 token 总数
+ * @param acceptedTokens 被主模型接受的草稿 token 数
+ */
+data class SpeculativeStats(
+    val draftLength: Int,
+    val steps: Long,
+    val draftedTokens: Long,
+    val acceptedTokens: Long
+) {
+    /** 草稿接受率 (0-1) */
+    val acceptanceRate: Float
+        get() = if (draftedTokens > 0) acceptedTokens.toFloat() / draftedTokens else 0f
+
+    /** 平均每次主模型前向得到的 token 数 */
+    val tokensPerStep: Float
+        get() = if (steps > 0) (acceptedTokens + steps).toFloat() / steps else 0f
+}
+
+/**
+ * ggml 注册的 GPU 设备
+ * @param name ggml 设备名（如 Vulkan0）
+ * @param description 驱动报告的设备描述
+ * @param memoryFree 可用显存（字节）
+ * @param memoryTotal 总显存（字节）
+ */
+data class GpuDevice(
+    val name: String,
+    val description: String,
+    val memoryFree: Long,
+    val memoryTotal: Long
+) {
+    companion object {
+        /**
+         * 解析 LlamaCppJNI.getGpuDevices 返回的一项
+         */
+        fun parse(line: String): GpuDevice {
+            val fields = line.split('\t')
+            return GpuDevice(
+                name = fields[0],
+                description = fields.getOrElse(1) { "" },
+                memoryFree = fields.getOrNull(2)?.toLongOrNull() ?: 0L,
+                memoryTotal = fields.getOrNull(3)?.toLongOrNull() ?: 0L
+            )
+        }
+    }
+}
+
+/**
+ * 主模型内存占用
+ * @param modelBytes 模型权重大小
+ * @param kvCacheBytes KV 缓存大小（按层数、KV 头宽度和 n_ctx 估算）
+ * @param keyType K 缓存类型（非 F16 / Q8_0 / Q4_0 时为 null）
+ * @param valueType V 缓存类型（量化 V 需要 Flash Attention，关闭时保持 F16）
+ * @param flashAttention Flash Attention 请求值，null 为自动
+ * @param contextSize 上下文 token 数
+ */
+data class MemoryUsage(
+    val modelBytes: Long,
+    val kvCacheBytes: Long,
+    val keyType: KvCacheType?,
+    val valueType: KvCacheType?,
+    val flashAttention: Boolean?,
+    val contextSize: Int
+) {
+    /** 权重与 KV 缓存合计（MB），不含计算缓冲区 */
+    val totalMb: Long
+        get() = (modelBytes + kvCacheBytes) / (1024 * 1024)
+
+    companion object {
+        /**
+         * 从 LlamaCppJNI.getMemoryUsage 返回的数组构造
+         */
+        fun fromArray(values: LongArray): MemoryUsage = MemoryUsage(
+            modelBytes = values[0],
+            kvCacheBytes = values[1],
+            keyType = KvCacheType.fromGgmlType(values[2].toInt()),
+            valueType = KvCacheType.fromGgmlType(values[3].toInt()),
+            flashAttention = if (values[4] < 0) null else values[4] > 0,
+            contextSize = values[5].toInt()
+        )
+    }
+}
+
+/**
+ * 内存压力级别，对应原生层 trimMemory 的处理范围
+ */
+enum class MemoryTrimLevel(val nativeLevel: Int) {
+    /** 释放上下文（KV 缓存与计算缓冲区） */
+    MODERATE(1),
+
+    /** 另外回收权重文件页并卸载嵌入模型 */
+    SEVERE(2);
+
+    companion object {
+        /**
+         * 从 ComponentCallbacks2.onTrimMemory 的级别映射，UI 隐藏等无需处理的级别返回 null
+         */
+        fun fromTrimMemory(level: Int): MemoryTrimLevel? = when {
+            level >= ComponentCallbacks2.TRIM_MEMORY_COMPLETE -> SEVERE
+            level >= ComponentCallbacks2.TRIM_MEMORY_BACKGROUND -> MODERATE
+            level == ComponentCallbacks2.TRIM_MEMORY_RUNNING_CRITICAL -> SEVERE
+            level == ComponentCallbacks2.TRIM_MEMORY_RUNNING_LOW -> MODERATE
+            else -> null
+        }
+    }
+}
+
+/**
+ * 一次内存压力响应释放的常驻内存（字节），GPU 显存不计入
+ */
+data class MemoryTrimResult(
+    val contextBytes: Long,
+    val weightBytes: Long,
+    val embeddingBytes: Long = 0
+) {
+    val totalBytes: Long
+        get() = contextBytes + weightBytes + embeddingBytes
+
+    companion object {
+        /**
+         * 从 LlamaCppJNI.trimMemory 返回的数组构造
+         */
+        fun fromArray(values: LongArray): MemoryTrimResult = MemoryTrimResult(
+            contextBytes = values[0],
+            weightBytes = values[1]
+        )
+    }
+}
+
+/**
+ * LlamaCppJNI.chunkAndEmbed 的结果（由原生层构造，构造函数签名不可改动）
+ * @param spans 每块三个值：在原文中的 UTF-16 起止下标 [start, end) 与 token 数
+ * @param embeddings 扁平的归一化嵌入 (count * dimension)，嵌入失败的块为全零行
+ * @param dimension 嵌入维度
+ */
+class ChunkEmbeddings(
+    private val spans: IntArray,
+    private val embeddings: FloatArray,
+    val dimension: Int
+) {
+    /** 块数 */
+    val count: Int
+        get() = spans.size / 3
+
+    fun start(index: Int): Int = spans[index * 3]
+
+    fun end(index: Int): Int = spans[index * 3 + 1]
+
+    fun tokenCount(index: Int): Int = spans[index * 3 + 2]
+
+    /** 块的原文 */
+    fun text(source: String, index: Int): String = source.substring(start(index), end(index)).trim()
+
+    /** 块的嵌入，失败的块返回 null */
+    fun embedding(index: Int): FloatArray? {
+        val row = embeddings.copyOfRange(index * dimension, (index + 1) * dimension)
+        return if (row.all { it == 0f }) null else row
+    }
+}
+
+/**
+ * 嵌入缓存统计
+ * @param hits 命中次数（跳过了 llama_decode）
+ * @param misses 未命中次数
+ * @param entries 当前缓存条目数
+ * @param bytes 估算的内存占用
+ */
+data class EmbeddingCacheStats(
+    val hits: Long,
+    val misses: Long,
+    val entries: Long,
+    val bytes: Long
+) {
+    /** 命中率，没有查询时为 0 */
+    val hitRate: Float
+        get() = if (hits + misses > 0) hits.toFloat() / (hits + misses) else 0f
+
+    companion object {
+        /**
+         * 从 LlamaCppJNI.getEmbeddingCacheStats 返回的数组构造
+         */
+        fun fromArray(values: LongArray): EmbeddingCacheStats = EmbeddingCacheStats(
+            hits = values[0],
+            misses = values[1],
+            entries = values[2],
+            bytes = values[3]
+        )
+    }
+}
+
+/**
+ * 推理调速模式（ordinal 与原生层一致），越往后越保守
+ */
+enum class GovernorMode {
+    /** 配置的线程数与生成长度 */
+    NORMAL,
+
+    /** 解码线程数减半 */
+    REDUCED_THREADS,
+
+    /** 减少线程并限制生成长度 */
+    SHORT_ANSWERS,
+
+    /** 只用草稿模型生成（需配置 draftModelPath） */
+    DRAFT_ONLY
+}
+
+/**
+ * 模型预热状态（ordinal 与原生层一致）
+ */
+enum class WarmupState {
+    NOT_RUN,
+    RUNNING,
+    DONE,
+
+    /** 被取消或被先到的生成请求打断 */
+    CANCELLED,
+    FAILED
+}
+
+/**
+ * 加载后预热的耗时统计（微秒），即从首条用户消息中移走的冷启动开销
+ *
+ * @param prefaultUs 预读映射的权重页耗时
+ * @param prefaultBytes 预读的字节数
+ * @param decodeUs 预热解码耗时（GPU 管线编译、线程池启动、计算缓冲区分配）
+ * @param totalUs 预热总耗时
+ */
+data class WarmupStats(
+    val state: WarmupState,
+    val prefaultUs: Long,
+    val prefaultBytes: Long,
+    val decodeUs: Long,
+    val totalUs: Long
+) {
+    /** 预热总耗时（毫秒） */
+    val totalMs: Float
+        get() = totalUs / 1000f
+
+    companion object {
+        /**
+         * 从 LlamaCppJNI.getWarmupStats 返回的数组构造
+         */
+        fun fromArray(values: LongArray): WarmupStats = WarmupStats(
+            state = WarmupState.values()[values[0].toInt()],
+            prefaultUs = values[1],
+            prefaultBytes = values[2],
+            decodeUs = values[3],
+            totalUs = values[4]
+        )
+    }
+}
+
+/**
+ * 单次生成请求的性能统计（原生层单调计时，时间单位为微秒）
+ *
+ * 各阶段耗时在 Perfetto 中对应同名的 "llama:*" trace section（抓取时才输出）
+ *
+ * @param timeToFirstTokenUs 首 token 延迟：请求开始到第一个输出 token，-1 表示没有产生 token
+ * @param totalUs 请求总耗时
+ * @param tokenizeUs 提示词分词耗时
+ * @param prefillUs 提示词预填充耗时
+ * @param decodeUs 生成阶段解码耗时（投机解码时为主模型批量验证）
+ * @param draftUs 草稿模型起草耗时
+ * @param sampleUs 采样耗时
+ * @param detokenizeUs token 转文本耗时
+ * @param callbackUs JNI 回调耗时（onText / onPrefillProgress）
+ * @param promptTokens 提示词 token 数
+ * @param reusedTokens 从 KV 缓存复用的前缀 token 数
+ * @param prefillTokens 实际预填充的 token 数
+ * @param generatedTokens 生成的 token 数
+ * @param perfPromptEvalUs llama_perf_context 报告的预填充耗时
+ * @param perfEvalUs llama_perf_context 报告的生成耗时
+ * @param perfPromptEvalTokens llama_perf_context 报告的预填充 token 数
+ * @param perfEvalTokens llama_perf_context 报告的生成 token 数
+ * @param governorMode 请求结束时的调速模式
+ * @param governorModeChanges 本次请求内调速模式的切换次数
+ * @param contextShifts 生成过程中上下文滑动次数
+ * @param discardedTokens 因超出上下文被丢弃的 token 数（提示词截断与生成中滑动合计）
+ */
+data class GenerationStats(
+    val timeToFirstTokenUs: Long,
+    val totalUs: Long,
+    val tokenizeUs: Long,
+    val prefillUs: Long,
+    val decodeUs: Long,
+    val draftUs: Long,
+    val sampleUs: Long,
+    val detokenizeUs: Long,
+    val callbackUs: Long,
+    val promptTokens: Int,
+    val reusedTokens: Int,
+    val prefillTokens: Int,
+    val generatedTokens: Int,
+    val perfPromptEvalUs: Long,
+    val perfEvalUs: Long,
+    val perfPromptEvalTokens: Int,
+    val perfEvalTokens: Int,
+    val governorMode: GovernorMode,
+    val governorModeChanges: Int,
+    val contextShifts: Int,
+    val discardedTokens: Int
+) {
+    /** 首 token 延迟（毫秒） */
+    val timeToFirstTokenMs: Float
+        get() = timeToFirstTokenUs / 1000f
+
+    /** 预填充吞吐 (token/s) */
+    val prefillTokensPerSecond: Float
+        get() = if (prefillUs > 0) prefillTokens * 1_000_000f / prefillUs else 0f
+
+    /** 生成吞吐 (token/s)，按首 token 之后的墙钟时间计算，包含采样和回调开销 */
+    val decodeTokensPerSecond: Float
+        get() {
+            val decodeWallUs = totalUs - timeToFirstTokenUs
+            return if (timeToFirstTokenUs >= 0 && decodeWallUs > 0 && generatedTokens > 1) {
+                (generatedTokens - 1) * 1_000_000f / decodeWallUs
+            } else {
+                0f
+            }
+        }
+
+    companion object {
+        /**
+         * 从 LlamaCppJNI.getLastGenerationStats 返回的数组构造
+         */
+        fun fromArray(values: LongArray): GenerationStats = GenerationStats(
+            timeToFirstTokenUs = values[0],
+            totalUs = values[1],
+            tokenizeUs = values[2],
+            prefillUs = values[3],
+            decodeUs = values[4],
+            draftUs = values[5],
+            sampleUs = values[6],
+            detokenizeUs = values[7],
+            callbackUs = values[8],
+            promptTokens = values[9].toInt(),
+            reusedTokens = values[10].toInt(),
+            prefillTokens = values[11].toInt(),
+            generatedTokens = values[12].toInt(),
+            perfPromptEvalUs = values[13],
+            perfEvalUs = values[14],
+            perfPromptEvalTokens = values[15].toInt(),
+            perfEvalTokens = values[16].toInt(),
+            governorMode = GovernorMode.values().getOrElse(values[18].toInt()) { GovernorMode.NORMAL },
+            governorModeChanges = values[19].toInt(),
+            contextShifts = values[20].toInt(),
+            discardedTokens = values[21].toInt()
+        )
+    }
+}
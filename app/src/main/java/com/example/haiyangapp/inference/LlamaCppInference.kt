@@ -1,15 +1,24 @@
 package com.example.haiyangapp.inference
 
 import android.content.Context
+import android.os.Build
 import android.util.Log
+import kotlinx.coroutines.CancellationException
 import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.Job
+import kotlinx.coroutines.async
 import kotlinx.coroutines.channels.awaitClose
+import kotlinx.coroutines.coroutineScope
 import kotlinx.coroutines.flow.Flow
+import kotlinx.coroutines.flow.MutableStateFlow
+import kotlinx.coroutines.flow.StateFlow
+import kotlinx.coroutines.flow.asStateFlow
 import kotlinx.coroutines.flow.callbackFlow
 import kotlinx.coroutines.flow.flow
+import kotlinx.coroutines.launch
 import kotlinx.coroutines.withContext
 import java.io.File
-import java.io.FileOutputStream
+import java.util.concurrent.atomic.AtomicBoolean
 
 /**
  * LLaMA.cpp推理引擎封装
@@ -21,6 +30,25 @@ class LlamaCppInference(
 ) {
     companion object {
         private const val TAG = "LlamaCppInference"
+
+        /** token 数少于该值的会话不值得落盘（重新预填充更快） */
+        private const val SESSION_MIN_TOKENS = 128
+
+        /** 会话状态文件扩展名 */
+        private const val SESSION_FILE_SUFFIX = ".kvs"
+
+        /** 线程数实测结果的缓存 */
+        private const val THREAD_TUNING_PREFS = "llama_thread_tuning"
+
+        /** 实测线程数时的生成 / 预填充 token 数（足够稳定，又不明显拖慢首次启动） */
+        private const val TUNE_DECODE_TOKENS = 16
+        private const val TUNE_PROMPT_TOKENS = 128
+
+        /** GPU 层数实测结果的缓存 */
+        private const val GPU_CALIBRATION_PREFS = "llama_gpu_calibration"
+
+        /** 预热进度中预读权重页所占的比例，其余为预热解码 */
+        private const val WARMUP_PREFAULT_SHARE = 0.9f
     }
 
     private var modelHandle: Long = 0
@@ -28,6 +56,48 @@ class LlamaCppInference(
     private var isUsingGpu = false
     private var gpuLayers = 0
 
+    private val _prefillProgress = MutableStateFlow(1f)
+    private val _lastGenerationStats = MutableStateFlow<GenerationStats?>(null)
+    private val _warmupProgress = MutableStateFlow(0f)
+    private val _warmupStats = MutableStateFlow<WarmupStats?>(null)
+
+    private val thermalMonitor = ThermalMonitor(context)
+
+    // 流式输出共享缓冲区（模型同一时刻只执行一个生成请求）
+    private val streamBuffer by lazy { TokenStreamBuffer() }
+
+    // 会话 KV 状态：UI 切换对话时只记录目标，下一次生成前再保存 / 恢复，避免与进行中的解码并发
+    private val sessionLock = Any()
+    @Volatile
+    private var requestedConversationId: Long? = null
+    private var activeConversationId: Long? = null  // KV 缓存当前所属的对话
+    private var sessionDirty = false                // 自上次保存 / 恢复后是否生成过
+
+    /** 会话状态目录，按模型区分，避免不同模型之间互相加载 */
+    private val sessionDir: File by lazy {
+        File(context.cacheDir, "kv_sessions/${config.modelPath.substringBeforeLast('.')}")
+    }
+
+    /**
+     * 当前流式请求的提示词预填充进度 (0.0 - 1.0)，可用于 UI 显示
+     */
+    val prefillProgress: StateFlow<Float> = _prefillProgress.asStateFlow()
+
+    /**
+     * 最近一次生成请求的性能统计（TTFT、预填充 / 生成吞吐、各阶段耗时），尚未生成时为 null
+     */
+    val lastGenerationStats: StateFlow<GenerationStats?> = _lastGenerationStats.asStateFlow()
+
+    /**
+     * 加载后预热的进度 (0.0 - 1.0)，可用于 UI 显示
+     */
+    val warmupProgress: StateFlow<Float> = _warmupProgress.asStateFlow()
+
+    /**
+     * 最近一次预热的统计（冷启动开销），尚未预热时为 null
+     */
+    val warmupStats: StateFlow<WarmupStats?> = _warmupStats.asStateFlow()
+
     /**
      * 初始化模型（自动检测并启用 GPU，不支持时静默回退到 CPU）
      *
@@ -41,8 +111,9 @@ class LlamaCppInference(
             Log.d(TAG, "Initializing LLaMA model via JNI...")
             Log.d(TAG, "GPU config: useGpu=${config.useGpu}, gpuLayers=${config.gpuLayers}")
 
-            // 获取模型文件
-            val modelFile = getModelFile()
+            Log.d(TAG, "Context size: ${config.contextLength}, Threads: ${config.threads} / ${config.batchThreads}")
+
+            val modelFile = getModelFile(config.modelPath)
             if (!modelFile.exists()) {
                 return@withContext Result.failure(
                     Exception("Model file not found: ${modelFile.absolutePath}")
@@ -50,15 +121,28 @@ class LlamaCppInference(
             }
 
             Log.d(TAG, "Model file path: ${modelFile.absolutePath}, size: ${modelFile.length()} bytes")
-            Log.d(TAG, "Context size: ${config.contextLength}, Threads: ${config.threads}")
+
+            val layers = resolveGpuLayers {
+                LlamaCppJNI.calibrateGpuLayers(
+                    modelFile.absolutePath, config.contextLength, config.batchSize, TUNE_DECODE_TOKENS
+                )
+            }
 
             // 使用带 GPU 支持的 JNI 加载模型（内置静默回退）
             modelHandle = LlamaCppJNI.initModelWithGpu(
                 modelPath = modelFile.absolutePath,
                 contextSize = config.contextLength,
                 threads = config.threads,
+                batchThreads = config.batchThreads,
                 useGpu = config.useGpu,
-                gpuLayers = config.gpuLayers
+                gpuLayers = layers,
+                batchSize = config.batchSize,
+                kvCacheType = config.kvCacheType.ggmlType,
+                flashAttention = flashAttentionFlag(),
+                parallelSessions = config.backgroundSessions,
+                sessionContextSize = config.sessionContextLength,
+                promptCacheSlots = config.promptCacheSlots,
+                promptCacheTokens = config.promptCacheTokens
             )
 
             if (modelHandle == 0L) {
@@ -68,6 +152,55 @@ class LlamaCppInference(
             // 检查实际是否使用了 GPU
             isUsingGpu = LlamaCppJNI.isUsingGpu(modelHandle)
             gpuLayers = LlamaCppJNI.getGpuLayers(modelHandle)
+            getMemoryUsage()?.let {
+                Log.i(TAG, "Memory: weights ${it.modelBytes / (1024 * 1024)} MB, KV cache " +
+                    "${it.kvCacheBytes / (1024 * 1024)} MB (${it.keyType}/${it.valueType}, ${it.contextSize} tokens)")
+            }
+
+            // 加载投机解码草稿模型（可选，失败时使用普通解码）
+            config.draftModelPath?.let { draftPath ->
+                try {
+                    val draftFile = getModelFile(draftPath)
+                    val draftLoaded = LlamaCppJNI.initDraftModel(
+                        modelHandle = modelHandle,
+                        draftModelPath = draftFile.absolutePath,
+                        contextSize = config.contextLength,
+                        threads = config.threads,
+                        draftLength = config.draftLength
+                    )
+                    Log.i(TAG, "Draft model $draftPath loaded: $draftLoaded")
+                } catch (e: Exception) {
+                    Log.w(TAG, "Failed to prepare draft model $draftPath, using normal decoding", e)
+                }
+            }
+
+            // 加载 LoRA 适配器（可选，失败时使用基础模型）
+            config.loraAdapterPath?.let { adapterPath ->
+                try {
+                    val adapterFile = getModelFile(adapterPath)
+                    val adapterId = LlamaCppJNI.loadLoraAdapter(modelHandle, adapterFile.absolutePath)
+                    if (adapterId >= 0) {
+                        LlamaCppJNI.setLoraAdapter(modelHandle, 0, adapterId, config.loraScale)
+                    }
+                    Log.i(TAG, "LoRA adapter $adapterPath loaded: ${adapterId >= 0} (scale ${config.loraScale})")
+                } catch (e: Exception) {
+                    Log.w(TAG, "Failed to prepare LoRA adapter $adapterPath, using base model", e)
+                }
+            }
+
+            tuneThreadCounts()
+
+            LlamaCppJNI.setContextShift(modelHandle, config.contextShift, config.contextKeepTokens)
+            LlamaCppJNI.setOutputFilter(
+                modelHandle,
+                config.stopSequences.toTypedArray(),
+                config.hiddenSpans.map { it.first }.toTypedArray(),
+                config.hiddenSpans.map { it.second }.toTypedArray()
+            )
+            LlamaCppJNI.setGovernorEnabled(modelHandle, config.enableGovernor)
+            if (config.enableGovernor) {
+                thermalMonitor.start { pushThermalState(it) }
+            }
 
             isModelLoaded = true
 
@@ -85,6 +218,191 @@ class LlamaCppInference(
         }
     }
 
+    /**
+     * 预热已加载的模型：预读权重页并做一次极小的解码，让第一条用户消息直接命中热模型
+     *
+     * 协程取消或 cancelWarmup 时在下一段预读之前停止；期间到来的生成请求会打断预热并照常执行
+     *
+     * @return 预热统计，模型未加载时返回 null
+     */
+    suspend fun warmup(): WarmupStats? = withContext(Dispatchers.IO) {
+        if (!isModelLoaded) return@withContext null
+        val handle = modelHandle
+        val job = coroutineContext[Job]
+
+        _warmupProgress.value = 0f
+        LlamaCppJNI.warmupModel(handle, object : WarmupCallback {
+            override fun onProgress(stage: Int, done: Long, total: Long) {
+                if (job?.isActive == false) {
+                    LlamaCppJNI.cancelWarmup(handle)
+                }
+                val fraction = if (total > 0) done.toFloat() / total else 1f
+                _warmupProgress.value = if (stage == 0) {
+                    fraction * WARMUP_PREFAULT_SHARE
+                } else {
+                    WARMUP_PREFAULT_SHARE + fraction * (1f - WARMUP_PREFAULT_SHARE)
+                }
+            }
+        })
+
+        val stats = WarmupStats.fromArray(LlamaCppJNI.getWarmupStats(handle))
+        _warmupStats.value = stats
+        _warmupProgress.value = 1f
+        Log.i(TAG, "Warmup ${stats.state} in ${stats.totalMs} ms: prefaulted " +
+            "${stats.prefaultBytes / (1024 * 1024)} MB in ${stats.prefaultUs / 1000} ms, decode ${stats.decodeUs / 1000} ms")
+        stats
+    }
+
+    /**
+     * 停止进行中的预热
+     */
+    fun cancelWarmup() {
+        if (modelHandle != 0L) {
+            LlamaCppJNI.cancelWarmup(modelHandle)
+        }
+    }
+
+    /**
+     * 选择 GPU 层数
+     *
+     * 只在 gpuLayers 为自动 (-1) 且开启 calibrateGpuLayers 时实测：已有缓存时直接使用，
+     * 否则测量各候选层数的解码速度并取最快值（可能是 0，即 CPU 更快）。
+     * 缓存按模型、上下文大小、GPU 设备描述和系统版本（驱动随系统更新）区分
+     *
+     * @param calibrate 执行实测的原生调用
+     * @return 传给 initModelWithGpu 的 gpuLayers
+     */
+    private fun resolveGpuLayers(calibrate: () -> LongArray?): Int {
+        if (!config.useGpu || config.gpuLayers >= 0 || !config.calibrateGpuLayers) {
+            return config.gpuLayers
+        }
+
+        val devices = LlamaCppJNI.getGpuDevices().map(GpuDevice::parse)
+        if (devices.isEmpty()) {
+            return 0
+        }
+        devices.forEach {
+            Log.d(TAG, "GPU ${it.name}: ${it.description}, ${it.memoryFree / (1024 * 1024)} / " +
+                "${it.memoryTotal / (1024 * 1024)} MB free")
+        }
+
+        val prefs = context.getSharedPreferences(GPU_CALIBRATION_PREFS, Context.MODE_PRIVATE)
+        val deviceFingerprint = devices.joinToString(",") { "${it.name}/${it.description}" }
+        val key = "${config.modelPath}:${config.contextLength}:" +
+            "${deviceFingerprint.hashCode()}:${Build.FINGERPRINT.hashCode()}"
+        if (prefs.contains(key)) {
+            return prefs.getInt(key, config.gpuLayers).also {
+                Log.d(TAG, "Using calibrated GPU layers: $it")
+            }
+        }
+
+        val results = calibrate() ?: return config.gpuLayers
+        val best = results.toList().chunked(2)
+            .filter { (_, us) -> us > 0 }
+            .minByOrNull { (_, us) -> us }
+            ?: return config.gpuLayers
+        val layers = best[0].toInt()
+
+        prefs.edit().putInt(key, layers).apply()
+        Log.i(TAG, "Calibrated GPU layers: $layers (${best[1]} us/token), candidates " +
+            results.toList().chunked(2).joinToString { (l, us) -> "$l=$us" })
+        return layers
+    }
+
+    /**
+     * 选择解码 / 预填充线程数
+     *
+     * 只调整配置为自动 (<= 0) 的那一项：已有缓存时直接应用，否则在性能核数范围内逐个实测取最快值。
+     * 缓存按模型、GPU 层数和系统版本区分，系统升级后重新实测
+     */
+    private fun tuneThreadCounts() {
+        val tuneDecode = config.threads <= 0
+        val tuneBatch = config.batchThreads <= 0
+        if (!config.autoTuneThreads || (!tuneDecode && !tuneBatch)) {
+            return
+        }
+
+        val prefs = context.getSharedPreferences(THREAD_TUNING_PREFS, Context.MODE_PRIVATE)
+        val key = "${config.modelPath}:$gpuLayers:${Build.FINGERPRINT.hashCode()}"
+        val current = LlamaCppJNI.getThreadCounts(modelHandle)
+        var decodeThreads = if (tuneDecode) prefs.getInt("$key:decode", 0) else config.threads
+        var batchThreads = if (tuneBatch) prefs.getInt("$key:batch", 0) else config.batchThreads
+
+        if (decodeThreads > 0 && batchThreads > 0) {
+            LlamaCppJNI.setThreadCounts(modelHandle, decodeThreads, batchThreads)
+            Log.d(TAG, "Using cached thread counts: decode $decodeThreads, prefill $batchThreads")
+            return
+        }
+
+        val performanceCores = LlamaCppJNI.getPerformanceCores().size.coerceAtLeast(1)
+        val candidates = (1..performanceCores).filter { it >= 2 || performanceCores == 1 }
+
+        if (decodeThreads <= 0) {
+            decodeThreads = if (candidates.size == 1) candidates[0] else candidates.minByOrNull { threads ->
+                LlamaCppJNI.setThreadCounts(modelHandle, threads, current[1])
+                LlamaCppJNI.benchmarkGeneration(modelHandle, 0, TUNE_DECODE_TOKENS, 1)?.get(1) ?: Long.MAX_VALUE
+            } ?: current[0]
+        }
+        if (batchThreads <= 0) {
+            batchThreads = if (candidates.size == 1) candidates[0] else candidates.minByOrNull { threads ->
+                LlamaCppJNI.setThreadCounts(modelHandle, decodeThreads, threads)
+                LlamaCppJNI.benchmarkGeneration(modelHandle, TUNE_PROMPT_TOKENS, 0, 1)?.get(0) ?: Long.MAX_VALUE
+            } ?: current[1]
+        }
+
+        LlamaCppJNI.setThreadCounts(modelHandle, decodeThreads, batchThreads)
+        prefs.edit()
+            .putInt("$key:decode", decodeThreads)
+            .putInt("$key:batch", batchThreads)
+            .apply()
+        Log.i(TAG, "Auto-tuned thread counts: decode $decodeThreads, prefill $batchThreads " +
+            "($performanceCores performance cores)")
+    }
+
+    /**
+     * 把当前温控 / 省电状态交给原生调速器
+     */
+    private fun pushThermalState(state: ThermalState? = null) {
+        if (!config.enableGovernor || modelHandle == 0L) {
+            return
+        }
+        val current = state ?: thermalMonitor.currentState()
+        LlamaCppJNI.setDeviceThermalState(
+            modelHandle, current.thermalStatus, current.thermalHeadroom, current.powerSave
+        )
+    }
+
+    private fun flashAttentionFlag(): Int = when (config.flashAttention) {
+        null -> -1
+        true -> 1
+        false -> 0
+    }
+
+    /**
+     * 主模型内存占用（权重与 KV 缓存），未加载时为 null
+     */
+    fun getMemoryUsage(): MemoryUsage? =
+        modelHandle.takeIf { it != 0L }?.let { LlamaCppJNI.getMemoryUsage(it) }?.let(MemoryUsage::fromArray)
+
+    /**
+     * 响应内存压力：先保存当前对话的 KV 状态，再释放上下文，下次生成时重建并从文件恢复
+     * @return 释放的内存，未加载或正在推理时返回 null
+     */
+    fun trimMemory(level: MemoryTrimLevel): MemoryTrimResult? {
+        if (modelHandle == 0L) return null
+        synchronized(sessionLock) {
+            if (config.persistSessionState) {
+                activeConversationId?.let { saveSessionLocked(it) }
+            }
+            val result = LlamaCppJNI.trimMemory(modelHandle, level.nativeLevel)
+                ?.let(MemoryTrimResult::fromArray) ?: return null
+            activeConversationId = null
+            sessionDirty = false
+            Log.i(TAG, "Trimmed memory ($level): context ${result.contextBytes / 1024} KB, weights ${result.weightBytes / 1024} KB")
+            return result
+        }
+    }
+
     /**
      * 检查是否正在使用 GPU 加速
      */
@@ -95,6 +413,28 @@ class LlamaCppInference(
      */
     fun getGpuLayerCount(): Int = gpuLayers
 
+    /**
+     * 获取投机解码统计，未加载草稿模型时各项为 0
+     */
+    fun getSpeculativeStats(): SpeculativeStats {
+        val stats = LlamaCppJNI.getSpeculativeStats(modelHandle)
+        return SpeculativeStats(
+            draftLength = stats[0].toInt(),
+            steps = stats[1],
+            draftedTokens = stats[2],
+            acceptedTokens = stats[3]
+        )
+    }
+
+    /**
+     * 调整投机解码每步起草的 token 数，0 表示暂时关闭
+     */
+    fun setDraftLength(draftLength: Int) {
+        if (modelHandle != 0L) {
+            LlamaCppJNI.setDraftLength(modelHandle, draftLength)
+        }
+    }
+
     /**
      * 获取推理模式描述
      */
@@ -107,35 +447,120 @@ class LlamaCppInference(
     }
 
     /**
-     * 从assets复制模型到内部存储
+     * 从assets复制模型到内部存储（大小与 asset 一致时直接复用）
      */
-    private suspend fun getModelFile(): File = withContext(Dispatchers.IO) {
-        val modelDir = File(context.filesDir, "models")
-        if (!modelDir.exists()) {
-            modelDir.mkdirs()
-        }
+    private suspend fun getModelFile(assetPath: String): File = withContext(Dispatchers.IO) {
+        val modelFile = File(File(context.filesDir, "models"), assetPath)
+        ModelAssets.copyToFile(context, assetPath, modelFile)
+        Log.d(TAG, "Model file ready, size: ${modelFile.length()} bytes")
+        modelFile
+    }
+
+    /**
+     * 设置当前对话，下一次生成前会保存上一个对话的 KV 状态并恢复该对话的状态
+     * @param conversationId 对话 ID，null 表示不关联任何对话
+     */
+    fun setActiveConversation(conversationId: Long?) {
+        requestedConversationId = conversationId
+    }
 
-        val modelFile = File(modelDir, config.modelPath)
+    /**
+     * 固定系统提示词的 KV 快照：注入知识块或切换对话后，这段前缀从快照恢复而不重新预填充
+     * 格式与 buildPrompt 生成的系统消息一致，空内容表示取消固定
+     */
+    fun pinSystemPrompt(systemContent: String) {
+        if (modelHandle == 0L || config.promptCacheSlots <= 0) return
+        val prompt = systemContent.takeIf { it.isNotEmpty() }?.let { "<|im_start|>system\n$it<|im_end|>\n" }
+        LlamaCppJNI.pinSystemPrompt(modelHandle, prompt)
+    }
 
-        // 如果文件已存在且大小正确,直接返回
-        if (modelFile.exists()) {
-            val assetSize = context.assets.open(config.modelPath).use { it.available().toLong() }
-            if (modelFile.length() == assetSize) {
-                Log.d(TAG, "Model file already exists: ${modelFile.absolutePath}")
-                return@withContext modelFile
+    /**
+     * 删除对话的已保存 KV 状态
+     */
+    fun deleteConversationState(conversationId: Long) {
+        synchronized(sessionLock) {
+            if (activeConversationId == conversationId) {
+                activeConversationId = null
+                sessionDirty = false
             }
+            sessionFile(conversationId).delete()
         }
+    }
+
+    private fun sessionFile(conversationId: Long): File =
+        File(sessionDir, "conv_$conversationId$SESSION_FILE_SUFFIX")
 
-        // 复制模型文件
-        Log.d(TAG, "Copying model from assets to ${modelFile.absolutePath}")
-        context.assets.open(config.modelPath).use { input ->
-            FileOutputStream(modelFile).use { output ->
-                input.copyTo(output)
+    /**
+     * 在生成线程上、生成开始前调用：切换 KV 缓存到当前请求的对话
+     */
+    private fun syncConversationState() {
+        if (!config.persistSessionState) return
+        synchronized(sessionLock) {
+            val target = requestedConversationId
+            if (target == activeConversationId) return
+
+            activeConversationId?.let { saveSessionLocked(it) }
+            activeConversationId = target
+            sessionDirty = false
+
+            if (target == null) return
+            val file = sessionFile(target)
+            if (!file.exists()) return
+
+            val restored = LlamaCppJNI.loadSessionState(modelHandle, file.absolutePath)
+            if (restored < 0) {
+                Log.w(TAG, "Discarding unreadable session state for conversation $target")
+                file.delete()
+            } else {
+                file.setLastModified(System.currentTimeMillis())
+                Log.i(TAG, "Restored $restored cached tokens for conversation $target")
             }
         }
+    }
 
-        Log.d(TAG, "Model copied successfully, size: ${modelFile.length()} bytes")
-        modelFile
+    /**
+     * 保存对话的 KV 状态并按上限淘汰旧文件，调用方需持有 sessionLock
+     */
+    private fun saveSessionLocked(conversationId: Long) {
+        if (!sessionDirty) return
+        sessionDirty = false
+        if (LlamaCppJNI.getCachedTokenCount(modelHandle) < SESSION_MIN_TOKENS) return
+
+        if (!sessionDir.exists()) {
+            sessionDir.mkdirs()
+        }
+        val file = sessionFile(conversationId)
+        if (LlamaCppJNI.saveSessionState(modelHandle, file.absolutePath) == 0L) {
+            file.delete()
+            return
+        }
+        trimSessionCache()
+    }
+
+    /**
+     * 会话目录超出大小上限时，按最近使用时间从旧到新删除
+     */
+    private fun trimSessionCache() {
+        val files = sessionDir.listFiles { f -> f.name.endsWith(SESSION_FILE_SUFFIX) } ?: return
+        val limitBytes = config.sessionCacheLimitMb.toLong() * 1024 * 1024
+        var totalBytes = files.sumOf { it.length() }
+        for (file in files.sortedBy { it.lastModified() }) {
+            if (totalBytes <= limitBytes) break
+            totalBytes -= file.length()
+            file.delete()
+            Log.d(TAG, "Evicted session state ${file.name}")
+        }
+    }
+
+    /**
+     * 标记 KV 缓存已被本次生成修改
+     */
+    private fun markSessionDirty() {
+        synchronized(sessionLock) {
+            if (activeConversationId != null) {
+                sessionDirty = true
+            }
+        }
     }
 
     /**
@@ -151,20 +576,39 @@ class LlamaCppInference(
 
             Log.d(TAG, "Starting inference with prompt: ${prompt.take(50)}...")
 
-            val result = LlamaCppJNI.generate(
-                modelHandle = modelHandle,
-                prompt = prompt,
-                maxTokens = config.maxTokens,
-                temperature = config.temperature,
-                topP = config.topP,
-                topK = config.topK
-            )
+            // 在子协程中阻塞调用原生生成，外部协程被取消时通知原生层尽快停止
+            val result = coroutineScope {
+                val generation = async(Dispatchers.IO) {
+                    syncConversationState()
+                    pushThermalState()
+                    LlamaCppJNI.generate(
+                        modelHandle = modelHandle,
+                        prompt = prompt,
+                        maxTokens = config.maxTokens,
+                        temperature = config.temperature,
+                        topP = config.topP,
+                        topK = config.topK
+                    )
+                }
+                try {
+                    generation.await()
+                } catch (e: CancellationException) {
+                    LlamaCppJNI.cancelGeneration(modelHandle)
+                    throw e
+                } finally {
+                    markSessionDirty()
+                }
+            }
 
-            // 移除思考标签
-            val filteredResult = removeThinkTags(result)
+            // 停止序列与思考标签已由原生层过滤
+            val filteredResult = result.trimEnd()
 
+            logPromptCacheUsage()
+            recordGenerationStats()
             Log.d(TAG, "Inference completed successfully")
             Result.success(filteredResult)
+        } catch (e: CancellationException) {
+            throw e
         } catch (e: Exception) {
             Log.e(TAG, "Inference failed", e)
             Result.failure(e)
@@ -172,20 +616,104 @@ class LlamaCppInference(
     }
 
     /**
-     * 移除文本中的思考标签
+     * 在后台会话中执行推理（非流式），用于自动标题、摘要等与聊天并行的任务
+     *
+     * 与主对话共享模型权重和上下文，主对话生成期间随其每个解码步合批推进；
+     * 不影响主对话的 KV 缓存复用与生成统计
+     * @param prompt 输入提示词（格式同 infer）
+     * @param maxTokens 最大生成 token 数
+     * @return 推理结果，没有空闲后台会话时失败
      */
-    private fun removeThinkTags(text: String): String {
-        var result = text
-        val thinkPattern = Regex("<think>.*?</think>", RegexOption.DOT_MATCHES_ALL)
-        result = thinkPattern.replace(result, "")
+    suspend fun inferInBackground(prompt: String, maxTokens: Int = config.maxTokens): Result<String> =
+        withContext(Dispatchers.IO) {
+            try {
+                if (!isModelLoaded) {
+                    return@withContext Result.failure(Exception("Model not loaded. Call initialize() first."))
+                }
+
+                if (config.backgroundSessions <= 0) {
+                    return@withContext Result.failure(Exception("Background sessions are disabled (ModelConfig.backgroundSessions = 0)"))
+                }
+                val sessionId = LlamaCppJNI.createSession(modelHandle)
+                if (sessionId < 0) {
+                    return@withContext Result.failure(Exception("No free background session"))
+                }
+
+                try {
+                    val submitted = LlamaCppJNI.submitSession(
+                        modelHandle = modelHandle,
+                        sessionId = sessionId,
+                        prompt = prompt,
+                        maxTokens = maxTokens,
+                        temperature = config.temperature,
+                        topP = config.topP,
+                        topK = config.topK
+                    )
+                    if (!submitted) {
+                        return@withContext Result.failure(
+                            Exception("Background prompt exceeds ${config.sessionContextLength} tokens")
+                        )
+                    }
 
-        // 如果有未闭合的 <think> 标签，移除从该标签到末尾的所有内容
-        val unclosedThinkIndex = result.indexOf("<think>")
-        if (unclosedThinkIndex != -1) {
-            result = result.substring(0, unclosedThinkIndex)
+                    // 外部协程被取消时释放会话，阻塞中的 runSession 随即返回 null
+                    val result = coroutineScope {
+                        val run = async(Dispatchers.IO) { LlamaCppJNI.runSession(modelHandle, sessionId) }
+                        try {
+                            run.await()
+                        } catch (e: CancellationException) {
+                            LlamaCppJNI.releaseSession(modelHandle, sessionId)
+                            throw e
+                        }
+                    }
+
+                    result?.let { Result.success(it.trimEnd()) }
+                        ?: Result.failure(Exception("Background session was released"))
+                } finally {
+                    LlamaCppJNI.releaseSession(modelHandle, sessionId)
+                }
+            } catch (e: CancellationException) {
+                throw e
+            } catch (e: Exception) {
+                Log.e(TAG, "Background inference failed", e)
+                Result.failure(e)
+            }
+        }
+
+    /**
+     * 取消当前正在进行的推理（非流式与流式均适用）
+     */
+    fun cancelGeneration() {
+        if (modelHandle != 0L) {
+            LlamaCppJNI.cancelGeneration(modelHandle)
         }
+    }
 
-        return result.trim()
+    /**
+     * 记录最近一次请求的 KV 缓存前缀复用情况
+     */
+    private fun logPromptCacheUsage() {
+        val promptTokens = LlamaCppJNI.getLastPromptTokenCount(modelHandle)
+        val reusedTokens = LlamaCppJNI.getLastReusedTokenCount(modelHandle)
+        val hitRate = if (promptTokens > 0) reusedTokens * 100 / promptTokens else 0
+        Log.d(TAG, "Prompt cache: reused $reusedTokens / $promptTokens tokens ($hitRate%)")
+    }
+
+    /**
+     * 读取原生层记录的最近一次生成统计
+     */
+    private fun recordGenerationStats() {
+        val stats = GenerationStats.fromArray(LlamaCppJNI.getLastGenerationStats(modelHandle))
+        _lastGenerationStats.value = stats
+        if (stats.discardedTokens > 0) {
+            Log.i(TAG, "Context window full: discarded ${stats.discardedTokens} oldest tokens " +
+                "(${stats.contextShifts} shifts during generation)")
+        }
+        Log.d(
+            TAG,
+            "Generation stats: TTFT ${stats.timeToFirstTokenMs} ms, " +
+                "prefill ${stats.prefillTokensPerSecond} tok/s, decode ${stats.decodeTokensPerSecond} tok/s, " +
+                "governor ${stats.governorMode}"
+        )
     }
 
     /**
@@ -199,108 +727,70 @@ class LlamaCppInference(
         }
 
         Log.d(TAG, "Starting streaming inference with prompt: ${prompt.take(50)}...")
+        _prefillProgress.value = 0f
 
-        // 用于累积完整响应，以便检测和移除思考标签
-        val fullResponse = StringBuilder()
-        // 标记是否在思考标签内
-        var inThinkTag = false
-        // 缓存可能不完整的标签
-        var tagBuffer = StringBuilder()
+        // 原生生成是否已自行结束（完成或出错）
+        val generationFinished = AtomicBoolean(false)
 
         val callback = object : StreamCallback {
-            override fun onToken(token: String) {
-                // 处理思考标签过滤
-                tagBuffer.append(token)
-                val bufferedText = tagBuffer.toString()
-
-                // 检查是否包含完整的<think>开始标签
-                if (!inThinkTag && bufferedText.contains("<think>")) {
-                    val thinkIndex = bufferedText.indexOf("<think>")
-                    // 发送<think>之前的内容
-                    if (thinkIndex > 0) {
-                        val beforeThink = bufferedText.substring(0, thinkIndex)
-                        trySend(beforeThink)
-                    }
-                    inThinkTag = true
-                    tagBuffer = StringBuilder(bufferedText.substring(thinkIndex + 7))
-                    return
-                }
+            override fun onText(offset: Int, length: Int) {
+                // 原生层只交付可见文本（停止序列和 <think> 片段已过滤），且不会拆开多字节字符
+                trySend(streamBuffer.read(offset, length))
+            }
 
-                // 检查是否包含完整的</think>结束标签
-                if (inThinkTag && bufferedText.contains("</think>")) {
-                    val endIndex = bufferedText.indexOf("</think>")
-                    inThinkTag = false
-                    tagBuffer = StringBuilder(bufferedText.substring(endIndex + 8))
-                    // 继续处理剩余内容
-                    if (tagBuffer.isNotEmpty()) {
-                        trySend(tagBuffer.toString())
-                        tagBuffer = StringBuilder()
-                    }
-                    return
-                }
-
-                // 如果不在思考标签内，检查是否有可能的未完成标签
-                if (!inThinkTag) {
-                    // 检查是否可能是未完成的<think>标签
-                    if (bufferedText.endsWith("<") ||
-                        bufferedText.endsWith("<t") ||
-                        bufferedText.endsWith("<th") ||
-                        bufferedText.endsWith("<thi") ||
-                        bufferedText.endsWith("<thin") ||
-                        bufferedText.endsWith("<think")) {
-                        // 保持在缓冲区，等待更多内容
-                        return
-                    }
-                    // 安全发送内容
-                    trySend(bufferedText)
-                    tagBuffer = StringBuilder()
-                } else {
-                    // 在思考标签内，检查是否可能是未完成的</think>标签
-                    if (bufferedText.contains("<")) {
-                        // 可能是</think>的开始，继续缓存
-                        return
-                    }
-                    // 在思考标签内的内容不发送
-                    tagBuffer = StringBuilder()
+            override fun onPrefillProgress(processed: Int, total: Int) {
+                if (total > 0) {
+                    _prefillProgress.value = processed.toFloat() / total
                 }
             }
 
             override fun onComplete() {
-                // 发送缓冲区剩余内容（如果不在思考标签内）
-                if (!inThinkTag && tagBuffer.isNotEmpty()) {
-                    val remaining = tagBuffer.toString()
-                    // 最终过滤可能残留的标签
-                    val filtered = removeThinkTags(remaining)
-                    if (filtered.isNotEmpty()) {
-                        trySend(filtered)
-                    }
-                }
+                logPromptCacheUsage()
+                recordGenerationStats()
                 Log.d(TAG, "Streaming inference completed")
+                generationFinished.set(true)
                 close()
             }
 
             override fun onError(error: String) {
                 Log.e(TAG, "Streaming inference error: $error")
+                generationFinished.set(true)
                 close(Exception(error))
             }
         }
 
-        try {
-            LlamaCppJNI.generateStream(
-                modelHandle = modelHandle,
-                prompt = prompt,
-                maxTokens = config.maxTokens,
-                temperature = config.temperature,
-                topP = config.topP,
-                topK = config.topK,
-                callback = callback
-            )
-        } catch (e: Exception) {
-            Log.e(TAG, "Streaming inference failed", e)
-            close(e)
+        // 在子协程中运行阻塞的原生生成，使 awaitClose 能在收集方取消时及时执行
+        launch(Dispatchers.IO) {
+            try {
+                syncConversationState()
+                pushThermalState()
+                LlamaCppJNI.generateStream(
+                    modelHandle = modelHandle,
+                    prompt = prompt,
+                    maxTokens = config.maxTokens,
+                    temperature = config.temperature,
+                    topP = config.topP,
+                    topK = config.topK,
+                    buffer = streamBuffer.buffer,
+                    flushTokens = config.streamFlushTokens,
+                    flushIntervalMs = config.streamFlushIntervalMs,
+                    callback = callback
+                )
+            } catch (e: Exception) {
+                Log.e(TAG, "Streaming inference failed", e)
+                generationFinished.set(true)
+                close(e)
+            } finally {
+                markSessionDirty()
+            }
         }
 
         awaitClose {
+            // 收集方提前关闭（停止/离开界面）时，让原生层停止解码
+            if (!generationFinished.get()) {
+                Log.d(TAG, "Stream closed before generation finished, cancelling")
+                LlamaCppJNI.cancelGeneration(modelHandle)
+            }
             Log.d(TAG, "Stream channel closed")
         }
     }
@@ -371,6 +861,14 @@ class LlamaCppInference(
     fun release() {
         try {
             if (modelHandle != 0L) {
+                // 保存当前对话的 KV 状态，下次启动后可直接恢复
+                if (config.persistSessionState) {
+                    synchronized(sessionLock) {
+                        activeConversationId?.let { saveSessionLocked(it) }
+                        activeConversationId = null
+                    }
+                }
+                thermalMonitor.stop()
                 LlamaCppJNI.freeModel(modelHandle)
                 modelHandle = 0
                 isModelLoaded = false
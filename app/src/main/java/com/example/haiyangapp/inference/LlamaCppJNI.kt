@@ -1,5 +1,7 @@
 package com.example.haiyangapp.inference
 
+import java.nio.ByteBuffer
+
 /**
  * llama.cpp JNI 接口
  * 负责调用原生 C++ 代码
@@ -38,17 +40,33 @@ object LlamaCppJNI {
      *
      * @param modelPath 模型文件路径
      * @param contextSize 上下文大小
-     * @param threads CPU 线程数
+     * @param threads 解码线程数，<= 0 表示按性能核数自动选择
+     * @param batchThreads 预填充线程数，<= 0 表示使用全部性能核
      * @param useGpu 是否尝试使用 GPU
-     * @param gpuLayers GPU 层数 (-1 表示全部层)
+     * @param gpuLayers GPU 层数 (-1 表示显存预算内尽量多放)
+     * @param batchSize 预填充批大小，提示词按此大小分批解码 (<= 0 使用默认值)
+     * @param kvCacheType KV 缓存的 ggml_type（见 KvCacheType），< 0 表示默认 (F16)
+     * @param flashAttention Flash Attention：-1 自动，0 关闭，1 开启（量化 KV 在自动时强制开启）
+     * @param parallelSessions 后台会话数，每个会话占用共享上下文中的一个序列（0 表示不启用）
+     * @param sessionContextSize 每个后台会话的上下文大小，KV 缓存总长为 contextSize + 会话数 × 该值
+     * @param promptCacheSlots 提示词前缀快照数，每个快照占用一个序列（0 表示不启用）
+     * @param promptCacheTokens 所有快照合计可占用的 token 数，KV 缓存总长再加上该值
      * @return 模型句柄
      */
     external fun initModelWithGpu(
         modelPath: String,
         contextSize: Int,
         threads: Int,
+        batchThreads: Int,
         useGpu: Boolean,
-        gpuLayers: Int
+        gpuLayers: Int,
+        batchSize: Int,
+        kvCacheType: Int,
+        flashAttention: Int,
+        parallelSessions: Int,
+        sessionContextSize: Int,
+        promptCacheSlots: Int,
+        promptCacheTokens: Int
     ): Long
 
     /**
@@ -65,6 +83,179 @@ object LlamaCppJNI {
      */
     external fun getGpuLayers(modelHandle: Long): Int
 
+    /**
+     * 获取主模型的内存占用（权重与 KV 缓存）
+     * @param modelHandle 模型句柄
+     * @return [权重字节, KV 缓存字节, K 类型, V 类型, Flash Attention, n_ctx]，用 MemoryUsage.fromArray 解析
+     */
+    external fun getMemoryUsage(modelHandle: Long): LongArray?
+
+    /**
+     * 响应系统内存压力：释放上下文（KV 缓存与计算缓冲区，下次请求时按原参数重建）
+     * SEVERE 级别还会让内核回收已映射的权重文件页，之后按需从文件重新读入
+     * @param modelHandle 模型句柄
+     * @param level MemoryTrimLevel.nativeLevel
+     * @return [上下文释放字节, 权重页释放字节]（常驻内存差值），正在推理时返回 null
+     */
+    external fun trimMemory(modelHandle: Long, level: Int): LongArray?
+
+    /**
+     * 当前进程的常驻内存（/proc/self/statm），用于衡量释放效果
+     */
+    external fun getResidentMemoryBytes(): Long
+
+    /**
+     * 加载后预热（阻塞，需在后台线程调用）：预读映射的权重页，再做一次极小的预填充和解码，
+     * 把 GPU 管线编译、缺页和线程池启动的开销从第一条用户消息中移走
+     *
+     * cancelWarmup 或有生成请求到来时尽快返回，剩余开销由该请求承担
+     *
+     * @param modelHandle 模型句柄
+     * @param callback 进度回调，可为 null
+     * @return 完整完成返回 true，耗时用 getWarmupStats 读取
+     */
+    external fun warmupModel(modelHandle: Long, callback: WarmupCallback?): Boolean
+
+    /**
+     * 请求停止进行中的预热，可在任意线程调用
+     */
+    external fun cancelWarmup(modelHandle: Long)
+
+    /**
+     * 获取最近一次预热的统计，可在任意线程调用（预热进行中返回 RUNNING 状态）
+     * @return [状态, 预读耗时, 预读字节, 预热解码耗时, 总耗时]（微秒），用 WarmupStats.fromArray 解析
+     */
+    external fun getWarmupStats(modelHandle: Long): LongArray
+
+    /**
+     * 枚举 ggml 注册的 GPU 设备
+     * @return 每个设备一项 "名称\t描述\t可用显存\t总显存"，用 GpuDevice.parse 解析
+     */
+    external fun getGpuDevices(): Array<String>
+
+    /**
+     * 实测不同 GPU 层数下的解码速度（每个候选都会重新加载模型，耗时较长）
+     *
+     * 候选为 0 层以及显存预算内最大层数的 1/4、1/2、3/4 和全部
+     *
+     * @param modelPath 模型文件路径
+     * @param contextSize 上下文大小（与正式加载一致，才能暴露创建上下文时的显存不足）
+     * @param batchSize 预填充批大小
+     * @param generateTokens 每个候选计时的解码 token 数
+     * @return [层数, 每 token 微秒] × 候选数，失败的候选耗时为 -1；没有 GPU 设备时返回 null
+     */
+    external fun calibrateGpuLayers(
+        modelPath: String,
+        contextSize: Int,
+        batchSize: Int,
+        generateTokens: Int
+    ): LongArray?
+
+    // ============================================
+    // 线程数设置
+    // ============================================
+
+    /**
+     * 获取性能核的 CPU 编号
+     *
+     * 原生层按 /sys/devices/system/cpu/cpuN/cpufreq 的最高频率区分大小核，
+     * 最低频簇以外的核心视为性能核；各核频率一致时返回全部核心
+     */
+    external fun getPerformanceCores(): IntArray
+
+    /**
+     * 设置解码 / 预填充线程数并重建绑定在性能核上的线程池，不能与生成并发调用
+     *
+     * @param modelHandle 模型句柄
+     * @param threads 解码线程数，<= 0 表示自动选择
+     * @param batchThreads 预填充线程数，<= 0 表示自动选择
+     */
+    external fun setThreadCounts(modelHandle: Long, threads: Int, batchThreads: Int)
+
+    /**
+     * 获取当前线程数
+     * @return [解码线程数, 预填充线程数]
+     */
+    external fun getThreadCounts(modelHandle: Long): IntArray
+
+    /**
+     * 获取最近一次生成请求的提示词 token 数
+     * @param modelHandle 模型句柄
+     * @return 提示词 token 数
+     */
+    external fun getLastPromptTokenCount(modelHandle: Long): Int
+
+    /**
+     * 获取最近一次生成请求从 KV 缓存复用的前缀 token 数
+     *
+     * 原生层会记住上下文中已有的 token，新提示词与之做最长公共前缀匹配，
+     * 只解码分歧之后的部分
+     *
+     * @param modelHandle 模型句柄
+     * @return 复用的 token 数，0 表示完全重新预填充
+     */
+    external fun getLastReusedTokenCount(modelHandle: Long): Int
+
+    /**
+     * 获取最近一次已结束的 generate / generateStream 的性能统计，可在任意线程调用
+     *
+     * @param modelHandle 模型句柄
+     * @return 扁平数组，用 GenerationStats.fromArray 解析
+     */
+    external fun getLastGenerationStats(modelHandle: Long): LongArray
+
+    // ============================================
+    // 推理调速
+    // ============================================
+
+    /**
+     * 更新设备温控状态，原生调速器据此（结合单 token 解码延迟）选择 GovernorMode，可在任意线程调用
+     *
+     * @param modelHandle 模型句柄
+     * @param thermalStatus PowerManager.THERMAL_STATUS_*，API 29 以下传 0
+     * @param thermalHeadroom PowerManager.getThermalHeadroom，未知时传负数
+     * @param powerSave 是否处于省电模式
+     */
+    external fun setDeviceThermalState(
+        modelHandle: Long,
+        thermalStatus: Int,
+        thermalHeadroom: Float,
+        powerSave: Boolean
+    )
+
+    /**
+     * 启用 / 关闭推理调速器
+     */
+    external fun setGovernorEnabled(modelHandle: Long, enabled: Boolean)
+
+    /**
+     * 设置超出上下文时的滑动窗口
+     *
+     * 开启后提示词过长时保留开头的固定部分、丢弃其后最早的轮次；生成中写满时通过 KV 位置平移滑动，
+     * 不需要重新预填充。会等待进行中的生成结束后再生效，不要在主线程调用
+     *
+     * @param enabled 关闭后超出 contextSize 的请求直接失败
+     * @param keepTokens 固定在窗口开头的 token 数，< 0 表示自动固定系统提示词
+     */
+    external fun setContextShift(modelHandle: Long, enabled: Boolean, keepTokens: Int)
+
+    /**
+     * 设置输出过滤规则：原生层增量匹配，只把用户可见的文本交给 generate 结果和 onText 回调
+     *
+     * 可在任意线程调用：会等待进行中的生成和后台会话调度步结束后再替换，对之后的解码生效。
+     * 生成期间会阻塞，不要在主线程调用
+     *
+     * @param stopSequences 停止序列，出现即停止生成，序列本身不输出
+     * @param hiddenOpen 隐藏片段开始标记（如 "<think>"），与 hiddenClose 按下标对应
+     * @param hiddenClose 隐藏片段结束标记（如 "</think>"），未闭合时隐藏到结尾
+     */
+    external fun setOutputFilter(
+        modelHandle: Long,
+        stopSequences: Array<String>,
+        hiddenOpen: Array<String>,
+        hiddenClose: Array<String>
+    )
+
     /**
      * 生成文本
      * @param modelHandle 模型句柄
@@ -73,7 +264,7 @@ object LlamaCppJNI {
      * @param temperature 温度参数
      * @param topP top-p 采样参数
      * @param topK top-k 采样参数
-     * @return 生成的文本
+     * @return 生成的文本（已按 setOutputFilter 去掉停止序列与隐藏片段）
      */
     external fun generate(
         modelHandle: Long,
@@ -92,6 +283,9 @@ object LlamaCppJNI {
      * @param temperature 温度参数
      * @param topP top-p 采样参数
      * @param topK top-k 采样参数
+     * @param buffer 与原生层共享的 direct ByteBuffer（见 TokenStreamBuffer），可见文本写入其中
+     * @param flushTokens 每累计多少个 token 交付一次 (<= 0 使用默认值 4)
+     * @param flushIntervalMs 距上次交付超过多少毫秒时交付 (< 0 使用默认值 50)
      * @param callback 流式回调接口
      */
     external fun generateStream(
@@ -101,15 +295,225 @@ object LlamaCppJNI {
         temperature: Float,
         topP: Float,
         topK: Int,
+        buffer: ByteBuffer,
+        flushTokens: Int,
+        flushIntervalMs: Int,
         callback: StreamCallback
     )
 
+    /**
+     * 请求取消当前正在进行的 generate / generateStream，以及已调用但仍在等锁的请求
+     *
+     * 原生层在每个解码步骤和预填充批次之间检查取消标记，
+     * 并通过 abort 回调中断进行中的 llama_decode；排队中的请求拿到锁后直接按已取消处理，
+     * 之后才调用的请求不受影响。可在任意线程调用。
+     *
+     * @param modelHandle 模型句柄
+     */
+    external fun cancelGeneration(modelHandle: Long)
+
+    // ============================================
+    // 会话 KV 状态持久化
+    // ============================================
+
+    /**
+     * 获取 KV 缓存中已有的 token 数
+     *
+     * @param modelHandle 模型句柄
+     */
+    external fun getCachedTokenCount(modelHandle: Long): Int
+
+    /**
+     * 将当前 KV 缓存（序列 0）连同其 token 列表保存到文件
+     *
+     * @param modelHandle 模型句柄
+     * @param path 会话状态文件路径
+     * @return 写入的字节数，0 表示失败或缓存为空
+     */
+    external fun saveSessionState(modelHandle: Long, path: String): Long
+
+    /**
+     * 从文件恢复 KV 缓存和 token 列表，之后的请求只需预填充与其分歧的部分
+     *
+     * @param modelHandle 模型句柄
+     * @param path 会话状态文件路径
+     * @return 恢复的 token 数，失败返回 -1（缓存被清空）
+     */
+    external fun loadSessionState(modelHandle: Long, path: String): Int
+
+    /**
+     * 固定系统提示词：之后预填充经过这段前缀时保存为快照（不参与 LRU 淘汰），
+     * 切换对话或注入不同知识块后从快照恢复，只需预填充之后的部分。调用本身不解码
+     *
+     * @param modelHandle 模型句柄（需以 promptCacheSlots > 0 初始化）
+     * @param prompt 格式化后的 ChatML 系统提示词块，null 表示取消固定
+     * @return 系统提示词的 token 数，未启用提示词快照时返回 -1
+     */
+    external fun pinSystemPrompt(modelHandle: Long, prompt: String?): Int
+
+    // ============================================
+    // LoRA 适配器
+    // ============================================
+
+    /**
+     * 加载 LoRA 适配器并挂到已加载的基础模型上，不复制基础权重，加载后默认不启用
+     *
+     * @param modelHandle 模型句柄
+     * @param path 适配器 GGUF 路径（需基于同一个基础模型训练）
+     * @return 适配器编号，失败返回 -1
+     */
+    external fun loadLoraAdapter(modelHandle: Long, path: String): Int
+
+    /**
+     * 设置主对话或后台会话的适配器缩放
+     *
+     * 适配器作用于整个上下文，缩放不同的后台会话不与主对话合批，等上下文空闲时再推进；
+     * 主对话的缩放改变时清空序列 0 的 KV 缓存和提示词快照
+     *
+     * @param modelHandle 模型句柄
+     * @param sessionId 0 表示主对话，否则为 createSession 返回的会话 ID（需未在运行）
+     * @param adapterId loadLoraAdapter 返回的编号
+     * @param scale 缩放，0 表示停用
+     * @return 参数无效或会话正在运行时返回 false
+     */
+    external fun setLoraAdapter(modelHandle: Long, sessionId: Int, adapterId: Int, scale: Float): Boolean
+
+    // ============================================
+    // 后台会话（与主对话并行生成）
+    // ============================================
+
+    /**
+     * 分配一个后台会话，用于自动标题、摘要等与聊天并行的任务
+     *
+     * 会话与主对话共享模型权重和 KV 缓存，各占一个序列；主对话生成期间，
+     * 后台会话的 token 与主对话的每个解码步合批解码，不需要第二份模型
+     *
+     * @param modelHandle 模型句柄（需以 parallelSessions > 0 初始化）
+     * @return 会话 ID，没有空闲会话时返回 -1
+     */
+    external fun createSession(modelHandle: Long): Int
+
+    /**
+     * 向空闲会话提交生成请求（参数同 generate），结果通过 runSession 取回
+     *
+     * @return 会话不可用或提示词超出 sessionContextSize 时返回 false
+     */
+    external fun submitSession(
+        modelHandle: Long,
+        sessionId: Int,
+        prompt: String,
+        maxTokens: Int,
+        temperature: Float,
+        topP: Float,
+        topK: Int
+    ): Boolean
+
+    /**
+     * 阻塞直到会话生成结束，应在后台线程调用；上下文空闲时由调用线程推进所有后台会话
+     *
+     * @return 生成结果，会话未提交或被释放时返回 null
+     */
+    external fun runSession(modelHandle: Long, sessionId: Int): String?
+
+    /**
+     * 释放会话，进行中的生成被放弃，阻塞在 runSession 上的调用返回 null
+     */
+    external fun releaseSession(modelHandle: Long, sessionId: Int)
+
+    // ============================================
+    // 投机解码相关方法
+    // ============================================
+
+    /**
+     * 为主模型加载投机解码草稿模型
+     *
+     * 草稿模型每步起草 draftLength 个 token，主模型在一次批量解码中验证，
+     * 接受与自身采样一致的前缀。草稿模型必须与主模型共享词表。
+     *
+     * @param modelHandle 主模型句柄
+     * @param draftModelPath 草稿模型文件路径
+     * @param contextSize 上下文大小（应与主模型一致）
+     * @param threads CPU 线程数
+     * @param draftLength 每步起草的 token 数
+     * @return 是否加载成功（词表不兼容时返回 false）
+     */
+    external fun initDraftModel(
+        modelHandle: Long,
+        draftModelPath: String,
+        contextSize: Int,
+        threads: Int,
+        draftLength: Int
+    ): Boolean
+
+    /**
+     * 设置每步起草的 token 数
+     * @param modelHandle 主模型句柄
+     * @param draftLength 起草长度，0 表示暂时关闭投机解码
+     */
+    external fun setDraftLength(modelHandle: Long, draftLength: Int)
+
+    /**
+     * 获取投机解码统计
+     * @param modelHandle 主模型句柄
+     * @return [起草长度, 验证步数, 起草 token 数, 接受 token 数]
+     */
+    external fun getSpeculativeStats(modelHandle: Long): LongArray
+
+    /**
+     * 释放草稿模型，之后回到普通解码
+     * @param modelHandle 主模型句柄
+     */
+    external fun freeDraftModel(modelHandle: Long)
+
     /**
      * 释放模型资源
      * @param modelHandle 模型句柄
      */
     external fun freeModel(modelHandle: Long)
 
+    // ============================================
+    // 基准测试
+    // ============================================
+
+    /**
+     * 以新的线程数 / 批大小 / KV 缓存类型重建主模型上下文（不重新加载权重），仅供基准测试使用
+     *
+     * @param modelHandle 模型句柄
+     * @param contextSize 上下文大小
+     * @param threads CPU 线程数
+     * @param batchSize 预填充批大小 (<= 0 使用默认值)
+     * @param kvCacheType KV 缓存的 ggml_type（F16 = 1, Q8_0 = 8, Q4_0 = 2），< 0 表示默认
+     * @return 是否重建成功，失败时保留原上下文
+     */
+    external fun benchmarkResetContext(
+        modelHandle: Long,
+        contextSize: Int,
+        threads: Int,
+        batchSize: Int,
+        kvCacheType: Int
+    ): Boolean
+
+    /**
+     * 用随机提示词测量预填充和生成耗时（与 generate 走相同的解码路径和采样链）
+     *
+     * @param modelHandle 模型句柄
+     * @param promptTokens 预填充 token 数
+     * @param generateTokens 生成 token 数（忽略结束符）
+     * @param repetitions 重复轮数
+     * @return [预填充微秒, 生成微秒] × repetitions，失败返回 null
+     */
+    external fun benchmarkGeneration(
+        modelHandle: Long,
+        promptTokens: Int,
+        generateTokens: Int,
+        repetitions: Int
+    ): LongArray?
+
+    /**
+     * 获取 llama.cpp / ggml 的系统特性描述（如 NEON = 1 | DOTPROD = 1 ...）
+     */
+    external fun getSystemInfo(): String
+
     // ============================================
     // 嵌入模型相关方法 (用于知识库 RAG)
     // ============================================
@@ -145,12 +549,201 @@ object LlamaCppJNI {
      */
     external fun getEmbedding(modelHandle: Long, text: String): FloatArray?
 
+    /**
+     * 批量获取多条文本的嵌入向量
+     *
+     * 原生层把多条文本以不同序列打包进同一次 llama_decode，
+     * 比逐条调用 getEmbedding 少得多的前向计算次数
+     *
+     * @param modelHandle 嵌入模型句柄
+     * @param texts 输入文本数组
+     * @return 扁平的归一化嵌入向量 (texts.size * dimension)，失败的文本对应全零行；整体失败返回 null
+     */
+    external fun getEmbeddingsBatch(modelHandle: Long, texts: Array<String>): FloatArray?
+
+    /**
+     * 按 token 分块并批量嵌入
+     *
+     * 整篇文档只在原生层用嵌入词表分词一次，优先在句末标点处切块，每块不超过 maxTokens，
+     * 相邻块按整句保留不超过 overlapTokens 的重叠，块直接走多序列批量解码，中间不产生逐块的 Java 字符串
+     *
+     * @param modelHandle 嵌入模型句柄
+     * @param text 文档全文
+     * @param maxTokens 每块的 token 上限（含特殊 token），<= 0 或超过嵌入上下文时取上下文大小
+     * @param overlapTokens 相邻块的重叠 token 上限
+     * @return 块区间与嵌入，失败返回 null；嵌入失败的块对应全零行
+     */
+    external fun chunkAndEmbed(
+        modelHandle: Long,
+        text: String,
+        maxTokens: Int,
+        overlapTokens: Int
+    ): ChunkEmbeddings?
+
+    /**
+     * 配置嵌入结果缓存（按截断后 token 序列的哈希做 LRU，命中时跳过 llama_decode）
+     *
+     * 模型加载后默认启用 8MB 的纯内存缓存；指定 path 时立即读取已有条目，
+     * 释放模型时写回，维度或模型不一致的旧文件会被忽略
+     *
+     * @param modelHandle 嵌入模型句柄
+     * @param path 持久化文件路径，null 表示只缓存在内存中
+     * @param maxBytes 内存上限（字节），<= 0 关闭缓存
+     * @return 从文件读取的条目数，失败返回 -1
+     */
+    external fun setEmbeddingCache(modelHandle: Long, path: String?, maxBytes: Long): Int
+
+    /**
+     * 获取嵌入缓存统计，可用 [EmbeddingCacheStats.fromArray] 解析
+     *
+     * @param modelHandle 嵌入模型句柄
+     * @return [命中次数, 未命中次数, 条目数, 占用字节数]，句柄无效返回 null
+     */
+    external fun getEmbeddingCacheStats(modelHandle: Long): LongArray?
+
     /**
      * 释放嵌入模型资源
      *
      * @param modelHandle 嵌入模型句柄
      */
     external fun freeEmbeddingModel(modelHandle: Long)
+
+    // ============================================
+    // 知识库向量索引
+    // ============================================
+
+    /**
+     * 打开（或创建）内存映射向量存储文件
+     *
+     * 文件为固定文件头 + 定长行（chunkId / documentId / 向量），启动时直接 mmap，无需反序列化
+     *
+     * @param path 向量文件路径
+     * @param dimension 向量维度，需与嵌入模型一致；<= 0 表示只打开已有文件并沿用其维度
+     * @return 索引句柄，0 表示失败（文件不存在、损坏或维度不匹配）
+     */
+    external fun openVectorIndex(path: String, dimension: Int): Long
+
+    /**
+     * 向存储追加向量（原生层会做 L2 归一化）
+     *
+     * @param indexHandle 索引句柄
+     * @param chunkIds 知识块 ID
+     * @param documentIds 对应的文档 ID
+     * @param vectors 扁平向量数组 (chunkIds.size * dimension)
+     * @param texts 知识块文本，同时增量写入 BM25 倒排索引；null 表示之后用 [vectorIndexSetText] 补建
+     * @return 追加的行数，失败返回 -1
+     */
+    external fun vectorIndexAdd(
+        indexHandle: Long,
+        chunkIds: LongArray,
+        documentIds: LongArray,
+        vectors: FloatArray,
+        texts: Array<String>?
+    ): Int
+
+    /**
+     * 为某个文档的全部向量打墓碑
+     *
+     * @return 标记删除的行数
+     */
+    external fun vectorIndexRemoveDocument(indexHandle: Long, documentId: Long): Int
+
+    /**
+     * 获取存活（未删除）的向量数
+     */
+    external fun vectorIndexSize(indexHandle: Long): Int
+
+    /**
+     * 获取墓碑行数
+     */
+    external fun vectorIndexDeletedCount(indexHandle: Long): Int
+
+    /**
+     * 压缩向量文件：重写存活行到新文件并原子替换
+     *
+     * @return 回收的行数，失败返回 -1
+     */
+    external fun vectorIndexCompact(indexHandle: Long): Int
+
+    /**
+     * Top-K 余弦相似度检索，只返回知识块 ID 和分数
+     *
+     * 量化模式下先用 int8 点积 / 二值汉明距离在内存镜像上粗排，再对候选用 float 向量精排；
+     * 向量数达到阈值后原生层会增量训练 IVF 索引（持久化在向量文件旁），按 nprobe 只扫描最近的若干簇
+     *
+     * @param indexHandle 索引句柄
+     * @param query 查询向量
+     * @param topK 返回的最大结果数
+     * @param minScore 最低相似度阈值（作用于精确相似度）
+     * @param documentIds 文档 ID 过滤集合，null 表示检索全部
+     * @param quantization 量化模式，取 VectorQuantization.ordinal
+     * @param rescoreCandidates 量化粗排保留的候选数
+     * @param nprobe IVF 近似检索探测的簇数，<= 0 表示精确扫描（向量数较少、尚未训练 IVF 时也是精确扫描）
+     * @param outChunkIds 输出：知识块 ID（长度至少为 topK）
+     * @param outScores 输出：相似度分数（长度至少为 topK）
+     * @return 结果数（按相似度降序写入输出数组），失败返回 -1
+     */
+    external fun vectorIndexSearch(
+        indexHandle: Long,
+        query: FloatArray,
+        topK: Int,
+        minScore: Float,
+        documentIds: LongArray?,
+        quantization: Int,
+        rescoreCandidates: Int,
+        nprobe: Int,
+        outChunkIds: LongArray,
+        outScores: FloatArray
+    ): Int
+
+    /**
+     * 混合检索：向量 Top-N 与 BM25 关键词 Top-N 在原生层用倒数排名融合 (RRF) 合并
+     *
+     * BM25 倒排索引随 vectorIndexAdd 增量更新（拉丁词 / 中日韩二元分词），持久化在向量文件旁；
+     * 只命中关键词（型号、人名等）而向量相似度不足 minScore 的知识块也能进入结果
+     *
+     * @param queryText 原始查询文本，null 时只有向量一路
+     * @param candidates 每一路保留的候选数
+     * @param rrfK RRF 平滑常数
+     * @param outScores 输出：融合分数，已归一化到 (0, 1]（两路都排第一为 1）
+     * 其余参数与 [vectorIndexSearch] 相同
+     * @return 结果数（按融合分数降序写入输出数组），失败返回 -1
+     */
+    external fun vectorIndexHybridSearch(
+        indexHandle: Long,
+        query: FloatArray,
+        queryText: String?,
+        topK: Int,
+        minScore: Float,
+        documentIds: LongArray?,
+        quantization: Int,
+        rescoreCandidates: Int,
+        nprobe: Int,
+        candidates: Int,
+        rrfK: Int,
+        outChunkIds: LongArray,
+        outScores: FloatArray
+    ): Int
+
+    /**
+     * 列出尚未建立 BM25 文本索引的存活知识块
+     *
+     * @param maxCount 最多返回的个数
+     * @return 知识块 ID
+     */
+    external fun vectorIndexMissingText(indexHandle: Long, maxCount: Int): LongArray?
+
+    /**
+     * 为已有知识块补建 BM25 文本索引
+     *
+     * @return 建立索引的行数，失败返回 -1
+     */
+    external fun vectorIndexSetText(indexHandle: Long, chunkIds: LongArray, texts: Array<String>): Int
+
+    /**
+     * 关闭向量存储（同步落盘并解除映射）
+     */
+    external fun freeVectorIndex(indexHandle: Long)
 }
 
 /**
@@ -158,10 +751,19 @@ object LlamaCppJNI {
  */
 interface StreamCallback {
     /**
-     * 每生成一个token时调用
-     * @param token 生成的token文本
+     * 有新的可见文本写入共享缓冲区时调用（经 setOutputFilter 过滤，按 flushTokens / flushIntervalMs 批量交付）
+     * 需在回调内用 TokenStreamBuffer.read(offset, length) 读取，返回后该区域可能被覆盖
+     * @param offset 文本在缓冲区中的起始位置
+     * @param length 字节数（完整的 UTF-8 码点）
      */
-    fun onToken(token: String)
+    fun onText(offset: Int, length: Int)
+
+    /**
+     * 提示词预填充进度（每解码完一批调用一次）
+     * @param processed 已处理的提示词 token 数（含复用的缓存前缀）
+     * @param total 提示词总 token 数
+     */
+    fun onPrefillProgress(processed: Int, total: Int) {}
 
     /**
      * 生成完成时调用
@@ -174,3 +776,15 @@ interface StreamCallback {
      */
     fun onError(error: String)
 }
+
+/**
+ * 模型预热进度回调（在调用 warmupModel 的线程上同步调用）
+ */
+interface WarmupCallback {
+    /**
+     * @param stage 0 预读权重页（done / total 为字节数），1 预热解码（0 / 1 开始，1 / 1 结束）
+     * @param done 已完成量
+     * @param total 总量
+     */
+    fun onProgress(stage: Int, done: Long, total: Long)
+}
@@ -0,0 +1,101 @@
+package com.example.haiyangapp.inference
+
+import android.content.Context
+import android.content.res.AssetFileDescriptor
+import android.util.Log
+import java.io.File
+import java.io.FileNotFoundException
+import java.io.FileOutputStream
+import java.io.IOException
+
+/**
+ * assets 中 GGUF 模型的访问工具
+ *
+ * llama.cpp 只能按路径从文件起点映射 GGUF，APK 内的资源总在非零偏移处，因此模型需要复制到内部存储。
+ * GGUF 在 APK 中以不压缩方式存放（见 build.gradle.kts 的 noCompress），可以拿到 (fd, offset, length)，
+ * 复制走 FileChannel.transferTo，由内核完成而不经过 Java 堆缓冲
+ *
+ * 复制先写入临时文件再改名，中途被杀不会留下看似完整的截断文件
+ */
+object ModelAssets {
+    private const val TAG = "ModelAssets"
+    private const val PARTIAL_SUFFIX = ".partial"
+    private const val STAMP_SUFFIX = ".stamp"
+
+    /**
+     * 打开不压缩存放的 asset，资源被压缩或不存在时返回 null
+     */
+    fun openFd(context: Context, assetPath: String): AssetFileDescriptor? {
+        return try {
+            context.assets.openFd(assetPath)
+        } catch (e: FileNotFoundException) {
+            // 资源被压缩时 openFd 同样抛出 FileNotFoundException
+            null
+        }
+    }
+
+    /**
+     * 确保 asset 已复制到目标文件：不压缩的资源按长度判断是否最新，
+     * 压缩的资源拿不到可靠长度，按安装包的更新时间（记录在旁边的 .stamp 文件中）判断
+     *
+     * @return 目标文件
+     */
+    fun copyToFile(context: Context, assetPath: String, target: File): File {
+        target.parentFile?.let { if (!it.exists()) it.mkdirs() }
+        val partial = File(target.path + PARTIAL_SUFFIX)
+
+        val afd = openFd(context, assetPath)
+        if (afd == null) {
+            val stampFile = File(target.path + STAMP_SUFFIX)
+            val stamp = packageStamp(context)
+            if (target.exists() && stampFile.exists() && stampFile.readText() == stamp) {
+                Log.d(TAG, "Model file already exists: ${target.absolutePath}")
+                return target
+            }
+
+            Log.d(TAG, "Streaming compressed asset $assetPath to ${target.absolutePath}")
+            context.assets.open(assetPath).use { input ->
+                FileOutputStream(partial).use { output -> input.copyTo(output) }
+            }
+            commit(partial, target)
+            stampFile.writeText(stamp)
+            return target
+        }
+
+        afd.use {
+            if (target.exists() && target.length() == it.length) {
+                Log.d(TAG, "Model file already exists: ${target.absolutePath}")
+                return target
+            }
+
+            Log.d(TAG, "Copying $assetPath (${it.length} bytes) to ${target.absolutePath}")
+            it.createInputStream().channel.use { source ->
+                FileOutputStream(partial).channel.use { dest ->
+                    // transferTo 的位置是整个 APK 文件内的绝对偏移
+                    var copied = 0L
+                    while (copied < it.length) {
+                        val n = source.transferTo(it.startOffset + copied, it.length - copied, dest)
+                        if (n <= 0) break
+                        copied += n
+                    }
+                    if (copied != it.length) {
+                        throw IOException("Copied $copied of ${it.length} bytes of $assetPath")
+                    }
+                }
+            }
+            commit(partial, target)
+        }
+        return target
+    }
+
+    // 应用更新后 assets 可能已变化，以安装包的更新时间作为压缩资源副本的版本
+    private fun packageStamp(context: Context): String =
+        context.packageManager.getPackageInfo(context.packageName, 0).lastUpdateTime.toString()
+
+    private fun commit(partial: File, target: File) {
+        if (!partial.renameTo(target)) {
+            partial.delete()
+            throw IOException("Failed to move ${partial.absolutePath} to ${target.absolutePath}")
+        }
+    }
+}
@@ -10,16 +10,87 @@ data class ModelConfig(
      */
     val modelPath: String = "qwen3-lora-merged-q4_k_m.gguf",
 
+    /**
+     * LoRA 适配器（assets中的相对路径），运行时挂到 modelPath 的基础模型上，null 表示不启用
+     * 启用时 modelPath 指向基础模型（如 Qwen3-0.6B-Q8_0.gguf），不必再打包合并后的完整模型
+     */
+    val loraAdapterPath: String? = null,
+
+    /**
+     * 主对话和后台会话使用的 LoRA 缩放，0 表示加载但不启用
+     */
+    val loraScale: Float = 1.0f,
+
     /**
      * 上下文长度（token数量）
      */
     val contextLength: Int = 2048,
 
+    /**
+     * 对话超出上下文长度时是否滑动窗口：固定系统提示词，丢弃最早的轮次并平移 KV 位置，
+     * 长对话每轮开销保持稳定，而不是解码失败
+     */
+    val contextShift: Boolean = true,
+
+    /**
+     * 滑动时固定在窗口开头的 token 数，-1 表示自动固定系统提示词
+     */
+    val contextKeepTokens: Int = -1,
+
+    /**
+     * 后台会话数：自动标题、摘要等任务与聊天共享同一份模型权重，
+     * 在同一上下文的独立序列中与主对话合批解码，0 表示不启用
+     *
+     * 默认关闭：每个会话的 KV 缓存在加载时按 sessionContextLength 额外分配
+     * （Qwen3-0.6B F16 下每 1024 token 约 112 MB），且主对话每步注意力都要扫描更大的统一 KV 缓存
+     */
+    val backgroundSessions: Int = 0,
+
+    /**
+     * 每个后台会话的上下文长度，KV 缓存额外占用 backgroundSessions × 该值个 token
+     */
+    val sessionContextLength: Int = 1024,
+
+    /**
+     * 提示词前缀快照数：系统提示词及注入知识块后的系统提示词按 LRU 保存在 KV 缓存的独立序列中，
+     * 切换对话或后台会话之后不必重新预填充，0 表示不启用（pinSystemPrompt 随之不生效）
+     *
+     * 默认关闭：启用后 KV 缓存在加载时额外分配 promptCacheTokens 个 token，
+     * 即使从未固定系统提示词也一直占用
+     */
+    val promptCacheSlots: Int = 0,
+
+    /**
+     * 所有提示词快照合计可占用的 token 数，仅 promptCacheSlots > 0 时分配
+     * （KV 缓存额外占用该值个 token，Qwen3-0.6B F16 下每 1024 token 约 112 MB）
+     */
+    val promptCacheTokens: Int = 2048,
+
     /**
      * 每次生成的最大token数
      */
     val maxTokens: Int = 512,
 
+    /**
+     * 停止序列：生成文本出现任一序列即停止（序列本身不输出）
+     */
+    val stopSequences: List<String> = listOf("<|im_end|>"),
+
+    /**
+     * 不输出给用户的片段（开始标记 to 结束标记），如模型的思考内容
+     */
+    val hiddenSpans: List<Pair<String, String>> = listOf("<think>" to "</think>"),
+
+    /**
+     * 流式输出每累计多少个 token 交付一次文本（减少 JNI 回调与字符串分配）
+     */
+    val streamFlushTokens: Int = 4,
+
+    /**
+     * 流式输出距上次交付超过该时长（毫秒）时立即交付，慢速解码时界面仍能及时更新
+     */
+    val streamFlushIntervalMs: Int = 50,
+
     /**
      * 温度参数（0.0-2.0），控制随机性
      * 较低的值使输出更确定，较高的值使输出更随机
@@ -44,9 +115,25 @@ data class ModelConfig(
     val repeatPenalty: Float = 1.1f,
 
     /**
-     * 使用的线程数
+     * 解码线程数，<= 0 表示按性能核数自动选择
+     * 解码受内存带宽限制，线程数超过性能核数或落到小核上反而更慢
+     */
+    val threads: Int = 0,
+
+    /**
+     * 预填充线程数，<= 0 表示使用全部性能核（预填充是计算密集型，可用更多线程）
+     */
+    val batchThreads: Int = 0,
+
+    /**
+     * 首次启动时是否实测选择最快的线程数（仅对自动选择的那一项生效，结果按模型缓存）
+     */
+    val autoTuneThreads: Boolean = true,
+
+    /**
+     * 是否启用热 / 电量感知调速：降频或温控告警时依次减少解码线程、限制生成长度、改用草稿模型
      */
-    val threads: Int = 4,
+    val enableGovernor: Boolean = true,
 
     /**
      * 是否使用GPU加速
@@ -54,7 +141,70 @@ data class ModelConfig(
     val useGpu: Boolean = true,
 
     /**
-     * GPU层数（-1为全部使用GPU）
+     * GPU层数（-1为自动：显存预算内尽量多放，开启 calibrateGpuLayers 时按实测结果选择）
+     */
+    val gpuLayers: Int = -1,
+
+    /**
+     * gpuLayers 为自动时，首次启动实测 0 层到最大层数之间的几个候选并选最快的
+     * （部分 Adreno / Mali 设备上 Vulkan 比 CPU 更慢），结果按 GPU 设备与系统版本缓存
+     */
+    val calibrateGpuLayers: Boolean = true,
+
+    /**
+     * KV 缓存元素类型：Q8_0 的 KV 缓存约为 F16 的一半，同样内存下可把 contextLength 翻倍（适合注入 RAG 上下文）；
+     * Q4_0 更省内存但精度下降明显
+     */
+    val kvCacheType: KvCacheType = KvCacheType.F16,
+
+    /**
+     * Flash Attention：null 为自动（由 llama.cpp 按后端决定），量化 KV 缓存时自动开启
+     */
+    val flashAttention: Boolean? = null,
+
+    /**
+     * 预填充批大小（每次 llama_decode 最多处理的提示词 token 数）
+     * 长提示词（如注入 RAG 上下文）会被拆成多批解码
      */
-    val gpuLayers: Int = -1
+    val batchSize: Int = 512,
+
+    /**
+     * 投机解码草稿模型（assets中的相对路径），null 表示不启用
+     * 草稿模型需与主模型共享分词器（如 Qwen3-0.6B-Q8_0.gguf），且应明显小于主模型才能提速
+     */
+    val draftModelPath: String? = null,
+
+    /**
+     * 投机解码每步起草的 token 数
+     */
+    val draftLength: Int = 4,
+
+    /**
+     * 是否按对话把 KV 缓存保存到磁盘，切回对话时直接恢复而不重新预填充
+     */
+    val persistSessionState: Boolean = true,
+
+    /**
+     * 会话 KV 缓存目录的大小上限（MB），超出时按最近使用时间淘汰
+     */
+    val sessionCacheLimitMb: Int = 512,
+
+    /**
+     * 后台加载完成后是否预热模型（预读权重页并做一次极小的解码），让第一条消息不再承担冷启动开销
+     */
+    val warmupOnLoad: Boolean = true
 )
+
+/**
+ * KV 缓存元素类型，取值为对应的 ggml_type
+ */
+enum class KvCacheType(val ggmlType: Int) {
+    F16(1),
+    Q8_0(8),
+    Q4_0(2);
+
+    companion object {
+        /** 按 ggml_type 查找，未知类型返回 null */
+        fun fromGgmlType(type: Int): KvCacheType? = values().firstOrNull { it.ggmlType == type }
+    }
+}
@@ -0,0 +1,89 @@
+package com.example.haiyangapp.inference
+
+import android.content.Context
+import android.os.Build
+import android.os.PowerManager
+import android.os.SystemClock
+import android.util.Log
+
+/**
+ * 设备温控 / 省电状态快照
+ * @param thermalStatus PowerManager.THERMAL_STATUS_*（API 29 以下恒为 0）
+ * @param thermalHeadroom 10 秒后的预测温度余量，>= 1 表示将要降频；未知时为 -1
+ * @param powerSave 是否处于省电模式
+ */
+data class ThermalState(
+    val thermalStatus: Int,
+    val thermalHeadroom: Float,
+    val powerSave: Boolean
+)
+
+/**
+ * 通过 PowerManager 监听温控状态，供原生推理调速器使用
+ */
+class ThermalMonitor(context: Context) {
+
+    companion object {
+        private const val TAG = "ThermalMonitor"
+
+        /** getThermalHeadroom 的预测时长（秒） */
+        private const val HEADROOM_FORECAST_SECONDS = 10
+
+        /** getThermalHeadroom 调用过于频繁时返回 NaN，两次查询至少间隔该时长 */
+        private const val HEADROOM_MIN_INTERVAL_MS = 1000L
+    }
+
+    private val powerManager = context.getSystemService(Context.POWER_SERVICE) as PowerManager
+    private var statusListener: PowerManager.OnThermalStatusChangedListener? = null
+
+    private var lastHeadroom = -1f
+    private var lastHeadroomTime = 0L
+
+    /**
+     * 开始监听温控状态变化（API 29+），状态改变时调用 onChange
+     */
+    fun start(onChange: (ThermalState) -> Unit) {
+        if (Build.VERSION.SDK_INT < Build.VERSION_CODES.Q || statusListener != null) {
+            return
+        }
+        val listener = PowerManager.OnThermalStatusChangedListener { status ->
+            Log.d(TAG, "Thermal status changed: $status")
+            onChange(currentState())
+        }
+        powerManager.addThermalStatusListener(listener)
+        statusListener = listener
+    }
+
+    /**
+     * 停止监听
+     */
+    fun stop() {
+        if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.Q) {
+            statusListener?.let { powerManager.removeThermalStatusListener(it) }
+        }
+        statusListener = null
+    }
+
+    /**
+     * 读取当前状态
+     */
+    @Synchronized
+    fun currentState(): ThermalState {
+        val status = if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.Q) {
+            powerManager.currentThermalStatus
+        } else {
+            0
+        }
+
+        if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.R) {
+            val now = SystemClock.elapsedRealtime()
+            if (now - lastHeadroomTime >= HEADROOM_MIN_INTERVAL_MS) {
+                val headroom = powerManager.getThermalHeadroom(HEADROOM_FORECAST_SECONDS)
+                lastHeadroom = if (headroom.isNaN()) -1f else headroom
+                lastHeadroomTime = now
+            }
+        }
+
+        return ThermalState(status, lastHeadroom, powerManager.isPowerSaveMode)
+    }
+}
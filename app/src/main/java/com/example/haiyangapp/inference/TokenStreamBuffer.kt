@@ -0,0 +1,44 @@
+package com.example.haiyangapp.inference
+
+import java.nio.ByteBuffer
+
+/**
+ * 流式生成时与原生层共享的 direct ByteBuffer 环形缓冲区
+ *
+ * 原生层只写入完整的 UTF-8 码点（被拆到两个 token 中的汉字会等齐再交付），写到 [offset, offset + length)，
+ * 超过容量时回绕到开头，然后同步回调 StreamCallback.onText；回调返回后这段区域即可被覆盖，
+ * 因此必须在回调内调用 read。按标准 UTF-8 解码，不经过 NewStringUTF 的 modified UTF-8
+ *
+ * 同一时刻只能用于一次生成
+ */
+class TokenStreamBuffer(capacity: Int = DEFAULT_CAPACITY) {
+    companion object {
+        /** 默认容量：远大于一次交付的文本量 */
+        const val DEFAULT_CAPACITY = 16 * 1024
+    }
+
+    /** 传给 LlamaCppJNI.generateStream 的缓冲区 */
+    val buffer: ByteBuffer = ByteBuffer.allocateDirect(capacity)
+
+    private val reader = buffer.duplicate()
+    private val scratch = ByteArray(capacity)
+
+    /**
+     * 读取原生层刚交付的一段文本
+     * @param offset 起始位置
+     * @param length 字节数（不超过容量）
+     */
+    fun read(offset: Int, length: Int): String {
+        val capacity = buffer.capacity()
+        val first = minOf(length, capacity - offset)
+
+        reader.clear()
+        reader.position(offset)
+        reader.get(scratch, 0, first)
+        if (length > first) {
+            reader.position(0)
+            reader.get(scratch, first, length - first)
+        }
+        return String(scratch, 0, length, Charsets.UTF_8)
+    }
+}
@@ -2,13 +2,15 @@ package com.example.haiyangapp.knowledge
 
 import android.content.Context
 import android.util.Log
+import com.example.haiyangapp.inference.ChunkEmbeddings
+import com.example.haiyangapp.inference.EmbeddingCacheStats
 import com.example.haiyangapp.inference.LlamaCppJNI
+import com.example.haiyangapp.inference.ModelAssets
 import kotlinx.coroutines.*
 import kotlinx.coroutines.flow.MutableStateFlow
 import kotlinx.coroutines.flow.StateFlow
 import kotlinx.coroutines.flow.asStateFlow
 import java.io.File
-import java.io.FileOutputStream
 
 /**
  * 嵌入模型管理器
@@ -17,6 +19,7 @@ import java.io.FileOutputStream
  * 特性：
  * - 懒加载：仅在需要时加载模型
  * - 自动释放：空闲5分钟后自动释放模型
+ * - 结果缓存：原生层按 token 序列缓存嵌入，与向量库一起保存在内部存储
  * - 线程安全：使用协程和同步机制
  */
 class EmbeddingManager(private val context: Context) {
@@ -36,6 +39,15 @@ class EmbeddingManager(private val context: Context) {
         /** 空闲超时时间（毫秒） */
         private const val IDLE_TIMEOUT_MS = 5 * 60 * 1000L  // 5 分钟
 
+        /** 嵌入缓存文件名（与 knowledge_vectors.bin 同目录） */
+        private const val CACHE_FILE_NAME = "knowledge_embedding_cache.bin"
+
+        /** 嵌入缓存内存上限，384 维约可容纳 5000 条 */
+        private const val CACHE_MAX_BYTES = 8L * 1024 * 1024
+
+        /** 单次 JNI 批量嵌入调用的最大文本数 */
+        private const val MAX_TEXTS_PER_CALL = 64
+
         /** 嵌入向量维度 (all-MiniLM-L6-v2) */
         const val EMBEDDING_DIMENSION = 384
     }
@@ -46,6 +58,9 @@ class EmbeddingManager(private val context: Context) {
     /** 最后使用时间 */
     private var lastUsedTime: Long = 0
 
+    /** 正在使用模型句柄的调用数，不为 0 时 trimMemory 不释放模型 */
+    private var activeCalls = 0
+
     /** 协程作用域 */
     private val scope = CoroutineScope(SupervisorJob() + Dispatchers.IO)
 
@@ -88,7 +103,6 @@ class EmbeddingManager(private val context: Context) {
         Log.i(TAG, "Starting embedding model initialization...")
 
         try {
-            // 准备模型文件路径
             val modelPath = prepareModelFile()
                 ?: return@withContext Result.failure(
                     Exception("嵌入模型文件不存在，请下载 $EMBEDDING_MODEL_NAME")
@@ -117,6 +131,13 @@ class EmbeddingManager(private val context: Context) {
             val dimension = LlamaCppJNI.getEmbeddingDimension(handle)
             Log.i(TAG, "Embedding model loaded, dimension: $dimension")
 
+            val cached = LlamaCppJNI.setEmbeddingCache(
+                handle,
+                File(context.filesDir, CACHE_FILE_NAME).absolutePath,
+                CACHE_MAX_BYTES
+            )
+            Log.i(TAG, "Embedding cache restored: $cached entries")
+
             _loadingState.value = LoadingState.Ready
 
             // 启动空闲检查
@@ -137,21 +158,10 @@ class EmbeddingManager(private val context: Context) {
         val internalDir = context.filesDir
         val modelFile = File(internalDir, EMBEDDING_MODEL_NAME)
 
-        // 检查是否已存在
-        if (modelFile.exists() && modelFile.length() > 0) {
-            Log.d(TAG, "Embedding model already exists at: ${modelFile.absolutePath}")
-            return modelFile.absolutePath
-        }
-
-        // 从 assets 复制
+        // 从 assets 复制（已存在且大小一致时直接复用）
         return try {
-            Log.i(TAG, "Copying embedding model from assets...")
-            context.assets.open(EMBEDDING_MODEL_NAME).use { input ->
-                FileOutputStream(modelFile).use { output ->
-                    input.copyTo(output)
-                }
-            }
-            Log.i(TAG, "Embedding model copied to: ${modelFile.absolutePath}")
+            ModelAssets.copyToFile(context, EMBEDDING_MODEL_NAME, modelFile)
+            Log.i(TAG, "Embedding model ready at: ${modelFile.absolutePath}")
             modelFile.absolutePath
         } catch (e: Exception) {
             Log.e(TAG, "Failed to copy embedding model from assets", e)
@@ -198,10 +208,7 @@ class EmbeddingManager(private val context: Context) {
             }
         }
 
-        val handle = synchronized(lock) {
-            lastUsedTime = System.currentTimeMillis()
-            modelHandle
-        }
+        val handle = acquireHandle()
 
         if (handle == 0L) {
             Log.e(TAG, "Embedding model handle is null")
@@ -226,6 +233,8 @@ class EmbeddingManager(private val context: Context) {
         } catch (e: Exception) {
             Log.e(TAG, "Failed to get embedding for text: ${text.take(50)}...", e)
             null
+        } finally {
+            releaseHandle()
         }
     }
 
@@ -244,9 +253,112 @@ class EmbeddingManager(private val context: Context) {
             }
         }
 
-        texts.map { text ->
-            embed(text)
+        if (texts.isEmpty()) {
+            return@withContext emptyList()
         }
+
+        val handle = acquireHandle()
+
+        if (handle == 0L) {
+            Log.e(TAG, "Embedding model handle is null")
+            return@withContext texts.map { null }
+        }
+
+        val results = ArrayList<FloatArray?>(texts.size)
+        try {
+            texts.chunked(MAX_TEXTS_PER_CALL).forEach { group ->
+                val flat = try {
+                    LlamaCppJNI.getEmbeddingsBatch(handle, group.toTypedArray())
+                } catch (e: Exception) {
+                    Log.e(TAG, "Failed to get batch embeddings for ${group.size} texts", e)
+                    null
+                }
+
+                if (flat == null || flat.size % group.size != 0) {
+                    Log.e(TAG, "JNI getEmbeddingsBatch returned invalid result for ${group.size} texts")
+                    group.forEach { _ -> results.add(null) }
+                    return@forEach
+                }
+
+                // 拆分扁平结果，全零行表示该文本嵌入失败
+                val dimension = flat.size / group.size
+                for (i in group.indices) {
+                    val embedding = flat.copyOfRange(i * dimension, (i + 1) * dimension)
+                    if (embedding.all { it == 0f }) {
+                        Log.w(TAG, "Batch embedding failed for text: ${group[i].take(50)}...")
+                        results.add(null)
+                    } else {
+                        results.add(embedding)
+                    }
+                }
+            }
+        } finally {
+            releaseHandle()
+        }
+
+        Log.d(TAG, "Batch embeddings generated: ${results.count { it != null }}/${texts.size}")
+        results
+    }
+
+    /**
+     * 按 token 分块并嵌入整篇文档
+     *
+     * @param text 文档全文
+     * @param maxTokens 每块的 token 上限（含特殊 token），默认用满嵌入上下文
+     * @param overlapTokens 相邻块的重叠 token 上限
+     * @return 块区间与嵌入，失败返回 null
+     */
+    suspend fun chunkAndEmbed(
+        text: String,
+        maxTokens: Int = CONTEXT_SIZE,
+        overlapTokens: Int = 0
+    ): ChunkEmbeddings? = withContext(Dispatchers.IO) {
+        // 确保模型已加载
+        if (!isLoaded()) {
+            val result = initialize()
+            if (result.isFailure) {
+                return@withContext null
+            }
+        }
+
+        val handle = acquireHandle()
+
+        if (handle == 0L) {
+            Log.e(TAG, "Embedding model handle is null")
+            return@withContext null
+        }
+
+        try {
+            LlamaCppJNI.chunkAndEmbed(handle, text, maxTokens, overlapTokens)?.also {
+                Log.d(TAG, "Native chunking produced ${it.count} chunks")
+            }
+        } catch (e: Exception) {
+            Log.e(TAG, "Failed to chunk and embed text of length ${text.length}", e)
+            null
+        } finally {
+            releaseHandle()
+        }
+    }
+
+    /**
+     * 取得模型句柄并记为使用中，句柄非 0 时调用方需在结束时调用 releaseHandle
+     */
+    private fun acquireHandle(): Long = synchronized(lock) {
+        lastUsedTime = System.currentTimeMillis()
+        if (modelHandle != 0L) activeCalls++
+        modelHandle
+    }
+
+    private fun releaseHandle() {
+        synchronized(lock) { activeCalls-- }
+    }
+
+    /**
+     * 获取嵌入缓存统计，模型未加载时返回 null
+     */
+    fun getCacheStats(): EmbeddingCacheStats? = synchronized(lock) {
+        if (modelHandle == 0L) null
+        else LlamaCppJNI.getEmbeddingCacheStats(modelHandle)?.let { EmbeddingCacheStats.fromArray(it) }
     }
 
     /**
@@ -283,6 +395,10 @@ class EmbeddingManager(private val context: Context) {
         synchronized(lock) {
             if (modelHandle != 0L) {
                 Log.i(TAG, "Releasing embedding model...")
+                LlamaCppJNI.getEmbeddingCacheStats(modelHandle)?.let {
+                    val stats = EmbeddingCacheStats.fromArray(it)
+                    Log.i(TAG, "Embedding cache: ${stats.hits} hits, ${stats.misses} misses, ${stats.entries} entries")
+                }
                 LlamaCppJNI.freeEmbeddingModel(modelHandle)
                 modelHandle = 0
                 _loadingState.value = LoadingState.NotLoaded
@@ -292,6 +408,19 @@ class EmbeddingManager(private val context: Context) {
         idleCheckJob?.cancel()
     }
 
+    /**
+     * 响应严重的内存压力：没有进行中的嵌入调用时卸载模型（保存嵌入缓存），下次使用时重新懒加载
+     * @return 释放的常驻内存字节数，模型正在使用或未加载时返回 0
+     */
+    fun trimMemory(): Long {
+        val before = LlamaCppJNI.getResidentMemoryBytes()
+        synchronized(lock) {
+            if (modelHandle == 0L || activeCalls > 0) return 0
+            release()
+        }
+        return (before - LlamaCppJNI.getResidentMemoryBytes()).coerceAtLeast(0)
+    }
+
     /**
      * 销毁管理器
      */
@@ -13,6 +13,7 @@ import kotlinx.coroutines.flow.MutableStateFlow
 import kotlinx.coroutines.flow.StateFlow
 import kotlinx.coroutines.flow.asStateFlow
 import kotlinx.coroutines.withContext
+import java.io.File
 
 /**
  * 知识库仓库接口
@@ -69,13 +70,22 @@ class KnowledgeRepositoryImpl(
 
     companion object {
         private const val TAG = "KnowledgeRepository"
+
+        /** 每次批量嵌入的知识块数 */
+        private const val EMBEDDING_BATCH_SIZE = 16
+
+        /** 原生分块的 token 上限（与嵌入模型上下文一致） */
+        private const val CHUNK_MAX_TOKENS = 512
+
+        /** 相邻知识块的重叠 token 上限 */
+        private const val CHUNK_OVERLAP_TOKENS = 64
     }
 
     // 文档处理器
     private val pdfProcessor = PdfDocumentProcessor()
     private val wordProcessor = WordDocumentProcessor()
 
-    // 语义分块器（替代简单的文本分块器）
+    // 语义分块器（原生按 token 分块不可用时的回退）
     private val semanticChunker = SemanticChunker(
         SemanticChunkConfig(
             targetChunkSize = 400,      // 目标块大小
@@ -88,7 +98,10 @@ class KnowledgeRepositoryImpl(
     )
 
     // 向量检索
-    private val vectorSearch = VectorSearch(knowledgeDao)
+    private val vectorSearch = VectorSearch(
+        knowledgeDao,
+        File(context.filesDir, "knowledge_vectors.bin")
+    )
 
     // 检索缓存
     private val retrievalCache = RetrievalCache()
@@ -143,21 +156,36 @@ class KnowledgeRepositoryImpl(
                 Log.i(TAG, "Extracted text length: ${text.length}")
                 updateProgress(documentId, 0.2f)
 
-                // 语义分块
-                val semanticChunks = semanticChunker.chunk(text)
-                Log.i(TAG, "Created ${semanticChunks.size} semantic chunks")
+                // 原生按 token 分块并一次性嵌入；模型不可用时回退到语义分块 + 逐组批量嵌入
+                val nativeChunks = embeddingManager.chunkAndEmbed(text, CHUNK_MAX_TOKENS, CHUNK_OVERLAP_TOKENS)
+                    ?.takeIf { it.count > 0 }
+                val chunks = if (nativeChunks != null) {
+                    Log.i(TAG, "Created ${nativeChunks.count} token chunks")
+                    (0 until nativeChunks.count).map { i ->
+                        TextChunk(
+                            content = nativeChunks.text(text, i),
+                            index = i,
+                            startPosition = nativeChunks.start(i),
+                            endPosition = nativeChunks.end(i)
+                        )
+                    }
+                } else {
+                    // 语义分块
+                    val semanticChunks = semanticChunker.chunk(text)
+                    Log.i(TAG, "Created ${semanticChunks.size} semantic chunks")
+
+                    // 打印分块详情（调试用）
+                    semanticChunks.take(3).forEachIndexed { idx, chunk ->
+                        Log.d(TAG, "Chunk $idx: type=${chunk.type}, section=${chunk.sectionTitle}, len=${chunk.content.length}")
+                        Log.d(TAG, "Chunk $idx preview: ${chunk.content.take(100)}...")
+                    }
 
-                // 打印分块详情（调试用）
-                semanticChunks.take(3).forEachIndexed { idx, chunk ->
-                    Log.d(TAG, "Chunk $idx: type=${chunk.type}, section=${chunk.sectionTitle}, len=${chunk.content.length}")
-                    Log.d(TAG, "Chunk $idx preview: ${chunk.content.take(100)}...")
+                    // 转换为 TextChunk 兼容格式
+                    semanticChunks.toTextChunks()
                 }
 
                 updateProgress(documentId, 0.3f)
 
-                // 转换为 TextChunk 兼容格式
-                val chunks = semanticChunks.toTextChunks()
-
                 if (chunks.isEmpty()) {
                     knowledgeDao.deleteDocumentById(documentId)
                     return@withContext Result.failure(Exception("文档内容为空"))
@@ -165,39 +193,57 @@ class KnowledgeRepositoryImpl(
 
                 // 生成嵌入向量并存储
                 val chunkEntities = mutableListOf<KnowledgeChunkEntity>()
+                val chunkEmbeddings = mutableListOf<FloatArray>()  // 与 chunkEntities 一一对应
                 val batchSize = 10
                 var nullEmbeddingCount = 0
 
-                chunks.forEachIndexed { index, chunk ->
-                    val embedding = embeddingManager.embed(chunk.content)
-                    if (embedding != null) {
-                        // 调试：检查嵌入向量
-                        if (index == 0) {
-                            Log.d(TAG, "First chunk embedding dimension: ${embedding.size}")
-                            Log.d(TAG, "First chunk embedding sample: ${embedding.take(5).joinToString()}")
-                        }
-                        chunkEntities.add(
-                            KnowledgeChunkEntity(
-                                documentId = documentId,
-                                content = chunk.content,
-                                chunkIndex = index,
-                                embedding = KnowledgeChunkEntity.floatArrayToByteArray(embedding),
-                                tokenCount = chunk.content.length / 4  // 粗略估计
-                            )
-                        )
+                // 分组批量嵌入，每组一次原生批量解码（原生分块时嵌入已经算好）
+                chunks.chunked(EMBEDDING_BATCH_SIZE).forEachIndexed { groupIndex, group ->
+                    val embeddings = if (nativeChunks != null) {
+                        group.map { nativeChunks.embedding(it.index) }
                     } else {
-                        nullEmbeddingCount++
-                        Log.w(TAG, "Null embedding for chunk $index: ${chunk.content.take(50)}...")
+                        embeddingManager.embedBatch(group.map { it.content })
+                    }
+
+                    group.forEachIndexed { offset, chunk ->
+                        val index = groupIndex * EMBEDDING_BATCH_SIZE + offset
+                        val embedding = embeddings[offset]
+                        if (embedding != null) {
+                            // 调试：检查嵌入向量
+                            if (index == 0) {
+                                Log.d(TAG, "First chunk embedding dimension: ${embedding.size}")
+                                Log.d(TAG, "First chunk embedding sample: ${embedding.take(5).joinToString()}")
+                            }
+                            chunkEntities.add(
+                                KnowledgeChunkEntity(
+                                    documentId = documentId,
+                                    content = chunk.content,
+                                    chunkIndex = index,
+                                    embedding = ByteArray(0),  // 向量写入内存映射向量文件
+                                    tokenCount = nativeChunks?.tokenCount(index)
+                                        ?: (chunk.content.length / 4)  // 粗略估计
+                                )
+                            )
+                            chunkEmbeddings.add(embedding)
+                        } else {
+                            nullEmbeddingCount++
+                            Log.w(TAG, "Null embedding for chunk $index: ${chunk.content.take(50)}...")
+                        }
                     }
 
                     // 更新进度 (30% - 90%)
-                    val progress = 0.3f + (index.toFloat() / chunks.size) * 0.6f
+                    val processed = minOf((groupIndex + 1) * EMBEDDING_BATCH_SIZE, chunks.size)
+                    val progress = 0.3f + (processed.toFloat() / chunks.size) * 0.6f
                     updateProgress(documentId, progress)
 
                     // 批量插入
                     if (chunkEntities.size >= batchSize) {
-                        knowledgeDao.insertChunks(chunkEntities.toList())
+                        val chunkIds = knowledgeDao.insertChunks(chunkEntities.toList())
+                        vectorSearch.addEmbeddings(
+                            chunkIds, documentId, chunkEmbeddings.toList(), chunkEntities.map { it.content }
+                        )
                         chunkEntities.clear()
+                        chunkEmbeddings.clear()
                     }
                 }
 
@@ -205,7 +251,10 @@ class KnowledgeRepositoryImpl(
 
                 // 插入剩余的块
                 if (chunkEntities.isNotEmpty()) {
-                    knowledgeDao.insertChunks(chunkEntities)
+                    val chunkIds = knowledgeDao.insertChunks(chunkEntities)
+                    vectorSearch.addEmbeddings(
+                        chunkIds, documentId, chunkEmbeddings, chunkEntities.map { it.content }
+                    )
                 }
 
                 // 更新文档状态
@@ -235,6 +284,7 @@ class KnowledgeRepositoryImpl(
     override suspend fun deleteDocument(documentId: Long) = withContext(Dispatchers.IO) {
         Log.i(TAG, "Deleting document: $documentId")
         knowledgeDao.deleteDocumentById(documentId)
+        vectorSearch.onDocumentDeleted(documentId)
         retrievalCache.clear()
     }
 
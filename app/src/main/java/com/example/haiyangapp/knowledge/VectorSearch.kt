@@ -1,12 +1,15 @@
 package com.example.haiyangapp.knowledge
 
 import android.util.Log
-import com.example.haiyangapp.database.dao.ChunkWithDocumentTitle
 import com.example.haiyangapp.database.dao.KnowledgeDao
-import com.example.haiyangapp.database.entity.KnowledgeChunkEntity
+import com.example.haiyangapp.inference.LlamaCppJNI
 import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.sync.Mutex
+import kotlinx.coroutines.sync.withLock
 import kotlinx.coroutines.withContext
-import kotlin.math.sqrt
+import java.io.File
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
 
 /**
  * 检索结果
@@ -34,6 +37,20 @@ data class RetrievalResult(
     val chunkIndex: Int
 )
 
+/**
+ * 向量粗排的量化方式（ordinal 与原生层一致）
+ */
+enum class VectorQuantization {
+    /** 直接扫描 float 向量 */
+    NONE,
+
+    /** int8 量化（内存约 1/4），int32 累加点积 */
+    INT8,
+
+    /** 1 bit 符号量化（内存约 1/32），popcount 汉明距离 */
+    BINARY
+}
+
 /**
  * 检索配置
  */
@@ -44,23 +61,67 @@ data class SearchConfig(
     /** 最低相似度阈值 */
     val similarityThreshold: Float = 0.15f,
 
-    /** 是否使用关键词重排序 */
+    /** 是否在原生层融合 BM25 关键词检索与向量检索（开启时不再做 Kotlin 端关键词重排序） */
+    val hybrid: Boolean = true,
+
+    /** 混合检索每一路保留的候选数 = topK * fusionMultiplier */
+    val fusionMultiplier: Int = 8,
+
+    /** 倒数排名融合的平滑常数 */
+    val rrfK: Int = 60,
+
+    /** 是否使用关键词重排序（仅非混合检索） */
     val useKeywordReranking: Boolean = true,
 
     /** 关键词重排序权重 */
-    val keywordWeight: Float = 0.2f
+    val keywordWeight: Float = 0.2f,
+
+    /** 粗排量化方式，量化后对候选用 float 向量精排 */
+    val quantization: VectorQuantization = VectorQuantization.INT8,
+
+    /** 量化粗排保留的候选数 = 候选数 * rescoreMultiplier（二值量化建议 8 以上） */
+    val rescoreMultiplier: Int = 4,
+
+    /**
+     * IVF 近似检索探测的簇数：越大召回越高、越慢；0 表示始终精确扫描
+     * 知识块数较少（尚未训练 IVF）时不生效
+     */
+    val nprobe: Int = 16
 )
 
 /**
  * 向量检索引擎
- * 实现基于余弦相似度的语义检索
+ * 向量保存在原生内存映射文件中（连续行 + SIMD 点积 + Top-K 堆），Room 只保存文本和元数据，
+ * Kotlin 端只拿到知识块 ID 和分数
+ *
+ * @param storeFile 向量文件路径
  */
-class VectorSearch(private val knowledgeDao: KnowledgeDao) {
+class VectorSearch(
+    private val knowledgeDao: KnowledgeDao,
+    private val storeFile: File
+) {
 
     companion object {
         private const val TAG = "VectorSearch"
+
+        /** 每批传给原生层的向量数 */
+        private const val INDEX_LOAD_BATCH_SIZE = 256
+
+        /** 墓碑行数达到该值且不少于存活行数时压缩向量文件 */
+        private const val COMPACT_MIN_DELETED = 64
+
+        /** 每批补建 BM25 文本索引的知识块数 */
+        private const val TEXT_BACKFILL_BATCH_SIZE = 256
     }
 
+    /** 原生向量存储句柄，首次使用时打开 */
+    private var indexHandle = 0L
+
+    /** 向量维度 */
+    private var indexDimension = 0
+
+    private val indexMutex = Mutex()
+
     /**
      * 检索与查询最相关的知识块
      *
@@ -75,77 +136,7 @@ class VectorSearch(private val knowledgeDao: KnowledgeDao) {
         config: SearchConfig = SearchConfig()
     ): List<RetrievalResult> = withContext(Dispatchers.IO) {
         Log.d(TAG, "Search started for query: $query")
-        Log.d(TAG, "Query embedding dimension: ${queryEmbedding.size}")
-        Log.d(TAG, "Query embedding sample (first 5): ${queryEmbedding.take(5).joinToString()}")
-
-        // 获取所有知识块
-        val allChunks = knowledgeDao.getAllChunks()
-        Log.d(TAG, "Total chunks in database: ${allChunks.size}")
-
-        if (allChunks.isEmpty()) {
-            Log.w(TAG, "No chunks found in database!")
-            return@withContext emptyList()
-        }
-
-        // 调试：打印第一个 chunk 的信息
-        val firstChunk = allChunks.first()
-        val firstChunkEmbedding = firstChunk.getEmbeddingAsFloatArray()
-        Log.d(TAG, "First chunk content preview: ${firstChunk.content.take(50)}...")
-        Log.d(TAG, "First chunk embedding dimension: ${firstChunkEmbedding.size}")
-        Log.d(TAG, "First chunk embedding sample (first 5): ${firstChunkEmbedding.take(5).joinToString()}")
-
-        // 计算相似度并排序
-        var maxSimilarity = 0f
-        var minSimilarity = 1f
-        val results = allChunks.mapNotNull { chunk ->
-            val chunkEmbedding = chunk.getEmbeddingAsFloatArray()
-            val similarity = cosineSimilarity(queryEmbedding, chunkEmbedding)
-
-            // 追踪最大和最小相似度
-            if (similarity > maxSimilarity) maxSimilarity = similarity
-            if (similarity < minSimilarity) minSimilarity = similarity
-
-            if (similarity >= config.similarityThreshold) {
-                chunk to similarity
-            } else {
-                null
-            }
-        }.sortedByDescending { it.second }
-            .take(config.topK * 2)  // 取更多候选项用于重排序
-
-        Log.d(TAG, "Similarity range: min=$minSimilarity, max=$maxSimilarity")
-        Log.d(TAG, "Chunks passing threshold (${config.similarityThreshold}): ${results.size}")
-
-        if (results.isEmpty()) {
-            return@withContext emptyList()
-        }
-
-        // 获取文档标题
-        val chunkIds = results.map { it.first.id }
-        val chunksWithTitles = knowledgeDao.getChunksWithDocumentTitles(chunkIds)
-        val titleMap = chunksWithTitles.associateBy { it.id }
-
-        // 转换为结果对象
-        var retrievalResults = results.map { (chunk, similarity) ->
-            val docInfo = titleMap[chunk.id]
-            RetrievalResult(
-                chunkId = chunk.id,
-                documentId = chunk.documentId,
-                documentTitle = docInfo?.documentTitle ?: "未知文档",
-                sourcePath = docInfo?.sourcePath ?: "",
-                content = chunk.content,
-                similarity = similarity,
-                chunkIndex = chunk.chunkIndex
-            )
-        }
-
-        // 关键词重排序
-        if (config.useKeywordReranking && query.isNotBlank()) {
-            retrievalResults = rerank(query, retrievalResults, config.keywordWeight)
-        }
-
-        // 返回 Top-K
-        retrievalResults.take(config.topK)
+        searchIndex(queryEmbedding, query, null, config)
     }
 
     /**
@@ -160,89 +151,261 @@ class VectorSearch(private val knowledgeDao: KnowledgeDao) {
         if (documentIds.isEmpty()) {
             return@withContext emptyList()
         }
+        searchIndex(queryEmbedding, query, documentIds.toLongArray(), config)
+    }
+
+    /**
+     * 写入新知识块的向量
+     *
+     * @param chunkIds Room 中的知识块 ID
+     * @param documentId 所属文档 ID
+     * @param embeddings 与 chunkIds 一一对应的嵌入向量
+     * @param texts 与 chunkIds 一一对应的知识块文本（写入 BM25 倒排索引）
+     */
+    suspend fun addEmbeddings(
+        chunkIds: List<Long>,
+        documentId: Long,
+        embeddings: List<FloatArray>,
+        texts: List<String>
+    ) = withContext(Dispatchers.IO) {
+        if (chunkIds.isEmpty()) return@withContext
+        indexMutex.withLock {
+            val dimension = embeddings.first().size
+            ensureIndex(dimension)
+            if (indexHandle == 0L) {
+                Log.e(TAG, "Vector store unavailable, ${chunkIds.size} embeddings dropped")
+                return@withLock
+            }
+
+            val vectors = FloatArray(embeddings.size * dimension)
+            embeddings.forEachIndexed { i, embedding ->
+                embedding.copyInto(vectors, i * dimension)
+            }
+            LlamaCppJNI.vectorIndexAdd(
+                indexHandle,
+                chunkIds.toLongArray(),
+                LongArray(chunkIds.size) { documentId },
+                vectors,
+                texts.toTypedArray()
+            )
+        }
+    }
 
-        val chunks = knowledgeDao.getChunksByDocumentIds(documentIds)
+    /**
+     * 文档删除后为其向量打墓碑，墓碑足够多时压缩文件
+     */
+    suspend fun onDocumentDeleted(documentId: Long) = withContext(Dispatchers.IO) {
+        indexMutex.withLock {
+            if (indexHandle == 0L) {
+                // 尚未打开时沿用文件自身的维度
+                indexHandle = LlamaCppJNI.openVectorIndex(storeFile.absolutePath, 0)
+                if (indexHandle == 0L) return@withLock
+                indexDimension = 0
+            }
 
-        if (chunks.isEmpty()) {
-            return@withContext emptyList()
+            val removed = LlamaCppJNI.vectorIndexRemoveDocument(indexHandle, documentId)
+            val deleted = LlamaCppJNI.vectorIndexDeletedCount(indexHandle)
+            val live = LlamaCppJNI.vectorIndexSize(indexHandle)
+            Log.d(TAG, "Tombstoned $removed vectors of document $documentId (live=$live, deleted=$deleted)")
+
+            if (deleted >= COMPACT_MIN_DELETED && deleted >= live) {
+                val reclaimed = LlamaCppJNI.vectorIndexCompact(indexHandle)
+                Log.i(TAG, "Vector store compacted, reclaimed $reclaimed rows")
+            }
         }
+    }
 
-        val results = chunks.mapNotNull { chunk ->
-            val chunkEmbedding = chunk.getEmbeddingAsFloatArray()
-            val similarity = cosineSimilarity(queryEmbedding, chunkEmbedding)
+    /**
+     * 关闭原生向量存储
+     */
+    suspend fun release() {
+        indexMutex.withLock {
+            if (indexHandle != 0L) {
+                LlamaCppJNI.freeVectorIndex(indexHandle)
+                indexHandle = 0L
+                indexDimension = 0
+            }
+        }
+    }
 
-            if (similarity >= config.similarityThreshold) {
-                chunk to similarity
+    /**
+     * 原生 Top-K 检索（混合模式下与 BM25 融合），再按 ID 回表读取文本和文档标题
+     */
+    private suspend fun searchIndex(
+        queryEmbedding: FloatArray,
+        query: String,
+        documentIds: LongArray?,
+        config: SearchConfig
+    ): List<RetrievalResult> {
+        // 非混合检索时取更多候选项用于 Kotlin 端重排序
+        val candidateCount = if (config.hybrid) config.topK else config.topK * 2
+        val chunkIds = LongArray(candidateCount)
+        val scores = FloatArray(candidateCount)
+
+        val count = indexMutex.withLock {
+            ensureIndex(queryEmbedding.size)
+            if (indexHandle == 0L) {
+                -1
+            } else if (config.hybrid) {
+                val fusionCandidates = config.topK * config.fusionMultiplier
+                LlamaCppJNI.vectorIndexHybridSearch(
+                    indexHandle,
+                    queryEmbedding,
+                    query.takeIf { it.isNotBlank() },
+                    candidateCount,
+                    config.similarityThreshold,
+                    documentIds,
+                    config.quantization.ordinal,
+                    fusionCandidates * config.rescoreMultiplier,
+                    config.nprobe,
+                    fusionCandidates,
+                    config.rrfK,
+                    chunkIds,
+                    scores
+                )
             } else {
-                null
+                LlamaCppJNI.vectorIndexSearch(
+                    indexHandle,
+                    queryEmbedding,
+                    candidateCount,
+                    config.similarityThreshold,
+                    documentIds,
+                    config.quantization.ordinal,
+                    candidateCount * config.rescoreMultiplier,
+                    config.nprobe,
+                    chunkIds,
+                    scores
+                )
             }
-        }.sortedByDescending { it.second }
-            .take(config.topK * 2)
+        }
 
-        if (results.isEmpty()) {
-            return@withContext emptyList()
+        if (count <= 0) {
+            Log.d(TAG, "No chunks passing threshold (${config.similarityThreshold})")
+            return emptyList()
         }
+        Log.d(TAG, "Native search returned $count candidates, top score: ${scores[0]}")
 
-        val chunkIds = results.map { it.first.id }
-        val chunksWithTitles = knowledgeDao.getChunksWithDocumentTitles(chunkIds)
-        val titleMap = chunksWithTitles.associateBy { it.id }
+        // 获取知识块内容和文档标题
+        val chunksWithTitles = knowledgeDao.getChunksWithDocumentTitles(chunkIds.take(count))
+        val chunkMap = chunksWithTitles.associateBy { it.id }
 
-        var retrievalResults = results.map { (chunk, similarity) ->
-            val docInfo = titleMap[chunk.id]
+        // 转换为结果对象（已删除的知识块在回表时被过滤）
+        var retrievalResults = (0 until count).mapNotNull { i ->
+            val chunk = chunkMap[chunkIds[i]] ?: return@mapNotNull null
             RetrievalResult(
                 chunkId = chunk.id,
                 documentId = chunk.documentId,
-                documentTitle = docInfo?.documentTitle ?: "未知文档",
-                sourcePath = docInfo?.sourcePath ?: "",
+                documentTitle = chunk.documentTitle,
+                sourcePath = chunk.sourcePath,
                 content = chunk.content,
-                similarity = similarity,
+                similarity = scores[i],
                 chunkIndex = chunk.chunkIndex
             )
         }
 
-        if (config.useKeywordReranking && query.isNotBlank()) {
+        // 关键词重排序（混合检索已在原生层融合关键词分数）
+        if (!config.hybrid && config.useKeywordReranking && query.isNotBlank()) {
             retrievalResults = rerank(query, retrievalResults, config.keywordWeight)
         }
 
-        retrievalResults.take(config.topK)
+        // 返回 Top-K
+        return retrievalResults.take(config.topK)
     }
 
     /**
-     * 计算余弦相似度
-     *
-     * @param a 向量 A
-     * @param b 向量 B
-     * @return 相似度 (0-1)
+     * 确保向量文件已按给定维度打开，调用方需持有 indexMutex
+     * 维度不匹配或文件损坏时重建文件；首次打开时导入旧版本的 Room BLOB 向量
+     */
+    private suspend fun ensureIndex(dimension: Int) {
+        if (indexHandle != 0L && indexDimension == dimension) {
+            return
+        }
+        if (indexHandle != 0L) {
+            LlamaCppJNI.freeVectorIndex(indexHandle)
+            indexHandle = 0L
+        }
+
+        val startTime = System.currentTimeMillis()
+        var handle = LlamaCppJNI.openVectorIndex(storeFile.absolutePath, dimension)
+        if (handle == 0L && storeFile.exists()) {
+            Log.w(TAG, "Vector store incompatible with dimension $dimension, recreating")
+            storeFile.delete()
+            handle = LlamaCppJNI.openVectorIndex(storeFile.absolutePath, dimension)
+        }
+        if (handle == 0L) {
+            Log.e(TAG, "Failed to open vector store: ${storeFile.absolutePath}")
+            return
+        }
+        indexHandle = handle
+        indexDimension = dimension
+        Log.i(TAG, "Vector store opened: ${LlamaCppJNI.vectorIndexSize(handle)} vectors " +
+                "in ${System.currentTimeMillis() - startTime}ms")
+
+        importLegacyEmbeddings()
+        backfillTextIndex()
+    }
+
+    /**
+     * 为尚未建立 BM25 索引的知识块（旧版本写入或刚导入的向量）补建文本索引，调用方需持有 indexMutex
      */
-    private fun cosineSimilarity(a: FloatArray, b: FloatArray): Float {
-        if (a.size != b.size) {
-            Log.e(TAG, "Dimension mismatch! a.size=${a.size}, b.size=${b.size}")
-            return 0f
+    private suspend fun backfillTextIndex() {
+        var total = 0
+        while (true) {
+            val missing = LlamaCppJNI.vectorIndexMissingText(indexHandle, TEXT_BACKFILL_BATCH_SIZE)
+            if (missing == null || missing.isEmpty()) break
+
+            val chunks = knowledgeDao.getChunksWithDocumentTitles(missing.toList()).associateBy { it.id }
+            // Room 中已不存在的知识块用空文本占位，避免反复列出
+            val texts = missing.map { chunks[it]?.content ?: "" }.toTypedArray()
+            if (LlamaCppJNI.vectorIndexSetText(indexHandle, missing, texts) <= 0) break
+            total += missing.size
         }
+        if (total > 0) {
+            Log.i(TAG, "Built BM25 text index for $total existing chunks")
+        }
+    }
 
-        // 检查是否为空向量
-        if (a.isEmpty() || b.isEmpty()) {
-            Log.e(TAG, "Empty embedding detected!")
-            return 0f
+    /**
+     * 把旧版本存在 Room 中的向量导入向量文件，然后清空 BLOB，调用方需持有 indexMutex
+     */
+    private suspend fun importLegacyEmbeddings() {
+        val chunks = knowledgeDao.getLegacyChunkEmbeddings()
+        if (chunks.isEmpty()) {
+            return
         }
 
-        var dotProduct = 0f
-        var normA = 0f
-        var normB = 0f
+        val dimension = indexDimension
+        val valid = chunks.filter { it.embedding.size == dimension * 4 }
+        if (valid.size < chunks.size) {
+            Log.w(TAG, "Skipped ${chunks.size - valid.size} legacy chunks with mismatched embedding dimension")
+        }
 
-        for (i in a.indices) {
-            dotProduct += a[i] * b[i]
-            normA += a[i] * a[i]
-            normB += b[i] * b[i]
+        // 先打墓碑，避免上次导入中断后重复写入
+        valid.map { it.documentId }.distinct().forEach { documentId ->
+            LlamaCppJNI.vectorIndexRemoveDocument(indexHandle, documentId)
         }
 
-        val denominator = sqrt(normA) * sqrt(normB)
-        return if (denominator > 0) {
-            dotProduct / denominator
-        } else {
-            Log.w(TAG, "Zero norm detected! normA=$normA, normB=$normB")
-            0f
+        valid.chunked(INDEX_LOAD_BATCH_SIZE).forEach { batch ->
+            val chunkIds = LongArray(batch.size)
+            val documentIds = LongArray(batch.size)
+            val vectors = FloatArray(batch.size * dimension)
+            batch.forEachIndexed { i, chunk ->
+                chunkIds[i] = chunk.id
+                documentIds[i] = chunk.documentId
+                // 旧数据以大端 Float32 存储，与 KnowledgeChunkEntity.floatArrayToByteArray 一致
+                ByteBuffer.wrap(chunk.embedding)
+                    .order(ByteOrder.BIG_ENDIAN)
+                    .asFloatBuffer()
+                    .get(vectors, i * dimension, dimension)
+            }
+            if (LlamaCppJNI.vectorIndexAdd(indexHandle, chunkIds, documentIds, vectors, null) < 0) {
+                Log.e(TAG, "Failed to import legacy embeddings, keeping Room BLOBs")
+                return
+            }
         }
+
+        knowledgeDao.clearLegacyChunkEmbeddings()
+        Log.i(TAG, "Imported ${valid.size} legacy embeddings into vector store")
     }
 
     /**
@@ -42,6 +42,14 @@ interface ChatRepository {
 
     // ==================== 对话管理 ====================
 
+    /**
+     * 通知仓库当前打开的对话（本地推理据此按对话保存 / 恢复 KV 缓存）
+     * @param conversationId 对话ID
+     */
+    fun setActiveConversation(conversationId: Long) {
+        // 默认实现：远程 API 无需处理
+    }
+
     /**
      * 获取所有对话列表
      * @return Flow of conversations ordered by last message time
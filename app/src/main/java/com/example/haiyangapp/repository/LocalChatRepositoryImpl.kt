@@ -25,6 +25,7 @@ class LocalChatRepositoryImpl(
 
     companion object {
         private const val TAG = "LocalChatRepository"
+        private const val DEFAULT_SYSTEM_PROMPT = "你是一个友好、乐于助人的AI助手。"
     }
 
     /**
@@ -90,6 +91,11 @@ class LocalChatRepositoryImpl(
 
         Log.d(TAG, "Sending message with ${ragContext.size} RAG context chunks")
 
+        // 固定原始系统提示词的 KV 快照：知识块每轮不同，但其前面的系统提示词不必重新预填充
+        val originalSystemContent = conversationHistory.firstOrNull { it.role == "system" }?.content
+            ?: DEFAULT_SYSTEM_PROMPT
+        withContext(Dispatchers.IO) { inferenceRepository.pinSystemPrompt(originalSystemContent) }
+
         // 构建增强的对话历史
         val augmentedHistory = injectRAGContext(conversationHistory, ragContext)
         return sendMessageStream(augmentedHistory, onContent)
@@ -112,7 +118,7 @@ ${result.content}
 
         // 查找系统消息
         val systemMessage = history.firstOrNull { it.role == "system" }
-        val originalSystemContent = systemMessage?.content ?: "你是一个友好、乐于助人的AI助手。"
+        val originalSystemContent = systemMessage?.content ?: DEFAULT_SYSTEM_PROMPT
 
         // 构建增强的系统消息
         val enhancedSystemContent = """
@@ -172,11 +178,16 @@ $contextText
         return createConversation("新对话")
     }
 
+    override fun setActiveConversation(conversationId: Long) {
+        inferenceRepository.setActiveConversation(conversationId)
+    }
+
     override suspend fun deleteConversation(conversationId: Long) {
         val conversation = conversationDao.getConversationById(conversationId)
         conversation?.let {
             conversationDao.deleteConversation(it)
         }
+        inferenceRepository.deleteConversationState(conversationId)
     }
 
     override suspend fun updateConversationTitle(conversationId: Long, title: String) {
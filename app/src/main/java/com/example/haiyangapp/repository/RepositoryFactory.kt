@@ -4,6 +4,8 @@ import android.content.Context
 import com.example.haiyangapp.api.RetrofitClient
 import com.example.haiyangapp.database.AppDatabase
 import com.example.haiyangapp.inference.InferenceRepositoryImpl
+import com.example.haiyangapp.inference.MemoryTrimLevel
+import com.example.haiyangapp.inference.MemoryTrimResult
 import com.example.haiyangapp.inference.ModelConfig
 import com.example.haiyangapp.inference.ModelLoadingState
 import kotlinx.coroutines.flow.StateFlow
@@ -100,12 +102,19 @@ object RepositoryFactory {
     /**
      * 启动后台模型加载
      * 用于APP启动时立即开始加载模型，但不阻塞UI
+     * @param alongsideWarmup 模型就绪后与预热并行执行的初始化
      */
-    fun startBackgroundModelLoading(context: Context) {
+    fun startBackgroundModelLoading(context: Context, alongsideWarmup: suspend () -> Unit = {}) {
         val repo = getInferenceRepository(context)
-        repo.startBackgroundInitialization()
+        repo.startBackgroundInitialization(alongsideWarmup)
     }
 
+    /**
+     * 响应系统内存压力，未创建本地推理引擎时返回 null
+     */
+    suspend fun trimMemory(level: MemoryTrimLevel): MemoryTrimResult? =
+        inferenceRepository?.trimMemory(level)
+
     /**
      * 设置推理模式
      */
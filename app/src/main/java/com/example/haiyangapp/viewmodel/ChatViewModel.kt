@@ -141,6 +141,7 @@ class ChatViewModel(
     fun loadConversation(conversationId: Long) {
         // 立即设置当前对话ID，避免时序问题
         _currentConversationId.value = conversationId
+        repository.setActiveConversation(conversationId)
 
         viewModelScope.launch {
             // 清空当前状态
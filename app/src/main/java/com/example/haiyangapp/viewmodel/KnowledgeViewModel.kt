@@ -185,6 +185,11 @@ class KnowledgeViewModel(
                 }
             }
         }
+
+        /**
+         * 内存压力严重时卸载嵌入模型（下次检索时懒加载），返回释放的常驻内存字节数
+         */
+        fun trimEmbeddingModel(): Long = embeddingManager?.trimMemory() ?: 0L
     }
 }
 